@@ -75,6 +75,11 @@ S3Status error_parser_add(ErrorParser *errorParser, char *buffer,
 
 void error_parser_convert_status(ErrorParser *errorParser, S3Status *status);
 
+// The status of an S3 error code such as "NoSuchKey", S3StatusErrorUnknown
+// for a code it doesn't know; also used for the per-key errors of a
+// multi-object delete
+S3Status error_code_to_status(const char *code);
+
 // Always call this
 void error_parser_deinitialize(ErrorParser *errorParser);
 
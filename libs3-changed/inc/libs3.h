@@ -138,6 +138,13 @@ extern "C" {
 #define S3_MAX_KEY_SIZE                    1024
 
 
+/**
+ * S3_MAX_DELETE_OBJECTS is the maximum number of objects one multi-object
+ * delete request may name.
+ **/
+#define S3_MAX_DELETE_OBJECTS              1000
+
+
 /**
  * S3_MAX_METADATA_SIZE is the maximum number of bytes allowed for
  * x-amz-meta header names and values in any request passed to Amazon S3
@@ -1027,6 +1034,30 @@ typedef S3Status (S3ListBucketCallback)(int isTruncated,
                                         int commonPrefixesCount,
                                         const char **commonPrefixes,
                                         void *callbackData);
+
+
+/**
+ * This callback is made during a multi-object delete operation, once for
+ * each object S3 could not delete.  Objects that were deleted are not
+ * reported.
+ *
+ * @param key is the key of the object that was not deleted
+ * @param versionId is the version of the object that was not deleted, or
+ *        NULL if the request did not name one
+ * @param status is the S3Status corresponding to the error code S3 gave
+ *        for this object, for example S3StatusErrorAccessDenied
+ * @param message is the error message S3 gave for this object, or NULL
+ * @param callbackData is the callback data as specified when the request
+ *        was issued.
+ * @return S3StatusOK to continue processing the request, anything else to
+ *         immediately abort the request with a status which will be
+ *         passed to the S3ResponseCompleteCallback for this request.
+ **/
+typedef S3Status (S3DeleteObjectsCallback)(const char *key,
+                                           const char *versionId,
+                                           S3Status status,
+                                           const char *message,
+                                           void *callbackData);
                                        
 
 /**
@@ -1186,6 +1217,25 @@ typedef struct S3ListBucketHandler
 } S3ListBucketHandler;
 
 
+/**
+ * An S3DeleteObjectsHandler defines the callbacks which are made for
+ * delete_objects requests.
+ **/
+typedef struct S3DeleteObjectsHandler
+{
+    /**
+     * responseHandler provides the properties and complete callback
+     **/
+    S3ResponseHandler responseHandler;
+
+    /**
+     * The deleteObjectsCallback is called for each object of the request
+     * that could not be deleted.
+     **/
+    S3DeleteObjectsCallback *deleteObjectsCallback;
+} S3DeleteObjectsHandler;
+
+
 /**
  * An S3PutObjectHandler defines the callbacks which are made for
  * put_object requests.
@@ -1854,6 +1904,34 @@ void S3_delete_object(const S3BucketContext *bucketContext, const char *key,
                       const S3ResponseHandler *handler, void *callbackData);
 
 
+/**
+ * Deletes up to S3_MAX_DELETE_OBJECTS objects of a bucket with one request
+ * (POST ?delete).  The request succeeds even if some of the objects could
+ * not be deleted; each of those is reported to the deleteObjectsCallback.
+ * A key that does not exist counts as deleted.
+ *
+ * @param bucketContext gives the bucket and associated parameters for this
+ *        request
+ * @param count is the number of objects to delete
+ * @param keys are the keys of the objects to delete
+ * @param versionIds if non-NULL, gives the version of each object to
+ *        delete; a NULL entry deletes the key as S3_delete_object does
+ *        without a version
+ * @param requestContext if non-NULL, gives the S3RequestContext to add this
+ *        request to, and does not perform the request immediately.  If NULL,
+ *        performs the request immediately and synchronously.
+ * @param handler gives the callbacks to call as the request is processed and
+ *        completed 
+ * @param callbackData will be passed in as the callbackData parameter to
+ *        all callbacks for this request
+ **/
+void S3_delete_objects(const S3BucketContext *bucketContext, int count,
+                       const char **keys, const char **versionIds,
+                       S3RequestContext *requestContext,
+                       const S3DeleteObjectsHandler *handler,
+                       void *callbackData);
+
+
 /** **************************************************************************
  * Access Control List Functions
  ************************************************************************** **/
@@ -13,6 +13,13 @@
 // setlinebuf() later in consequence.
 #define _XOPEN_SOURCE 500
 
+// Mount options for both frontends: requests of up to 128k, the most
+// the kernel sends, and splicing between /dev/fuse and the cache
+// files where the kernel supports it.
+#define S3_FUSE_IO_OPTIONS \
+	"-obig_writes,max_write=131072,max_read=131072," \
+	"splice_read,splice_write,splice_move"
+
 // maintain bbfs state in here
 #include <limits.h>
 #include <stdio.h>
@@ -9,13 +9,16 @@ typedef struct s3_file_info {
 	time_t	time;
 	int64_t size;
 	char	*versionId;
+	char	*eTag;		/* from a bucket listing, else NULL */
 
 } s3_file_info;
 
+typedef struct s3_key_list	s3_key_list;	/* s3_key_list.h */
+
 /******************* Global Variables *****************************/
 
-extern int statusG;
-extern char errorDetailsG[4096];
+extern __thread int statusG;
+extern __thread char errorDetailsG[4096];
 
 /******************** Function Definitions ************************/
 
@@ -25,11 +28,23 @@ int list_bucket(const char *bucketName, const char *prefix,
                         const char *marker, const char *delimiter,
                         int maxkeys, int allDetails,
 			int *pCount, s3_file_info** pS3FileInfoList);
+int list_bucket_page(const char *bucketName, const char *prefix,
+			const char *marker, const char *delimiter, int maxkeys,
+			int *pCount, s3_file_info **pS3FileInfoList,
+			int *pPrefixCount, char ***pCommonPrefixes,
+			char **pNextMarker);
+int list_bucket_keys(const char *bucketName, const char *prefix,
+			s3_key_list *keys);
+void freeCommonPrefixes(int prefixCount, char **commonPrefixes);
 
 int saveSecurityCredentials();
 int get_object(int argc, char **argv, int optindex);
+int head_object(int argc, char **argv, int optindex);
 int put_object(int argc, char **argv, int optindex);
 int delete_object(int argc, char **argv, int optindex);
+int delete_objects(const char *bucketName, int count, const char **keys,
+			const char **versionIds, int *results);
+int copy_object(int argc, char **argv, int optindex, char **pETag);
 int create_bucket(int argc, char **argv, int optindex);
 int set_versioning(int argc, char **argv, int optindex);
 int get_versioning(int argc, char **argv, int optindex, char **pVersioning);
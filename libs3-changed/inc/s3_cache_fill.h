@@ -0,0 +1,44 @@
+#ifndef S3_CACHE_FILL_H
+#define S3_CACHE_FILL_H
+
+#include <stdint.h>
+#include "s3_fuse_bridge.h"
+
+/*
+ * Background fill of cached copies.
+ *
+ * Without it open() downloads the whole object before it returns.  A
+ * read-only open of a plain object - not erasure coded or chunked -
+ * bigger than one block returns at once instead: the cached file is
+ * created at its full size and a thread fills it block by block with
+ * ranged GETs, pinned to the object's ETag or version.  A bitmap
+ * records the blocks present; a read waits for the blocks it covers
+ * only, and fetches a block the thread has not got to yet itself.
+ *
+ *	S3_BACKGROUND_FILL	0 (or off/no) turns it off, default on
+ *	S3_FILL_BLOCK_KB	block size in KB, default 1024
+ *
+ * Whatever writes or truncates a cached copy first waits for its fill
+ * with fillWait(path, 0, FILL_TO_END).  Delete cancels the fills under
+ * the path, and fillStop(), at unmount, all of them; an unfinished
+ * copy is removed so that it is fetched again.
+ */
+
+/***************** constants ****************************/
+#define FILL_DEFAULT_BLOCK_KB	1024
+#define FILL_TO_END		INT64_MAX
+
+/****************** global variables ******************/
+extern int		gFillFlag;
+
+/******************* function definitions ****************/
+int saveFillPolicy();
+int64_t fillBlockSize();
+int fillStart(s3_cache *cache, const char *path, const char *cachedPath,
+		const char *s3Name, const char *versionId, const char *eTag,
+		int64_t size);
+int fillWait(const char *path, int64_t offset, int64_t size);
+void fillCancel(const char *path);
+void fillStop();
+
+#endif /* S3_CACHE_FILL_H */
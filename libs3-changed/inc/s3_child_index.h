@@ -0,0 +1,46 @@
+#ifndef S3_CHILD_INDEX_H
+#define S3_CHILD_INDEX_H
+
+#include "s3_fuse_bridge.h"
+
+/*
+ * Child index.
+ *
+ * The children of a node are a list in descending name order, which
+ * the tree code and readdir walk.  Finding a name in it, or the place
+ * for a new one, is a walk too; once a directory has CHILD_INDEX_MIN
+ * children they are also indexed:
+ *
+ * - a hash table of the names, chained through hashNext, finds a child
+ * - the children in ascending order, in blocks of up to
+ *   CHILD_INDEX_BLOCK, find the place of a new name with two binary
+ *   searches; a block that fills up is split in two, so an insert
+ *   moves at most a block's worth of pointers
+ *
+ * Listings come in ascending order and so go to the end of the last
+ * block.  Every change to a children list goes through childLink() and
+ * childUnlink(), which keep the index up to date and count the change
+ * in the directory's listing, if it has one; childUnlink() also tells
+ * the path cache (s3_path_cache.h).  A node is renamed only
+ * while it is unlinked.  If the index cannot be
+ * allocated the directory goes on without it.  Protected by
+ * gS3TreeLock, like the tree; childFindLockFree() reads the list or
+ * the hash table without it, so they are changed with atomic stores
+ * and a table or index that goes is retired (s3_epoch.h).  An unlinked
+ * child keeps its next and hashNext, a reader that is on it when it
+ * goes still reaches the children after it.
+ */
+
+/***************** constants ****************************/
+#define CHILD_INDEX_MIN		16
+#define CHILD_INDEX_BLOCK	256
+
+/******************* function definitions ****************/
+s3_tree_node *childFind(s3_tree_node *dir, const char *name,
+						s3_tree_node **pPrev);
+s3_tree_node *childFindLockFree(s3_tree_node *dir, const char *name);
+void childLink(s3_tree_node *dir, s3_tree_node *child, s3_tree_node *prev);
+void childUnlink(s3_tree_node *child);
+void childIndexFree(s3_tree_node *dir);
+
+#endif /* S3_CHILD_INDEX_H */
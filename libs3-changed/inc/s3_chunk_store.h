@@ -0,0 +1,47 @@
+#ifndef S3_CHUNK_STORE_H
+#define S3_CHUNK_STORE_H
+
+#include "s3.h"
+#include "s3_fuse_bridge.h"
+
+/*
+ * Chunked storage mode.
+ *
+ * A file is split into content-defined chunks (FastCDC style gear hash).
+ * Every chunk is stored once per bucket under CHUNK_STORE_PREFIX/<sha1>
+ * and only uploaded if it is not there yet.  The file itself becomes a
+ * manifest object, <key>/CHUNK_MANIFEST_NAME, which is written last:
+ *
+ *	<file name>
+ *	<file size>
+ *	<chunk count>
+ *	<sha1> <length>		one line per chunk, in file order
+ *
+ * The first two lines match the _meta.txt format written by the encoder,
+ * so fixEncodedFileInfo() picks up the file size unchanged.
+ *
+ * A fetch takes the manifest over anything else under the key, so a file
+ * put in another mode has its manifest deleted once the put succeeded,
+ * with chunkStoreDropManifest().
+ */
+
+/***************** constants ****************************/
+#define CHUNK_STORE_PREFIX	".chunks"
+#define CHUNK_MANIFEST_NAME	"chunks_meta.txt"
+
+#define CHUNK_MIN_SIZE		(16 * 1024)
+#define CHUNK_AVG_SIZE		(64 * 1024)
+#define CHUNK_MAX_SIZE		(256 * 1024)
+
+/****************** global variables ******************/
+extern int		gChunkStoreFlag;
+
+/******************* function definitions ****************/
+int saveChunkStorePolicy();
+int isChunkStoreKey(const char *key);
+int isNodeChunkManifest(s3_tree_node *node);
+int chunkStoreObjectAndPut(char *path, char *cachedPath);
+int chunkStoreGetObject(char *path, char *cachedPath, char *versionId);
+int chunkStoreDropManifest(char *path);
+
+#endif /* S3_CHUNK_STORE_H */
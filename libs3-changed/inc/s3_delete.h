@@ -0,0 +1,34 @@
+#ifndef S3_DELETE_H
+#define S3_DELETE_H
+
+/*
+ * Batched deletes.
+ *
+ * rm -rf of a directory, and of an erasure-coded file, which is its
+ * k + m fragments and _meta.txt, deletes many keys at once.  They go to
+ * S3 as multi-object deletes (POST ?delete), up to
+ * S3_MAX_DELETE_OBJECTS keys, versions included, a request, instead of
+ * a DELETE each:
+ *
+ *	S3_DELETE_THREADS	requests in flight, default 4
+ *
+ * - keys are "bucket/key"; a request is of one bucket, so a run of keys
+ *   of the same bucket is cut into batches
+ * - a batch of one key is a plain DELETE
+ * - S3 answers a multi-object delete with the keys it could not delete;
+ *   each one is logged and gets its own error, the others count as
+ *   deleted
+ * - a store without multi-object delete (NotImplemented,
+ *   MethodNotAllowed) gets the keys of the batch one by one
+ */
+
+/***************** constants ****************************/
+#define DELETE_DEFAULT_THREADS		4
+#define DELETE_MAX_THREADS		64
+
+/******************* function definitions ****************/
+int saveDeletePolicy();
+int deleteKeysFromS3(int count, char **keys, char **versionIds,
+							int *results);
+
+#endif /* S3_DELETE_H */
@@ -0,0 +1,64 @@
+#ifndef S3_EPOCH_H
+#define S3_EPOCH_H
+
+#include <stdint.h>
+
+/*
+ * Epochs.
+ *
+ * Reads of what the tree has don't take gS3TreeLock:
+ *
+ * - getattr and opendir of a path find the node with
+ *   searchForPathLockFree(), through the path cache (s3_path_cache.h)
+ *   or name by name
+ * - the low-level lookup and getattr find the parent or the node with
+ *   s3InodeGetLockFree(), the inode table being replaced whole when it
+ *   grows
+ * - readdir of a directory listed to the end takes its children with
+ *   s3DirNextChildrenLockFree(); childLink() and childUnlink() bump
+ *   the listing's changes before and after, and a reader that saw it
+ *   odd or move on takes the lock
+ *
+ * Writers still take gS3TreeLock and are one at a time, and publish
+ * what such a reader follows with atomic stores: the children lists,
+ * the child index and its hash table (s3_child_index.h), a node's
+ * parent and name, and the size, time, kind, inode and listing of a
+ * node (NODE_STORE() in s3_fuse_bridge.h).  A reader that finds
+ * nothing, or finds what the locked path would do more with, takes
+ * the lock as before.
+ *
+ * What a reader may be looking at is not freed while it looks:
+ *
+ * - a reader announces the global epoch in its slot on epochEnter()
+ *   and clears it on epochExit(); a thread without a slot, one of
+ *   EPOCH_MAX_READERS, takes the lock instead
+ * - a writer hands a node, or a child index, it unlinked to
+ *   epochRetire(), with the function that frees it; retired memory is
+ *   kept in batches of EPOCH_BATCH
+ * - a full batch is closed with the epoch, which moves on; it is
+ *   freed once no slot holds that epoch or an older one, so every
+ *   reader that could have seen what is in it has left
+ * - on a mount that retires little a batch may not fill for hours:
+ *   the reclaimer, started by epochStart(), closes the open batch and
+ *   frees what it can every EPOCH_FLUSH_SECONDS that something waits
+ * - with no memory for a batch, epochRetire() waits for the readers
+ *   there are and frees at once; a reader never waits for the lock
+ *   between epochEnter() and epochExit(), so they all leave
+ *
+ * epochRetire() and epochFlush() are called with gS3TreeLock held.
+ */
+
+/***************** constants ****************************/
+#define EPOCH_MAX_READERS	256
+#define EPOCH_BATCH		256
+#define EPOCH_FLUSH_SECONDS	1
+
+/******************* function definitions ****************/
+int epochEnter();
+void epochExit();
+void epochRetire(void (*freeFn)(void *), void *p);
+void epochFlush();
+int epochStart();
+void epochStop();
+
+#endif /* S3_EPOCH_H */
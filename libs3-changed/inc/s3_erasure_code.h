@@ -12,6 +12,7 @@ typedef struct erasure_policy {
 	char		int_w[6];
 	char		int_packetSize[6];
 	char		int_bufferSize[6];	
+	char		stripePages[16];	/* optional: hugetlb, thp or none */
 
 } erasure_policy;
 
@@ -20,7 +21,8 @@ extern erasure_policy		gErasurePolicy;
 
 /******************* function definitions ****************/
 int saveErasurePolicy();
-int getObjectAndDecode(char *path, char *cachedPath, s3_tree_node *foundNode);
+int getObjectAndDecode(char *path, char *cachedPath, int partCount,
+							s3_file_info *parts);
 int  encodeObjectAndPut(char* path, char *cachedPath);
 
 #endif /* S3_ERASURE_CODE_H */
@@ -0,0 +1,56 @@
+#ifndef S3_EVICT_H
+#define S3_EVICT_H
+
+#include <stddef.h>
+#include "s3_fuse_bridge.h"
+
+/*
+ * Tree eviction.
+ *
+ * Nodes are only deleted with their objects, so browsing a large
+ * bucket would in the end hold all of it in memory.  The tree is kept
+ * under
+ *
+ *	S3_TREE_MEMORY_KB	kilobytes, default 1048576 (1 GB), 0 no
+ *				limit
+ *
+ * counting EVICT_NODE_BYTES a node, what benchtree measures a node,
+ * its strings and its share of the child index to take, and the name
+ * arena (s3_tree_arena.h) as it is.
+ *
+ * - a lookup stamps the time on the listing of the node, or of the
+ *   nearest directory above it that has one; getattr without
+ *   gS3TreeLock (s3_epoch.h) too, with an atomic store
+ * - once the tree grows past the limit, a thread walks it and takes
+ *   the listed, complete directories whose subtree was used longest
+ *   ago, deepest first of those used at the same time, and drops their
+ *   children until the tree is down to EVICT_LOW_PERCENT of the limit
+ * - the directory stays, incomplete and without a listing, and is
+ *   listed from S3 again the next time it is read or looked in; the
+ *   low-level frontend's kernel is told to forget the children
+ * - a subtree stays while something in it was used in the last
+ *   second, has a cached copy, is dirty, was made here and no listing
+ *   has shown it yet, or is being re-listed
+ * - children whose inodes the kernel still holds (s3InodeHeld()) stay
+ *   too; the kernel is told to forget them, and they go on a later
+ *   pass once it has
+ *
+ * A tree all in use is left over the limit and looked at again a
+ * second later.  The names of dropped nodes leave the name arena with
+ * them.  Protected by gS3TreeLock, like the tree.
+ */
+
+/***************** constants ****************************/
+#define EVICT_DEFAULT_KB	(1024 * 1024)
+#define EVICT_NODE_BYTES	256
+#define EVICT_LOW_PERCENT	90
+
+/******************* function definitions ****************/
+int saveEvictPolicy();
+void evictTouch(s3_tree_node *node);
+void evictCheck();
+size_t evictRun(size_t keepBytes);
+int evictStart();
+void evictStop();
+
+#endif /* S3_EVICT_H */
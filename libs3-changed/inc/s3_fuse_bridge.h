@@ -1,6 +1,9 @@
 #ifndef S3_FUSE_BRIDGE_H
 #define S3_FUSE_BRIDGE_H
 
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
 #include "s3.h"
 #include "libs3.h"
 
@@ -8,33 +11,175 @@
 
 //typedef struct s3_child_node  	s3_child_node;
 typedef struct s3_tree_node	s3_tree_node;
+typedef struct s3_child_index	s3_child_index;	/* s3_child_index.h */
 
 #define		NODE_COMPLETE		1
 #define		VERSION_COMPLETE	2
+#define		NODE_LOCAL		4	/* made here, no listing has
+						   shown it yet */
 
+/*
+ * Directory listing.
+ *
+ * A directory is listed one level at a time with delimiter "/", one
+ * page of S3_LIST_PAGE_KEYS (env S3_LIST_PAGE_KEYS) keys per request.
+ * Objects right under it become file nodes; every common prefix is
+ * probed with a listing of up to S3_LIST_PROBE_KEYS keys and becomes
+ * an encoded or chunked file if it holds a _meta.txt, else a directory
+ * node that is not listed until it is opened.  Until the last page is
+ * in, NODE_COMPLETE is clear and listing->marker is the rest of the
+ * key, after the directory's prefix, that the next page starts from; a
+ * directory without a listing was never listed.
+ *
+ * Directory readers take the children in listing order, page by page,
+ * with s3DirNextChildren(); a child is handed out once the pages cover
+ * name + "/", so nothing is missed however S3 orders "a.b" and "a/".
+ */
+#define		S3_LIST_PAGE_KEYS	1000
+#define		S3_LIST_PROBE_KEYS	64
+
+/* what a directory keeps of its listing, once it was listed */
+typedef struct s3_dir_listing {
+	char		*marker;	/* see Directory listing above */
+	time_t		listedTime;	/* the last page came in */
+	int		refreshing;	/* re-listed in the background,
+					   see s3_revalidate.h */
+	unsigned int	changes;	/* children linked and unlinked,
+					   odd while they are, see s3_epoch.h */
+	time_t		usedTime;	/* looked in, see s3_evict.h */
+} s3_dir_listing;
+
+/*
+ * A node is one allocation from the node slabs (s3_tree_arena.h), its
+ * file info included, and its name is in the name arena.  What a
+ * lookup reads comes first and fills the first cache line; a node is
+ * two cache lines.
+ */
 struct s3_tree_node {
 
-	s3_file_info	*s3FileInfo;
-	int		isFileNode;
-	int		isComplete;
-	char		*s3Name;
+	s3_file_info	s3FileInfo;	/* name is interned, never freed */
+	s3_tree_node	*hashNext;	/* in the parent's childIndex */
 	s3_tree_node	*children;
 	s3_tree_node	*parent;
+	/* cache line */
 	s3_tree_node 	*prev;
 	s3_tree_node 	*next;
+	s3_child_index	*childIndex;	/* of children, once there are many */
+	uint64_t	ino;		/* slot in the inode table */
+	char		*cachedETag;	/* ETag the cached copy was fetched at */
+	char		*s3Name;
+	s3_dir_listing	*listing;	/* directories that were listed */
+	unsigned int	generation;	/* bumped when the slot is reused */
+	char		isFileNode;
+	char		isComplete;
+	char		uploaded;	/* cached copy flushed, the next listing
+					   has its ETag */
 	
 };
 
+/*
+ * What getattr reads without gS3TreeLock (s3_epoch.h) is stored with
+ * NODE_STORE() once the node is linked, and loaded with NODE_LOAD().
+ */
+#define		NODE_STORE(field, value)	\
+			__atomic_store_n(&(field), (value), __ATOMIC_RELEASE)
+#define		NODE_LOAD(field)	__atomic_load_n(&(field), __ATOMIC_ACQUIRE)
+
+/*
+ * Inode table for the low-level frontend.
+ *
+ * Every tree node gets a slot when it is allocated and gives it back
+ * when it is deleted and the kernel has forgotten it; the slot index is
+ * the inode number.  nlookup counts the entries the low-level frontend
+ * handed the kernel, less those it forgot, so a number the kernel still
+ * holds is not given to another node.  Slots are reused with a new
+ * generation.  The root is the first node ever allocated
+ * and so gets inode 1, FUSE_ROOT_ID.  Slots come in chunks of
+ * S3_INODE_CHUNK_SLOTS that never move.  Protected by gS3TreeLock; the
+ * array of chunks is replaced whole when it grows and the slots are
+ * stored with NODE_STORE(), for s3InodeGetLockFree().
+ */
+typedef struct s3_inode_slot {
+	s3_tree_node	*node;		/* NULL when deleted */
+	unsigned long	generation;
+	uint64_t	nextFree;
+	uint64_t	nlookup;	/* atomic */
+	int		isFree;		/* on the free list */
+} s3_inode_slot;
+
+#define		S3_INODE_CHUNK_SLOTS	1024
+
+/*
+ * Kernel cache invalidation.
+ *
+ * A frontend that can talk to the kernel sets gS3Invalidate; it is
+ * called with gS3TreeLock held, so it must only queue the work.
+ * - S3_INVALIDATE_ATTR : our own flush changed the size of a file
+ * - S3_INVALIDATE_DATA : a listing shows the object was rewritten
+ * - S3_INVALIDATE_ENTRY : we deleted the node from its parent
+ */
+#define		S3_INVALIDATE_ATTR	1
+#define		S3_INVALIDATE_DATA	2
+#define		S3_INVALIDATE_ENTRY	4
+
+typedef void (*s3_invalidate_fn)(s3_tree_node *node, int what);
+
 typedef struct s3_versioning_info {
 	char		*bucket;
 	char		*state;
 } s3_versioning_info;
 
+/*
+ * Dirty-file table.
+ *
+ * One entry per file written in the cache and not uploaded yet, found
+ * by a hash of its path and chained, oldest first, for the flushers.
+ * Writes add their byte range to the entry, overlapping and adjacent
+ * ranges are merged, so dirtyBytes is what was actually written.  An
+ * upload moves the ranges to flushRanges; writes meanwhile start a new
+ * set, and a failed upload merges the two again.  Protected by the
+ * cache lock.
+ */
+typedef struct s3_dirty_range {
+	int64_t		start;
+	int64_t		end;		/* exclusive */
+} s3_dirty_range;
+
+typedef struct s3_dirty_file s3_dirty_file;
+
+struct s3_dirty_file {
+	char		*path;
+	time_t		dirtyTime;	/* first write since the last upload */
+	time_t		lastWrite;
+	int		flushing;	/* being uploaded */
+	int		redirtied;	/* written again during the upload */
+	s3_dirty_range	*ranges;	/* sorted, disjoint */
+	int		rangeCount;
+	int		rangeSize;
+	int64_t		dirtyBytes;
+	s3_dirty_range	*flushRanges;	/* what the upload in progress covers */
+	int		flushRangeCount;
+	int64_t		flushBytes;
+	s3_dirty_file	*hashNext;
+	s3_dirty_file	*prev;		/* dirty list, oldest first */
+	s3_dirty_file	*next;
+};
+
+#define		S3_CACHE_DIRTY_TABLE_INITIAL_SIZE	64
+
 typedef struct s3_cache {
 
 	char		*location;
-	int		count;
-	char		*flushList[50];
+	int		count;		/* dirty files */
+	int		flushingCount;
+	int64_t		dirtyBytes;	/* of all dirty files */
+	int64_t		dirtyLimit;	/* writers wait above it, 0: never */
+	s3_dirty_file	**dirtyTable;
+	int		dirtyTableSize;
+	s3_dirty_file	*dirtyHead;
+	s3_dirty_file	*dirtyTail;
+	pthread_mutex_t	lock;		/* protects everything above */
+	pthread_cond_t	flushed;	/* an upload ended */
 
 } s3_cache;
 
@@ -43,6 +188,23 @@ extern s3_tree_node		*gS3DirectoryTree;
 extern s3_cache		*gS3Cache;
 extern char		gExecuteDir[1024];
 extern int		gEncodeFlag;
+extern s3_invalidate_fn	gS3Invalidate;
+
+/*
+ * gS3TreeLock protects gS3DirectoryTree and every node in it.
+ *
+ * - the tree functions (search*, insert*, updateDirTree, deleteNode, ...)
+ *   expect the caller to hold it; node pointers are only valid while it
+ *   is held.
+ * - searchAndInsertPathInTree(), populateNodes() and s3ListDirPage()
+ *   drop it while they list from S3 and take it again before touching
+ *   the tree.
+ * - addDirectory(), deletePath(), s3CacheFetch() and s3CacheFlushCache()
+ *   take it themselves, and never hold it across S3 requests.
+ * - searchForPathLockFree(), s3DirNextChildrenLockFree() and
+ *   s3InodeGetLockFree() read without it, see s3_epoch.h.
+ */
+extern pthread_mutex_t	gS3TreeLock;
 
 /******************** Function Definitions ************************/
 
@@ -54,10 +216,19 @@ int	searchAndInsertPathInTree(const char *path, s3_tree_node **tree,
 int populateNodes(s3_tree_node **tree, const char * path, 
 					int initialize,  int *pCount); 
 int searchForPath(const char *path, s3_tree_node *tree, s3_tree_node **pathNode);
+s3_tree_node *searchForPathLockFree(const char *path);
 int getPathFromS3(const char *path, int *pCount, s3_file_info **pS3FileInfoList,
 														int initialize);
+int getKeysFromS3(const char *path, s3_key_list *keys);
 int insertS3NodesInTree(s3_tree_node **tree, const char* path, int count, 
-											s3_file_info *s3FileInfoList);
+				s3_file_info *s3FileInfoList,
+				int *pMetaCount, char ***pMetaPaths);
+int s3ListDirPage(s3_tree_node **tree, const char *path);
+int s3DirNextChildren(s3_tree_node *dir, char **pLast,
+			s3_tree_node ***pChildren, int *pCount);
+int s3DirNextChildrenLockFree(s3_tree_node *dir, char **pLast,
+			s3_tree_node ***pChildren, int *pCount);
+int s3RelistDir(const char *path);
 
 int searchNode(s3_tree_node *tree, char *name, 
 				int insertFlag, s3_tree_node **pResultNode);
@@ -66,19 +237,38 @@ int  allocateTreeNode(s3_tree_node **pResultNode);
 
 
 int fixEncodedFileInfo(s3_tree_node *node, char* path);
+int getEncodedFileSize(char *path, char *s3Name, char *versionId,
+							int64_t *pSize);
+int readMetaHeader(FILE *fp, int64_t *pSize);
+int fixEncodedFileSizes(int metaCount, char **metaPaths);
 
 int updateDirTree(char *path, int isFileNode);
 
 int getPathForNode(s3_tree_node *pathNode, char **pPath);
+int pathForNode(s3_tree_node *node, char *buf, size_t size);
 int	addDirectory(const char *path);
 int	deletePath(char *path);
 int deleteNode(s3_tree_node *node);
 int deleteChildren(s3_tree_node *node);
+int moveNode(s3_tree_node *node, s3_tree_node *newParent,
+						const char *newName);
 int deleteThroughTree(char *path);
 int deleteThroughS3(char *path);
 int deleteObjectFromS3(char *key, char *versionId);
+int copyObjectInS3(char *sourceKey, char *destinationKey, char **pETag);
 int deleteBucketFromS3(char *bucket);
 
+/******* inode functions **********/
+
+int s3InodeAdd(s3_tree_node *node);
+void s3InodeRemove(s3_tree_node *node);
+void s3InodeRef(s3_tree_node *node);
+int s3InodeRefLockFree(s3_tree_node *node, uint64_t ino);
+void s3InodeForget(uint64_t ino, uint64_t nlookup);
+int s3InodeHeld(s3_tree_node *node);
+int s3InodeGet(uint64_t ino, s3_tree_node **pNode);
+s3_tree_node *s3InodeGetLockFree(uint64_t ino);
+
 /**************versioning functions ****************************/
 
 int populateVersions(s3_tree_node *pathNode, const char *path);
@@ -104,11 +294,23 @@ int processVersionsList(s3_tree_node *versionNode,
 int s3CacheInit(s3_cache **pCache, char* cacheLocation) ;
 int s3CacheGetCachedPath(s3_cache * cache, const char *path, char **pCachedPath);
 int s3CacheInCache(s3_cache * cache, const char* path, int *pInCache);
-int s3CacheMarkForFlush(s3_cache * cache, const char* path);
-int s3CacheFetch(s3_cache * cache, const char* path);
+int s3CacheMarkForFlush(s3_cache * cache, const char* path, int64_t offset,
+							int64_t size);
+int s3CacheIsDirty(s3_cache * cache, const char *path);
+int s3CacheIsDirtyBelow(s3_cache * cache, const char *path);
+int s3CacheDiscard(s3_cache * cache, const char *path);
+int s3CacheTakeDirty(s3_cache * cache, int delay, int64_t dirtyLimit,
+							char **pPath);
+int s3CacheWriteBack(s3_cache * cache, char *path);
+int s3CacheFetch(s3_cache * cache, const char* path, int background);
+int s3CacheOpen(s3_cache * cache, const char* path, int flags,
+							int *pKeepCache);
+int s3CacheFetchObject(char *s3Name, char *versionId, char *cachedPath);
+int s3CacheTempPath(s3_cache *cache, const char *tag, char **pTempPath);
 int s3CacheFlushCache(s3_cache * cache, char* path);
 
 int mkpath(char *path);
 int saveExecuteDir();
+int saveListPolicy();
 void logS3Errors(int status);
 #endif /* S3_FUSE_BRIDGE_H */
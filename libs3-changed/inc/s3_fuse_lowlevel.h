@@ -0,0 +1,14 @@
+#ifndef S3_FUSE_LOWLEVEL_H
+#define S3_FUSE_LOWLEVEL_H
+
+/*
+ * Low-level (inode based) FUSE frontend, selected with --lowlevel.
+ * See s3_fuse_lowlevel.c.
+ */
+
+struct s3_fuse_state;
+
+/******************* function definitions ****************/
+int s3_fuse_lowlevel_main(int argc, char *argv[], struct s3_fuse_state *state);
+
+#endif /* S3_FUSE_LOWLEVEL_H */
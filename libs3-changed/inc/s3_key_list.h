@@ -0,0 +1,51 @@
+#ifndef S3_KEY_LIST_H
+#define S3_KEY_LIST_H
+
+#include "s3.h"
+
+/*
+ * Front-coded key lists.
+ *
+ * A listing comes back in key order, and the keys under a prefix share
+ * most of their bytes: tenant/2026/10/17/host-0042/part-00001.parquet
+ * is followed by .../part-00002.parquet.  A key list keeps every key as
+ * the number of bytes it shares with the key before and the rest, with
+ * its size, time and ETag, in one growing buffer, rather than an
+ * s3_file_info and two strings each.  Keys are read back in order with
+ * keyListNext(), which rebuilds them in the iterator and tells how much
+ * of the key before they share.
+ *
+ * The tree holds listed directories one level at a time with their
+ * names interned (s3_tree_arena.h); the keys of a whole prefix, which
+ * deleting or renaming a directory needs, are held here.
+ */
+
+/********************Structure Definitions *************************/
+struct s3_key_list {
+	unsigned char	*data;
+	size_t		length;
+	size_t		size;
+	int		count;
+	char		last[S3_MAX_KEY_SIZE + 1];	/* the key appended last */
+	int		lastLength;
+};
+
+typedef struct s3_key_iter {
+	const s3_key_list	*list;
+	size_t		offset;
+	char		key[S3_MAX_KEY_SIZE + 1];
+	char		eTag[256];
+	int		shared;		/* bytes of the key before kept */
+} s3_key_iter;
+
+#define		S3_KEY_LIST_INITIAL_SIZE	4096
+
+/******************** Function Definitions ************************/
+void keyListInit(s3_key_list *list);
+void keyListFree(s3_key_list *list);
+int keyListAppend(s3_key_list *list, const char *key, time_t time,
+					int64_t size, const char *eTag);
+void keyIterInit(s3_key_iter *iter, const s3_key_list *list);
+int keyListNext(s3_key_iter *iter, s3_file_info *info);
+
+#endif /* S3_KEY_LIST_H */
@@ -0,0 +1,40 @@
+#ifndef S3_NEGATIVE_CACHE_H
+#define S3_NEGATIVE_CACHE_H
+
+#include "s3_fuse_bridge.h"
+
+/*
+ * Negative lookup cache.
+ *
+ * Shells, editors and build tools look for many paths that are not
+ * there (.git, *.swp, __pycache__), and every path the tree doesn't
+ * have costs a listing of its prefix in S3.  searchAndInsertPathInTree()
+ * doesn't ask S3 when
+ *
+ * - the deepest directory of the path the tree has was listed to the
+ *   end, see s3_revalidate.h for how long that holds, or
+ * - S3 did not have the path when it was looked for less than
+ *
+ *	S3_NEGATIVE_TTL		seconds ago, default 10, 0 never
+ *
+ *   ago; at most S3_NEGATIVE_ENTRIES (default 4096) such misses are
+ *   kept, the oldest goes first.
+ *
+ * The tree is searched first, so a path that shows up in a listing or
+ * is made here is found at once; create, mkdir and the upload of a
+ * file also drop the path from the cache.  Protected by gS3TreeLock,
+ * like the tree.
+ */
+
+/***************** constants ****************************/
+#define NEGATIVE_DEFAULT_TTL		10
+#define NEGATIVE_DEFAULT_ENTRIES	4096
+#define NEGATIVE_MAX_ENTRIES		(1024 * 1024)
+
+/******************* function definitions ****************/
+int saveNegativePolicy();
+int negativeFind(const char *path);
+void negativeAdd(const char *path);
+void negativeForget(const char *path);
+
+#endif /* S3_NEGATIVE_CACHE_H */
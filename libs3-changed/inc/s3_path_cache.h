@@ -0,0 +1,43 @@
+#ifndef S3_PATH_CACHE_H
+#define S3_PATH_CACHE_H
+
+#include "s3_fuse_bridge.h"
+
+/*
+ * Path cache.
+ *
+ * getattr, open, readdir and the cache find their node with
+ * searchForPath(), which looks every name of the path up from the
+ * root.  The paths found last are kept in a table,
+ *
+ *	S3_PATH_CACHE_ENTRIES	slots, default 4096, 0 none
+ *
+ * one slot a path, by its hash, the path found last in it; a path that
+ * is there is found with one probe.  Only paths as the frontends pass
+ * them, "/bucket/dir/name", are kept.
+ *
+ * An entry holds the node and the tree generation it was found at.
+ * Linking a node changes nothing found; childUnlink(), which deletes
+ * and moves go through, calls pathCacheUnlink(): a node without
+ * children takes its own path out, anything else moves the
+ * generation on, and every entry found before goes stale.  Protected by
+ * gS3TreeLock, like the tree; searchForPathLockFree() looks in it with
+ * pathCacheFindLockFree(), so an entry is changed between two bumps of
+ * its sequence and a path it drops is retired (s3_epoch.h).
+ */
+
+/***************** constants ****************************/
+#define PATH_CACHE_DEFAULT_ENTRIES	4096
+#define PATH_CACHE_MAX_ENTRIES		(1024 * 1024)
+
+/* "/bucket/key" */
+#define PATH_CACHE_MAX_PATH	(S3_MAX_BUCKET_NAME_SIZE + S3_MAX_KEY_SIZE + 3)
+
+/******************* function definitions ****************/
+int savePathCachePolicy();
+s3_tree_node *pathCacheFind(s3_tree_node *tree, const char *path);
+s3_tree_node *pathCacheFindLockFree(s3_tree_node *tree, const char *path);
+void pathCacheAdd(s3_tree_node *tree, const char *path, s3_tree_node *node);
+void pathCacheUnlink(s3_tree_node *node);
+
+#endif /* S3_PATH_CACHE_H */
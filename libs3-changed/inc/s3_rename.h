@@ -0,0 +1,33 @@
+#ifndef S3_RENAME_H
+#define S3_RENAME_H
+
+#include "s3_fuse_bridge.h"
+
+/*
+ * Server-side rename.
+ *
+ * rename() copies the keys of a file or directory to their new names
+ * with S3 COPY requests, so no data goes through the host, deletes the
+ * old keys and moves the node in the tree; the inode and the cached
+ * copy go with it.  An erasure-coded file is its k + m fragments and
+ * _meta.txt, which the decoder finds by the file's name, so they are
+ * renamed after the new name as the encoder would have named them.
+ *
+ *	S3_RENAME_THREADS	copies in parallel, default 8
+ *
+ * The old keys then go in multi-object deletes (s3_delete.h).
+ * A dirty file is uploaded first.  Moving between buckets, or a bucket
+ * itself, returns EXDEV and is left to the copy and delete of mv.  If
+ * a copy fails the copies made so far are deleted and the old keys
+ * stay.
+ */
+
+/***************** constants ****************************/
+#define RENAME_DEFAULT_THREADS		8
+#define RENAME_MAX_THREADS		64
+
+/******************* function definitions ****************/
+int saveRenamePolicy();
+int renamePath(const char *path, const char *newPath);
+
+#endif /* S3_RENAME_H */
@@ -0,0 +1,43 @@
+#ifndef S3_REVALIDATE_H
+#define S3_REVALIDATE_H
+
+#include "s3_fuse_bridge.h"
+
+/*
+ * Background revalidation of directory listings.
+ *
+ * A directory listed to the end is served from the tree without asking
+ * S3 again, so what other writers do would never be seen.  Its listing
+ * keeps the time the last page came in; once it is older than
+ *
+ *	S3_LIST_TTL		seconds, default 60, 0 never
+ *
+ * the next lookup in the directory, or readdir of it, still answers
+ * from the tree and starts a thread that lists the directory again
+ * with s3RelistDir() and merges the differences: new children are
+ * added, sizes, times and ETags updated - a new ETag invalidates the
+ * cached copy as after any listing - and children S3 no longer has
+ * are deleted.  Nothing waits for it.
+ *
+ * A file or directory made here (NODE_LOCAL) that no listing has shown
+ * yet, a file with writes not uploaded or whose upload the listing may
+ * not show yet, and a directory holding any of them, are never deleted
+ * by a re-list.  At most REVALIDATE_MAX_THREADS directories are
+ * re-listed at once, an expired one found meanwhile waits for the next
+ * access.  A failed re-list is tried again a TTL later.
+ *
+ * getattr without gS3TreeLock (s3_epoch.h) asks revalidateDue() first
+ * and takes the lock when a listing it would look at expired.
+ */
+
+/***************** constants ****************************/
+#define REVALIDATE_DEFAULT_TTL		60
+#define REVALIDATE_MAX_THREADS		4
+
+/******************* function definitions ****************/
+int saveRevalidatePolicy();
+void revalidateCheck(s3_tree_node *node);
+int revalidateDue(s3_tree_node *node);
+void revalidateStop();
+
+#endif /* S3_REVALIDATE_H */
@@ -0,0 +1,39 @@
+#ifndef S3_SCAN_H
+#define S3_SCAN_H
+
+#include "s3.h"
+
+/*
+ * Parallel key scans.
+ *
+ * Deleting or renaming a directory needs every key under it, and one
+ * listing pages through them one request after the other.  scanKeys()
+ * splits the keyspace of the prefix into ranges of keys, after one key
+ * and up to another, and lists them with
+ *
+ *	S3_SCAN_THREADS		ranges at once, default 8, 1 pages through
+ *				the keys one request after the other
+ *	S3_SCAN_PAGE_KEYS	keys a request, default 1000
+ *
+ * - the first request lists the prefix with delimiter "/"; if that was
+ *   all of it, it is the answer, else its common prefixes are the
+ *   first ranges
+ * - a range whose page is not the last, while a thread has nothing to
+ *   do, is split: the keys of the page vary from some byte on, and
+ *   the rest of the range is cut before the next values of that byte
+ *   and the one before it, "part-00999" gives "part-01" .. "part-09",
+ *   "part-1" .. "part-9"
+ * - the ranges together are the keyspace, so their keys, one range
+ *   after the other, are the listing in key order
+ */
+
+/***************** constants ****************************/
+#define SCAN_DEFAULT_THREADS	8
+#define SCAN_MAX_THREADS	64
+#define SCAN_DEFAULT_PAGE_KEYS	1000
+
+/******************* function definitions ****************/
+int saveScanPolicy();
+int scanKeys(const char *bucket, const char *prefix, s3_key_list *keys);
+
+#endif /* S3_SCAN_H */
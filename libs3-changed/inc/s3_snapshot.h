@@ -0,0 +1,80 @@
+#ifndef S3_SNAPSHOT_H
+#define S3_SNAPSHOT_H
+
+#include <stdint.h>
+#include "s3_fuse_bridge.h"
+
+/*
+ * Tree snapshot.
+ *
+ * A mount starts with an empty tree and lists every directory from S3
+ * on first touch, so a remount of a large bucket is a cold start.  The
+ * tree is saved to
+ *
+ *	S3_SNAPSHOT		file, default .s3fs_snapshot in the cache
+ *				directory, "off" never
+ *	S3_SNAPSHOT_INTERVAL	seconds between saves, default 300, 0 only
+ *				at unmount
+ *
+ * and the next mount maps the file and loads nothing up front: the
+ * buckets still come from list_service(), and a directory the snapshot
+ * has a complete listing of gets its children from there the first
+ * time it would be listed from S3.  Its listing keeps the time it was
+ * listed at, so under S3_LIST_TTL (s3_revalidate.h) it is served at
+ * once and re-listed in the background; with S3_LIST_TTL=0 it is
+ * trusted as it is.  Directories below are loaded the same way when
+ * they are touched; a directory made here is never loaded, nor any one
+ * twice.
+ *
+ * The file is a header, the nodes breadth first, the children of each
+ * node together and by name, and their strings; it is in the byte
+ * order of the machine that wrote it, and a file that doesn't check
+ * out is not used.  A directory with something made here that no
+ * listing has shown yet is saved as listed long ago, so the next mount
+ * re-lists it on first access.  A save writes a new file and renames
+ * it over the old one; the directories not loaded yet are copied over
+ * from the old one.  Protected by gS3TreeLock, like the tree.
+ */
+
+/***************** constants ****************************/
+#define SNAPSHOT_DEFAULT_INTERVAL	300
+#define SNAPSHOT_DEFAULT_NAME		".s3fs_snapshot"
+#define SNAPSHOT_MAGIC			"S3FSTREE"
+#define SNAPSHOT_VERSION		1
+#define SNAPSHOT_NONE			UINT32_MAX	/* no string */
+
+/********************Structure Definitions *************************/
+typedef struct s3_snapshot_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	nodeCount;	/* the root is the first */
+	uint64_t	stringsSize;	/* after the nodes */
+	int64_t		savedTime;
+} s3_snapshot_header;
+
+typedef struct s3_snapshot_node {
+	uint32_t	name;		/* offsets into the strings */
+	uint32_t	s3Name;
+	uint32_t	versionId;
+	uint32_t	eTag;
+	uint32_t	cachedETag;
+	uint32_t	firstChild;
+	uint32_t	childCount;
+	uint8_t		isFileNode;
+	uint8_t		isComplete;
+	uint8_t		listed;		/* the children are all of them */
+	uint8_t		pad;
+	int64_t		time;
+	int64_t		size;
+	int64_t		listedTime;
+} s3_snapshot_node;
+
+/******************* function definitions ****************/
+int saveSnapshotPolicy();
+int snapshotStart(s3_cache *cache);
+void snapshotStop();
+int snapshotSave();
+int snapshotLoadDir(s3_tree_node *dir, const char *path);
+int snapshotLoadPath(s3_tree_node *tree, const char *path);
+
+#endif /* S3_SNAPSHOT_H */
@@ -0,0 +1,43 @@
+#ifndef S3_TREE_ARENA_H
+#define S3_TREE_ARENA_H
+
+#include <stddef.h>
+#include "s3_fuse_bridge.h"
+
+/*
+ * Tree arenas.
+ *
+ * A bucket of millions of keys is millions of nodes and names; rather
+ * than a malloc() for each, nodes come from slabs and names from a
+ * string arena:
+ *
+ * - a slab is NODE_SLAB_NODES nodes, cache line aligned; a deleted
+ *   node goes on a free list, chained through next, for the next
+ *   allocation.  Slabs are never given back, the tree reuses them up
+ *   to the most nodes it ever had, which eviction bounds (s3_evict.h).
+ * - nameIntern() keeps one copy of each name, in blocks of
+ *   NAME_ARENA_BLOCK bytes, found by a hash of the name; the many
+ *   nodes called "2026" or "_meta.txt" share it.  Every node holds a
+ *   reference to its name, given back with nameRelease() when the
+ *   node, or its name after a rename, is retired; a name with none
+ *   left goes on a free list by size, for the next name as long.
+ *   Blocks are never given back.  Node names must never be freed with
+ *   free() or written to.
+ *
+ * Protected by gS3TreeLock, like the tree.
+ */
+
+/***************** constants ****************************/
+#define NODE_SLAB_NODES		1024
+#define NAME_ARENA_BLOCK	(64 * 1024)
+#define NAME_TABLE_INITIAL_SIZE	1024
+
+/******************* function definitions ****************/
+s3_tree_node *nodeArenaAlloc();
+void nodeArenaFree(s3_tree_node *node);
+char *nameIntern(const char *name);
+void nameRelease(char *name);
+void treeArenaUsage(size_t *pNodeBytes, size_t *pNameBytes);
+size_t treeArenaNodes();
+
+#endif /* S3_TREE_ARENA_H */
@@ -0,0 +1,41 @@
+#ifndef S3_WRITE_BACK_H
+#define S3_WRITE_BACK_H
+
+#include "s3_fuse_bridge.h"
+
+/*
+ * Write-back mode.
+ *
+ * By default every close() of a written file encodes and uploads it
+ * before it returns.  With S3_WRITE_BACK=1 close() returns at once and
+ * the file waits in the cache's dirty-file table for a pool of
+ * workers:
+ *
+ *	S3_WRITE_BACK_DELAY	seconds a file stays dirty before it is
+ *				uploaded, default 5
+ *	S3_WRITE_BACK_DIRTY_MB	once this many MB were written and not
+ *				uploaded yet files go up at once, at
+ *				twice as many writers wait, default 64
+ *	S3_WRITE_BACK_THREADS	uploads in parallel, default 4
+ *
+ * fsync() waits for the file to be in S3; writeBackStop(), at unmount,
+ * for all of them.
+ */
+
+/***************** constants ****************************/
+#define WRITE_BACK_DEFAULT_DELAY	5
+#define WRITE_BACK_DEFAULT_DIRTY_MB	64
+#define WRITE_BACK_DEFAULT_THREADS	4
+#define WRITE_BACK_MAX_THREADS		32
+
+/****************** global variables ******************/
+extern int		gWriteBackFlag;
+
+/******************* function definitions ****************/
+int saveWriteBackPolicy();
+int writeBackStart(s3_cache *cache);
+void writeBackStop(s3_cache *cache);
+int writeBackClose(s3_cache *cache, const char *path);
+void writeBackKick();
+
+#endif /* S3_WRITE_BACK_H */
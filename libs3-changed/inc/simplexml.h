@@ -68,6 +68,11 @@ void simplexml_initialize(SimpleXml *simpleXml, SimpleXmlCallback *callback,
 
 S3Status simplexml_add(SimpleXml *simpleXml, const char *data, int dataLen);
 
+// Parses what the parser still holds back of the document, so that the
+// callbacks of its last elements are made; for when the end of an element
+// is what a caller acts on
+S3Status simplexml_finish(SimpleXml *simpleXml);
+
 
 // Always call this
 void simplexml_deinitialize(SimpleXml *simpleXml);
@@ -88,6 +88,15 @@ int base64Encode(const unsigned char *in, int inLen, char *out);
 void HMAC_SHA1(unsigned char hmac[20], const unsigned char *key, int key_len,
                const unsigned char *message, int message_len);
 
+// Compute SHA-1 of [message], storing result in [digest]
+void SHA1_digest(unsigned char digest[20], const unsigned char *message,
+                 int message_len);
+
+// Compute MD5 of [message], storing result in [digest]; this is what the
+// Content-MD5 header carries, base64 encoded
+void MD5_digest(unsigned char digest[16], const unsigned char *message,
+                int message_len);
+
 // Compute a 64-bit hash values given a set of bytes
 uint64_t hash(const unsigned char *k, int length);
 
@@ -0,0 +1,551 @@
+/*
+  Benchmark of the directory tree with many children.
+
+  Inserts NKEYS synthetic names into one directory through searchNode(),
+  as a listing does, in listing (ascending) order and in random order,
+  looks every name up in random order, walks the children list as
+  readdir does and deletes the directory.  The children list must stay
+  in descending order with every name found once; the timings, and
+  the heap the tree takes per key, go to stdout.  The heap is only
+  reported for the first insert: after a delete the tree reuses the
+  freed nodes and names, which says nothing of a fresh tree.
+
+  Then inserts the keys of a deep, repetitive keyspace
+  (tenant/2026/10/17/host-0042/part-00001.parquet) through
+  insertS3NodesInTree(), a page of a recursive listing at a time,
+  reports the nodes and interned names the tree holds for them and the
+  share of single-child chains a radix tree would merge, finds
+  every one of them, and looks them up by path with searchForPath(),
+  every one once and then the same 64 over and over, and every one
+  with searchForPathLockFree(), as getattr does.
+
+  Then deletes it and lists directories of BROWSE_KEYS unique names
+  one after the other, as browsing a bucket does, evicting the ones
+  listed before past a limit of BROWSE_LIVE of them; what the node and
+  name arenas hold must stay where it was once the limit was reached.
+
+  Then holds as many keys of that keyspace as a listing of
+  s3_file_info would, and as a front-coded key list, and reads them
+  back.
+
+  usage: benchtree [keys]		default 1000000
+  S3_PATH_CACHE_ENTRIES sizes the path cache, as for s3fs.
+*/
+
+/* strdup() */
+#define _XOPEN_SOURCE 500
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "log.h"
+#include "s3_fuse_bridge.h"
+#include "s3_tree_arena.h"
+#include "s3_key_list.h"
+#include "s3_path_cache.h"
+#include "s3_epoch.h"
+#include "s3_evict.h"
+
+#define NKEYS		1000000
+#define BROWSE_KEYS	1000
+#define BROWSE_LIVE	8
+
+static int		failures = 0;
+static int		arenaFresh = 1;	/* no node freed yet */
+
+static double now()
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *what, int count, double start)
+{
+	double		seconds = now() - start;
+
+	printf("%-24s %8d keys %8.3f s %8.0f ns/key\n", what, count,
+					seconds, seconds * 1e9 / count);
+}
+
+/* a random permutation of 0 .. count - 1, the same on every run */
+static int *shuffled(int count)
+{
+	int		*order = malloc(count * sizeof(int));
+	int		i, j, t;
+
+	srand(1);
+	for( i = 0; i < count; i++ ) {
+		order[i] = i;
+	}
+	for( i = count - 1; i > 0; i-- ) {
+		j = (int) (((double) rand() / ((double) RAND_MAX + 1)) * (i + 1));
+		t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+	return order;
+}
+
+static void keyName(int i, char *name)
+{
+	sprintf(name, "key%08d.dat", i);
+}
+
+/* bytes in use on the heap */
+static size_t heapInUse()
+{
+	struct mallinfo2	mi = mallinfo2();
+
+	return mi.uordblks + mi.hblkhd;
+}
+
+static void insertKeys(s3_tree_node *dir, int count, int *order,
+							const char *what)
+{
+	s3_tree_node	*node = NULL;
+	char		name[64];
+	size_t		heap = heapInUse();
+	double		start = now();
+	int		i;
+
+	for( i = 0; i < count; i++ ) {
+		keyName((order != NULL) ? order[i] : i, name);
+		if( (searchNode(dir, name, 1, &node) != 0) || (node == NULL) ) {
+			fprintf(stderr, "FAIL: insert %s\n", name);
+			failures++;
+			return;
+		}
+		node->isFileNode = 1;
+		node->s3FileInfo.size = i;
+	}
+	report(what, count, start);
+	if( arenaFresh ) {
+		printf("%-24s %8d keys %8.1f bytes/key\n", "heap", count,
+					(double) (heapInUse() - heap) / count);
+	}
+}
+
+static void lookupKeys(s3_tree_node *dir, int count, int *order)
+{
+	s3_tree_node	*node = NULL;
+	char		name[64];
+	double		start = now();
+	int		i;
+
+	for( i = 0; i < count; i++ ) {
+		keyName(order[i], name);
+		searchNode(dir, name, 0, &node);
+		if( (node == NULL) || (strcmp(node->s3FileInfo.name, name) != 0) ) {
+			fprintf(stderr, "FAIL: lookup %s\n", name);
+			failures++;
+			return;
+		}
+	}
+	name[0] = 'x';
+	searchNode(dir, name, 0, &node);
+	if( node != NULL ) {
+		fprintf(stderr, "FAIL: lookup %s found\n", name);
+		failures++;
+	}
+	report("lookup, random", count, start);
+}
+
+static void walkKeys(s3_tree_node *dir, int count)
+{
+	s3_tree_node	*child = NULL;
+	s3_tree_node	*last = NULL;
+	double		start = now();
+	int		n = 0;
+
+	for( child = dir->children; child != NULL; child = child->next ) {
+		if( (last != NULL) && (strcmp(last->s3FileInfo.name,
+					child->s3FileInfo.name) <= 0) ) {
+			fprintf(stderr, "FAIL: %s before %s\n",
+				last->s3FileInfo.name, child->s3FileInfo.name);
+			failures++;
+			return;
+		}
+		last = child;
+		n++;
+	}
+	if( n != count ) {
+		fprintf(stderr, "FAIL: %d children, not %d\n", n, count);
+		failures++;
+		return;
+	}
+	report("walk", count, start);
+}
+
+static void deepKey(int i, char *key)
+{
+	sprintf(key, "tenant/2026/%02d/%02d/host-%04d/part-%05d.parquet",
+			1 + i / 1000000 % 12, 1 + i / 100000 % 28,
+			i / 1000 % 100, i % 1000);
+}
+
+static void listKeys(int count)
+{
+	s3_file_info	*list = NULL;
+	s3_key_list	keys;
+	s3_key_iter	iter;
+	s3_file_info	info;
+	char		key[S3_MAX_KEY_SIZE + 1];
+	const char	*eTag = "\"0123456789abcdef0123456789abcdef\"";
+	size_t		heap = heapInUse();
+	double		start = now();
+	int		i;
+
+	list = malloc(count * sizeof(s3_file_info));
+	for( i = 0; i < count; i++ ) {
+		deepKey(i, key);
+		list[i].name = strdup(key);
+		list[i].time = i;
+		list[i].size = i;
+		list[i].versionId = NULL;
+		list[i].eTag = strdup(eTag);
+	}
+	report("list, s3_file_info", count, start);
+	printf("%-24s %8d keys %8.1f bytes/key\n", "heap", count,
+				(double) (heapInUse() - heap) / count);
+	for( i = 0; i < count; i++ ) {
+		free(list[i].name);
+		free(list[i].eTag);
+	}
+	free(list);
+
+	keyListInit(&keys);
+	heap = heapInUse();
+	start = now();
+	for( i = 0; i < count; i++ ) {
+		deepKey(i, key);
+		if( keyListAppend(&keys, key, i, i, eTag) != 0 ) {
+			fprintf(stderr, "FAIL: append %s\n", key);
+			failures++;
+			break;
+		}
+	}
+	report("list, front-coded", count, start);
+	printf("%-24s %8d keys %8.1f bytes/key\n", "heap", count,
+				(double) (heapInUse() - heap) / count);
+
+	start = now();
+	keyIterInit(&iter, &keys);
+	for( i = 0; keyListNext(&iter, &info); i++ ) {
+		deepKey(i, key);
+		if( (strcmp(info.name, key) != 0) || (info.size != i)
+				|| (info.time != i) || (info.eTag == NULL)
+				|| (strcmp(info.eTag, eTag) != 0) ) {
+			fprintf(stderr, "FAIL: key %d is %s\n", i, info.name);
+			failures++;
+			break;
+		}
+	}
+	if( i != count ) {
+		fprintf(stderr, "FAIL: %d keys, not %d\n", i, count);
+		failures++;
+	}
+	report("read, front-coded", count, start);
+	keyListFree(&keys);
+}
+
+/* every listed key by its path, once, then the same few over and over,
+   as getattr and open do */
+static void lookupPaths(s3_tree_node *root, int count)
+{
+	s3_tree_node	*node = NULL;
+	char		key[S3_MAX_KEY_SIZE + 1];
+	char		path[S3_MAX_KEY_SIZE + 16];
+	double		start = now();
+	int		i = 0;
+
+	for( i = 0; i < count; i++ ) {
+		deepKey(i, key);
+		sprintf(path, "/bench/listed/%s", key);
+		searchForPath(path, root, &node);
+		if( (node == NULL) || (node->s3FileInfo.size != i) ) {
+			fprintf(stderr, "FAIL: path %s\n", path);
+			failures++;
+			return;
+		}
+	}
+	report("lookup, every path", count, start);
+
+	start = now();
+	for( i = 0; i < count; i++ ) {
+		deepKey(i % 64, key);
+		sprintf(path, "/bench/listed/%s", key);
+		searchForPath(path, root, &node);
+		if( (node == NULL) || (node->s3FileInfo.size != i % 64) ) {
+			fprintf(stderr, "FAIL: path %s\n", path);
+			failures++;
+			return;
+		}
+	}
+	report("lookup, 64 paths", count, start);
+
+	start = now();
+	for( i = 0; i < count; i++ ) {
+		deepKey(i, key);
+		sprintf(path, "/bench/listed/%s", key);
+		epochEnter();
+		node = searchForPathLockFree(path);
+		epochExit();
+		if( (node == NULL) || (node->s3FileInfo.size != i) ) {
+			fprintf(stderr, "FAIL: lock-free path %s\n", path);
+			failures++;
+			return;
+		}
+	}
+	report("lookup, lock-free", count, start);
+}
+
+/* the nodes under dir, and how many of them have a single child: a
+   radix tree would merge each of those with its child */
+static void treeShape(s3_tree_node *dir, size_t *pNodes, size_t *pChained)
+{
+	s3_tree_node	*child = NULL;
+
+	for( child = dir->children; child != NULL; child = child->next ) {
+		(*pNodes)++;
+		if( (child->children != NULL) && (child->children->next == NULL) ) {
+			(*pChained)++;
+		}
+		treeShape(child, pNodes, pChained);
+	}
+}
+
+/* pages of a recursive listing of the deep keyspace, inserted as
+   getPathFromS3() results are, then every key looked up */
+static void insertListing(s3_tree_node *root, int count)
+{
+	s3_file_info	*page = NULL;
+	s3_tree_node	*node = NULL;
+	char		path[] = "/bench/listed";
+	char		key[S3_MAX_KEY_SIZE + 1];
+	char		*name = NULL;
+	char		**metaPaths = NULL;
+	int		metaCount = 0;
+	double		start = 0;
+	double		seconds = 0;
+	size_t		nodeBytes = 0;
+	size_t		nameBytes = 0;
+	size_t		names = 0;
+	size_t		nodes = 0;
+	size_t		chained = 0;
+	int		n = 0;
+	int		i = 0;
+	int		j = 0;
+
+	treeArenaUsage(&nodeBytes, &nameBytes);
+	names = nameBytes;
+	page = malloc(S3_LIST_PAGE_KEYS * sizeof(s3_file_info));
+	for( i = 0; (failures == 0) && (i < count); i += n ) {
+		n = (count - i < S3_LIST_PAGE_KEYS) ? count - i
+							: S3_LIST_PAGE_KEYS;
+		for( j = 0; j < n; j++ ) {
+			deepKey(i + j, key);
+			page[j].name = malloc(strlen(path) + strlen(key) + 2);
+			sprintf(page[j].name, "%s/%s", path + 7, key);
+			page[j].time = i + j;
+			page[j].size = i + j;
+			page[j].versionId = NULL;
+			page[j].eTag = NULL;
+		}
+		start = now();
+		if( insertS3NodesInTree(&root, path, n, page, &metaCount,
+							&metaPaths) != 0 ) {
+			fprintf(stderr, "FAIL: insert page at %d\n", i);
+			failures++;
+		}
+		seconds += now() - start;
+	}
+	free(page);
+	printf("%-24s %8d keys %8.3f s %8.0f ns/key\n", "insert, listing pages",
+				count, seconds, seconds * 1e9 / count);
+
+	/* what the tree holds for the keyspace: its nodes, the names
+	   interned for it, and the nodes single-child chains take */
+	treeArenaUsage(&nodeBytes, &nameBytes);
+	searchNode(root, "bench", 0, &node);
+	searchNode(node, "listed", 0, &node);
+	treeShape(node, &nodes, &chained);
+	printf("%-24s %8d keys %8.3f nodes/key\n", "tree nodes", count,
+					(double) nodes / count);
+	printf("%-24s %8d keys %8.1f bytes/key\n", "tree nodes and names",
+		count, (double) (nodes * sizeof(s3_tree_node)
+					+ nameBytes - names) / count);
+	printf("%-24s %8d keys %8.1f bytes/key\n", "single-child chains",
+		count, (double) (chained * sizeof(s3_tree_node)) / count);
+
+	for( i = 0; (failures == 0) && (i < count); i++ ) {
+		deepKey(i, key);
+		node = root;
+		searchNode(node, "bench", 0, &node);
+		searchNode(node, "listed", 0, &node);
+		for( name = strtok(key, "/"); (node != NULL) && (name != NULL);
+						name = strtok(NULL, "/") ) {
+			searchNode(node, name, 0, &node);
+		}
+		if( (node == NULL) || !node->isFileNode
+				|| (node->s3FileInfo.size != i) ) {
+			deepKey(i, key);
+			fprintf(stderr, "FAIL: listed %s not found\n", key);
+			failures++;
+		}
+	}
+	if( failures == 0 ) {
+		lookupPaths(root, count);
+	}
+}
+
+/* directories listed past the eviction limit, see above */
+static void browseDirs(s3_tree_node *root, int count)
+{
+	s3_tree_node	*browse = NULL;
+	s3_tree_node	*dir = NULL;
+	s3_tree_node	*child = NULL;
+	s3_dir_listing	*listing = NULL;
+	char		name[64];
+	double		start = 0;
+	size_t		nodeBytes = 0;
+	size_t		nameBytes = 0;
+	size_t		limit = 0;
+	size_t		first = 0;
+	size_t		last = 0;
+	double		perKey = 0;
+	int		dirs = count / BROWSE_KEYS;
+	int		i = 0;
+	int		j = 0;
+
+	if( dirs < 4 * BROWSE_LIVE ) {
+		dirs = 4 * BROWSE_LIVE;
+	}
+	searchNode(root, "browse", 1, &browse);
+	start = now();
+	for( i = 0; (failures == 0) && (i < dirs); i++ ) {
+		sprintf(name, "d%06d", i);
+		searchNode(browse, name, 1, &dir);
+		for( j = 0; j < BROWSE_KEYS; j++ ) {
+			sprintf(name, "d%06d-k%06d", i, j);
+			if( (searchNode(dir, name, 1, &child) != 0)
+							|| (child == NULL) ) {
+				fprintf(stderr, "FAIL: insert %s\n", name);
+				failures++;
+				break;
+			}
+		}
+		/* listed to the end and not used since */
+		listing = calloc(1, sizeof(s3_dir_listing));
+		NODE_STORE(dir->listing, listing);
+		dir->isComplete |= NODE_COMPLETE;
+
+		/* the limit evictRun() keeps the tree to, as s3_evict.c
+		   counts it */
+		treeArenaUsage(&nodeBytes, &nameBytes);
+		if( i == BROWSE_LIVE - 1 ) {
+			limit = treeArenaNodes() * EVICT_NODE_BYTES + nameBytes;
+		} else if( i >= BROWSE_LIVE ) {
+			evictRun(limit);
+		}
+		if( i == 2 * BROWSE_LIVE - 1 ) {
+			first = nodeBytes + nameBytes;
+		}
+		last = nodeBytes + nameBytes;
+	}
+	report("list and evict", dirs * BROWSE_KEYS, start);
+
+	/* what the arenas grew by for each key listed past the limit;
+	   only the directories themselves stay, BROWSE_KEYS times fewer
+	   than their names, which take 8 bytes or more */
+	perKey = (double) (last - first)
+			/ ((dirs - 2 * BROWSE_LIVE) * BROWSE_KEYS);
+	printf("%-24s %8d keys %8.1f bytes/key\n", "arenas, browsing",
+			(dirs - 2 * BROWSE_LIVE) * BROWSE_KEYS, perKey);
+	if( perKey > 4 ) {
+		fprintf(stderr, "FAIL: arenas grew from %lu to %lu bytes "
+				"browsing\n", (unsigned long) first,
+				(unsigned long) last);
+		failures++;
+	}
+}
+
+static void run(s3_tree_node *root, const char *dirName, int count,
+						int *insertOrder, int *lookupOrder)
+{
+	s3_tree_node	*dir = NULL;
+	double		start = 0;
+
+	searchNode(root, (char *) dirName, 1, &dir);
+	insertKeys(dir, count, insertOrder,
+			(insertOrder == NULL) ? "insert, ascending" : "insert, random");
+	if( failures != 0 ) {
+		return;
+	}
+	lookupKeys(dir, count, lookupOrder);
+	walkKeys(dir, count);
+
+	start = now();
+	deleteNode(dir);
+	arenaFresh = 0;
+	report("delete", count, start);
+}
+
+int main(int argc, char **argv)
+{
+	s3_tree_node	*root = NULL;
+	s3_tree_node	*bucket = NULL;
+	FILE		*logfile = NULL;
+	int		count = NKEYS;
+	int		*order = NULL;
+
+	if( argc > 1 ) {
+		count = atoi(argv[1]);
+	}
+	if( count < 1 ) {
+		fprintf(stderr, "usage: benchtree [keys]\n");
+		return 1;
+	}
+
+	/* the tree logs every step */
+	logfile = log_open();
+	if( freopen("/dev/null", "w", logfile) == NULL ) {
+		perror("/dev/null");
+		return 1;
+	}
+
+	printf("%-24s %8d bytes\n", "s3_tree_node", (int) sizeof(s3_tree_node));
+	savePathCachePolicy();
+	order = shuffled(count);
+	pthread_mutex_lock(&gS3TreeLock);
+	allocateTreeNode(&root);
+	root->s3FileInfo.name = nameIntern("/");
+	gS3DirectoryTree = root;
+	searchNode(root, "bench", 1, &bucket);
+
+	run(bucket, "ascending", count, NULL, order);
+	if( failures == 0 ) {
+		run(bucket, "random", count, order, order);
+	}
+	if( failures == 0 ) {
+		insertListing(root, count);
+	}
+	if( failures == 0 ) {
+		/* an eviction pass would walk all of the keyspace */
+		deleteNode(bucket);
+		browseDirs(root, count);
+	}
+	pthread_mutex_unlock(&gS3TreeLock);
+	if( failures == 0 ) {
+		listKeys(count);
+	}
+
+	free(order);
+	printf(failures ? "FAILED\n" : "PASSED\n");
+	return failures != 0;
+}
@@ -144,18 +144,12 @@ S3Status error_parser_add(ErrorParser *errorParser, char *buffer,
 }
 
 
-void error_parser_convert_status(ErrorParser *errorParser, S3Status *status)
+S3Status error_code_to_status(const char *code)
 {
-    // Convert the error status string into a code
-    if (!errorParser->codeLen) {
-        return;
-    }
-
 #define HANDLE_CODE(name)                                       \
     do {                                                        \
-        if (!strcmp(errorParser->code, #name)) {                \
-            *status = S3StatusError##name;                      \
-            goto code_set;                                      \
+        if (!strcmp(code, #name)) {                             \
+            return S3StatusError##name;                         \
         }                                                       \
     } while (0)
     
@@ -222,11 +216,18 @@ void error_parser_convert_status(ErrorParser *errorParser, S3Status *status)
     HANDLE_CODE(UnexpectedContent);
     HANDLE_CODE(UnresolvableGrantByEmailAddress);
     HANDLE_CODE(UserKeyMustBeSpecified);
-    *status = S3StatusErrorUnknown;
+    return S3StatusErrorUnknown;
+}
 
- code_set:
 
-    return;
+void error_parser_convert_status(ErrorParser *errorParser, S3Status *status)
+{
+    // Convert the error status string into a code
+    if (!errorParser->codeLen) {
+        return;
+    }
+
+    *status = error_code_to_status(errorParser->code);
 }
 
 
@@ -16,6 +16,10 @@
 
 #include "log.h"
 
+// The low-level frontend has no fuse_context, so log_msg() can't find
+// the logfile through S3_FUSE_DATA; remember it here instead.
+static FILE *logfileG = NULL;
+
 FILE *log_open()
 {
     FILE *logfile;
@@ -31,6 +35,7 @@ FILE *log_open()
     // set logfile to line buffering
     setvbuf(logfile, NULL, _IOLBF, 0);
 
+    logfileG = logfile;
     return logfile;
 }
 
@@ -39,7 +44,8 @@ void log_msg(const char *format, ...)
     va_list ap;
     va_start(ap, format);
 
-    vfprintf(S3_FUSE_DATA->logfile, format, ap);
+    vfprintf(logfileG, format, ap);
+    va_end(ap);
 }
     
 // struct fuse_file_info keeps information about files (surprise!).
@@ -371,3 +371,334 @@ void S3_delete_object(const S3BucketContext *bucketContext, const char *key,
     // Perform the request
     request_perform(&params, requestContext);
 }
+
+
+// delete objects ------------------------------------------------------------
+
+typedef struct DeleteObjectsData
+{
+    SimpleXml simpleXml;
+
+    S3ResponsePropertiesCallback *responsePropertiesCallback;
+    S3DeleteObjectsCallback *deleteObjectsCallback;
+    S3ResponseCompleteCallback *responseCompleteCallback;
+    void *callbackData;
+
+    // The <Delete> document, and its Content-MD5
+    char *doc;
+    int docLen, docBytesWritten;
+    char md5[32];
+
+    // The <Error> being parsed
+    string_buffer(key, S3_MAX_KEY_SIZE + 1);
+    string_buffer(versionId, 1024);
+    string_buffer(code, 256);
+    string_buffer(message, 1024);
+} DeleteObjectsData;
+
+
+// Escapes the XML special characters of [in] into [out] if [out] is
+// non-NULL; returns the length of the escaped string either way
+static int xml_escape(char *out, const char *in)
+{
+    int len = 0;
+
+    for (; *in; in++) {
+        const char *entity = 0;
+        switch (*in) {
+        case '&':
+            entity = "&amp;";
+            break;
+        case '<':
+            entity = "&lt;";
+            break;
+        case '>':
+            entity = "&gt;";
+            break;
+        case '"':
+            entity = "&quot;";
+            break;
+        case '\'':
+            entity = "&apos;";
+            break;
+        }
+        if (entity) {
+            if (out) {
+                strcpy(&(out[len]), entity);
+            }
+            len += strlen(entity);
+        }
+        else {
+            if (out) {
+                out[len] = *in;
+            }
+            len++;
+        }
+    }
+
+    if (out) {
+        out[len] = 0;
+    }
+    return len;
+}
+
+
+// Composes the <Delete> document into doData->doc; Quiet, so that S3 only
+// reports the objects it could not delete
+static S3Status compose_delete_doc(DeleteObjectsData *doData, int count,
+                                   const char **keys, const char **versionIds)
+{
+#define DELETE_DOC_HEAD "<Delete><Quiet>true</Quiet>"
+#define DELETE_DOC_TAIL "</Delete>"
+#define DELETE_OBJECT_HEAD "<Object><Key>"
+#define DELETE_OBJECT_TAIL "</Object>"
+#define DELETE_KEY_TAIL "</Key>"
+#define DELETE_VERSION_HEAD "<VersionId>"
+#define DELETE_VERSION_TAIL "</VersionId>"
+
+    int i, len = sizeof(DELETE_DOC_HEAD) + sizeof(DELETE_DOC_TAIL);
+
+    for (i = 0; i < count; i++) {
+        len += sizeof(DELETE_OBJECT_HEAD) + xml_escape(0, keys[i]) +
+            sizeof(DELETE_KEY_TAIL) + sizeof(DELETE_OBJECT_TAIL);
+        if (versionIds && versionIds[i]) {
+            len += sizeof(DELETE_VERSION_HEAD) +
+                xml_escape(0, versionIds[i]) + sizeof(DELETE_VERSION_TAIL);
+        }
+    }
+
+    if (!(doData->doc = (char *) malloc(len))) {
+        return S3StatusOutOfMemory;
+    }
+
+#define doc_append(str)                                                 \
+    do {                                                                \
+        strcpy(&(doData->doc[doData->docLen]), str);                    \
+        doData->docLen += strlen(str);                                  \
+    } while (0)
+
+    doData->docLen = 0;
+    doc_append(DELETE_DOC_HEAD);
+    for (i = 0; i < count; i++) {
+        doc_append(DELETE_OBJECT_HEAD);
+        doData->docLen += xml_escape(&(doData->doc[doData->docLen]), keys[i]);
+        doc_append(DELETE_KEY_TAIL);
+        if (versionIds && versionIds[i]) {
+            doc_append(DELETE_VERSION_HEAD);
+            doData->docLen += xml_escape(&(doData->doc[doData->docLen]),
+                                         versionIds[i]);
+            doc_append(DELETE_VERSION_TAIL);
+        }
+        doc_append(DELETE_OBJECT_TAIL);
+    }
+    doc_append(DELETE_DOC_TAIL);
+
+    // S3 requires the Content-MD5 of a multi-object delete
+    unsigned char digest[16];
+    MD5_digest(digest, (const unsigned char *) doData->doc, doData->docLen);
+    int b64Len = base64Encode(digest, sizeof(digest), doData->md5);
+    doData->md5[b64Len] = 0;
+
+    return S3StatusOK;
+}
+
+
+static S3Status deleteObjectsXmlCallback(const char *elementPath,
+                                         const char *data, int dataLen,
+                                         void *callbackData)
+{
+    DeleteObjectsData *doData = (DeleteObjectsData *) callbackData;
+
+    int fit;
+
+    if (data) {
+        if (!strcmp(elementPath, "DeleteResult/Error/Key")) {
+            string_buffer_append(doData->key, data, dataLen, fit);
+        }
+        else if (!strcmp(elementPath, "DeleteResult/Error/VersionId")) {
+            string_buffer_append(doData->versionId, data, dataLen, fit);
+        }
+        else if (!strcmp(elementPath, "DeleteResult/Error/Code")) {
+            string_buffer_append(doData->code, data, dataLen, fit);
+        }
+        else if (!strcmp(elementPath, "DeleteResult/Error/Message")) {
+            string_buffer_append(doData->message, data, dataLen, fit);
+        }
+    }
+    else if (!strcmp(elementPath, "DeleteResult/Error")) {
+        // An object that was not deleted, report it
+        S3Status status = (*(doData->deleteObjectsCallback))
+            (doData->key, doData->versionId[0] ? doData->versionId : 0,
+             error_code_to_status(doData->code),
+             doData->message[0] ? doData->message : 0,
+             doData->callbackData);
+
+        string_buffer_initialize(doData->key);
+        string_buffer_initialize(doData->versionId);
+        string_buffer_initialize(doData->code);
+        string_buffer_initialize(doData->message);
+
+        return status;
+    }
+
+    /* Avoid compiler error about variable set but not used */
+    (void) fit;
+
+    return S3StatusOK;
+}
+
+
+static S3Status deleteObjectsPropertiesCallback
+    (const S3ResponseProperties *responseProperties, void *callbackData)
+{
+    DeleteObjectsData *doData = (DeleteObjectsData *) callbackData;
+
+    if (!doData->responsePropertiesCallback) {
+        return S3StatusOK;
+    }
+
+    return (*(doData->responsePropertiesCallback))
+        (responseProperties, doData->callbackData);
+}
+
+
+static int deleteObjectsToS3Callback(int bufferSize, char *buffer,
+                                     void *callbackData)
+{
+    DeleteObjectsData *doData = (DeleteObjectsData *) callbackData;
+
+    int remaining = (doData->docLen - doData->docBytesWritten);
+
+    int toCopy = bufferSize > remaining ? remaining : bufferSize;
+
+    if (!toCopy) {
+        return 0;
+    }
+
+    memcpy(buffer, &(doData->doc[doData->docBytesWritten]), toCopy);
+
+    doData->docBytesWritten += toCopy;
+
+    return toCopy;
+}
+
+
+static S3Status deleteObjectsFromS3Callback(int bufferSize,
+                                            const char *buffer,
+                                            void *callbackData)
+{
+    DeleteObjectsData *doData = (DeleteObjectsData *) callbackData;
+    return simplexml_add(&(doData->simpleXml), buffer, bufferSize);
+}
+
+
+static void deleteObjectsCompleteCallback(S3Status requestStatus,
+                                          const S3ErrorDetails *s3ErrorDetails,
+                                          void *callbackData)
+{
+    DeleteObjectsData *doData = (DeleteObjectsData *) callbackData;
+
+    // The last </Error> is only seen once the document is finished
+    if (requestStatus == S3StatusOK) {
+        requestStatus = simplexml_finish(&(doData->simpleXml));
+    }
+
+    (*(doData->responseCompleteCallback))
+        (requestStatus, s3ErrorDetails, doData->callbackData);
+
+    simplexml_deinitialize(&(doData->simpleXml));
+
+    free(doData->doc);
+    free(doData);
+}
+
+
+void S3_delete_objects(const S3BucketContext *bucketContext, int count,
+                       const char **keys, const char **versionIds,
+                       S3RequestContext *requestContext,
+                       const S3DeleteObjectsHandler *handler,
+                       void *callbackData)
+{
+    if ((count <= 0) || (count > S3_MAX_DELETE_OBJECTS)) {
+        (*(handler->responseHandler.completeCallback))
+            (S3StatusFailedToInitializeRequest, 0, callbackData);
+        return;
+    }
+
+    // Create the callback data
+    DeleteObjectsData *doData = 
+        (DeleteObjectsData *) malloc(sizeof(DeleteObjectsData));
+    if (!doData) {
+        (*(handler->responseHandler.completeCallback))
+            (S3StatusOutOfMemory, 0, callbackData);
+        return;
+    }
+
+    S3Status status = compose_delete_doc(doData, count, keys, versionIds);
+    if (status != S3StatusOK) {
+        free(doData);
+        (*(handler->responseHandler.completeCallback))
+            (status, 0, callbackData);
+        return;
+    }
+    doData->docBytesWritten = 0;
+
+    simplexml_initialize(&(doData->simpleXml), &deleteObjectsXmlCallback,
+                         doData);
+
+    doData->responsePropertiesCallback = 
+        handler->responseHandler.propertiesCallback;
+    doData->deleteObjectsCallback = handler->deleteObjectsCallback;
+    doData->responseCompleteCallback = 
+        handler->responseHandler.completeCallback;
+    doData->callbackData = callbackData;
+
+    string_buffer_initialize(doData->key);
+    string_buffer_initialize(doData->versionId);
+    string_buffer_initialize(doData->code);
+    string_buffer_initialize(doData->message);
+
+    // Only the Content-MD5
+    S3PutProperties putProperties =
+    {
+        0,                                            // contentType
+        doData->md5,                                  // md5
+        0,                                            // cacheControl
+        0,                                            // contentDispositionFilename
+        0,                                            // contentEncoding
+        -1,                                           // expires
+        S3CannedAclPrivate,                           // cannedAcl
+        0,                                            // metaDataCount
+        0                                             // metaData
+    };
+
+    // Set up the RequestParams
+    RequestParams params =
+    {
+        HttpRequestTypePOST,                          // httpRequestType
+        { bucketContext->hostName,                    // hostName
+          bucketContext->bucketName,                  // bucketName
+          bucketContext->protocol,                    // protocol
+          bucketContext->uriStyle,                    // uriStyle
+          bucketContext->accessKeyId,                 // accessKeyId
+          bucketContext->secretAccessKey },           // secretAccessKey
+        0,                                            // key
+        0,                                            // queryParams
+        "delete",                                     // subResource
+        0,                                            // copySourceBucketName
+        0,                                            // copySourceKey
+        0,                                            // getConditions
+        0,                                            // startByte
+        0,                                            // byteCount
+        &putProperties,                               // putProperties
+        &deleteObjectsPropertiesCallback,             // propertiesCallback
+        &deleteObjectsToS3Callback,                   // toS3Callback
+        doData->docLen,                               // toS3CallbackTotalSize
+        &deleteObjectsFromS3Callback,                 // fromS3Callback
+        &deleteObjectsCompleteCallback,               // completeCallback
+        doData                                        // callbackData
+    };
+
+    // Perform the request
+    request_perform(&params, requestContext);
+}
@@ -118,14 +118,13 @@ static void request_headers_done(Request *request)
         return;
     }
 
-    request->propertiesCallbackMade = 1;
-
     // Get the http response code
     long httpResponseCode;
     request->httpResponseCode = 0;
     if (curl_easy_getinfo(request->curl, CURLINFO_RESPONSE_CODE, 
                           &httpResponseCode) != CURLE_OK) {
         // Not able to get the HTTP response code - error
+        request->propertiesCallbackMade = 1;
         request->status = S3StatusInternalError;
         return;
     }
@@ -133,6 +132,15 @@ static void request_headers_done(Request *request)
         request->httpResponseCode = httpResponseCode;
     }
 
+    // While the body of a PUT or POST is being read there is no response
+    // yet, or only a 100 Continue; the headers are done with the final
+    // response, else the body of a POST's would go to the error parser
+    if (httpResponseCode < 200) {
+        return;
+    }
+
+    request->propertiesCallbackMade = 1;
+
     response_headers_handler_done(&(request->responseHeadersHandler), 
                                   request->curl);
 
@@ -333,8 +341,10 @@ static S3Status compose_amz_headers(const RequestParams *params,
 
     // Add the x-amz-date header
     time_t now = time(NULL);
+    struct tm tm;
     char date[64];
-    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&now));
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT",
+             gmtime_r(&now, &tm));
     headers_append(1, "x-amz-date: %s", date);
 
     if (params->httpRequestType == HttpRequestTypeCOPY) {
@@ -446,8 +456,9 @@ static S3Status compose_standard_headers(const RequestParams *params,
     // Expires
     if (params->putProperties && (params->putProperties->expires >= 0)) {
         time_t t = (time_t) params->putProperties->expires;
+        struct tm tm;
         strftime(values->expiresHeader, sizeof(values->expiresHeader),
-                 "Expires: %a, %d %b %Y %H:%M:%S UTC", gmtime(&t));
+                 "Expires: %a, %d %b %Y %H:%M:%S UTC", gmtime_r(&t, &tm));
     }
     else {
         values->expiresHeader[0] = 0;
@@ -457,9 +468,11 @@ static S3Status compose_standard_headers(const RequestParams *params,
     if (params->getConditions &&
         (params->getConditions->ifModifiedSince >= 0)) {
         time_t t = (time_t) params->getConditions->ifModifiedSince;
+        struct tm tm;
         strftime(values->ifModifiedSinceHeader,
                  sizeof(values->ifModifiedSinceHeader),
-                 "If-Modified-Since: %a, %d %b %Y %H:%M:%S UTC", gmtime(&t));
+                 "If-Modified-Since: %a, %d %b %Y %H:%M:%S UTC",
+                 gmtime_r(&t, &tm));
     }
     else {
         values->ifModifiedSinceHeader[0] = 0;
@@ -469,9 +482,11 @@ static S3Status compose_standard_headers(const RequestParams *params,
     if (params->getConditions &&
         (params->getConditions->ifNotModifiedSince >= 0)) {
         time_t t = (time_t) params->getConditions->ifNotModifiedSince;
+        struct tm tm;
         strftime(values->ifUnmodifiedSinceHeader,
                  sizeof(values->ifUnmodifiedSinceHeader),
-                 "If-Unmodified-Since: %a, %d %b %Y %H:%M:%S UTC", gmtime(&t));
+                 "If-Unmodified-Since: %a, %d %b %Y %H:%M:%S UTC",
+                 gmtime_r(&t, &tm));
     }
     else {
         values->ifUnmodifiedSinceHeader[0] = 0;
@@ -676,6 +691,8 @@ static const char *http_request_type_to_verb(HttpRequestType requestType)
     case HttpRequestTypePUT:
     case HttpRequestTypeCOPY:
         return "PUT";
+    case HttpRequestTypePOST:
+        return "POST";
     default: // HttpRequestTypeDELETE
         return "DELETE";
     }
@@ -875,7 +892,8 @@ static S3Status setup_curl(Request *request,
     }
 
     // Would use CURLOPT_INFILESIZE_LARGE, but it is buggy in libcurl
-    if (params->httpRequestType == HttpRequestTypePUT) {
+    if ((params->httpRequestType == HttpRequestTypePUT) ||
+        (params->httpRequestType == HttpRequestTypePOST)) {
         char header[256];
         snprintf(header, sizeof(header), "Content-Length: %llu",
                  (unsigned long long) params->toS3CallbackTotalSize);
@@ -926,6 +944,11 @@ static S3Status setup_curl(Request *request,
     case HttpRequestTypeDELETE:
     curl_easy_setopt_safe(CURLOPT_CUSTOMREQUEST, "DELETE");
         break;
+    case HttpRequestTypePOST:
+        // The body comes from toS3Callback, as for a PUT
+        curl_easy_setopt_safe(CURLOPT_UPLOAD, 1);
+        curl_easy_setopt_safe(CURLOPT_CUSTOMREQUEST, "POST");
+        break;
     default: // HttpRequestTypeGET
         break;
     }
@@ -39,7 +39,9 @@
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "s3.h"
+#include "s3_key_list.h"
 
 // Some Windows stuff
 #ifndef FOPEN_EXTRA_FLAGS
@@ -72,8 +74,15 @@ static const char *secretAccessKeyG = 0;
 
 // Request results, saved as globals -----------------------------------------
 
-int statusG = 0;
-char errorDetailsG[4096] = { 0 };
+// Per thread, so that concurrent FUSE requests each see their own result
+
+__thread int statusG = 0;
+__thread char errorDetailsG[4096] = { 0 };
+static __thread int retriesLeftG = 0;
+static __thread int retrySleepIntervalG = 0;
+
+// S3_initialize()/S3_deinitialize() keep an unlocked reference count
+static pthread_mutex_t initMutexG = PTHREAD_MUTEX_INITIALIZER;
 
 
 // Other globals -------------------------------------------------------------
@@ -155,12 +164,27 @@ static void S3_init()
     S3Status status;
     const char *hostname = getenv("S3_HOSTNAME");
     
-    if ((status = S3_initialize("s3", S3_INIT_ALL, hostname))
-        != S3StatusOK) {
+    pthread_mutex_lock(&initMutexG);
+    status = S3_initialize("s3", S3_INIT_ALL, hostname);
+    pthread_mutex_unlock(&initMutexG);
+
+    if (status != S3StatusOK) {
         fprintf(stderr, "Failed to initialize libs3: %s\n", 
                 S3_get_status_name(status));
         exit(-1);
     }
+
+    // Every request starts with a full set of retries
+    retriesLeftG = retriesG;
+    retrySleepIntervalG = 1 * SLEEP_UNITS_PER_SECOND;
+}
+
+
+static void S3_deinit()
+{
+    pthread_mutex_lock(&initMutexG);
+    S3_deinitialize();
+    pthread_mutex_unlock(&initMutexG);
 }
 
 
@@ -686,12 +710,12 @@ static int convert_simple_acl(char *aclXml, char *ownerId,
 
 static int should_retry()
 {
-    if (retriesG--) {
+    if (retriesLeftG > 0) {
+        retriesLeftG--;
         // Sleep before next retry; start out with a 1 second sleep
-        static int retrySleepInterval = 1 * SLEEP_UNITS_PER_SECOND;
-        sleep(retrySleepInterval);
+        sleep(retrySleepIntervalG);
         // Next sleep 1 second longer
-        retrySleepInterval++;
+        retrySleepIntervalG++;
         return 1;
     }
 
@@ -742,8 +766,9 @@ static S3Status responsePropertiesCallback
     if (properties->lastModified > 0) {
         char timebuf[256];
         time_t t = (time_t) properties->lastModified;
-        // gmtime is not thread-safe but we don't care here.
-        strftime(timebuf, sizeof(timebuf), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+        struct tm tm;
+        strftime(timebuf, sizeof(timebuf), "%Y-%m-%dT%H:%M:%SZ",
+                 gmtime_r(&t, &tm));
         printf("Last-Modified: %s\n", timebuf);
     }
     int i;
@@ -844,7 +869,9 @@ static S3Status listServiceCallback(const char *ownerId,
     char timebuf[256];
     if (creationDate >= 0) {
         time_t t = (time_t) creationDate;
-        strftime(timebuf, sizeof(timebuf), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+        struct tm tm;
+        strftime(timebuf, sizeof(timebuf), "%Y-%m-%dT%H:%M:%SZ",
+                 gmtime_r(&t, &tm));
     }
     else {
         timebuf[0] = 0;
@@ -868,6 +895,8 @@ static S3Status listServiceCallback(const char *ownerId,
    (*((s3_file_info*)&(data->s3FileInfoList[(data->count)-1]))).name = strdup(bucketName);
    (*((s3_file_info*)&(data->s3FileInfoList[(data->count)-1]))).time = creationDate ;
    (*((s3_file_info*)&(data->s3FileInfoList[(data->count)-1]))).size = -1 ;
+   (*((s3_file_info*)&(data->s3FileInfoList[(data->count)-1]))).versionId = NULL ;
+   (*((s3_file_info*)&(data->s3FileInfoList[(data->count)-1]))).eTag = NULL ;
 
     printf("%-56s  %-20s", bucketName, timebuf);
     if (data->allDetails) {
@@ -913,7 +942,7 @@ int list_service(int allDetails, int *pCount, s3_file_info** pS3FileInfoList)
         printError();
     }
 
-    S3_deinitialize();
+    S3_deinit();
 	return statusG;
 }
 
@@ -978,7 +1007,7 @@ static void test_bucket(int argc, char **argv, int optindex)
         printError();
     }
 
-    S3_deinitialize();
+    S3_deinit();
 }
 
 
@@ -1055,7 +1084,7 @@ int create_bucket(int argc, char **argv, int optindex)
         printError();
     }
     
-    S3_deinitialize();
+    S3_deinit();
 	return statusG;
 }
 
@@ -1092,7 +1121,7 @@ int delete_bucket(int argc, char **argv, int optindex)
         printError();
     }
 
-    S3_deinitialize();
+    S3_deinit();
 	return statusG;
 }
 
@@ -1106,6 +1135,9 @@ typedef struct list_bucket_callback_data
     int keyCount;
     int allDetails;
 	s3_file_info *s3FileInfoList;
+	s3_key_list *keys;	/* the keys go here instead when set */
+	int prefixCount;
+	char **commonPrefixes;
 } list_bucket_callback_data;
 
 
@@ -1150,6 +1182,11 @@ static S3Status listBucketCallback(int isTruncated, const char *nextMarker,
     if ((!nextMarker || !nextMarker[0]) && contentsCount) {
         nextMarker = contents[contentsCount - 1].key;
     }
+    // With a delimiter the page may end on a common prefix instead.
+    if (commonPrefixesCount && (!nextMarker || !nextMarker[0] ||
+        strcmp(commonPrefixes[commonPrefixesCount - 1], nextMarker) > 0)) {
+        nextMarker = commonPrefixes[commonPrefixesCount - 1];
+    }
     if (nextMarker) {
         snprintf(data->nextMarker, sizeof(data->nextMarker), "%s", 
                  nextMarker);
@@ -1163,13 +1200,16 @@ static S3Status listBucketCallback(int isTruncated, const char *nextMarker,
     }
 
 
-	if( data->s3FileInfoList == NULL ) {
+	if( (contentsCount == 0) || (data->keys != NULL) ) {
+		// a page of common prefixes only, or a key list
+	} else if( data->s3FileInfoList == NULL ) {
 		data->s3FileInfoList =  (s3_file_info * )malloc ( contentsCount * sizeof(s3_file_info) );  
 	} else {
 		data->s3FileInfoList =  (s3_file_info * )realloc (data->s3FileInfoList,  (data->keyCount +contentsCount) * sizeof(s3_file_info) );  
 	}
 	
-	if( data->s3FileInfoList == NULL )	{
+	if( (contentsCount != 0) && (data->keys == NULL)
+				&& (data->s3FileInfoList == NULL) )	{
 			fprintf(stderr, "Out of Memory\n");
 			exit (-1);	
 
@@ -1180,8 +1220,9 @@ static S3Status listBucketCallback(int isTruncated, const char *nextMarker,
         char timebuf[256];
         if (0) {
             time_t t = (time_t) content->lastModified;
+            struct tm tm;
             strftime(timebuf, sizeof(timebuf), "%Y-%m-%dT%H:%M:%SZ",
-                     gmtime(&t));
+                     gmtime_r(&t, &tm));
             printf("\nKey: %s\n", content->key);
             printf("Last Modified: %s\n", timebuf);
             printf("ETag: %s\n", content->eTag);
@@ -1195,8 +1236,9 @@ static S3Status listBucketCallback(int isTruncated, const char *nextMarker,
         }
         else {
             time_t t = (time_t) content->lastModified;
+            struct tm tm;
             strftime(timebuf, sizeof(timebuf), "%Y-%m-%dT%H:%M:%SZ", 
-                     gmtime(&t));
+                     gmtime_r(&t, &tm));
             char sizebuf[16];
             if (content->size < 100000) {
                 sprintf(sizebuf, "%5llu", (unsigned long long) content->size);
@@ -1229,9 +1271,21 @@ static S3Status listBucketCallback(int isTruncated, const char *nextMarker,
                        content->ownerDisplayName : "");
             }
             printf("\n");
+			if( data->keys != NULL ) {
+				if( keyListAppend(data->keys, content->key,
+						content->lastModified,
+						content->size,
+						content->eTag) != 0 ) {
+					fprintf(stderr, "Out of Memory\n");
+					exit (-1);
+				}
+				continue;
+			}
    			(*((s3_file_info*)&(data->s3FileInfoList[(data->keyCount)+i]))).name = strdup(content->key);
    			(*((s3_file_info*)&(data->s3FileInfoList[(data->keyCount)+i]))).time = content->lastModified ;
    			(*((s3_file_info*)&(data->s3FileInfoList[(data->keyCount)+i]))).size = content->size ;
+   			(*((s3_file_info*)&(data->s3FileInfoList[(data->keyCount)+i]))).versionId = NULL ;
+   			(*((s3_file_info*)&(data->s3FileInfoList[(data->keyCount)+i]))).eTag = (content->eTag != NULL) ? strdup(content->eTag) : NULL ;
 			
 			
         }
@@ -1239,18 +1293,28 @@ static S3Status listBucketCallback(int isTruncated, const char *nextMarker,
 
     data->keyCount += contentsCount;
 
+	if( commonPrefixesCount != 0 ) {
+		data->commonPrefixes = (char **) realloc(data->commonPrefixes,
+			(data->prefixCount + commonPrefixesCount) * sizeof(char *));
+		if( data->commonPrefixes == NULL ) {
+			fprintf(stderr, "Out of Memory\n");
+			exit (-1);
+		}
+	}
     for (i = 0; i < commonPrefixesCount; i++) {
         printf("\nCommon Prefix: %s\n", commonPrefixes[i]);
+		data->commonPrefixes[data->prefixCount++] = strdup(commonPrefixes[i]);
     }
 
     return S3StatusOK;
 }
 
 
-int list_bucket(const char *bucketName, const char *prefix,
+static int listBucket(const char *bucketName, const char *prefix,
                         const char *marker, const char *delimiter,
                         int maxkeys, int allDetails,
-			int *pCount, s3_file_info** pS3FileInfoList)
+			int *pCount, s3_file_info** pS3FileInfoList,
+			s3_key_list *keys)
 {
     S3_init();
     
@@ -1272,15 +1336,20 @@ int list_bucket(const char *bucketName, const char *prefix,
 
     list_bucket_callback_data data;
 
-    snprintf(data.nextMarker, sizeof(data.nextMarker), "%s", marker);
+    snprintf(data.nextMarker, sizeof(data.nextMarker), "%s",
+             marker ? marker : "");
     data.keyCount = 0;
     data.allDetails = allDetails;
 	data.s3FileInfoList = NULL;
+	data.keys = keys;
+	data.prefixCount = 0;
+	data.commonPrefixes = NULL;
 
     do {
         data.isTruncated = 0;
         do {
-            S3_list_bucket(&bucketContext, prefix, data.nextMarker,
+            S3_list_bucket(&bucketContext, prefix,
+                           data.nextMarker[0] ? data.nextMarker : NULL,
                            delimiter, maxkeys, 0, &listBucketHandler, &data);
         } while (S3_status_is_retryable(statusG) && should_retry());
         if (statusG != S3StatusOK) {
@@ -1292,18 +1361,121 @@ int list_bucket(const char *bucketName, const char *prefix,
         if (!data.keyCount) {
             printListBucketHeader(allDetails);
         }
+		*pCount = data.keyCount;
+		if( keys == NULL ) {
+			*pS3FileInfoList = data.s3FileInfoList;
+		}
+    }
+    else {
+        printError();
+    }
+	freeCommonPrefixes(data.prefixCount, data.commonPrefixes);
+
+    S3_deinit();
+	return statusG;
+}
+
+
+int list_bucket(const char *bucketName, const char *prefix,
+                        const char *marker, const char *delimiter,
+                        int maxkeys, int allDetails,
+			int *pCount, s3_file_info** pS3FileInfoList)
+{
+	return listBucket(bucketName, prefix, marker, delimiter, maxkeys,
+			allDetails, pCount, pS3FileInfoList, NULL);
+}
+
+
+// Every key under prefix, all pages, front-coded in keys; see
+// s3_key_list.h.
+int list_bucket_keys(const char *bucketName, const char *prefix,
+			s3_key_list *keys)
+{
+	int count = 0;
+
+	return listBucket(bucketName, prefix, NULL, NULL, 0, 0, &count,
+								NULL, keys);
+}
+
+
+// One page of a listing.  With a delimiter the keys rolled up under it
+// come back in *pCommonPrefixes; *pNextMarker is where the next page
+// starts, NULL after the last one.
+int list_bucket_page(const char *bucketName, const char *prefix,
+			const char *marker, const char *delimiter, int maxkeys,
+			int *pCount, s3_file_info **pS3FileInfoList,
+			int *pPrefixCount, char ***pCommonPrefixes,
+			char **pNextMarker)
+{
+    S3_init();
+    
+    S3BucketContext bucketContext =
+    {
+        0,
+        bucketName,
+        protocolG,
+        uriStyleG,
+        accessKeyIdG,
+        secretAccessKeyG
+    };
+
+    S3ListBucketHandler listBucketHandler =
+    {
+        { &responsePropertiesCallback, &responseCompleteCallback },
+        &listBucketCallback
+    };
+
+    list_bucket_callback_data data;
+
+    data.nextMarker[0] = 0;
+    data.keyCount = 0;
+    data.allDetails = 0;
+	data.s3FileInfoList = NULL;
+	data.keys = NULL;
+	data.prefixCount = 0;
+	data.commonPrefixes = NULL;
+
+    do {
+        data.isTruncated = 0;
+        S3_list_bucket(&bucketContext, prefix, marker, delimiter, maxkeys,
+                       0, &listBucketHandler, &data);
+    } while (S3_status_is_retryable(statusG) && should_retry());
+
+    if (statusG == S3StatusOK) {
 		*pCount = data.keyCount;
 		*pS3FileInfoList = data.s3FileInfoList;
+		*pPrefixCount = data.prefixCount;
+		*pCommonPrefixes = data.commonPrefixes;
+		*pNextMarker = (data.isTruncated && data.nextMarker[0]) ?
+					strdup(data.nextMarker) : NULL;
     }
     else {
         printError();
+		int i;
+		for (i = 0; i < data.keyCount; i++) {
+			free(data.s3FileInfoList[i].name);
+			free(data.s3FileInfoList[i].eTag);
+		}
+		free(data.s3FileInfoList);
+		freeCommonPrefixes(data.prefixCount, data.commonPrefixes);
     }
 
-    S3_deinitialize();
+    S3_deinit();
 	return statusG;
 }
 
 
+void freeCommonPrefixes(int prefixCount, char **commonPrefixes)
+{
+	int	i;
+
+	for (i = 0; i < prefixCount; i++) {
+		free(commonPrefixes[i]);
+	}
+	free(commonPrefixes);
+}
+
+
 void list(int argc, char **argv, int optindex)
 {
     if (optindex == argc) {
@@ -1425,7 +1597,98 @@ int delete_object(int argc, char **argv, int optindex)
         printError();
     }
 
-    S3_deinitialize();
+    S3_deinit();
+	return statusG;
+}
+
+
+// delete objects ------------------------------------------------------------
+
+typedef struct delete_objects_callback_data
+{
+    int count;
+    const char **keys;
+    const char **versionIds;
+    int *results;
+    int next;          // where the next error is looked for first
+} delete_objects_callback_data;
+
+
+static S3Status deleteObjectsCallback(const char *key, const char *versionId,
+                                      S3Status status, const char *message,
+                                      void *callbackData)
+{
+    delete_objects_callback_data *data = 
+        (delete_objects_callback_data *) callbackData;
+    int n;
+
+    // S3 reports the errors in the order of the request
+    for (n = 0; n < data->count; n++) {
+        int i = (data->next + n) % data->count;
+        const char *v = data->versionIds ? data->versionIds[i] : 0;
+        if (!strcmp(data->keys[i], key) && 
+            ((!v && !versionId) || (v && versionId && !strcmp(v, versionId)))) {
+            data->results[i] = status;
+            data->next = i + 1;
+            break;
+        }
+    }
+
+    if (n == data->count) {
+        fprintf(stderr, "\nERROR: %s not requested: %s\n", key,
+                S3_get_status_name(status));
+    }
+    if (message) {
+        fprintf(stderr, "\nERROR: %s: %s\n", key, message);
+    }
+    return S3StatusOK;
+}
+
+
+// Deletes keys[0..count) of the bucket, with their versionIds if
+// versionIds is set, in one request; count is at most
+// S3_MAX_DELETE_OBJECTS.  results[i] is the status of keys[i], and is only
+// meaningful if the request itself succeeded.
+int delete_objects(const char *bucketName, int count, const char **keys,
+                   const char **versionIds, int *results)
+{
+    S3_init();
+
+    S3BucketContext bucketContext =
+    {
+        0,
+        bucketName,
+        protocolG,
+        uriStyleG,
+        accessKeyIdG,
+        secretAccessKeyG
+    };
+
+    S3DeleteObjectsHandler deleteObjectsHandler =
+    {
+        { &responsePropertiesCallback, &responseCompleteCallback },
+        &deleteObjectsCallback
+    };
+
+    delete_objects_callback_data data;
+
+    data.count = count;
+    data.keys = keys;
+    data.versionIds = versionIds;
+    data.results = results;
+
+    do {
+        memset(results, 0, count * sizeof(int));
+        data.next = 0;
+        S3_delete_objects(&bucketContext, count, keys, versionIds, 0,
+                          &deleteObjectsHandler, &data);
+    } while (S3_status_is_retryable(statusG) && should_retry());
+
+    if (statusG != S3StatusOK) {
+        printError();
+    }
+
+    S3_deinit();
 	return statusG;
 }
 
@@ -1711,14 +1974,14 @@ int put_object(int argc, char **argv, int optindex)
                 "input\n", (unsigned long long) data.contentLength);
     }
 
-    S3_deinitialize();
+    S3_deinit();
 	return statusG;
 }
 
 
 // copy object ---------------------------------------------------------------
 
-static void copy_object(int argc, char **argv, int optindex)
+int copy_object(int argc, char **argv, int optindex, char **pETag)
 {
     if (optindex == argc) {
         fprintf(stderr, "\nERROR: Missing parameter: source bucket/key\n");
@@ -1889,12 +2152,16 @@ static void copy_object(int argc, char **argv, int optindex)
                        &responseHandler, 0);
     } while (S3_status_is_retryable(statusG) && should_retry());
 
-    if (statusG == S3StatusOK) {
+    if ((statusG == S3StatusOK) && (pETag != NULL)) {
+        *pETag = eTag[0] ? strdup(eTag) : NULL;
+    }
+    else if (statusG == S3StatusOK) {
         if (lastModified >= 0) {
             char timebuf[256];
             time_t t = (time_t) lastModified;
+            struct tm tm;
             strftime(timebuf, sizeof(timebuf), "%Y-%m-%dT%H:%M:%SZ",
-                     gmtime(&t));
+                     gmtime_r(&t, &tm));
             printf("Last-Modified: %s\n", timebuf);
         }
         if (eTag[0]) {
@@ -1905,7 +2172,8 @@ static void copy_object(int argc, char **argv, int optindex)
         printError();
     }
 
-    S3_deinitialize();
+    S3_deinit();
+	return statusG;
 }
 
 
@@ -2070,23 +2338,20 @@ int get_object(int argc, char **argv, int optindex)
 
     fclose(outfile);
 
-    S3_deinitialize();
+    S3_deinit();
 	return statusG;
 }
 
 
 // head object ---------------------------------------------------------------
 
-static void head_object(int argc, char **argv, int optindex)
+int head_object(int argc, char **argv, int optindex)
 {
     if (optindex == argc) {
         fprintf(stderr, "\nERROR: Missing parameter: bucket/key\n");
         usageExit(stderr);
     }
     
-    // Head implies showing response properties
-    showResponsePropertiesG = 1;
-
     // Split bucket/key
     char *slash = argv[optindex];
 
@@ -2131,11 +2396,13 @@ static void head_object(int argc, char **argv, int optindex)
     } while (S3_status_is_retryable(statusG) && should_retry());
 
     if ((statusG != S3StatusOK) &&
-        (statusG != S3StatusErrorPreconditionFailed)) {
+        (statusG != S3StatusErrorPreconditionFailed) &&
+        (statusG != S3StatusHttpErrorNotFound)) {
         printError();
     }
 
-    S3_deinitialize();
+    S3_deinit();
+	return statusG;
 }
 
 
@@ -2212,7 +2479,7 @@ static void generate_query_string(int argc, char **argv, int optindex)
         printf("%s\n", buffer);
     }
 
-    S3_deinitialize();
+    S3_deinit();
 }
 
 
@@ -2380,7 +2647,7 @@ void get_acl(int argc, char **argv, int optindex)
 
     fclose(outfile);
 
-    S3_deinitialize();
+    S3_deinit();
 }
 
 
@@ -2481,7 +2748,7 @@ void set_acl(int argc, char **argv, int optindex)
 
     fclose(infile);
 
-    S3_deinitialize();
+    S3_deinit();
 }
 
 
@@ -2640,7 +2907,7 @@ void get_logging(int argc, char **argv, int optindex)
 
     fclose(outfile);
 
-    S3_deinitialize();
+    S3_deinit();
 }
 
 
@@ -2738,7 +3005,7 @@ void set_logging(int argc, char **argv, int optindex)
         printError();
     }
 
-    S3_deinitialize();
+    S3_deinit();
 }
 
 
@@ -2802,7 +3069,7 @@ int set_versioning(int argc, char **argv, int optindex)
         printError();
     }
 
-    S3_deinitialize();
+    S3_deinit();
 	return statusG;
 }
 
@@ -2955,8 +3222,9 @@ static S3Status listVersionsCallback(int isTruncated,
         char timebuf[256];
         if (0) {
             time_t t = (time_t) content->lastModified;
+            struct tm tm;
             strftime(timebuf, sizeof(timebuf), "%Y-%m-%dT%H:%M:%SZ",
-                     gmtime(&t));
+                     gmtime_r(&t, &tm));
             printf("\nKey: %s\n", content->key);
             printf("Last Modified: %s\n", timebuf);
             printf("ETag: %s\n", content->eTag);
@@ -2970,8 +3238,9 @@ static S3Status listVersionsCallback(int isTruncated,
         }
         else {
             time_t t = (time_t) content->lastModified;
+            struct tm tm;
            strftime(timebuf, sizeof(timebuf), "%Y-%m-%dT%H:%M:%SZ", 
-                     gmtime(&t));
+                     gmtime_r(&t, &tm));
             char sizebuf[16];
             if (content->size < 100000) {
                 sprintf(sizebuf, "%5llu", (unsigned long long) content->size);
@@ -3090,7 +3359,7 @@ int list_versions(const char *bucketName, const char *prefix,
         printError();
     }
 
-    S3_deinitialize();
+    S3_deinit();
 	return statusG;
 }
 
@@ -3150,7 +3419,12 @@ static void parse_args_and_list_versions (int argc, char **argv, int optindex )
 
 int saveSecurityCredentials()
 {
+    const char *protocol = getenv("S3_PROTOCOL");
 
+    // plain http, for a local stand-in such as test/s3_standin.py
+    if (protocol && !strcmp(protocol, "http")) {
+        protocolG = S3ProtocolHTTP;
+    }
 
     accessKeyIdG = getenv("S3_ACCESS_KEY_ID");
     if (!accessKeyIdG) {
@@ -3272,12 +3546,14 @@ int init(int argc, char **argv)
         put_object(argc, argv, optind);
     }
     else if (!strcmp(command, "copy")) {
-        copy_object(argc, argv, optind);
+        copy_object(argc, argv, optind, 0);
     }
     else if (!strcmp(command, "get")) {
         get_object(argc, argv, optind);
     }
     else if (!strcmp(command, "head")) {
+        // Head implies showing response properties
+        showResponsePropertiesG = 1;
         head_object(argc, argv, optind);
     }
     else if (!strcmp(command, "gqs")) {
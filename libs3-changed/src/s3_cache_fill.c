@@ -0,0 +1,504 @@
+/* pwrite() */
+#define _XOPEN_SOURCE 500
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "s3.h"
+#include "s3_fuse_bridge.h"
+#include "s3_cache_fill.h"
+#include "log.h"
+
+int			gFillFlag = 1;
+
+static int64_t		fillBlock = (int64_t) FILL_DEFAULT_BLOCK_KB * 1024;
+
+/* one cached copy being filled; fills holds those still to finish */
+typedef struct s3_fill s3_fill;
+struct s3_fill {
+	char		*path;
+	char		*cachedPath;
+	char		*s3Name;
+	char		*versionId;
+	char		*eTag;
+	s3_cache	*cache;
+	int		fd;
+	int64_t		size;
+	int64_t		blockCount;
+	int64_t		front;		/* blocks below it are all present */
+	unsigned char	*present;	/* bitmaps, one bit per block */
+	unsigned char	*fetching;
+	int		error;
+	int		cancelled;
+	int		refs;		/* the thread and the waiting readers */
+	s3_fill		*next;
+};
+
+#define FILL_BIT(map, b)	((map)[(b) / 8] & (1 << ((b) % 8)))
+#define FILL_SET(map, b)	((map)[(b) / 8] |= (1 << ((b) % 8)))
+#define FILL_CLEAR(map, b)	((map)[(b) / 8] &= ~(1 << ((b) % 8)))
+
+/* fillLock guards fills and everything in them but fd; blocks are
+   fetched without it */
+static s3_fill		*fills = NULL;
+static int		threadCount = 0;
+static pthread_mutex_t	fillLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	fillCond = PTHREAD_COND_INITIALIZER;
+
+int saveFillPolicy()
+{
+	char		*env = NULL;
+	char		*end = NULL;
+	long		kb = 0;
+
+	env = getenv("S3_BACKGROUND_FILL");
+	if( (env != NULL) && ((strcmp(env, "0") == 0)
+				|| (strcasecmp(env, "off") == 0)
+				|| (strcasecmp(env, "no") == 0)) ) {
+		gFillFlag = 0;
+	}
+
+	env = getenv("S3_FILL_BLOCK_KB");
+	if( env != NULL ) {
+		kb = strtol(env, &end, 10);
+		if( (*env == 0) || (*end != 0) || (kb < 4)
+						|| (kb > 1024 * 1024) ) {
+			log_msg("S3_FILL_BLOCK_KB : %s is not valid, using %d\n",
+						env, FILL_DEFAULT_BLOCK_KB);
+		} else {
+			fillBlock = (int64_t) kb * 1024;
+		}
+	}
+
+	log_msg("background fill %s, block %lld bytes\n",
+			gFillFlag ? "enabled" : "disabled", (long long) fillBlock);
+	return 0;
+}
+
+int64_t fillBlockSize()
+{
+	return fillBlock;
+}
+
+/* fillLock held */
+static s3_fill *findFill(const char *path)
+{
+	s3_fill		*fill = NULL;
+
+	for( fill = fills; fill != NULL; fill = fill->next ) {
+		if( strcmp(fill->path, path) == 0 ) {
+			break;
+		}
+	}
+	return fill;
+}
+
+/* take fill out of fills, it gets no new readers; fillLock held */
+static void unlinkFill(s3_fill *fill)
+{
+	s3_fill		**p = NULL;
+
+	for( p = &fills; *p != NULL; p = &((*p)->next) ) {
+		if( *p == fill ) {
+			*p = fill->next;
+			break;
+		}
+	}
+	fill->next = NULL;
+	pthread_cond_broadcast(&fillCond);
+}
+
+/* the file at cachedPath is still the one being filled */
+static int copyInPlace(s3_fill *fill)
+{
+	struct stat	ours;
+	struct stat	now;
+
+	return (fstat(fill->fd, &ours) == 0) 
+			&& (stat(fill->cachedPath, &now) == 0)
+			&& (ours.st_dev == now.st_dev)
+			&& (ours.st_ino == now.st_ino);
+}
+
+/* the cached copy won't be complete: remove it, unless it was replaced
+   since; fillLock held */
+static void removeCopy(s3_fill *fill)
+{
+	if( copyInPlace(fill) ) {
+		unlink(fill->cachedPath);
+	}
+}
+
+/* fillLock held */
+static void cancelFill(s3_fill *fill)
+{
+	fill->cancelled = 1;
+	unlinkFill(fill);
+}
+
+/* drop a reference, the last one frees fill; fillLock held */
+static void releaseFill(s3_fill *fill)
+{
+	if( --fill->refs > 0 ) {
+		return;
+	}
+	close(fill->fd);
+	free(fill->path);
+	free(fill->cachedPath);
+	free(fill->s3Name);
+	if( fill->versionId != NULL )
+		free(fill->versionId);
+	if( fill->eTag != NULL )
+		free(fill->eTag);
+	free(fill->present);
+	free(fill->fetching);
+	free(fill);
+}
+
+static int fetchBlock(s3_fill *fill, int64_t block)
+{
+	/*
+	 - GET the block into a file of its own and copy it into place:
+	   get_object() writes from the start of the file it is given
+	 - the range is pinned to the version, or to the ETag, the fill
+	   started with; a rewritten object fails the fill
+	*/
+	int		argc = 0;
+	char		*argv[5] = { NULL, NULL, NULL, NULL, NULL };
+	char		*rangePath = NULL;
+	char		*buf = NULL;
+	int64_t		offset = block * fillBlock;
+	int64_t		count = fillBlock;
+	ssize_t		n = 0;
+	int		fd = -1;
+	int		s3Status = 0;
+	int		ret = 0;
+	int		i;
+
+	if( offset + count > fill->size ) {
+		count = fill->size - offset;
+	}
+
+	ret = s3CacheTempPath(fill->cache, ".range", &rangePath);
+	if( ret != 0 ) {
+		return ret;
+	}
+
+	argv[argc++] = strdup(fill->s3Name + 1);
+	argv[argc++] = malloc(strlen(rangePath) + strlen("filename=") + 1);
+	argv[argc++] = malloc(64);
+	argv[argc++] = malloc(64);
+	if( fill->versionId != NULL ) {
+		argv[argc++] = malloc(strlen("versionId=")
+					+ strlen(fill->versionId) + 1);
+	} else if( fill->eTag != NULL ) {
+		argv[argc++] = malloc(strlen("ifMatch=")
+					+ strlen(fill->eTag) + 1);
+	}
+	for( i = 0; i < argc; i++ ) {
+		if( argv[i] == NULL ) {
+			ret = -ENOMEM;
+			goto ret;
+		}
+	}
+	sprintf(argv[1], "filename=%s", rangePath);
+	sprintf(argv[2], "startByte=%lld", (long long) offset);
+	sprintf(argv[3], "byteCount=%lld", (long long) count);
+	if( fill->versionId != NULL ) {
+		sprintf(argv[4], "versionId=%s", fill->versionId);
+	} else if( fill->eTag != NULL ) {
+		sprintf(argv[4], "ifMatch=%s", fill->eTag);
+	}
+
+	s3Status = get_object(argc, argv, 0);
+	if( s3Status != 0 ) {
+		logS3Errors(s3Status);
+		ret = -EIO;
+		goto ret;
+	}
+
+	buf = malloc(count);
+	fd = open(rangePath, O_RDONLY);
+	if( (buf == NULL) || (fd < 0) ) {
+		ret = (buf == NULL) ? -ENOMEM : -errno;
+		goto ret;
+	}
+	n = read(fd, buf, count);
+	if( n != count ) {
+		log_msg("fetchBlock : %s block %lld is %lld bytes\n", fill->path,
+					(long long) block, (long long) n);
+		ret = -EIO;
+		goto ret;
+	}
+	if( pwrite(fill->fd, buf, count, offset) != count ) {
+		ret = -errno;
+		goto ret;
+	}
+
+ret:
+	if( fd >= 0 )
+		close(fd);
+	if( buf != NULL )
+		free(buf);
+	unlink(rangePath);
+	free(rangePath);
+	for( i = 0; i < argc; i++ ) {
+		if( argv[i] != NULL )
+			free(argv[i]);
+	}
+	return ret;
+}
+
+/* fetch block with fillLock dropped meanwhile; fillLock held */
+static int fetchBlockUnlocked(s3_fill *fill, int64_t block)
+{
+	int		ret = 0;
+
+	FILL_SET(fill->fetching, block);
+	pthread_mutex_unlock(&fillLock);
+	ret = fetchBlock(fill, block);
+	pthread_mutex_lock(&fillLock);
+	FILL_CLEAR(fill->fetching, block);
+
+	if( ret == 0 ) {
+		FILL_SET(fill->present, block);
+		while( (fill->front < fill->blockCount)
+				&& FILL_BIT(fill->present, fill->front) ) {
+			fill->front++;
+		}
+	} else if( fill->error == 0 ) {
+		/* readers of the copy get the error, later opens refetch */
+		fill->error = ret;
+		unlinkFill(fill);
+		removeCopy(fill);
+	}
+	pthread_cond_broadcast(&fillCond);
+	return ret;
+}
+
+static void *fillThread(void *arg)
+{
+	s3_fill		*fill = (s3_fill *) arg;
+	int64_t		block = 0;
+	int		busy = 0;
+
+	pthread_mutex_lock(&fillLock);
+	while( !fill->cancelled && (fill->error == 0) ) {
+		/* the next block nobody has, readers may have taken some
+		   ahead of the front */
+		busy = 0;
+		for( block = fill->front; block < fill->blockCount; block++ ) {
+			if( FILL_BIT(fill->fetching, block) ) {
+				busy = 1;
+			} else if( !FILL_BIT(fill->present, block) ) {
+				break;
+			}
+		}
+
+		if( block < fill->blockCount ) {
+			fetchBlockUnlocked(fill, block);
+		} else if( busy ) {
+			pthread_cond_wait(&fillCond, &fillLock);
+		} else {
+			log_msg("fillThread : %s complete\n", fill->path);
+			unlinkFill(fill);
+			break;
+		}
+	}
+
+	releaseFill(fill);
+	threadCount--;
+	pthread_cond_broadcast(&fillCond);
+	pthread_mutex_unlock(&fillLock);
+	return NULL;
+}
+
+int fillStart(s3_cache *cache, const char *path, const char *cachedPath,
+		const char *s3Name, const char *versionId, const char *eTag,
+		int64_t size)
+{
+	/*
+	 - create the cached copy of path at its full size and start
+	   filling it, an open can then use it at once
+	 - the copy is made next to cachedPath and renamed into place, a
+	   fill already running for path is left to finish; one whose
+	   copy was removed meanwhile is cancelled
+	*/
+	s3_fill		*fill = NULL;
+	s3_fill		*running = NULL;
+	char		*fetchPath = NULL;
+	pthread_t	thread;
+	pthread_attr_t	attr;
+	int		ret = 0;
+
+	fill = calloc(1, sizeof(s3_fill));
+	if( fill == NULL ) {
+		return -ENOMEM;
+	}
+	fill->fd = -1;
+	fill->refs = 1;
+	fill->cache = cache;
+	fill->size = size;
+	fill->blockCount = (size + fillBlock - 1) / fillBlock;
+	fill->path = strdup(path);
+	fill->cachedPath = strdup(cachedPath);
+	fill->s3Name = strdup(s3Name);
+	fill->versionId = (versionId != NULL) ? strdup(versionId) : NULL;
+	fill->eTag = (eTag != NULL) ? strdup(eTag) : NULL;
+	fill->present = calloc(fill->blockCount / 8 + 1, 1);
+	fill->fetching = calloc(fill->blockCount / 8 + 1, 1);
+	if( (fill->path == NULL) || (fill->cachedPath == NULL)
+			|| (fill->s3Name == NULL) || (fill->present == NULL)
+			|| (fill->fetching == NULL)
+			|| ((versionId != NULL) && (fill->versionId == NULL))
+			|| ((eTag != NULL) && (fill->eTag == NULL)) ) {
+		ret = -ENOMEM;
+		goto ret;
+	}
+
+	ret = s3CacheTempPath(cache, ".fetch", &fetchPath);
+	if( ret != 0 ) {
+		goto ret;
+	}
+	fill->fd = open(fetchPath, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if( (fill->fd < 0) || (ftruncate(fill->fd, size) != 0) ) {
+		ret = -errno;
+		goto ret;
+	}
+
+	pthread_mutex_lock(&fillLock);
+	running = findFill(path);
+	if( (running != NULL) && copyInPlace(running) ) {
+		pthread_mutex_unlock(&fillLock);
+		goto ret;
+	}
+	if( running != NULL ) {
+		cancelFill(running);
+	}
+	if( rename(fetchPath, cachedPath) != 0 ) {
+		ret = -errno;
+		pthread_mutex_unlock(&fillLock);
+		goto ret;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = -pthread_create(&thread, &attr, fillThread, fill);
+	pthread_attr_destroy(&attr);
+	if( ret != 0 ) {
+		log_msg("fillStart : pthread_create %d\n", -ret);
+		removeCopy(fill);
+		pthread_mutex_unlock(&fillLock);
+		goto ret;
+	}
+
+	log_msg("fillStart : %s, %lld blocks\n", path,
+					(long long) fill->blockCount);
+	fill->next = fills;
+	fills = fill;
+	threadCount++;
+	fill = NULL;
+	pthread_mutex_unlock(&fillLock);
+
+ret:
+	if( fetchPath != NULL ) {
+		unlink(fetchPath);
+		free(fetchPath);
+	}
+	if( fill != NULL ) {
+		pthread_mutex_lock(&fillLock);
+		releaseFill(fill);
+		pthread_mutex_unlock(&fillLock);
+	}
+	return ret;
+}
+
+int fillWait(const char *path, int64_t offset, int64_t size)
+{
+	/*
+	 - return once bytes [offset, offset + size) of the cached copy of
+	   path are present, at once when it isn't being filled
+	 - a block the fill thread is not fetching yet is fetched here,
+	   readers ahead of the front don't wait for it to get there
+	*/
+	s3_fill		*fill = NULL;
+	int64_t		block = 0;
+	int64_t		last = 0;
+	int		ret = 0;
+
+	pthread_mutex_lock(&fillLock);
+	fill = findFill(path);
+	if( (fill == NULL) || (offset >= fill->size) || (size <= 0) ) {
+		pthread_mutex_unlock(&fillLock);
+		return 0;
+	}
+
+	if( size > fill->size - offset ) {
+		size = fill->size - offset;
+	}
+	last = (offset + size - 1) / fillBlock;
+	fill->refs++;
+
+	for( block = offset / fillBlock; block <= last; block++ ) {
+		while( !FILL_BIT(fill->present, block) ) {
+			if( fill->error != 0 ) {
+				ret = fill->error;
+				goto ret;
+			}
+			if( fill->cancelled ) {
+				ret = -ENOENT;
+				goto ret;
+			}
+			if( FILL_BIT(fill->fetching, block) ) {
+				pthread_cond_wait(&fillCond, &fillLock);
+			} else {
+				fetchBlockUnlocked(fill, block);
+			}
+		}
+	}
+
+ret:
+	releaseFill(fill);
+	pthread_mutex_unlock(&fillLock);
+	return ret;
+}
+
+void fillCancel(const char *path)
+{
+	/* path, or a directory above the copies, is being deleted */
+	s3_fill		*fill = NULL;
+	s3_fill		*next = NULL;
+	int		len = strlen(path);
+
+	pthread_mutex_lock(&fillLock);
+	for( fill = fills; fill != NULL; fill = next ) {
+		next = fill->next;
+		if( (strncmp(fill->path, path, len) == 0)
+				&& ((fill->path[len] == 0)
+					|| (fill->path[len] == '/')) ) {
+			cancelFill(fill);
+		}
+	}
+	pthread_mutex_unlock(&fillLock);
+}
+
+void fillStop()
+{
+	/* at unmount: unfinished copies are removed, the threads are
+	   waited for */
+	pthread_mutex_lock(&fillLock);
+	while( fills != NULL ) {
+		removeCopy(fills);
+		cancelFill(fills);
+	}
+	while( threadCount > 0 ) {
+		pthread_cond_wait(&fillCond, &fillLock);
+	}
+	pthread_mutex_unlock(&fillLock);
+}
@@ -0,0 +1,503 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "s3_fuse_bridge.h"
+#include "s3_child_index.h"
+#include "s3_path_cache.h"
+#include "s3_epoch.h"
+#include "log.h"
+
+typedef struct s3_child_block {
+	int		count;
+	s3_tree_node	*children[CHILD_INDEX_BLOCK];	/* ascending */
+} s3_child_block;
+
+/* replaced whole when it grows, a reader may be in the old one */
+typedef struct s3_child_table {
+	int		size;		/* a power of two */
+	s3_tree_node	*slots[];	/* chained through hashNext */
+} s3_child_table;
+
+struct s3_child_index {
+	s3_child_table	*table;
+	s3_child_block	**blocks;	/* ascending, none empty */
+	int		blockCount;
+	int		blockSize;
+	int		count;		/* children */
+};
+
+static unsigned int nameHash(const char *name)
+{
+	unsigned int	h = 2166136261u;
+
+	while( *name != 0 ) {
+		h = (h ^ (unsigned char) *name++) * 16777619u;
+	}
+	return h;
+}
+
+static const char *childName(s3_tree_node *child)
+{
+	return child->s3FileInfo.name;
+}
+
+static s3_child_table *tableAlloc(int size)
+{
+	s3_child_table	*table = NULL;
+
+	table = calloc(1, sizeof(s3_child_table)
+					+ size * sizeof(s3_tree_node *));
+	if( table != NULL ) {
+		table->size = size;
+	}
+	return table;
+}
+
+static void tableInsert(s3_child_table *table, s3_tree_node *child)
+{
+	unsigned int	h = nameHash(childName(child)) & (table->size - 1);
+
+	NODE_STORE(child->hashNext, table->slots[h]);
+	NODE_STORE(table->slots[h], child);
+}
+
+static void hashInsert(s3_child_index *index, s3_tree_node *child)
+{
+	tableInsert(index->table, child);
+}
+
+static int hashGrow(s3_child_index *index)
+{
+	s3_child_table	*old = index->table;
+	s3_child_table	*table = NULL;
+	s3_tree_node	*child = NULL;
+	s3_tree_node	*next = NULL;
+	int		i = 0;
+
+	table = tableAlloc(old->size * 2);
+	if( table == NULL ) {
+		return -ENOMEM;
+	}
+	for( i = 0; i < old->size; i++ ) {
+		for( child = old->slots[i]; child != NULL; child = next ) {
+			next = child->hashNext;
+			tableInsert(table, child);
+		}
+	}
+	NODE_STORE(index->table, table);
+	epochRetire(free, old);
+	return 0;
+}
+
+static s3_tree_node *hashFind(s3_child_index *index, const char *name)
+{
+	s3_tree_node	*child = NULL;
+
+	child = index->table->slots[nameHash(name) & (index->table->size - 1)];
+	while( (child != NULL) && (strcmp(childName(child), name) != 0) ) {
+		child = child->hashNext;
+	}
+	return child;
+}
+
+static void hashRemove(s3_child_index *index, s3_tree_node *child)
+{
+	s3_tree_node	**p = NULL;
+
+	p = &(index->table->slots[nameHash(childName(child))
+					& (index->table->size - 1)]);
+	while( (*p != NULL) && (*p != child) ) {
+		p = &((*p)->hashNext);
+	}
+	if( *p != NULL ) {
+		NODE_STORE(*p, child->hashNext);
+	}
+	/* child->hashNext stays, a reader on child goes on down the chain */
+}
+
+/* first block whose last child is >= name, blockCount if none */
+static int findBlock(s3_child_index *index, const char *name)
+{
+	int		lo = 0;
+	int		hi = index->blockCount;
+	int		mid = 0;
+	s3_child_block	*block = NULL;
+
+	while( lo < hi ) {
+		mid = (lo + hi) / 2;
+		block = index->blocks[mid];
+		if( strcmp(childName(block->children[block->count - 1]),
+							name) < 0 ) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/* first child of block that is >= name, block->count if none */
+static int findInBlock(s3_child_block *block, const char *name)
+{
+	int		lo = 0;
+	int		hi = block->count;
+	int		mid = 0;
+
+	while( lo < hi ) {
+		mid = (lo + hi) / 2;
+		if( strcmp(childName(block->children[mid]), name) < 0 ) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/* makes room for a block at position b */
+static int addBlock(s3_child_index *index, int b)
+{
+	s3_child_block	**blocks = NULL;
+	s3_child_block	*block = NULL;
+	int		size = 0;
+
+	if( index->blockCount == index->blockSize ) {
+		size = (index->blockSize == 0) ? 4 : index->blockSize * 2;
+		blocks = realloc(index->blocks, size * sizeof(s3_child_block *));
+		if( blocks == NULL ) {
+			return -ENOMEM;
+		}
+		index->blocks = blocks;
+		index->blockSize = size;
+	}
+	block = malloc(sizeof(s3_child_block));
+	if( block == NULL ) {
+		return -ENOMEM;
+	}
+	block->count = 0;
+	memmove(&(index->blocks[b + 1]), &(index->blocks[b]),
+			(index->blockCount - b) * sizeof(s3_child_block *));
+	index->blocks[b] = block;
+	index->blockCount++;
+	return 0;
+}
+
+static int blockInsert(s3_child_index *index, s3_tree_node *child)
+{
+	const char	*name = childName(child);
+	s3_child_block	*block = NULL;
+	s3_child_block	*right = NULL;
+	int		b = 0;
+	int		i = 0;
+	int		half = 0;
+
+	b = findBlock(index, name);
+	if( b == index->blockCount ) {
+		/* past the last child: append, to a new block if it is full */
+		if( (b == 0) || (index->blocks[b - 1]->count == CHILD_INDEX_BLOCK) ) {
+			if( addBlock(index, b) != 0 ) {
+				return -ENOMEM;
+			}
+		} else {
+			b--;
+		}
+	}
+	block = index->blocks[b];
+	i = findInBlock(block, name);
+
+	if( block->count == CHILD_INDEX_BLOCK ) {
+		if( addBlock(index, b + 1) != 0 ) {
+			return -ENOMEM;
+		}
+		right = index->blocks[b + 1];
+		half = CHILD_INDEX_BLOCK / 2;
+		memcpy(right->children, &(block->children[half]),
+				(CHILD_INDEX_BLOCK - half) * sizeof(s3_tree_node *));
+		right->count = CHILD_INDEX_BLOCK - half;
+		block->count = half;
+		if( i > half ) {
+			block = right;
+			i -= half;
+		}
+	}
+	memmove(&(block->children[i + 1]), &(block->children[i]),
+			(block->count - i) * sizeof(s3_tree_node *));
+	block->children[i] = child;
+	block->count++;
+	return 0;
+}
+
+static void blockRemove(s3_child_index *index, s3_tree_node *child)
+{
+	const char	*name = childName(child);
+	s3_child_block	*block = NULL;
+	int		b = 0;
+	int		i = 0;
+
+	b = findBlock(index, name);
+	if( b == index->blockCount ) {
+		return;
+	}
+	block = index->blocks[b];
+	i = findInBlock(block, name);
+	if( (i == block->count) || (block->children[i] != child) ) {
+		return;
+	}
+	block->count--;
+	memmove(&(block->children[i]), &(block->children[i + 1]),
+			(block->count - i) * sizeof(s3_tree_node *));
+	if( block->count == 0 ) {
+		free(block);
+		index->blockCount--;
+		memmove(&(index->blocks[b]), &(index->blocks[b + 1]),
+			(index->blockCount - b) * sizeof(s3_child_block *));
+	}
+}
+
+/* the blocks only the writers use go now, the tables when readers left */
+static void indexFree(s3_child_index *index)
+{
+	int		b = 0;
+
+	for( b = 0; b < index->blockCount; b++ ) {
+		free(index->blocks[b]);
+	}
+	free(index->blocks);
+	index->blocks = NULL;
+	index->blockCount = 0;
+}
+
+static void indexRetired(void *p)
+{
+	s3_child_index	*index = p;
+
+	free(index->table);
+	free(index);
+}
+
+void childIndexFree(s3_tree_node *dir)
+{
+	s3_child_index	*index = dir->childIndex;
+
+	if( index == NULL ) {
+		return;
+	}
+	NODE_STORE(dir->childIndex, NULL);
+	indexFree(index);
+	epochRetire(indexRetired, index);
+}
+
+/* indexes the children of dir, from the tail of the list up */
+static void buildIndex(s3_tree_node *dir)
+{
+	s3_child_index	*index = NULL;
+	s3_tree_node	*child = NULL;
+	s3_tree_node	*tail = NULL;
+	int		count = 0;
+	int		size = 16;
+
+	index = calloc(1, sizeof(s3_child_index));
+	if( index == NULL ) {
+		goto nomem;
+	}
+	for( child = dir->children; child != NULL; child = child->next ) {
+		tail = child;
+		count++;
+	}
+	while( size < count ) {
+		size *= 2;
+	}
+	index->table = tableAlloc(size);
+	if( index->table == NULL ) {
+		goto nomem;
+	}
+	index->count = count;
+
+	for( child = tail; child != NULL; child = child->prev ) {
+		hashInsert(index, child);
+		if( blockInsert(index, child) != 0 ) {
+			goto nomem;
+		}
+	}
+	/* complete before a reader can find it */
+	NODE_STORE(dir->childIndex, index);
+	return;
+
+nomem:
+	log_msg("childIndex : no memory for the index of %s\n", childName(dir));
+	if( index != NULL ) {
+		indexFree(index);
+		indexRetired(index);
+	}
+}
+
+s3_tree_node *childFind(s3_tree_node *dir, const char *name,
+						s3_tree_node **pPrev)
+{
+	/*
+	 - returns the child called name, or NULL
+	 - *pPrev, if not NULL, is where a child called name goes in the
+	   list: after the smallest child greater than name, at the head
+	   when it is NULL
+	*/
+	s3_child_index	*index = dir->childIndex;
+	s3_tree_node	*child = NULL;
+	s3_tree_node	*prev = NULL;
+	s3_child_block	*block = NULL;
+	int		b = 0;
+	int		i = 0;
+
+	if( index != NULL ) {
+		child = hashFind(index, name);
+		if( pPrev == NULL ) {
+			return child;
+		}
+		if( child != NULL ) {
+			*pPrev = child->prev;
+			return child;
+		}
+		b = findBlock(index, name);
+		if( b < index->blockCount ) {
+			block = index->blocks[b];
+			i = findInBlock(block, name);
+			*pPrev = block->children[i];
+		} else {
+			*pPrev = NULL;
+		}
+		return NULL;
+	}
+
+	for( child = dir->children; child != NULL; child = child->next ) {
+		i = strcmp(childName(child), name);
+		if( i <= 0 ) {
+			break;
+		}
+		prev = child;
+	}
+	if( pPrev != NULL ) {
+		*pPrev = prev;
+	}
+	return ((child != NULL) && (i == 0)) ? child : NULL;
+}
+
+s3_tree_node *childFindLockFree(s3_tree_node *dir, const char *name)
+{
+	/*
+	 - childFind() without gS3TreeLock, between epochEnter() and
+	   epochExit(); a child a writer is moving may be missed, one that
+	   is not dir's is never returned
+	*/
+	s3_child_index	*index = NODE_LOAD(dir->childIndex);
+	s3_child_table	*table = NULL;
+	s3_tree_node	*child = NULL;
+	int		cmp = 1;
+
+	if( index != NULL ) {
+		table = NODE_LOAD(index->table);
+		child = NODE_LOAD(table->slots[nameHash(name)
+						& (table->size - 1)]);
+		while( (child != NULL)
+			&& (strcmp(NODE_LOAD(child->s3FileInfo.name), name) != 0) ) {
+			child = NODE_LOAD(child->hashNext);
+		}
+	} else {
+		for( child = NODE_LOAD(dir->children); child != NULL;
+					child = NODE_LOAD(child->next) ) {
+			cmp = strcmp(NODE_LOAD(child->s3FileInfo.name), name);
+			if( cmp <= 0 ) {
+				break;
+			}
+		}
+		if( cmp != 0 ) {
+			child = NULL;
+		}
+	}
+	if( (child != NULL) && (NODE_LOAD(child->parent) != dir) ) {
+		return NULL;
+	}
+	return child;
+}
+
+/* before and after the children list of dir changes: odd while it
+   does, for s3DirNextChildrenLockFree() */
+static void changesBump(s3_tree_node *dir)
+{
+	if( dir->listing != NULL ) {
+		NODE_STORE(dir->listing->changes, dir->listing->changes + 1);
+	}
+}
+
+void childLink(s3_tree_node *dir, s3_tree_node *child, s3_tree_node *prev)
+{
+	s3_child_index	*index = NULL;
+	s3_tree_node	*sibling = NULL;
+	int		count = 0;
+
+	NODE_STORE(child->parent, dir);
+	changesBump(dir);
+	child->prev = prev;
+	NODE_STORE(child->next, (prev != NULL) ? prev->next : dir->children);
+	if( child->next != NULL ) {
+		child->next->prev = child;
+	}
+	if( prev != NULL ) {
+		NODE_STORE(prev->next, child);
+	} else {
+		NODE_STORE(dir->children, child);
+	}
+	changesBump(dir);
+
+	index = dir->childIndex;
+	if( index == NULL ) {
+		for( sibling = dir->children; (sibling != NULL)
+			&& (count < CHILD_INDEX_MIN); sibling = sibling->next ) {
+			count++;
+		}
+		if( count == CHILD_INDEX_MIN ) {
+			buildIndex(dir);
+		}
+		return;
+	}
+	index->count++;
+	if( (index->count > index->table->size) && (hashGrow(index) != 0) ) {
+		goto nomem;
+	}
+	hashInsert(index, child);
+	if( blockInsert(index, child) != 0 ) {
+		goto nomem;
+	}
+	return;
+
+nomem:
+	log_msg("childLink : no memory for the index of %s\n", childName(dir));
+	childIndexFree(dir);
+}
+
+void childUnlink(s3_tree_node *child)
+{
+	s3_tree_node	*dir = child->parent;
+	s3_child_index	*index = dir->childIndex;
+
+	pathCacheUnlink(child);
+	if( index != NULL ) {
+		hashRemove(index, child);
+		blockRemove(index, child);
+		index->count--;
+	}
+	changesBump(dir);
+	if( child->next != NULL ) {
+		child->next->prev = child->prev;
+	}
+	if( child->prev != NULL ) {
+		NODE_STORE(child->prev->next, child->next);
+	} else {
+		NODE_STORE(dir->children, child->next);
+	}
+	/* child->next stays until child is linked again: a reader on child
+	   goes on to the rest of the list, as if it had not been there */
+	child->prev = NULL;
+	changesBump(dir);
+	if( (index != NULL) && (index->count == 0) ) {
+		childIndexFree(dir);
+	}
+}
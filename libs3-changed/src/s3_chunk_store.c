@@ -0,0 +1,754 @@
+/* strdup() */
+#define _XOPEN_SOURCE 500
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include "s3_fuse_bridge.h"
+#include "s3_chunk_store.h"
+#include "log.h"
+#include "util.h"
+
+int			gChunkStoreFlag = 0;
+
+/*
+ * FastCDC normalized chunking: below the average size a cut point needs
+ * CHUNK_MASK_S_BITS zero bits, above it only CHUNK_MASK_L_BITS, which
+ * pulls the chunk size distribution towards CHUNK_AVG_SIZE.  The gear
+ * hash shifts left, so the mask uses the high bits, which depend on the
+ * most recent 64 bytes.
+ */
+#define CHUNK_MASK_S_BITS	18
+#define CHUNK_MASK_L_BITS	14
+#define CHUNK_MASK(bits)	((((uint64_t) 1 << (bits)) - 1) << (64 - (bits)))
+
+#define SHA1_HEX_LEN		40
+
+typedef struct chunk_ref {
+	char		hash[SHA1_HEX_LEN + 1];
+	int		length;
+} chunk_ref;
+
+static uint64_t		gearTable[256];
+
+/* bucket/.chunks/<sha1> keys known to exist, saves a HEAD per chunk */
+static char		**knownChunks = NULL;
+static int		knownChunksSize = 0;
+static int		knownChunksCount = 0;
+static pthread_mutex_t	knownChunksLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void initGearTable()
+{
+	/* splitmix64 from a fixed seed: cut points have to be identical
+	   across runs or nothing would ever deduplicate */
+	uint64_t	seed = 0x5333434443ULL;
+	uint64_t	z;
+	int		i;
+
+	for( i = 0; i < 256; i++ ) {
+		seed += 0x9e3779b97f4a7c15ULL;
+		z = seed;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gearTable[i] = z ^ (z >> 31);
+	}
+}
+
+int saveChunkStorePolicy()
+{
+	char		*mode = NULL;
+
+	mode = getenv("S3_CHUNK_STORE");
+	if( (mode != NULL) && ((strcmp(mode, "1") == 0)
+				|| (strcasecmp(mode, "on") == 0)
+				|| (strcasecmp(mode, "yes") == 0)) ) {
+		gChunkStoreFlag = 1;
+	}
+
+	initGearTable();
+	log_msg("chunk store %s\n", gChunkStoreFlag ? "enabled" : "disabled");
+	return 0;
+}
+
+/* length of the chunk starting at buf, len bytes available */
+static int chunkCut(const unsigned char *buf, int len)
+{
+	uint64_t	fp = 0;
+	int		i = CHUNK_MIN_SIZE;
+	int		normal = CHUNK_AVG_SIZE;
+
+	if( len <= CHUNK_MIN_SIZE ) {
+		return len;
+	}
+	if( len > CHUNK_MAX_SIZE ) {
+		len = CHUNK_MAX_SIZE;
+	}
+	if( len < normal ) {
+		normal = len;
+	}
+
+	for( ; i < normal; i++ ) {
+		fp = (fp << 1) + gearTable[buf[i]];
+		if( (fp & CHUNK_MASK(CHUNK_MASK_S_BITS)) == 0 ) {
+			return i + 1;
+		}
+	}
+	for( ; i < len; i++ ) {
+		fp = (fp << 1) + gearTable[buf[i]];
+		if( (fp & CHUNK_MASK(CHUNK_MASK_L_BITS)) == 0 ) {
+			return i + 1;
+		}
+	}
+	return len;
+}
+
+static void chunkHash(const unsigned char *buf, int len, char *hex)
+{
+	unsigned char	digest[20];
+	int		i;
+
+	SHA1_digest(digest, buf, len);
+	for( i = 0; i < 20; i++ ) {
+		sprintf(hex + 2*i, "%02x", digest[i]);
+	}
+	hex[SHA1_HEX_LEN] = 0;
+}
+
+static int knownChunkSlot(char **table, int size, const char *key)
+{
+	int		slot;
+
+	slot = (int) (hash((const unsigned char *) key, strlen(key))
+						% (uint64_t) size);
+	while( (table[slot] != NULL) && (strcmp(table[slot], key) != 0) ) {
+		slot = (slot + 1) % size;
+	}
+	return slot;
+}
+
+static int isKnownChunk(const char *key)
+{
+	int		known = 0;
+
+	pthread_mutex_lock(&knownChunksLock);
+	if( knownChunksSize != 0 ) {
+		known = knownChunks[knownChunkSlot(knownChunks,
+					knownChunksSize, key)] != NULL;
+	}
+	pthread_mutex_unlock(&knownChunksLock);
+	return known;
+}
+
+static int addKnownChunk(const char *key)
+{
+	char		**table = NULL;
+	int		size = 0;
+	int		slot = 0;
+	int		i = 0;
+	int		ret = 0;
+
+	pthread_mutex_lock(&knownChunksLock);
+	if( 2 * (knownChunksCount + 1) > knownChunksSize ) {
+		size = (knownChunksSize == 0) ? 1024 : 2 * knownChunksSize;
+		table = calloc(size, sizeof(char *));
+		if( table == NULL ) {
+			ret = -ENOMEM;
+			goto ret;
+		}
+		for( i = 0; i < knownChunksSize; i++ ) {
+			if( knownChunks[i] != NULL ) {
+				slot = knownChunkSlot(table, size, knownChunks[i]);
+				table[slot] = knownChunks[i];
+			}
+		}
+		free(knownChunks);
+		knownChunks = table;
+		knownChunksSize = size;
+	}
+
+	slot = knownChunkSlot(knownChunks, knownChunksSize, key);
+	if( knownChunks[slot] == NULL ) {
+		knownChunks[slot] = strdup(key);
+		if( knownChunks[slot] == NULL ) {
+			ret = -ENOMEM;
+			goto ret;
+		}
+		knownChunksCount++;
+	}
+
+ret:
+	pthread_mutex_unlock(&knownChunksLock);
+	return ret;
+}
+
+int isChunkStoreKey(const char *key)
+{
+	return (strncmp(key, CHUNK_STORE_PREFIX "/",
+				strlen(CHUNK_STORE_PREFIX "/")) == 0);
+}
+
+int isNodeChunkManifest(s3_tree_node *node)
+{
+	return ((node->s3FileInfo.name != NULL)
+		&& (strcmp(node->s3FileInfo.name, CHUNK_MANIFEST_NAME) == 0));
+}
+
+/* path is /bucket/key..., *pBucket gets a copy of bucket */
+static int getBucketFromPath(const char *path, char **pBucket)
+{
+	char		*tmp = NULL;
+
+	*pBucket = strdup(path + 1);
+	if( *pBucket == NULL ) {
+		return -ENOMEM;
+	}
+	tmp = strchr(*pBucket, '/');
+	if( tmp == NULL ) {
+		free(*pBucket);
+		*pBucket = NULL;
+		return -EINVAL;
+	}
+	*tmp = 0;
+	return 0;
+}
+
+/* chunks and manifests are staged in <cache>/.chunks, bucket names
+   cannot start with a dot so this never shadows a cached object.  The
+   name gets a unique suffix, two flushes may stage the same chunk. */
+static int getStagingPath(const char *name, char **pStagingPath)
+{
+	char		*tag = NULL;
+	int		ret = 0;
+
+	tag = malloc(strlen(CHUNK_STORE_PREFIX) + strlen(name) + 2);
+	if( tag == NULL ) {
+		return -ENOMEM;
+	}
+	sprintf(tag, "%s/%s", CHUNK_STORE_PREFIX, name);
+
+	ret = s3CacheTempPath(gS3Cache, tag, pStagingPath);
+	free(tag);
+	return ret;
+}
+
+static int putChunk(const char *bucket, const char *hex,
+				const unsigned char *buf, int len)
+{
+	char		*key = NULL;
+	char		*stagingPath = NULL;
+	char		*argv[3] = { NULL, NULL, NULL };
+	FILE		*fp = NULL;
+	int		s3Status = 0;
+	int		ret = 0;
+
+	key = malloc(strlen(bucket) + strlen(CHUNK_STORE_PREFIX)
+						+ SHA1_HEX_LEN + 3);
+	if( key == NULL ) {
+		ret = -ENOMEM;
+		goto ret;
+	}
+	sprintf(key, "%s/%s/%s", bucket, CHUNK_STORE_PREFIX, hex);
+
+	if( isKnownChunk(key) ) {
+		goto ret;
+	}
+
+	argv[0] = strdup(key);
+	if( argv[0] == NULL ) {
+		ret = -ENOMEM;
+		goto ret;
+	}
+	s3Status = head_object(1, argv, 0);
+	free(argv[0]);
+	argv[0] = NULL;
+
+	if( s3Status == S3StatusOK ) {
+		log_msg("chunk %s already stored\n", key);
+		ret = addKnownChunk(key);
+		goto ret;
+	}
+	if( (s3Status != S3StatusHttpErrorNotFound)
+			&& (s3Status != S3StatusErrorNoSuchKey) ) {
+		logS3Errors(s3Status);
+		ret = -EINVAL;
+		goto ret;
+	}
+
+	ret = getStagingPath(hex, &stagingPath);
+	if( ret != 0 ) {
+		goto ret;
+	}
+
+	fp = fopen(stagingPath, "wb");
+	if( fp == NULL ) {
+		ret = -errno;
+		goto ret;
+	}
+	if( fwrite(buf, 1, len, fp) != (size_t) len ) {
+		ret = -EIO;
+		fclose(fp);
+		goto ret;
+	}
+	fclose(fp);
+
+	argv[0] = strdup(key);
+	argv[1] = malloc(strlen(stagingPath) + strlen("filename=") + 1);
+	argv[2] = strdup("noStatus=1");
+	if( (argv[0] == NULL) || (argv[1] == NULL) || (argv[2] == NULL) ) {
+		ret = -ENOMEM;
+		goto ret;
+	}
+	sprintf(argv[1], "filename=%s", stagingPath);
+
+	log_msg("putChunk %s length %d\n", key, len);
+	s3Status = put_object(3, argv, 0);
+	if( s3Status != 0 ) {
+		logS3Errors(s3Status);
+		ret = -EINVAL;
+		goto ret;
+	}
+
+	ret = addKnownChunk(key);
+
+ret:
+	if( stagingPath != NULL ) {
+		unlink(stagingPath);
+		free(stagingPath);
+	}
+	free(argv[0]);
+	free(argv[1]);
+	free(argv[2]);
+	free(key);
+	return ret;
+}
+
+/* make the manifest visible in the tree so a later fetch finds it,
+   takes gS3TreeLock */
+static int insertManifestNode(char *path, int64_t fileSize,
+						int64_t manifestSize)
+{
+	s3_tree_node		*foundNode = NULL;
+	s3_tree_node		*newTree = NULL;
+	char			*tmpPath = NULL;
+	char			*tmp = NULL;
+	int			ret = 0;
+
+	tmpPath = malloc(strlen(path) + strlen(CHUNK_MANIFEST_NAME) + 2);
+	if( tmpPath == NULL ) {
+		return -ENOMEM;
+	}
+	sprintf(tmpPath, "%s/%s", path, CHUNK_MANIFEST_NAME);
+
+	pthread_mutex_lock(&gS3TreeLock);
+	newTree = gS3DirectoryTree;
+	tmp = strtok(tmpPath, "/");
+	while( tmp != NULL ) {
+		ret = searchNode(newTree, tmp, 1, &foundNode);
+		if( ret != 0 ) {
+			goto ret;
+		}
+		newTree = foundNode;
+		tmp = strtok(NULL, "/");
+	}
+
+	if( foundNode != NULL ) {
+		NODE_STORE(foundNode->isFileNode, 1);
+		NODE_STORE(foundNode->s3FileInfo.size, manifestSize);
+		NODE_STORE(foundNode->s3FileInfo.time, time(NULL));
+		if( foundNode->s3FileInfo.versionId != NULL ) {
+			free(foundNode->s3FileInfo.versionId);
+			foundNode->s3FileInfo.versionId = NULL;
+		}
+		NODE_STORE(foundNode->parent->isFileNode, 1);
+		NODE_STORE(foundNode->parent->s3FileInfo.size, fileSize);
+	}
+
+ret:
+	pthread_mutex_unlock(&gS3TreeLock);
+	free(tmpPath);
+	return ret;
+}
+
+int chunkStoreObjectAndPut(char *path, char *cachedPath)
+{
+	FILE		*fp = NULL;
+	FILE		*manifest = NULL;
+	unsigned char	*buf = NULL;
+	char		*bucket = NULL;
+	char		*fileName = NULL;
+	char		*manifestPath = NULL;
+	char		*argv[3] = { NULL, NULL, NULL };
+	chunk_ref	*chunks = NULL;
+	chunk_ref	*tmpChunks = NULL;
+	int		chunkCount = 0;
+	int		chunkListSize = 0;
+	int		len = 0;
+	int		cut = 0;
+	int64_t		fileSize = 0;
+	struct stat	statbuf;
+	int		s3Status = 0;
+	int		i = 0;
+	int		ret = 0;
+
+	log_msg("chunkStoreObjectAndPut %s\n", path);
+
+	ret = getBucketFromPath(path, &bucket);
+	if( ret != 0 ) {
+		goto ret;
+	}
+
+	fp = fopen(cachedPath, "rb");
+	if( fp == NULL ) {
+		ret = -errno;
+		goto ret;
+	}
+
+	buf = malloc(CHUNK_MAX_SIZE);
+	if( buf == NULL ) {
+		ret = -ENOMEM;
+		goto ret;
+	}
+
+	/* upload every chunk the bucket does not have yet */
+	while( 1 ) {
+		len += fread(buf + len, 1, CHUNK_MAX_SIZE - len, fp);
+		if( len == 0 ) {
+			break;
+		}
+
+		if( chunkCount == chunkListSize ) {
+			chunkListSize = (chunkListSize == 0) ? 64 : 2 * chunkListSize;
+			tmpChunks = realloc(chunks, chunkListSize * sizeof(chunk_ref));
+			if( tmpChunks == NULL ) {
+				ret = -ENOMEM;
+				goto ret;
+			}
+			chunks = tmpChunks;
+		}
+
+		cut = chunkCut(buf, len);
+		chunkHash(buf, cut, chunks[chunkCount].hash);
+		chunks[chunkCount].length = cut;
+
+		ret = putChunk(bucket, chunks[chunkCount].hash, buf, cut);
+		if( ret != 0 ) {
+			goto ret;
+		}
+
+		fileSize += cut;
+		chunkCount++;
+		memmove(buf, buf + cut, len - cut);
+		len -= cut;
+	}
+
+	/* the manifest goes last, a failed flush leaves the old one intact */
+	ret = getStagingPath("manifest", &manifestPath);
+	if( ret != 0 ) {
+		goto ret;
+	}
+
+	manifest = fopen(manifestPath, "w");
+	if( manifest == NULL ) {
+		ret = -errno;
+		goto ret;
+	}
+
+	fileName = strrchr(path, '/') + 1;
+	fprintf(manifest, "%s\n%lld\n%d\n", fileName, (long long) fileSize,
+								chunkCount);
+	for( i = 0; i < chunkCount; i++ ) {
+		fprintf(manifest, "%s %d\n", chunks[i].hash, chunks[i].length);
+	}
+	fclose(manifest);
+
+	argv[0] = malloc(strlen(path) + strlen(CHUNK_MANIFEST_NAME) + 2);
+	argv[1] = malloc(strlen(manifestPath) + strlen("filename=") + 1);
+	argv[2] = strdup("noStatus=1");
+	if( (argv[0] == NULL) || (argv[1] == NULL) || (argv[2] == NULL) ) {
+		ret = -ENOMEM;
+		goto ret;
+	}
+	sprintf(argv[0], "%s/%s", path + 1, CHUNK_MANIFEST_NAME);
+	sprintf(argv[1], "filename=%s", manifestPath);
+
+	log_msg("put manifest %s/%s, %d chunks\n", path, CHUNK_MANIFEST_NAME,
+								chunkCount);
+	s3Status = put_object(3, argv, 0);
+	if( s3Status != 0 ) {
+		logS3Errors(s3Status);
+		ret = -EINVAL;
+		goto ret;
+	}
+
+	if( stat(manifestPath, &statbuf) != 0 ) {
+		statbuf.st_size = 0;
+	}
+	ret = insertManifestNode(path, fileSize, statbuf.st_size);
+
+ret:
+	if( fp != NULL )
+		fclose(fp);
+	if( manifestPath != NULL ) {
+		unlink(manifestPath);
+		free(manifestPath);
+	}
+	free(argv[0]);
+	free(argv[1]);
+	free(argv[2]);
+	free(chunks);
+	free(buf);
+	free(bucket);
+	return ret;
+}
+
+static int getChunk(const char *bucket, const char *hex, int length,
+					unsigned char *buf, FILE *out)
+{
+	char		*stagingPath = NULL;
+	char		*argv[2] = { NULL, NULL };
+	char		check[SHA1_HEX_LEN + 1];
+	FILE		*fp = NULL;
+	int		s3Status = 0;
+	int		ret = 0;
+
+	ret = getStagingPath(hex, &stagingPath);
+	if( ret != 0 ) {
+		goto ret;
+	}
+	/* get_object does not truncate an existing file */
+	unlink(stagingPath);
+
+	argv[0] = malloc(strlen(bucket) + strlen(CHUNK_STORE_PREFIX)
+						+ SHA1_HEX_LEN + 3);
+	argv[1] = malloc(strlen(stagingPath) + strlen("filename=") + 1);
+	if( (argv[0] == NULL) || (argv[1] == NULL) ) {
+		ret = -ENOMEM;
+		goto ret;
+	}
+	sprintf(argv[0], "%s/%s/%s", bucket, CHUNK_STORE_PREFIX, hex);
+	sprintf(argv[1], "filename=%s", stagingPath);
+
+	s3Status = get_object(2, argv, 0);
+	if( s3Status != 0 ) {
+		logS3Errors(s3Status);
+		ret = -EINVAL;
+		goto ret;
+	}
+
+	fp = fopen(stagingPath, "rb");
+	if( fp == NULL ) {
+		ret = -errno;
+		goto ret;
+	}
+	if( (int) fread(buf, 1, length, fp) != length ) {
+		log_msg("chunk %s is short\n", hex);
+		ret = -EIO;
+		goto ret;
+	}
+
+	chunkHash(buf, length, check);
+	if( strcmp(check, hex) != 0 ) {
+		log_msg("chunk %s does not match its hash\n", hex);
+		ret = -EIO;
+		goto ret;
+	}
+
+	if( fwrite(buf, 1, length, out) != (size_t) length ) {
+		ret = -EIO;
+		goto ret;
+	}
+
+ret:
+	if( fp != NULL )
+		fclose(fp);
+	if( stagingPath != NULL ) {
+		unlink(stagingPath);
+		free(stagingPath);
+	}
+	free(argv[0]);
+	free(argv[1]);
+	return ret;
+}
+
+int chunkStoreGetObject(char *path, char *cachedPath, char *versionId)
+{
+	FILE		*manifest = NULL;
+	FILE		*out = NULL;
+	unsigned char	*buf = NULL;
+	char		*bucket = NULL;
+	char		*manifestPath = NULL;
+	char		*chunkKey = NULL;
+	char		line[64];
+	char		*end = NULL;
+	char		hex[SHA1_HEX_LEN + 1];
+	char		*argv[3] = { NULL, NULL, NULL };
+	int		argc = 2;
+	int64_t		fileSize = 0;
+	int64_t		total = 0;
+	int		chunkCount = 0;
+	int		length = 0;
+	int		s3Status = 0;
+	int		i = 0;
+	int		ret = 0;
+
+	log_msg("chunkStoreGetObject %s\n", path);
+
+	ret = getBucketFromPath(path, &bucket);
+	if( ret != 0 ) {
+		goto ret;
+	}
+
+	ret = getStagingPath("manifest", &manifestPath);
+	if( ret != 0 ) {
+		goto ret;
+	}
+	unlink(manifestPath);
+
+	argv[0] = malloc(strlen(path) + strlen(CHUNK_MANIFEST_NAME) + 2);
+	argv[1] = malloc(strlen(manifestPath) + strlen("filename=") + 1);
+	if( (argv[0] == NULL) || (argv[1] == NULL) ) {
+		ret = -ENOMEM;
+		goto ret;
+	}
+	sprintf(argv[0], "%s/%s", path + 1, CHUNK_MANIFEST_NAME);
+	sprintf(argv[1], "filename=%s", manifestPath);
+
+	if( versionId != NULL ) {
+		argc = 3;
+		argv[2] = malloc(strlen("versionId=") + strlen(versionId) + 1);
+		if( argv[2] == NULL ) {
+			ret = -ENOMEM;
+			goto ret;
+		}
+		sprintf(argv[2], "versionId=%s", versionId);
+	}
+
+	s3Status = get_object(argc, argv, 0);
+	if( s3Status != 0 ) {
+		logS3Errors(s3Status);
+		ret = -EINVAL;
+		goto ret;
+	}
+
+	manifest = fopen(manifestPath, "r");
+	if( manifest == NULL ) {
+		ret = -errno;
+		goto ret;
+	}
+	/* a line each for the name, which may have spaces, size and count */
+	if( (readMetaHeader(manifest, &fileSize) != 0)
+			|| (fgets(line, sizeof(line), manifest) == NULL) ) {
+		log_msg("manifest for %s is not valid\n", path);
+		ret = -EIO;
+		goto ret;
+	}
+	chunkCount = (int) strtol(line, &end, 10);
+	if( (end == line) || (chunkCount < 0)
+				|| ((*end != '\n') && (*end != 0)) ) {
+		log_msg("manifest for %s is not valid\n", path);
+		ret = -EIO;
+		goto ret;
+	}
+
+	out = fopen(cachedPath, "wb");
+	buf = malloc(CHUNK_MAX_SIZE);
+	chunkKey = malloc(strlen(bucket) + strlen(CHUNK_STORE_PREFIX)
+						+ SHA1_HEX_LEN + 3);
+	if( (out == NULL) || (buf == NULL) || (chunkKey == NULL) ) {
+		ret = (out == NULL) ? -errno : -ENOMEM;
+		goto ret;
+	}
+
+	for( i = 0; i < chunkCount; i++ ) {
+		if( (fscanf(manifest, "%40s %d", hex, &length) != 2)
+				|| (length <= 0) || (length > CHUNK_MAX_SIZE) ) {
+			log_msg("manifest for %s is not valid at chunk %d\n",
+								path, i);
+			ret = -EIO;
+			goto ret;
+		}
+
+		ret = getChunk(bucket, hex, length, buf, out);
+		if( ret != 0 ) {
+			goto ret;
+		}
+		total += length;
+
+		sprintf(chunkKey, "%s/%s/%s", bucket, CHUNK_STORE_PREFIX, hex);
+		addKnownChunk(chunkKey);
+	}
+
+	if( total != fileSize ) {
+		log_msg("%s: manifest size %lld, chunks add up to %lld\n",
+				path, (long long) fileSize, (long long) total);
+		ret = -EIO;
+	}
+
+ret:
+	if( manifest != NULL )
+		fclose(manifest);
+	if( out != NULL )
+		fclose(out);
+	if( manifestPath != NULL ) {
+		unlink(manifestPath);
+		free(manifestPath);
+	}
+	free(argv[0]);
+	free(argv[1]);
+	free(argv[2]);
+	free(chunkKey);
+	free(buf);
+	free(bucket);
+	return ret;
+}
+
+int chunkStoreDropManifest(char *path)
+{
+	s3_tree_node	*node = NULL;
+	s3_tree_node	*manifestNode = NULL;
+	char		*key = NULL;
+	int		ret = 0;
+
+	pthread_mutex_lock(&gS3TreeLock);
+	if( (searchForPath(path, gS3DirectoryTree, &node) == 0)
+			&& (node != NULL) && (node->children != NULL) ) {
+		searchNode(node, CHUNK_MANIFEST_NAME, 0, &manifestNode);
+	}
+	pthread_mutex_unlock(&gS3TreeLock);
+	if( manifestNode == NULL ) {
+		return 0;
+	}
+
+	key = malloc(strlen(path) + strlen(CHUNK_MANIFEST_NAME) + 2);
+	if( key == NULL ) {
+		return -ENOMEM;
+	}
+	sprintf(key, "%s/%s", path + 1, CHUNK_MANIFEST_NAME);
+	log_msg("drop manifest %s\n", key);
+	ret = deleteObjectFromS3(key, NULL);
+	free(key);
+	if( ret != 0 ) {
+		return ret;
+	}
+
+	/* the node may have gone while S3 was asked, look again */
+	pthread_mutex_lock(&gS3TreeLock);
+	manifestNode = NULL;
+	if( (searchForPath(path, gS3DirectoryTree, &node) == 0)
+			&& (node != NULL) && (node->children != NULL) ) {
+		searchNode(node, CHUNK_MANIFEST_NAME, 0, &manifestNode);
+	}
+	if( manifestNode != NULL ) {
+		deleteNode(manifestNode);
+	}
+	pthread_mutex_unlock(&gS3TreeLock);
+	return 0;
+}
@@ -0,0 +1,243 @@
+/* strndup() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "s3_fuse_bridge.h"
+#include "s3_delete.h"
+#include "log.h"
+
+static int		deleteThreads = DELETE_DEFAULT_THREADS;
+
+/* keys[first .. first + count) of one bucket, one request */
+typedef struct s3_delete_batch {
+	int		first;
+	int		count;
+	int		bucketLen;	/* "bucket/" is bucketLen + 1 */
+} s3_delete_batch;
+
+/* the batches of a deleteKeysFromS3(), shared by the workers */
+typedef struct s3_delete_run {
+	char		**keys;
+	char		**versionIds;
+	int		*results;
+	s3_delete_batch	*batches;
+	int		batchCount;
+	int		next;		/* first batch not taken yet */
+	pthread_mutex_t	lock;
+} s3_delete_run;
+
+int saveDeletePolicy()
+{
+	char		*env = NULL;
+	char		*end = NULL;
+	long		l = 0;
+
+	env = getenv("S3_DELETE_THREADS");
+	if( env != NULL ) {
+		l = strtol(env, &end, 10);
+		if( (*env == 0) || (*end != 0) || (l < 1)
+					|| (l > DELETE_MAX_THREADS) ) {
+			log_msg("S3_DELETE_THREADS : %s is not valid, using %d\n",
+						env, DELETE_DEFAULT_THREADS);
+		} else {
+			deleteThreads = (int) l;
+		}
+	}
+
+	log_msg("delete with %d threads, %d keys a request\n",
+				deleteThreads, S3_MAX_DELETE_OBJECTS);
+	return 0;
+}
+
+static void deleteOneByOne(s3_delete_run *run, s3_delete_batch *batch)
+{
+	int		i = 0;
+
+	for( i = batch->first; i < batch->first + batch->count; i++ ) {
+		run->results[i] = deleteObjectFromS3(run->keys[i],
+			(run->versionIds != NULL) ? run->versionIds[i] : NULL);
+	}
+}
+
+static void deleteBatch(s3_delete_run *run, s3_delete_batch *batch)
+{
+	const char	**names = NULL;
+	int		*statuses = NULL;
+	char		*bucket = NULL;
+	int		s3Status = 0;
+	int		i = 0;
+
+	if( batch->count == 1 ) {
+		deleteOneByOne(run, batch);
+		return;
+	}
+
+	bucket = strndup(run->keys[batch->first], batch->bucketLen);
+	names = malloc(batch->count * sizeof(char *));
+	statuses = malloc(batch->count * sizeof(int));
+	if( (bucket == NULL) || (names == NULL) || (statuses == NULL) ) {
+		for( i = 0; i < batch->count; i++ ) {
+			run->results[batch->first + i] = -ENOMEM;
+		}
+		goto ret;
+	}
+	for( i = 0; i < batch->count; i++ ) {
+		names[i] = run->keys[batch->first + i] + batch->bucketLen + 1;
+	}
+
+	log_msg("deleteBatch : %d keys of %s\n", batch->count, bucket);
+	s3Status = delete_objects(bucket, batch->count, names,
+			(run->versionIds != NULL) ?
+			(const char **) run->versionIds + batch->first : NULL,
+			statuses);
+	if( (s3Status == S3StatusErrorNotImplemented)
+			|| (s3Status == S3StatusErrorMethodNotAllowed) ) {
+		log_msg("deleteBatch : no multi-object delete, "
+						"one key at a time\n");
+		deleteOneByOne(run, batch);
+		goto ret;
+	}
+	if( s3Status != S3StatusOK ) {
+		logS3Errors(s3Status);
+		for( i = 0; i < batch->count; i++ ) {
+			run->results[batch->first + i] = -EINVAL;
+		}
+		goto ret;
+	}
+
+	for( i = 0; i < batch->count; i++ ) {
+		if( statuses[i] == S3StatusOK ) {
+			run->results[batch->first + i] = 0;
+			continue;
+		}
+		log_msg("deleteBatch : %s not deleted : %s\n",
+					run->keys[batch->first + i],
+					S3_get_status_name(statuses[i]));
+		run->results[batch->first + i] = -EINVAL;
+	}
+
+ret:
+	free(bucket);
+	free(names);
+	free(statuses);
+}
+
+static void *deleteWorker(void *arg)
+{
+	s3_delete_run	*run = (s3_delete_run *) arg;
+	int		i = 0;
+
+	for( ;; ) {
+		pthread_mutex_lock(&run->lock);
+		i = run->next++;
+		pthread_mutex_unlock(&run->lock);
+		if( i >= run->batchCount ) {
+			break;
+		}
+		deleteBatch(run, &run->batches[i]);
+	}
+	return NULL;
+}
+
+/* keys of the same bucket, S3_MAX_DELETE_OBJECTS at most, a batch */
+static int cutBatches(s3_delete_run *run, int count)
+{
+	s3_delete_batch	*batch = NULL;
+	char		*slash = NULL;
+	int		bucketLen = 0;
+	int		i = 0;
+
+	run->batches = malloc(count * sizeof(s3_delete_batch));
+	if( run->batches == NULL ) {
+		return -ENOMEM;
+	}
+	for( i = 0; i < count; i++ ) {
+		slash = strchr(run->keys[i], '/');
+		if( slash == NULL ) {
+			log_msg("deleteKeysFromS3 : %s is not bucket/key\n",
+							run->keys[i]);
+			return -EINVAL;
+		}
+		bucketLen = slash - run->keys[i];
+		if( (batch == NULL) || (batch->count == S3_MAX_DELETE_OBJECTS)
+				|| (batch->bucketLen != bucketLen)
+				|| (strncmp(run->keys[batch->first],
+					run->keys[i], bucketLen) != 0) ) {
+			batch = &run->batches[run->batchCount++];
+			batch->first = i;
+			batch->count = 0;
+			batch->bucketLen = bucketLen;
+		}
+		batch->count++;
+	}
+	return 0;
+}
+
+int deleteKeysFromS3(int count, char **keys, char **versionIds, int *results)
+{
+	/*
+	 - deletes keys, "bucket/key", with versionIds[i] if versionIds is
+	   set; results[i], if results is set, is what became of keys[i]
+	 - returns the first error
+	*/
+	s3_delete_run	run;
+	pthread_t	workers[DELETE_MAX_THREADS];
+	int		workerCount = 0;
+	int		ret = 0;
+	int		i = 0;
+
+	if( count == 0 ) {
+		return 0;
+	}
+
+	memset(&run, 0, sizeof(run));
+	run.keys = keys;
+	run.versionIds = versionIds;
+	run.results = (results != NULL) ? results : malloc(count * sizeof(int));
+	if( run.results == NULL ) {
+		return -ENOMEM;
+	}
+	pthread_mutex_init(&run.lock, NULL);
+
+	ret = cutBatches(&run, count);
+	if( ret != 0 ) {
+		for( i = 0; i < count; i++ ) {
+			run.results[i] = ret;
+		}
+		goto ret;
+	}
+	log_msg("deleteKeysFromS3 : %d keys in %d requests\n", count,
+							run.batchCount);
+
+	while( (workerCount < deleteThreads - 1)
+				&& (workerCount < run.batchCount - 1) ) {
+		if( pthread_create(&workers[workerCount], NULL,
+						deleteWorker, &run) != 0 ) {
+			break;
+		}
+		workerCount++;
+	}
+	deleteWorker(&run);
+	for( i = 0; i < workerCount; i++ ) {
+		pthread_join(workers[i], NULL);
+	}
+
+	for( i = 0; i < count; i++ ) {
+		if( run.results[i] != 0 ) {
+			ret = run.results[i];
+			break;
+		}
+	}
+
+ret:
+	pthread_mutex_destroy(&run.lock);
+	free(run.batches);
+	if( results == NULL ) {
+		free(run.results);
+	}
+	return ret;
+}
@@ -0,0 +1,267 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "s3_fuse_bridge.h"
+#include "s3_epoch.h"
+#include "log.h"
+
+#define CACHE_LINE	64
+
+/* a reader's epoch, 0 when it is not in one; a slot a cache line */
+typedef struct s3_epoch_slot {
+	uint64_t	epoch;
+	int		owned;
+	char		pad[CACHE_LINE - sizeof(uint64_t) - sizeof(int)];
+} s3_epoch_slot;
+
+typedef struct s3_epoch_item {
+	void		(*freeFn)(void *);
+	void		*p;
+} s3_epoch_item;
+
+typedef struct s3_epoch_batch s3_epoch_batch;
+struct s3_epoch_batch {
+	uint64_t	epoch;		/* the epoch it was closed in */
+	int		count;
+	s3_epoch_item	items[EPOCH_BATCH];
+	s3_epoch_batch	*next;
+};
+
+static s3_epoch_slot	slots[EPOCH_MAX_READERS]
+					__attribute__((aligned(CACHE_LINE)));
+static uint64_t		globalEpoch = 1;
+
+static __thread int	mySlot = -1;
+static pthread_key_t	slotKey;
+static pthread_once_t	slotKeyOnce = PTHREAD_ONCE_INIT;
+
+/* protected by gS3TreeLock */
+static s3_epoch_batch	*openBatch = NULL;
+static s3_epoch_batch	*closedBatches = NULL;
+
+/* set while something is retired and not freed, read by the reclaimer */
+static int		pending = 0;
+
+static int		stopping = 0;
+static int		running = 0;
+static pthread_t	reclaimer;
+static pthread_mutex_t	reclaimLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	reclaimWakeup = PTHREAD_COND_INITIALIZER;
+
+static void releaseSlot(void *arg)
+{
+	s3_epoch_slot	*slot = arg;
+
+	__atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&slot->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void makeSlotKey()
+{
+	pthread_key_create(&slotKey, releaseSlot);
+}
+
+static int claimSlot()
+{
+	/* the thread's slot, given back when it exits */
+	int		i = 0;
+	int		expected = 0;
+
+	pthread_once(&slotKeyOnce, makeSlotKey);
+	for( i = 0; i < EPOCH_MAX_READERS; i++ ) {
+		expected = 0;
+		if( __atomic_compare_exchange_n(&slots[i].owned, &expected, 1,
+				0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) ) {
+			pthread_setspecific(slotKey, &slots[i]);
+			mySlot = i;
+			return 0;
+		}
+	}
+	return -EAGAIN;
+}
+
+int epochEnter()
+{
+	uint64_t	epoch = 0;
+
+	if( (mySlot < 0) && (claimSlot() != 0) ) {
+		return -EAGAIN;
+	}
+	epoch = __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&slots[mySlot].epoch, epoch, __ATOMIC_SEQ_CST);
+	/* the epoch is seen by a writer before anything this reader loads */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return 0;
+}
+
+void epochExit()
+{
+	__atomic_store_n(&slots[mySlot].epoch, 0, __ATOMIC_RELEASE);
+}
+
+static uint64_t oldestReader()
+{
+	/* the oldest epoch a reader is in, UINT64_MAX if none is */
+	uint64_t	oldest = UINT64_MAX;
+	uint64_t	epoch = 0;
+	int		i = 0;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for( i = 0; i < EPOCH_MAX_READERS; i++ ) {
+		epoch = __atomic_load_n(&slots[i].epoch, __ATOMIC_ACQUIRE);
+		if( (epoch != 0) && (epoch < oldest) ) {
+			oldest = epoch;
+		}
+	}
+	return oldest;
+}
+
+static void freeBatches()
+{
+	s3_epoch_batch	**p = &closedBatches;
+	s3_epoch_batch	*batch = NULL;
+	uint64_t	oldest = oldestReader();
+	int		i = 0;
+
+	while( *p != NULL ) {
+		batch = *p;
+		if( batch->epoch >= oldest ) {
+			p = &batch->next;
+			continue;
+		}
+		*p = batch->next;
+		for( i = 0; i < batch->count; i++ ) {
+			batch->items[i].freeFn(batch->items[i].p);
+		}
+		free(batch);
+	}
+}
+
+static void closeBatch()
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	openBatch->epoch = __atomic_fetch_add(&globalEpoch, 1,
+							__ATOMIC_SEQ_CST);
+	openBatch->next = closedBatches;
+	closedBatches = openBatch;
+	openBatch = NULL;
+	freeBatches();
+	__atomic_store_n(&pending, closedBatches != NULL, __ATOMIC_RELAXED);
+}
+
+static void waitForReaders()
+{
+	/* every reader in an epoch now has left; they do not wait for
+	   gS3TreeLock while in one, so this ends */
+	struct timespec	pause = { 0, 1000 };
+	uint64_t	epoch = 0;
+
+	epoch = __atomic_fetch_add(&globalEpoch, 1, __ATOMIC_SEQ_CST);
+	while( oldestReader() <= epoch ) {
+		nanosleep(&pause, NULL);
+		if( pause.tv_nsec < 1000000 ) {
+			pause.tv_nsec *= 2;
+		}
+	}
+}
+
+void epochRetire(void (*freeFn)(void *), void *p)
+{
+	/*
+	 - freeFn(p) once no reader can be looking at p; p is unlinked,
+	   a reader that comes now does not find it
+	*/
+	if( openBatch == NULL ) {
+		openBatch = malloc(sizeof(s3_epoch_batch));
+		if( openBatch == NULL ) {
+			/* nowhere to keep it: free it after a grace period,
+			   and every closed batch with it */
+			log_msg("epochRetire : no memory, waiting for readers\n");
+			waitForReaders();
+			freeFn(p);
+			freeBatches();
+			return;
+		}
+		openBatch->count = 0;
+		__atomic_store_n(&pending, 1, __ATOMIC_RELAXED);
+	}
+
+	openBatch->items[openBatch->count].freeFn = freeFn;
+	openBatch->items[openBatch->count].p = p;
+	openBatch->count++;
+	if( openBatch->count == EPOCH_BATCH ) {
+		closeBatch();
+	}
+}
+
+void epochFlush()
+{
+	/* the open batch closed, and what no reader can see freed */
+	if( openBatch != NULL ) {
+		closeBatch();
+	} else {
+		freeBatches();
+		__atomic_store_n(&pending, closedBatches != NULL,
+							__ATOMIC_RELAXED);
+	}
+}
+
+static void *reclaimThread(void *arg)
+{
+	struct timespec	until;
+
+	(void) arg;
+	pthread_mutex_lock(&reclaimLock);
+	while( !stopping ) {
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += EPOCH_FLUSH_SECONDS;
+		while( !stopping && (pthread_cond_timedwait(&reclaimWakeup,
+				&reclaimLock, &until) != ETIMEDOUT) )
+			;
+		if( stopping || !__atomic_load_n(&pending, __ATOMIC_RELAXED) ) {
+			continue;
+		}
+		pthread_mutex_unlock(&reclaimLock);
+
+		pthread_mutex_lock(&gS3TreeLock);
+		epochFlush();
+		pthread_mutex_unlock(&gS3TreeLock);
+
+		pthread_mutex_lock(&reclaimLock);
+	}
+	pthread_mutex_unlock(&reclaimLock);
+	return NULL;
+}
+
+int epochStart()
+{
+	/* at mount */
+	int		ret = 0;
+
+	pthread_mutex_lock(&reclaimLock);
+	stopping = 0;
+	ret = pthread_create(&reclaimer, NULL, reclaimThread, NULL);
+	if( ret != 0 ) {
+		log_msg("epochStart : pthread_create %d\n", ret);
+	} else {
+		running = 1;
+	}
+	pthread_mutex_unlock(&reclaimLock);
+	return -ret;
+}
+
+void epochStop()
+{
+	/* at unmount; what is retired still waits for epochFlush() */
+	pthread_mutex_lock(&reclaimLock);
+	stopping = 1;
+	pthread_cond_broadcast(&reclaimWakeup);
+	if( !running ) {
+		pthread_mutex_unlock(&reclaimLock);
+		return;
+	}
+	running = 0;
+	pthread_mutex_unlock(&reclaimLock);
+	pthread_join(reclaimer, NULL);
+}
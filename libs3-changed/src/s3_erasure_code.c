@@ -10,6 +10,8 @@
 #include <errno.h>
 #include <dirent.h>
 #include "erasurecodes.h"
+#include "stripe_pool.h"
+#include "galois.h"
 #include "s3_fuse_bridge.h"
 #include "s3_erasure_code.h"
 #include "log.h"
@@ -17,55 +19,98 @@
 
 erasure_policy		gErasurePolicy;
 
-int getObjectAndDecode(char *path, char *cachedPath, s3_tree_node *foundNode)
+static void initStripePool();
+static void initGaloisTables();
+
+#define STRIPE_POOL_MAX_FREE	4
+
+/* Encode and decode run in a directory of their own under the cache, so
+   concurrent requests never share a Coding directory and nobody has to
+   chdir().  removeWorkDir() unlinks whatever is left in it. */
+static int makeWorkDir(char **pWorkDir, char **pCodingDir)
+{
+	int		ret = 0 ;
+
+	ret = s3CacheTempPath(gS3Cache, ".ec", pWorkDir);
+	if( ret != 0 ) {
+		return ret;
+	}
+
+	*pCodingDir = malloc(strlen(*pWorkDir) + strlen("/Coding") + 1);
+	if( *pCodingDir == NULL ) {
+		return -ENOMEM;
+	}
+	sprintf(*pCodingDir, "%s/Coding", *pWorkDir);
+
+	if( (mkdir(*pWorkDir, S_IRWXU) != 0)
+			|| (mkdir(*pCodingDir, S_IRWXU) != 0) ) {
+		log_msg("makeWorkDir : cannot create %s : %d\n", *pCodingDir,
+								errno);
+		return -errno;
+	}
+	return 0;
+}
+
+static void removeWorkDir(char *workDir, char *codingDir)
+{
+	DIR		*pDir = NULL;
+	struct dirent	*entry = NULL;	
+	char		fileName[4096];
+
+	if( codingDir != NULL ) {
+		pDir = opendir(codingDir);
+		while( (pDir != NULL) && ((entry = readdir(pDir)) != NULL) ) {
+			if( (strcmp(entry->d_name, ".") == 0)
+				|| ((strcmp(entry->d_name, "..") ==0)) ){
+				continue;
+			}
+			snprintf(fileName, sizeof(fileName), "%s/%s", codingDir,
+							entry->d_name);
+			unlink(fileName);
+		}
+		if( pDir != NULL )
+			closedir(pDir);
+		rmdir(codingDir);
+		free(codingDir);
+	}
+	if( workDir != NULL ) {
+		rmdir(workDir);
+		free(workDir);
+	}
+}
+
+int getObjectAndDecode(char *path, char *cachedPath, int partCount,
+							s3_file_info *parts)
 {
 
-	char		*codingPath = NULL;
+	char		*workDir = NULL;
+	char		*codingDir = NULL;
 	char		*destinationPath = NULL;
 	char		*sourcePath = NULL;
 	char		*childName = NULL;
-	int		argc = 2;
-	char		*argv[4] = {NULL, NULL, NULL, NULL };
 	int		decodeArgc = 2;
 	char		*decodeArgv[3] = {"decoder", NULL, NULL};
 	int		ret = 0 ;
-	s3_tree_node	*child = NULL;
+	int		i = 0 ;
 	DIR		*pDir = NULL;
 	struct dirent	*entry = NULL;	
-	char		decodedFileName[1024];
+	char		decodedFileName[4096];
 	char		*fileToDecode = NULL;
-	char		curdir[1024];
-	int 		ret1 = 0 ;
-	int		s3Status = 0 ;
 	
 	
 
-	codingPath = malloc(1024); 
-	if( codingPath == NULL ) {
-		ret = -ENOMEM;
+	ret = makeWorkDir(&workDir, &codingDir);
+	if( ret != 0 ) {
 		goto ret;
 	}
-	
-	//getcwd(codingPath, 1024);
-	sprintf(codingPath, "%s/", gExecuteDir);
 
-	log_msg("cur dir = %s\n", codingPath);
+	log_msg("get_object_and_decode in %s\n", workDir);
+	for( i=0; i < partCount; i++ ) {
 
-	ret1 = chdir(codingPath);
-	log_msg("chdir returned %d\n", ret1);
-	getcwd(curdir, 1000);
-	log_msg("curdir = %s\n", curdir);
-
-	mkpath("Coding");
-	log_msg("get_object_and_decode\n");
-	child = foundNode->children;
-	while( child != NULL ) {
-
-		childName = child->s3FileInfo->name;
+		childName = parts[i].name;
 		log_msg("child = %s\n", childName);
 
-		destinationPath = malloc(strlen(codingPath)
-						+strlen("Coding/")
+		destinationPath = malloc(strlen(codingDir)
 						+ strlen(childName) + 5); 
 
 		if( destinationPath == NULL ) {
@@ -73,7 +118,7 @@ int getObjectAndDecode(char *path, char *cachedPath, s3_tree_node *foundNode)
 			goto ret;
 		}
 
-		sprintf(destinationPath, "%sCoding/%s", codingPath, childName);
+		sprintf(destinationPath, "%s/%s", codingDir, childName);
 
 		// build sourcePath
 		sourcePath = malloc( strlen(path) + strlen(childName) + 5) ;
@@ -82,42 +127,12 @@ int getObjectAndDecode(char *path, char *cachedPath, s3_tree_node *foundNode)
 			goto ret;
 		}
 
-		sprintf(sourcePath, "%s/%s", path+1, childName);	
-
-		argv[0] = sourcePath;
-		log_msg("argv[0] = %s\n", argv[0]);
-		argv[1] = malloc(strlen("filename=") + strlen(destinationPath) +5);
-		if(argv[1] == NULL ) {
-			ret= -ENOMEM ;
-			goto ret;
-		}
+		sprintf(sourcePath, "%s/%s", path, childName);	
 
-		sprintf(argv[1], "filename=%s", destinationPath);
-		log_msg("argv[1] = %s\n", argv[1]);
-
-		if(child->s3FileInfo->versionId != NULL) {
-
-			argc = 3;
-			argv[2] = malloc(strlen("versionId=") 
-				+ strlen(child->s3FileInfo->versionId) +1 ) ;
-			if(argv[2] == NULL) {
-				ret =  -ENOMEM;
-				goto ret;
-			}
-	
-			sprintf(argv[2], "versionId=%s", 
-					child->s3FileInfo->versionId);
-			
-			log_msg("argv[2] = %s\n", argv[2]);
-
-		
-		}
 		log_msg("before get_object\n");
-		
-		s3Status = get_object(argc, argv, 0 );	
-		if(s3Status != 0 ) { 
-			logS3Errors(s3Status);
-			ret = -EINVAL;
+		ret = s3CacheFetchObject(sourcePath, parts[i].versionId,
+							destinationPath);
+		if( ret != 0 ) { 
 			goto ret; 
 		}
 		log_msg("after get_object\n");	
@@ -127,10 +142,6 @@ int getObjectAndDecode(char *path, char *cachedPath, s3_tree_node *foundNode)
 		destinationPath = NULL;
 		free(sourcePath);
 		sourcePath = NULL;
-		free(argv[1]);
-		argv[1] = NULL;
-
-		child = child->next;
 	}
 
 	// all files are available in Coding directory, set arguments and decode
@@ -140,46 +151,48 @@ int getObjectAndDecode(char *path, char *cachedPath, s3_tree_node *foundNode)
 	decodeArgv[1] = strdup(fileToDecode+1) ; 	
 
 	log_msg("before decode\n");
-	decode(decodeArgc, decodeArgv);
+	decode_in_dir(workDir, decodeArgc, decodeArgv);
 	log_msg("after decode\n");
 
 
 
 	// decoded file is available in Coding directory
 	// traverse through directory, rename decoded file to cachedPath
-	// unlink other files, remove Coding Directory
+	// removeWorkDir() unlinks the other files
 	//
 
 
-	pDir =  opendir("Coding");
+	pDir =  opendir(codingDir);
 	if(pDir == NULL) {
 
 		log_msg("\nERROR: Failed to open Coding directory");
                         perror(0);
                         ret = -errno;
+			goto ret;
 	}
 
+	ret = -EIO;
 	while( (entry= readdir(pDir)) != NULL) {
 
-		fprintf(stderr, "readdir\n");
-		if((strcmp(entry->d_name, ".") == 0)
-				|| ((strcmp(entry->d_name, "..") ==0))){
-			continue;
-		}
-
-		sprintf(decodedFileName, "Coding/%s", entry->d_name);
 		if(( strstr(entry->d_name, "decoded") != NULL)) {
+			snprintf(decodedFileName, sizeof(decodedFileName), 
+					"%s/%s", codingDir, entry->d_name);
 			log_msg("decodedFileName : %s\n", decodedFileName);
                                                                            
 
 			ret= rename(decodedFileName, cachedPath);
-		} else {
-			unlink(decodedFileName);
+			if( ret != 0 )
+				ret = -errno;
+			break;
 		}
 	}
+	closedir(pDir);
 ret :
-	if(codingPath != NULL)
-		free(codingPath);
+	removeWorkDir(workDir, codingDir);
+	if( decodeArgv[1] != NULL )
+		free(decodeArgv[1]);
+	if( destinationPath != NULL )
+		free(destinationPath);
 	if(sourcePath != NULL)
 		free(sourcePath);
 	return ret ;
@@ -192,17 +205,23 @@ int  encodeObjectAndPut(char* path, char *cachedPath)
 	int		encodeArgc = 8;
 	char		*encodeArgv[8] 
 		= {"encode", NULL, NULL, NULL, NULL, NULL, NULL, NULL} ;
+	char		*workDir = NULL;
+	char		*codingDir = NULL;
 	DIR		*pDir = NULL;
 	struct	dirent	*entry = NULL;
 	char		*encodedFileName = NULL;
 	char		*encodedKey = NULL;
 	int		ret = 0 ;
 	int		argc = 2;
-	char		*argv[3];
+	char		*argv[3] = { NULL, NULL, NULL };
 	int		s3Status = 0 ;
 
 	
-	chdir(gExecuteDir);
+	ret = makeWorkDir(&workDir, &codingDir);
+	if( ret != 0 ) {
+		goto ret;
+	}
+
 	encodeArgv[1] = strdup(cachedPath);
 
 	encodeArgv[2] = gErasurePolicy.int_k;
@@ -223,36 +242,36 @@ int  encodeObjectAndPut(char* path, char *cachedPath)
 					encodeArgv[6],
 					encodeArgv[7]);
 					
-	log_msg("before encode\n");
-	encode(encodeArgc, encodeArgv);
+	log_msg("before encode in %s\n", workDir);
+	encode_in_dir(workDir, encodeArgc, encodeArgv);
 	log_msg("after encode\n");
 	
 	
-	pDir =  opendir("Coding");
+	pDir =  opendir(codingDir);
 	if(pDir == NULL) {
 
 		log_msg("\nERROR: Failed to open Coding directory");
                         perror(0);
                         ret = -errno;
+			goto ret;
 	}
 
 	while( (entry= readdir(pDir)) != NULL) {
 
-		fprintf(stderr, "readdir\n");
 		if((strcmp(entry->d_name, ".") == 0)
 				|| ((strcmp(entry->d_name, "..") ==0))){
 			continue;
 		}
 
 		
-		encodedFileName = malloc(strlen("Coding/") 
+		encodedFileName = malloc(strlen(codingDir) 
 					+ strlen(entry->d_name) +5 ) ;
 		if(encodedFileName == NULL ) {
 			ret = -ENOMEM;
 			goto ret;
 		}
 
-		sprintf(encodedFileName, "Coding/%s", entry->d_name);
+		sprintf(encodedFileName, "%s/%s", codingDir, entry->d_name);
 
 		encodedKey = malloc( strlen(path+1)
 					+ strlen(entry->d_name) + 5 );
@@ -267,7 +286,8 @@ int  encodeObjectAndPut(char* path, char *cachedPath)
 		argv[0] = encodedKey;
 		argv[1] = malloc(strlen(encodedFileName) + strlen("filename=") +1 ) ;
 		if(argv[1] == NULL) {
-			return -ENOMEM;
+			ret = -ENOMEM;
+			goto ret;
 		}
 	
 		sprintf(argv[1], "filename=%s", encodedFileName);
@@ -287,12 +307,26 @@ int  encodeObjectAndPut(char* path, char *cachedPath)
 		}
 			
 		free(argv[1]);
+		argv[1] = NULL;
 		free(encodedFileName);
+		encodedFileName = NULL;
 		free(encodedKey);
+		encodedKey = NULL;
 
 	}
 
 ret :
+	if( pDir != NULL )
+		closedir(pDir);
+	removeWorkDir(workDir, codingDir);
+	if( encodeArgv[1] != NULL )
+		free(encodeArgv[1]);
+	if( argv[1] != NULL )
+		free(argv[1]);
+	if( encodedFileName != NULL )
+		free(encodedFileName);
+	if( encodedKey != NULL )
+		free(encodedKey);
 	return ret ;
 }
 int saveErasurePolicy()
@@ -311,8 +345,68 @@ int saveErasurePolicy()
 	fscanf(fp, "%s", gErasurePolicy.int_w);
 	fscanf(fp, "%s", gErasurePolicy.int_packetSize);
 	fscanf(fp, "%s", gErasurePolicy.int_bufferSize);
+	if( fscanf(fp, "%15s", gErasurePolicy.stripePages) != 1 ) {
+		strcpy(gErasurePolicy.stripePages, "none");
+	}
 	
 	fclose(fp);
+
+	initStripePool();
+
+	initGaloisTables();
 	return 0;
 
 }
+
+/* Size the encoder/decoder stripe pool from the policy.  encode() rounds
+   buffersize to a multiple of sizeof(int)*w*k*packetsize and splits it
+   into k blocks; do the same here so every stripe of a large file is
+   served from the pool. */
+static void initStripePool()
+{
+	int		k = atoi(gErasurePolicy.int_k);
+	int		m = atoi(gErasurePolicy.int_m);
+	int		w = atoi(gErasurePolicy.int_w);
+	int		packetSize = atoi(gErasurePolicy.int_packetSize);
+	int		bufferSize = atoi(gErasurePolicy.int_bufferSize);
+	int		unit;
+	int		flags = 0;
+
+	if( k <= 0 || m < 0 || w <= 0 || bufferSize <= 0 ) {
+		return;
+	}
+
+	unit = sizeof(int) * w * k * (packetSize > 0 ? packetSize : 1);
+	bufferSize = ((bufferSize + unit - 1) / unit) * unit;
+
+	if( strcmp(gErasurePolicy.stripePages, "hugetlb") == 0 ) {
+		flags = STRIPE_POOL_HUGETLB;
+	} else if( strcmp(gErasurePolicy.stripePages, "thp") == 0 ) {
+		flags = STRIPE_POOL_THP;
+	}
+
+	if( stripe_pool_init(k, m, bufferSize / k, STRIPE_POOL_MAX_FREE,
+							flags) != 0 ) {
+		log_msg("stripe_pool_init failed, k = %d m = %d blocksize = %d\n",
+						k, m, bufferSize / k);
+	}
+}
+
+/* galois builds its tables on first use, without a lock; build the
+   ones the policy needs before FUSE starts more than one thread */
+static void initGaloisTables()
+{
+	int		w = atoi(gErasurePolicy.int_w);
+
+	if( w <= 0 || w > 32 ) {
+		return;
+	}
+
+	if( w == 32 ) {
+		galois_create_split_w8_tables();
+	} else if( w < 14 ) {
+		galois_create_mult_tables(w);
+	} else {
+		galois_create_log_tables(w);
+	}
+}
@@ -0,0 +1,368 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "s3_fuse_bridge.h"
+#include "s3_tree_arena.h"
+#include "s3_epoch.h"
+#include "s3_evict.h"
+#include "log.h"
+
+/* a directory whose children may go */
+typedef struct s3_evict_dir {
+	s3_tree_node	*dir;
+	time_t		usedTime;	/* the latest in its subtree */
+	int		depth;
+	int		held;		/* the kernel holds a child inode */
+} s3_evict_dir;
+
+typedef struct s3_evict_pass {
+	time_t		now;
+	s3_evict_dir	*dirs;
+	size_t		count;
+	size_t		size;
+	int		nomem;
+} s3_evict_pass;
+
+static size_t		maxBytes = (size_t) EVICT_DEFAULT_KB * 1024;
+
+/* evictLock guards the four below; the tree is guarded by gS3TreeLock */
+static int		wanted = 0;
+static int		stopping = 0;
+static int		running = 0;
+static pthread_t	evicter;
+static pthread_mutex_t	evictLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	evictWakeup = PTHREAD_COND_INITIALIZER;
+
+int saveEvictPolicy()
+{
+	char		*env = NULL;
+	char		*end = NULL;
+	long long	l = 0;
+
+	env = getenv("S3_TREE_MEMORY_KB");
+	if( env != NULL ) {
+		l = strtoll(env, &end, 10);
+		if( (*env == 0) || (*end != 0) || (l < 0)
+				|| (l > (long long) (SIZE_MAX / 1024)) ) {
+			log_msg("S3_TREE_MEMORY_KB : %s is not valid, using %d\n",
+						env, EVICT_DEFAULT_KB);
+		} else {
+			maxBytes = (size_t) l * 1024;
+		}
+	}
+
+	if( maxBytes == 0 ) {
+		log_msg("the tree is never evicted\n");
+	} else {
+		log_msg("the tree is evicted above %lu bytes\n",
+						(unsigned long) maxBytes);
+	}
+	return 0;
+}
+
+/* what the tree takes against the limit: its nodes and their names */
+static size_t treeBytes()
+{
+	size_t		nodeBytes = 0;
+	size_t		nameBytes = 0;
+
+	treeArenaUsage(&nodeBytes, &nameBytes);
+	return treeArenaNodes() * EVICT_NODE_BYTES + nameBytes;
+}
+
+void evictTouch(s3_tree_node *node)
+{
+	/*
+	 - node was looked up: stamps the listing of node, or of the
+	   nearest directory above it that has one
+	 - with gS3TreeLock held, or in an epoch (s3_epoch.h)
+	*/
+	s3_dir_listing	*listing = NULL;
+	time_t		now = 0;
+
+	while( node != NULL ) {
+		listing = NODE_LOAD(node->listing);
+		if( listing != NULL ) {
+			now = time(NULL);
+			if( NODE_LOAD(listing->usedTime) != now ) {
+				NODE_STORE(listing->usedTime, now);
+			}
+			return;
+		}
+		node = NODE_LOAD(node->parent);
+	}
+}
+
+void evictCheck()
+{
+	/* a node was added, gS3TreeLock held */
+	if( (maxBytes == 0) || (treeBytes() <= maxBytes)
+			|| __atomic_load_n(&wanted, __ATOMIC_RELAXED) ) {
+		return;
+	}
+	pthread_mutex_lock(&evictLock);
+	if( running && !wanted ) {
+		__atomic_store_n(&wanted, 1, __ATOMIC_RELAXED);
+		pthread_cond_signal(&evictWakeup);
+	}
+	pthread_mutex_unlock(&evictLock);
+}
+
+static void addDir(s3_evict_pass *pass, s3_tree_node *dir, time_t usedTime,
+							int depth, int held)
+{
+	s3_evict_dir	*dirs = NULL;
+	size_t		size = 0;
+
+	if( pass->count == pass->size ) {
+		size = (pass->size == 0) ? 64 : pass->size * 2;
+		dirs = realloc(pass->dirs, size * sizeof(s3_evict_dir));
+		if( dirs == NULL ) {
+			pass->nomem = 1;
+			return;
+		}
+		pass->dirs = dirs;
+		pass->size = size;
+	}
+	pass->dirs[pass->count].dir = dir;
+	pass->dirs[pass->count].usedTime = usedTime;
+	pass->dirs[pass->count].depth = depth;
+	pass->dirs[pass->count].held = held;
+	pass->count++;
+}
+
+/*
+ * The latest use in the subtree of node, -1 if it has to stay; the
+ * directories below whose children could go are added to pass.
+ * *pHeld tells whether the kernel holds an inode in the subtree.
+ */
+static time_t walk(s3_evict_pass *pass, s3_tree_node *node, int depth,
+								int *pHeld)
+{
+	s3_tree_node	*child = NULL;
+	time_t		usedTime = 0;
+	time_t		t = 0;
+	int		keep = 0;
+	int		held = 0;
+	int		heldBelow = 0;
+
+	if( (node->isComplete & NODE_LOCAL) || node->uploaded
+				|| (node->cachedETag != NULL) ) {
+		keep = 1;
+	}
+	if( node->listing != NULL ) {
+		keep |= node->listing->refreshing;
+		usedTime = NODE_LOAD(node->listing->usedTime);
+	}
+	for( child = node->children; child != NULL; child = child->next ) {
+		t = walk(pass, child, depth + 1, &held);
+		heldBelow |= held;
+		if( t < 0 ) {
+			keep = 1;
+		} else if( t > usedTime ) {
+			usedTime = t;
+		}
+	}
+	*pHeld = heldBelow || s3InodeHeld(node);
+	if( keep ) {
+		return -1;
+	}
+	if( (depth > 0) && !node->isFileNode && (node->listing != NULL)
+			&& (node->isComplete & NODE_COMPLETE)
+			&& (node->children != NULL) && (usedTime < pass->now) ) {
+		addDir(pass, node, usedTime, depth, heldBelow);
+	}
+	return usedTime;
+}
+
+/* longest unused first; below a directory before it */
+static int evictDirCmp(const void *a, const void *b)
+{
+	const s3_evict_dir	*x = a;
+	const s3_evict_dir	*y = b;
+
+	if( x->usedTime != y->usedTime ) {
+		return (x->usedTime < y->usedTime) ? -1 : 1;
+	}
+	return y->depth - x->depth;
+}
+
+static size_t countBelow(s3_tree_node *node)
+{
+	s3_tree_node	*child = NULL;
+	size_t		count = 0;
+
+	for( child = node->children; child != NULL; child = child->next ) {
+		count += 1 + countBelow(child);
+	}
+	return count;
+}
+
+/* tells the kernel to forget the children of dir */
+static void forgetChildren(s3_tree_node *dir)
+{
+	s3_tree_node	*child = NULL;
+
+	if( gS3Invalidate == NULL ) {
+		return;
+	}
+	for( child = dir->children; child != NULL; child = child->next ) {
+		gS3Invalidate(child, S3_INVALIDATE_ENTRY);
+	}
+}
+
+/* drops the children of dir, which is listed again when it is used */
+static size_t dropChildren(s3_tree_node *dir)
+{
+	s3_dir_listing	*listing = dir->listing;
+	size_t		count = countBelow(dir);
+
+	forgetChildren(dir);
+	deleteChildren(dir);
+	dir->isComplete &= ~NODE_COMPLETE;
+	NODE_STORE(dir->listing, NULL);
+	free(listing->marker);
+	listing->marker = NULL;
+	epochRetire(free, listing);
+	return count;
+}
+
+size_t evictRun(size_t keepBytes)
+{
+	/*
+	 - drops the children of the directories used longest ago until
+	   the tree takes at most keepBytes, or nothing else can go;
+	   returns how many nodes were dropped
+	 - a dropped node counts EVICT_NODE_BYTES here; the names freed
+	   with it, once the readers are gone, count from the next pass
+	 - gS3TreeLock held
+	*/
+	s3_evict_pass	pass;
+	s3_evict_dir	*candidate = NULL;
+	size_t		nodes = treeArenaNodes();
+	size_t		bytes = treeBytes();
+	size_t		dropped = 0;
+	size_t		forgetting = 0;
+	size_t		dirs = 0;
+	int		held = 0;
+	size_t		i = 0;
+	char		*path = NULL;
+
+	if( (gS3DirectoryTree == NULL) || (bytes <= keepBytes) ) {
+		return 0;
+	}
+	memset(&pass, 0, sizeof(pass));
+	pass.now = time(NULL);
+	walk(&pass, gS3DirectoryTree, 0, &held);
+	if( pass.nomem ) {
+		log_msg("evictRun : no memory for all the directories\n");
+	}
+	qsort(pass.dirs, pass.count, sizeof(s3_evict_dir), evictDirCmp);
+
+	/* a directory comes after those below it, which are still
+	   there when it does */
+	for( i = 0; (i < pass.count) && (bytes - (dropped + forgetting)
+				* EVICT_NODE_BYTES > keepBytes); i++ ) {
+		candidate = &pass.dirs[i];
+		if( gS3Cache != NULL ) {
+			if( getPathForNode(candidate->dir, &path) != 0 ) {
+				continue;
+			}
+			if( s3CacheIsDirtyBelow(gS3Cache, path) ) {
+				free(path);
+				continue;
+			}
+			free(path);
+		}
+		if( candidate->held ) {
+			/* their inodes would be freed under the kernel; it
+			   is asked to let go, and they go on a later pass */
+			forgetChildren(candidate->dir);
+			forgetting += countBelow(candidate->dir);
+			continue;
+		}
+		dropped += dropChildren(candidate->dir);
+		dirs++;
+	}
+	free(pass.dirs);
+
+	log_msg("evictRun : %lu nodes of %lu directories dropped, "
+			"%lu nodes left, %lu held by the kernel\n",
+			(unsigned long) dropped, (unsigned long) dirs,
+			(unsigned long) (nodes - dropped),
+			(unsigned long) forgetting);
+	return dropped;
+}
+
+static void *evictThread(void *arg)
+{
+	struct timespec	until;
+	int		over = 0;
+
+	(void) arg;
+	pthread_mutex_lock(&evictLock);
+	while( !stopping ) {
+		if( !wanted ) {
+			pthread_cond_wait(&evictWakeup, &evictLock);
+			continue;
+		}
+		pthread_mutex_unlock(&evictLock);
+
+		pthread_mutex_lock(&gS3TreeLock);
+		evictRun(maxBytes / 100 * EVICT_LOW_PERCENT);
+		over = (treeBytes() > maxBytes);
+		pthread_mutex_unlock(&gS3TreeLock);
+
+		pthread_mutex_lock(&evictLock);
+		if( over ) {
+			/* what is left was used this second */
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_sec += 1;
+			while( !stopping && (pthread_cond_timedwait(&evictWakeup,
+					&evictLock, &until) != ETIMEDOUT) )
+				;
+		}
+		__atomic_store_n(&wanted, 0, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&evictLock);
+	return NULL;
+}
+
+int evictStart()
+{
+	/* at mount */
+	int		ret = 0;
+
+	if( maxBytes == 0 ) {
+		return 0;
+	}
+	pthread_mutex_lock(&evictLock);
+	stopping = 0;
+	ret = pthread_create(&evicter, NULL, evictThread, NULL);
+	if( ret != 0 ) {
+		log_msg("evictStart : pthread_create %d\n", ret);
+	} else {
+		running = 1;
+	}
+	pthread_mutex_unlock(&evictLock);
+	return -ret;
+}
+
+void evictStop()
+{
+	/* at unmount, the pass in progress is waited for */
+	pthread_mutex_lock(&evictLock);
+	stopping = 1;
+	pthread_cond_broadcast(&evictWakeup);
+	if( !running ) {
+		pthread_mutex_unlock(&evictLock);
+		return;
+	}
+	running = 0;
+	pthread_mutex_unlock(&evictLock);
+	pthread_join(evicter, NULL);
+}
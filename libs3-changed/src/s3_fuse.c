@@ -34,6 +34,19 @@
 #include "log.h"
 #include "s3_fuse_bridge.h"
 #include "s3_erasure_code.h"
+#include "s3_chunk_store.h"
+#include "s3_fuse_lowlevel.h"
+#include "s3_write_back.h"
+#include "s3_cache_fill.h"
+#include "s3_rename.h"
+#include "s3_delete.h"
+#include "s3_revalidate.h"
+#include "s3_negative_cache.h"
+#include "s3_snapshot.h"
+#include "s3_scan.h"
+#include "s3_path_cache.h"
+#include "s3_epoch.h"
+#include "s3_evict.h"
 
 // Report errors to logfile and give -errno to caller
 static int s3_fuse_error(char *str)
@@ -62,6 +75,143 @@ static void s3_fuse_fullpath(char fpath[PATH_MAX], const char *path)
 	    S3_FUSE_DATA->cache->location, path, fpath);
 }
 
+// Attributes of a tree node, as getattr and readdir report them.
+// Called with gS3TreeLock held, or in an epoch (s3_epoch.h).
+static void s3_fuse_node_stat(s3_tree_node *node, struct stat *statbuf)
+{
+    time_t time = NODE_LOAD(node->s3FileInfo.time);
+    int64_t size = NODE_LOAD(node->s3FileInfo.size);
+
+    statbuf->st_ino = NODE_LOAD(node->ino);
+    statbuf->st_atime = time;
+    statbuf->st_mtime = time;
+    statbuf->st_ctime = time;
+    if (size == -1) {
+	statbuf->st_mode = S_IFDIR | 0755;
+	statbuf->st_nlink = 2;
+    } else {
+	statbuf->st_mode = S_IFREG | 0755;
+	statbuf->st_nlink = 1;
+	statbuf->st_size = size;
+    }
+}
+
+// An open directory: the names and attributes of the entries read so
+// far, so that readdir can start at any offset.  Entries are added a
+// listing page at a time as readdir gets to the end of them.
+typedef struct s3_fuse_dir {
+    int count;
+    int capacity;
+    char **names;
+    struct stat *stats;
+    char *last;		// name of the last entry, for s3DirNextChildren
+} s3_fuse_dir;
+
+static void s3_fuse_dir_free(s3_fuse_dir *dir)
+{
+    int i;
+
+    for (i = 0; (dir->names != NULL) && (i < dir->count); i++) {
+	free(dir->names[i]);
+    }
+    free(dir->names);
+    free(dir->stats);
+    free(dir->last);
+    free(dir);
+}
+
+// Adds children, as s3DirNextChildren() hands them out, to the entries.
+// Called with gS3TreeLock held, or in an epoch (s3_epoch.h).
+static int s3_fuse_dir_add(s3_fuse_dir *dir, s3_tree_node **children, int n)
+{
+    int i;
+
+    if (dir->count + n > dir->capacity) {
+	char **names;
+	struct stat *stats;
+
+	dir->capacity = (dir->capacity == 0) ? 64 : dir->capacity;
+	while (dir->count + n > dir->capacity)
+	    dir->capacity *= 2;
+	names = realloc(dir->names, dir->capacity * sizeof(char *));
+	if (names != NULL)
+	    dir->names = names;
+	stats = realloc(dir->stats, dir->capacity * sizeof(struct stat));
+	if (stats != NULL)
+	    dir->stats = stats;
+	if ((names == NULL) || (stats == NULL))
+	    return -ENOMEM;
+    }
+    for (i = 0; i < n; i++) {
+	dir->names[dir->count] = strdup(NODE_LOAD(children[i]->s3FileInfo.name));
+	if (dir->names[dir->count] == NULL)
+	    return -ENOMEM;
+	memset(&(dir->stats[dir->count]), 0, sizeof(struct stat));
+	s3_fuse_node_stat(children[i], &(dir->stats[dir->count]));
+	dir->count++;
+    }
+    return 0;
+}
+
+// Adds the entries after the last one, listing the next page of the
+// directory if there are none yet; returns how many it added, 0 at
+// the end of the directory
+static int s3_fuse_dir_more(const char *path, s3_fuse_dir *dir)
+{
+    int retstat = 0;
+    s3_tree_node *node = NULL;
+    s3_tree_node **children = NULL;
+    int count = dir->count;
+    int n = 0;
+
+    // a directory listed to the end, without gS3TreeLock, see s3_epoch.h
+    if (epochEnter() == 0) {
+	node = searchForPathLockFree(path);
+	if ((node != NULL) && !revalidateDue(node)
+		&& (s3DirNextChildrenLockFree(node, &(dir->last),
+						&children, &n) == 0)) {
+	    retstat = s3_fuse_dir_add(dir, children, n);
+	    free(children);
+	    epochExit();
+	    return (retstat != 0) ? retstat : dir->count - count;
+	}
+	epochExit();
+    }
+
+    pthread_mutex_lock(&gS3TreeLock);
+    for (;;) {
+	retstat = searchForPath(path, S3_FUSE_DATA->dirTree, &node);
+	if ((retstat != 0) || (node == NULL))
+	    break;
+	revalidateCheck(node);
+	if (((node->isComplete & NODE_COMPLETE) == 0)
+				&& (node->listing == NULL)) {
+	    // not listed yet
+	    retstat = s3ListDirPage(&(S3_FUSE_DATA->dirTree), path);
+	    if (retstat != 0)
+		break;
+	    continue;
+	}
+
+	retstat = s3DirNextChildren(node, &(dir->last), &children, &n);
+	if (retstat != 0)
+	    break;
+	retstat = s3_fuse_dir_add(dir, children, n);
+	free(children);
+	children = NULL;
+	if ((retstat != 0) || (dir->count > count)
+			|| (node->isComplete & NODE_COMPLETE))
+	    break;
+
+	retstat = s3ListDirPage(&(S3_FUSE_DATA->dirTree), path);
+	if (retstat != 0)
+	    break;
+    }
+    pthread_mutex_unlock(&gS3TreeLock);
+
+    return (retstat != 0) ? retstat : dir->count - count;
+}
+
 ///////////////////////////////////////////////////////////
 //
 // Prototypes for all these functions, and the C-style comments,
@@ -82,27 +232,27 @@ int s3_fuse_getattr(const char *path, struct stat *statbuf)
     log_msg("\ns3_fuse_getattr(path=\"%s\", statbuf=0x%08x)\n",
 	  path, statbuf);
 
+	// a path the tree has, without gS3TreeLock, see s3_epoch.h
+	if (epochEnter() == 0) {
+		node = searchForPathLockFree(path);
+		if ((node != NULL) && !revalidateDue(node)) {
+			s3_fuse_node_stat(node, statbuf);
+			epochExit();
+			log_stat(statbuf);
+			return 0;
+		}
+		epochExit();
+	}
 
-	retstat = searchAndInsertPathInTree(path, &(S3_FUSE_DATA->dirTree), &node, 1 );
+	pthread_mutex_lock(&gS3TreeLock);
+	retstat = searchAndInsertPathInTree(path, &(S3_FUSE_DATA->dirTree), &node, 0 );
     
 	if( (retstat == 0 ) && (node != NULL)) {
-		if( node->s3FileInfo->size == -1 ) {
-			statbuf->st_mode = S_IFDIR | 0755 ;
-			statbuf->st_nlink = 2;
-			statbuf->st_atime = node->s3FileInfo->time;	
-			statbuf->st_mtime = node->s3FileInfo->time;	
-			statbuf->st_ctime = node->s3FileInfo->time;	
-		} else {
-			statbuf->st_mode = S_IFREG | 0755 ;
-			statbuf->st_nlink = 1;
-			statbuf->st_atime = node->s3FileInfo->time;	
-			statbuf->st_mtime = node->s3FileInfo->time;	
-			statbuf->st_ctime = node->s3FileInfo->time;	
-			statbuf->st_size = node->s3FileInfo->size;	
-
-		}
+		s3_fuse_node_stat(node, statbuf);
+	pthread_mutex_unlock(&gS3TreeLock);
     log_stat(statbuf);
 	} else {
+	pthread_mutex_unlock(&gS3TreeLock);
 
     		s3_fuse_fullpath(fpath, path);
     
@@ -287,21 +437,19 @@ int s3_fuse_symlink(const char *path, const char *link)
 #endif
 
 /** Rename a file */
-// both path and newpath are fs-relative
+// both path and newpath are fs-relative; the keys are copied in S3
+// and the cached copy moved along, see s3_rename.h
 int s3_fuse_rename(const char *path, const char *newpath)
 {
     int retstat = 0;
-    char fpath[PATH_MAX];
-    char fnewpath[PATH_MAX];
     
     log_msg("\ns3_fuse_rename(fpath=\"%s\", newpath=\"%s\")\n",
 	    path, newpath);
-    s3_fuse_fullpath(fpath, path);
-    s3_fuse_fullpath(fnewpath, newpath);
     
-    retstat = rename(fpath, fnewpath);
-    if (retstat < 0)
-	retstat = s3_fuse_error("s3_fuse_rename rename");
+	retstat = renamePath(path, newpath);
+	if( retstat != 0 ) {
+		log_msg("s3_fuse_rename : renamePath error %d\n", retstat);
+	}
     
     return retstat;
 }
@@ -368,6 +516,10 @@ int s3_fuse_truncate(const char *path, off_t newsize)
     log_msg("\ns3_fuse_truncate(path=\"%s\", newsize=%lld)\n",
 	    path, newsize);
     s3_fuse_fullpath(fpath, path);
+
+    retstat = fillWait(path, 0, FILL_TO_END);
+    if (retstat != 0)
+	return retstat;
     
     retstat = truncate(fpath, newsize);
     if (retstat < 0)
@@ -409,23 +561,16 @@ int s3_fuse_open(const char *path, struct fuse_file_info *fi)
     int retstat = 0;
     int fd;
     char fpath[PATH_MAX];
-	int	inCache = 0;
+	int	keepCache = 0;
     
     log_msg("\ns3_fuse_open(path\"%s\", fi=0x%08x)\n",
 	    path, fi);
 
-	retstat = s3CacheInCache(S3_FUSE_DATA->cache, path, &inCache);
+	retstat = s3CacheOpen(S3_FUSE_DATA->cache, path, fi->flags, &keepCache);
 	if(retstat != 0 ) {
-		log_msg("InCache error\n");
+		log_msg("Fetch error\n");
 		return retstat;
 	}
-	if( inCache == 0 ) {
-		retstat = s3CacheFetch(S3_FUSE_DATA->cache, path);
-		if(retstat != 0 ) {
-			log_msg("Fetch error\n");
-			return retstat;
-		}
-	}
 
     s3_fuse_fullpath(fpath, path);
     
@@ -434,6 +579,8 @@ int s3_fuse_open(const char *path, struct fuse_file_info *fi)
 	retstat = s3_fuse_error("s3_fuse_open open");
     
     fi->fh = fd;
+	/* the copy is the one the kernel read its pages from */
+	fi->keep_cache = keepCache;
     log_fi(fi);
     
     return retstat;
@@ -463,6 +610,11 @@ int s3_fuse_read(const char *path, char *buf, size_t size, off_t offset, struct
 	    path, buf, size, offset, fi);
     // no need to get fpath on this one, since I work from fi->fh not the path
     log_fi(fi);
+
+    // the copy may still be being filled
+    retstat = fillWait(path, offset, size);
+    if (retstat != 0)
+	return retstat;
     
     retstat = pread(fi->fh, buf, size, offset);
     if (retstat < 0)
@@ -496,7 +648,7 @@ int s3_fuse_write(const char *path, const char *buf, size_t size, off_t offset,
     if (retstat < 0) {
 	retstat = s3_fuse_error("s3_fuse_write pwrite");
 	} else {
-		s3CacheMarkForFlush(S3_FUSE_DATA->cache, path);
+		s3CacheMarkForFlush(S3_FUSE_DATA->cache, path, offset, retstat);
 
 	}    
 
@@ -504,6 +656,87 @@ int s3_fuse_write(const char *path, const char *buf, size_t size, off_t offset,
     return retstat;
 }
 
+/** Store data from an open file in a buffer
+ *
+ * Similar to the read() method, but data is stored and returned in a
+ * generic buffer.
+ *
+ * No actual copying of data has to take place, the source file
+ * descriptor may simply be stored in the buffer for later data
+ * transfer.
+ *
+ * The buffer must be allocated dynamically and stored at the
+ * location pointed to by bufp.  If the buffer contains memory
+ * regions, they too must be allocated using malloc().  The allocated
+ * memory will be freed by the caller.
+ *
+ * Introduced in version 2.9
+ */
+// The data is in the cache file already, so hand libfuse its fd and
+// let it splice the pages to /dev/fuse instead of copying them
+// through a buffer of ours.
+int s3_fuse_read_buf(const char *path, struct fuse_bufvec **bufp,
+		     size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    struct fuse_bufvec *src;
+    int retstat = 0;
+    
+    log_msg("\ns3_fuse_read_buf(path=\"%s\", bufp=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
+	    path, bufp, size, offset, fi);
+    log_fi(fi);
+
+    retstat = fillWait(path, offset, size);
+    if (retstat != 0)
+	return retstat;
+
+    src = malloc(sizeof(struct fuse_bufvec));
+    if (src == NULL)
+	return -ENOMEM;
+
+    *src = FUSE_BUFVEC_INIT(size);
+    src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    src->buf[0].fd = fi->fh;
+    src->buf[0].pos = offset;
+    *bufp = src;
+    
+    return 0;
+}
+
+/** Write contents of buffer to an open file
+ *
+ * Similar to the write() method, but data is supplied in a
+ * generic buffer.  Use fuse_buf_copy() to transfer data to
+ * the destination.
+ *
+ * Introduced in version 2.9
+ */
+int s3_fuse_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+		      struct fuse_file_info *fi)
+{
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+    int retstat = 0;
+    
+    log_msg("\ns3_fuse_write_buf(path=\"%s\", buf=0x%08x, offset=%lld, fi=0x%08x)\n",
+	    path, buf, offset, fi);
+    log_fi(fi);
+
+    dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    dst.buf[0].fd = fi->fh;
+    dst.buf[0].pos = offset;
+
+    // with a spliced request libfuse moves the pages from /dev/fuse
+    // into the cache file without them passing through user space
+    retstat = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+    if (retstat < 0) {
+	log_msg("    ERROR s3_fuse_write_buf fuse_buf_copy: %s\n",
+		strerror(-retstat));
+    } else {
+	s3CacheMarkForFlush(S3_FUSE_DATA->cache, path, offset, retstat);
+    }
+
+    return retstat;
+}
+
 /** Get file system statistics
  *
  * The 'f_frsize', 'f_favail', 'f_fsid' and 'f_flag' fields are ignored
@@ -561,7 +794,10 @@ int s3_fuse_flush(const char *path, struct fuse_file_info *fi)
     // no need to get fpath on this one, since I work from fi->fh not the path
     log_fi(fi);
 	
-	s3CacheFlushCache(S3_FUSE_DATA->cache, path);
+	if (gWriteBackFlag)
+		writeBackClose(S3_FUSE_DATA->cache, path);
+	else
+		s3CacheFlushCache(S3_FUSE_DATA->cache, path);
     return retstat;
 }
 
@@ -615,7 +851,10 @@ int s3_fuse_fsync(const char *path, int datasync, struct fuse_file_info *fi)
 	retstat = fsync(fi->fh);
     
     if (retstat < 0)
-	s3_fuse_error("s3_fuse_fsync fsync");
+	retstat = s3_fuse_error("s3_fuse_fsync fsync");
+    else
+	// with write-back this is where a file is known to be in S3
+	retstat = s3CacheFlushCache(S3_FUSE_DATA->cache, (char *) path);
     
     return retstat;
 }
@@ -705,23 +944,47 @@ int s3_fuse_removexattr(const char *path, const char *name)
  */
 int s3_fuse_opendir(const char *path, struct fuse_file_info *fi)
 {
-    DIR *dp;
     int retstat = 0;
-    char fpath[PATH_MAX];
+    s3_fuse_dir *dir;
+    s3_tree_node *node = NULL;
     
     log_msg("\ns3_fuse_opendir(path=\"%s\", fi=0x%08x)\n",
 	  path, fi);
-    s3_fuse_fullpath(fpath, path);
-    
-    dp = opendir(fpath);
-    if (dp == NULL)
-	retstat = s3_fuse_error("s3_fuse_opendir opendir");
+
+    // a path the tree has, without gS3TreeLock, see s3_epoch.h
+    if (epochEnter() == 0) {
+	node = searchForPathLockFree(path);
+	if ((node != NULL) && revalidateDue(node))
+	    node = NULL;
+	epochExit();
+    }
+    if (node == NULL) {
+	pthread_mutex_lock(&gS3TreeLock);
+	retstat = searchAndInsertPathInTree(path, &(S3_FUSE_DATA->dirTree),
+								&node, 0);
+	pthread_mutex_unlock(&gS3TreeLock);
+    }
+    if ((retstat == 0) && (node == NULL))
+	retstat = -ENOENT;
+    if (retstat != 0)
+	return retstat;
+
+    dir = calloc(1, sizeof(s3_fuse_dir));
+    if (dir == NULL)
+	return -ENOMEM;
+
+    // the first page only, readdir lists the rest as it gets there
+    retstat = s3_fuse_dir_more(path, dir);
+    if (retstat < 0) {
+	s3_fuse_dir_free(dir);
+	return retstat;
+    }
     
-    fi->fh = (intptr_t) dp;
+    fi->fh = (uintptr_t) dir;
     
     log_fi(fi);
     
-    return retstat;
+    return 0;
 }
 
 /** Read directory
@@ -745,32 +1008,28 @@ int s3_fuse_opendir(const char *path, struct fuse_file_info *fi)
  *
  * Introduced in version 2.3
  */
+// Mode 2: the offset of an entry is its index in the open directory
+// plus one
 int s3_fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
 	       struct fuse_file_info *fi)
 {
     int retstat = 0;
-	s3_tree_node	*node=NULL;
-	s3_tree_node 	*child=NULL;
-	char			*childName = NULL;
+    s3_fuse_dir *dir = (s3_fuse_dir *) (uintptr_t) fi->fh;
+    int i;
     
     log_msg("\ns3_fuse_readdir(path=\"%s\", buf=0x%08x, filler=0x%08x, offset=%lld, fi=0x%08x)\n",
 	    path, buf, filler, offset, fi);
 
-	retstat = searchAndInsertPathInTree(path, &(S3_FUSE_DATA->dirTree), &node, 1 );
-
-	if((retstat == 0 ) && (node != NULL)) {
-	child = node->children;
-	
-    while(child != NULL) {
-	childName = child->s3FileInfo->name;
-	log_msg("calling filler with name %s\n", childName);
-	if (filler(buf, childName, NULL, 0) != 0) {
-	    log_msg("    ERROR s3_fuse_readdir filler:  buffer full");
-	    return -ENOMEM;
+    for (i = offset; ; i++) {
+	if (i >= dir->count) {
+	    retstat = s3_fuse_dir_more(path, dir);
+	    if (retstat <= 0)
+		break;
+	    retstat = 0;
 	}
-	child = child->next;
+	if (filler(buf, dir->names[i], &(dir->stats[i]), i + 1) != 0)
+	    break;
     }
-  	} 
     log_fi(fi);
     
     return retstat;
@@ -859,8 +1118,8 @@ int s3_fuse_releasedir(const char *path, struct fuse_file_info *fi)
     log_msg("\ns3_fuse_releasedir(path=\"%s\", fi=0x%08x)\n",
 	    path, fi);
     log_fi(fi);
-    
-    closedir((DIR *) (uintptr_t) fi->fh);
+
+    s3_fuse_dir_free((s3_fuse_dir *) (uintptr_t) fi->fh);
     
     return retstat;
 }
@@ -905,6 +1164,12 @@ int s3_fuse_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
 void *s3_fuse_init(struct fuse_conn_info *conn)
 {
     log_msg("\ns3_fuse_init()\n");
+
+    // the workers have to start here, after fuse_main() daemonized
+    writeBackStart(S3_FUSE_DATA->cache);
+    snapshotStart(S3_FUSE_DATA->cache);
+    evictStart();
+    epochStart();
     
     return S3_FUSE_DATA;
 }
@@ -919,6 +1184,14 @@ void *s3_fuse_init(struct fuse_conn_info *conn)
 void s3_fuse_destroy(void *userdata)
 {
     log_msg("\ns3_fuse_destroy(userdata=0x%08x)\n", userdata);
+
+    // upload whatever is still dirty before the unmount completes
+    revalidateStop();
+    evictStop();
+    epochStop();
+    fillStop();
+    writeBackStop(((struct s3_fuse_state *) userdata)->cache);
+    snapshotStop();
 }
 
 /**
@@ -977,9 +1250,15 @@ int s3_fuse_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 	mkpath(fpath);
 	*tmp = '/';
     fd = creat(fpath, mode);
-    if (fd < 0)
+    if (fd < 0) {
 	retstat = s3_fuse_error("s3_fuse_create creat");
-    
+    } else {
+	// not missing any more, before its upload puts it in the tree
+	pthread_mutex_lock(&gS3TreeLock);
+	negativeForget(path);
+	pthread_mutex_unlock(&gS3TreeLock);
+    }
+
     fi->fh = fd;
     
     log_fi(fi);
@@ -1049,19 +1328,27 @@ int s3_fuse_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_in
 struct fuse_operations s3_fuse_oper = {
 
   .getattr = s3_fuse_getattr,
+  .opendir = s3_fuse_opendir,
   .readdir = s3_fuse_readdir,
+  .releasedir = s3_fuse_releasedir,
   .init = s3_fuse_init,
   .open = s3_fuse_open,
   .read = s3_fuse_read,
+  .read_buf = s3_fuse_read_buf,
   .create = s3_fuse_create,
   .write = s3_fuse_write,
+  .write_buf = s3_fuse_write_buf,
   .flush = s3_fuse_flush,
+  .release = s3_fuse_release,
+  .fsync = s3_fuse_fsync,
+  .destroy = s3_fuse_destroy,
   .chmod = s3_fuse_chmod,
   .chown = s3_fuse_chown,
   .utime = s3_fuse_utime,
   .truncate = s3_fuse_truncate,
   .unlink = s3_fuse_unlink,
   .rmdir = s3_fuse_rmdir,
+  .rename = s3_fuse_rename,
   .mkdir = s3_fuse_mkdir
 
 };
@@ -1110,16 +1397,21 @@ struct fuse_operations s3_fuse_oper = {
 
 void s3_fuse_usage()
 {
-    fprintf(stderr, "usage:  s3_fuse_fs rootDir mountPoint\n");
+    fprintf(stderr, "usage:  s3_fuse_fs [--lowlevel] "
+	    "[-o attr_timeout=T,entry_timeout=T] rootDir mountPoint\n");
     abort();
 }
 
+/* tests3fuse.c drives the handlers itself and is built with S3_FUSE_NO_MAIN */
+#ifndef S3_FUSE_NO_MAIN
 int main(int argc, char *argv[])
 {
     int i, ret;
     int fuse_stat;
     struct s3_fuse_state *s3_fuse_data;
 	char	*cacheLocation;
+	int	lowlevel = 0;
+	struct fuse_args args;
 
     // s3_fuse_fs doesn't do any access checking on its own (the comment
     // blocks in fuse.h mention some of the functions that need
@@ -1143,6 +1435,15 @@ int main(int argc, char *argv[])
     
     s3_fuse_data->logfile = log_open();
     
+    // --lowlevel selects the inode based frontend in s3_fuse_lowlevel.c;
+    // take it out before libfuse sees the options
+    if ((argc > 1) && (strcmp(argv[1], "--lowlevel") == 0)) {
+	lowlevel = 1;
+	for (i = 1; i < argc - 1; i++)
+	    argv[i] = argv[i+1];
+	argc--;
+    }
+
     // libfuse is able to do most of the command line parsing; all I
     // need to do is to extract the cache; this will be the first
     // non-option passed in.  I'm using the GNU non-standard extension
@@ -1183,9 +1484,84 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	ret = saveChunkStorePolicy();
+	if( ret != 0 ) {
+		return 1;
+	}
+
+	ret = saveWriteBackPolicy();
+	if( ret != 0 ) {
+		return 1;
+	}
+
+	ret = saveListPolicy();
+	if( ret != 0 ) {
+		return 1;
+	}
+
+	ret = saveFillPolicy();
+	if( ret != 0 ) {
+		return 1;
+	}
+
+	ret = saveRenamePolicy();
+	if( ret != 0 ) {
+		return 1;
+	}
+
+	ret = saveRevalidatePolicy();
+	if( ret != 0 ) {
+		return 1;
+	}
+
+	ret = saveNegativePolicy();
+	if( ret != 0 ) {
+		return 1;
+	}
+
+	ret = saveSnapshotPolicy();
+	if( ret != 0 ) {
+		return 1;
+	}
+
+	ret = saveScanPolicy();
+	if( ret != 0 ) {
+		return 1;
+	}
+
+	ret = savePathCachePolicy();
+	if( ret != 0 ) {
+		return 1;
+	}
+
+	ret = saveEvictPolicy();
+	if( ret != 0 ) {
+		return 1;
+	}
+
+	ret = saveDeletePolicy();
+	if( ret != 0 ) {
+		return 1;
+	}
+
+    if (lowlevel) {
+	fprintf(stderr, "about to call s3_fuse_lowlevel_main\n");
+	fuse_stat = s3_fuse_lowlevel_main(argc, argv, s3_fuse_data);
+	fprintf(stderr, "s3_fuse_lowlevel_main returned %d\n", fuse_stat);
+	return fuse_stat;
+    }
+
+    // ours go first, so that -o options on the command line win
+    args = (struct fuse_args) FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_insert_arg(&args, 1, S3_FUSE_IO_OPTIONS) != 0) {
+	return 1;
+    }
+
     fprintf(stderr, "about to call fuse_main\n");
-    fuse_stat = fuse_main(argc, argv, &s3_fuse_oper, s3_fuse_data);
+    fuse_stat = fuse_main(args.argc, args.argv, &s3_fuse_oper, s3_fuse_data);
+    fuse_opt_free_args(&args);
     fprintf(stderr, "fuse_main returned %d\n", fuse_stat);
     
     return fuse_stat;
 }
+#endif /* S3_FUSE_NO_MAIN */
@@ -9,8 +9,24 @@
 #include <time.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include "s3_fuse_bridge.h"
 #include "s3_erasure_code.h"
+#include "s3_chunk_store.h"
+#include "s3_write_back.h"
+#include "s3_cache_fill.h"
+#include "s3_child_index.h"
+#include "s3_tree_arena.h"
+#include "s3_key_list.h"
+#include "s3_revalidate.h"
+#include "s3_negative_cache.h"
+#include "s3_snapshot.h"
+#include "s3_scan.h"
+#include "s3_path_cache.h"
+#include "s3_epoch.h"
+#include "s3_evict.h"
+#include "s3_delete.h"
 #include "log.h"
 #include "util.h"
 
@@ -18,7 +34,65 @@ s3_tree_node		*gS3DirectoryTree = NULL;
 s3_cache		*gS3Cache = NULL;
 char			gExecuteDir[1024];
 int			gEncodeFlag = 1;
+s3_invalidate_fn	gS3Invalidate = NULL;
 s3_versioning_info		*gVersioningInfoList[50];
+pthread_mutex_t		gS3TreeLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* protects gVersioningInfoList */
+static pthread_mutex_t	versioningInfoLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* unique suffix for s3CacheTempPath() */
+static pthread_mutex_t	tempSequenceLock = PTHREAD_MUTEX_INITIALIZER;
+static int		tempSequence = 0;
+
+/* inode table, see s3_fuse_bridge.h; slot 0 is never used */
+static s3_inode_slot	**inodeChunks = NULL;
+static uint64_t		inodeChunkCount = 0;
+static uint64_t		inodeChunkSize = 0;	/* of inodeChunks */
+static uint64_t		inodeNextUnused = 1;
+static uint64_t		inodeFreeList = 0;
+
+/* keys per page of a directory listing, see s3_fuse_bridge.h */
+static int		listPageKeys = S3_LIST_PAGE_KEYS;
+
+/* a common prefix of a listing page: a directory, or the objects of
+   an encoded or chunked file */
+typedef struct s3_list_prefix {
+	char		*path;
+	int		count;		/* 0 for a directory */
+	s3_file_info	*list;
+	time_t		time;
+} s3_list_prefix;
+
+/* one page of a one-level listing */
+typedef struct s3_dir_page {
+	int		count;		/* objects right under the directory */
+	s3_file_info	*list;
+	int		prefixCount;
+	s3_list_prefix	*prefixes;
+	char		*nextMarker;	/* NULL on the last page */
+} s3_dir_page;
+
+/* where insertS3NodesInTree() put the key before: its names, in key,
+   and their nodes, nodes[0] is the listed path; of key and names the
+   cur one is the key before's, the other one the next key's */
+typedef struct s3_insert_cursor {
+	char		key[2][S3_MAX_KEY_SIZE + 1];
+	char		*names[2][S3_MAX_KEY_SIZE / 2 + 1];
+	s3_tree_node	*nodes[S3_MAX_KEY_SIZE / 2 + 2];
+	int		depth;
+	int		cur;
+} s3_insert_cursor;
+
+static int getS3NameForNode(const char *path, s3_tree_node *node, 
+							char **pS3Name);
+static int s3CacheFlushPath(s3_cache *cache, char *path);
+static void setNodeETag(s3_tree_node *node, char *eTag);
+static void s3Invalidate(s3_tree_node *node, int what);
+static int probePlainObject(s3_tree_node **tree, const char *path);
+static int knownMissing(const char *path, s3_tree_node *tree);
+static int appendChild(s3_tree_node *dir, s3_tree_node *last, char *name,
+						s3_tree_node **pChild);
 
 int	searchAndInsertPathInTree(const char *path, s3_tree_node **tree, 
 									s3_tree_node **pathNode, int completeList )
@@ -29,6 +103,8 @@ int	searchAndInsertPathInTree(const char *path, s3_tree_node **tree,
 	- search for path, if found and complete : return pathNode
 	- if not found or not complete : get Path from S3 and add to tree
 	- search for path, this time it should be found & complete : return pathNode
+	- called with gS3TreeLock held, the lock is dropped while listing
+	  from S3 so *pathNode is always the result of a fresh search
 	*/
 
 	int			ret = 0;
@@ -40,14 +116,27 @@ int	searchAndInsertPathInTree(const char *path, s3_tree_node **tree,
 		if(ret != 0 ) {
 			goto ret;
 		}
-		gS3DirectoryTree = *tree;
+		NODE_STORE(gS3DirectoryTree, *tree);
+		pthread_mutex_lock(&versioningInfoLock);
 		gVersioningInfoList[0] = NULL;
+		pthread_mutex_unlock(&versioningInfoLock);
 	} 	
 	
 	ret = searchForPath(path, *tree, pathNode);
 	if(ret != 0 ) {
 		goto ret;
 	}
+	if( (*pathNode == NULL) && snapshotLoadPath(*tree, path) ) {
+		ret = searchForPath(path, *tree, pathNode);
+		if( ret != 0 ) {
+			goto ret;
+		}
+	}
+	if( (*pathNode == NULL) && knownMissing(path, *tree) ) {
+		log_msg("searchAndInsertPathInTree : %s is known missing\n",
+								path);
+		goto ret;
+	}
 
 	if( (*pathNode == NULL) 
 		|| (completeList 
@@ -56,7 +145,7 @@ int	searchAndInsertPathInTree(const char *path, s3_tree_node **tree,
 		if(*pathNode != NULL) {
 			log_msg( "searchAndInsertPathInTree : pathNode not NULL,\n");
 			log_msg( "name = %s isComplete = %d\n",
-						(*pathNode)->s3FileInfo->name,
+						(*pathNode)->s3FileInfo.name,
 						(*pathNode)->isComplete);
 		} else {	
 			log_msg( "searchAndInsertPathInTree : pathNode NULL\n");
@@ -70,24 +159,25 @@ int	searchAndInsertPathInTree(const char *path, s3_tree_node **tree,
 		}
 		log_msg("searchAndInsertPathInTree path after S3 : %s\n",
 								path);
-		if((*pathNode) != NULL) {
-			log_msg( "before search name = %s isComplete = %d\n",
-						(*pathNode)->s3FileInfo->name,
-						(*pathNode)->isComplete);
+		/* the tree was unlocked while listing, the old pathNode
+		   may have been deleted by another thread */
+		ret = searchForPath(path, *tree, pathNode);
+		if( ret != 0 ) {
+			goto ret;
 		}
-		if( count != 0 ) {
-			ret = searchForPath(path, *tree, pathNode);
-			if(ret != 0 ) {
-				goto ret;
-			}
-			if((*pathNode) != NULL) {
-			log_msg( "after search name = %s isComplete = %d\n",
-						(*pathNode)->s3FileInfo->name,
-						(*pathNode)->isComplete);
-			}
+		if( (*pathNode) != NULL ) {
+		log_msg( "after search name = %s isComplete = %d\n",
+					(*pathNode)->s3FileInfo.name,
+					(*pathNode)->isComplete);
+		} else {
+			negativeAdd(path);
 		}
 	}
 
+	if( *pathNode != NULL ) {
+		revalidateCheck(*pathNode);
+	}
+
 /*
 	if( ((*pathNode) != NULL) 
 		&& (((*pathNode)->isComplete & VERSION_COMPLETE) == 0 ) 
@@ -113,21 +203,69 @@ int populateNodes(s3_tree_node **tree, const char * path,
 	int			count=0;
 	s3_file_info		*s3FileInfoList=NULL;
 	int			ret = 0; 
+	int			metaCount = 0;
+	char			**metaPaths = NULL;
+	int			i = 0;
 
+	/* called with gS3TreeLock held, don't hold it across the listing */
 	log_msg( "populateNodes\n");
+	if( initialize == 0 ) {
+		/* one level of path, every page of it */
+		s3_tree_node	*node = NULL;
+
+		do {
+			ret = s3ListDirPage(tree, path);
+			if( ret == 0 ) {
+				ret = searchForPath(path, *tree, &node);
+			}
+		} while( (ret == 0) && (node != NULL)
+			&& ((node->isComplete & NODE_COMPLETE) == 0) );
+		if( (ret == 0) && (node == NULL) ) {
+			ret = probePlainObject(tree, path);
+			if( ret == 0 ) {
+				ret = searchForPath(path, *tree, &node);
+			}
+		}
+		*pCount = (node != NULL) ? 1 : 0;
+		return ret;
+	}
+
+	pthread_mutex_unlock(&gS3TreeLock);
 	ret = getPathFromS3(path, &count, &s3FileInfoList, initialize);
+	pthread_mutex_lock(&gS3TreeLock);
 	if( ret != 0 ) {
 		goto ret;
 	}
 	log_msg(" count = %d\n", count);
-	if(count > 0 ) {
-		ret = insertS3NodesInTree(tree, path, count, s3FileInfoList);
+
+	if( (initialize == 1) && (*tree != NULL) ) {
+		/* another thread built the tree while we were listing */
+		for( i=0; i < count; i++ ) {
+			free(s3FileInfoList[i].name);
+		}
+		goto ret;
+	}
+
+	/* an account without buckets still needs the / node */
+	if( (count > 0) || (initialize == 1) ) {
+		ret = insertS3NodesInTree(tree, path, count, s3FileInfoList,
+						&metaCount, &metaPaths);
 		if(ret != 0 ) {
 			goto ret;
 		}
 	}
+
+	if( metaCount > 0 ) {
+		ret = fixEncodedFileSizes(metaCount, metaPaths);
+	}
 ret : 
 	*pCount = count;
+	for( i=0; i < metaCount; i++ ) {
+		free(metaPaths[i]);
+	}
+	if( metaPaths != NULL ) {
+		free(metaPaths);
+	}
 	if(s3FileInfoList != NULL ) {
 		free(s3FileInfoList);
 		s3FileInfoList = NULL;
@@ -137,6 +275,40 @@ ret :
 }
 
 
+/*
+ * path is not in the tree: 1 if S3 doesn't have it either as far as we
+ * know, see s3_negative_cache.h.  Called with gS3TreeLock held.
+ */
+static int knownMissing(const char *path, s3_tree_node *tree)
+{
+	s3_tree_node		*dir = tree;
+	s3_tree_node		*child = NULL;
+	char			*tmpPath = NULL;
+	char			*tmp = NULL;
+
+	tmpPath = strdup(path);
+	if( tmpPath == NULL ) {
+		return 0;
+	}
+	for( tmp = strtok(tmpPath, "/"); tmp != NULL; tmp = strtok(NULL, "/") ) {
+		searchNode(dir, tmp, 0, &child);
+		if( child == NULL ) {
+			break;
+		}
+		dir = child;
+	}
+	free(tmpPath);
+
+	/* the directory the path leaves the tree in was listed to the
+	   end; a plain object can be a directory as well */
+	if( (dir != NULL) && !dir->isFileNode && (dir->listing != NULL)
+			&& (dir->isComplete & NODE_COMPLETE) ) {
+		revalidateCheck(dir);
+		return 1;
+	}
+	return negativeFind(path);
+}
+
 int searchForPath(const char *path, s3_tree_node *tree, s3_tree_node **pathNode)
 {
 	s3_tree_node		*newTree = NULL;
@@ -147,7 +319,19 @@ int searchForPath(const char *path, s3_tree_node *tree, s3_tree_node **pathNode)
 
 	log_msg("searchForPath\n");
 
+	/* the same few paths over and over, see s3_path_cache.h */
+	newTree = pathCacheFind(tree, path);
+	if( newTree != NULL ) {
+		evictTouch(newTree);
+		*pathNode = newTree;
+		return 0;
+	}
+
 	tmpPath = strdup(path);
+	if( tmpPath == NULL ) {
+		*pathNode = NULL;
+		return -ENOMEM;
+	}
 	tmp = strtok(tmpPath,"/");
 	newTree = tree;
 	
@@ -159,6 +343,7 @@ int searchForPath(const char *path, s3_tree_node *tree, s3_tree_node **pathNode)
 			return ret ;
 		}
 		if(foundNode == NULL) {
+			free (tmpPath);
 			*pathNode = NULL;
 			return 0;
 		}
@@ -167,16 +352,63 @@ int searchForPath(const char *path, s3_tree_node *tree, s3_tree_node **pathNode)
 	}
 	
 	*pathNode = newTree;
+	if( newTree != tree ) {
+		pathCacheAdd(tree, path, newTree);
+	}
+	evictTouch(newTree);
 
 	free(tmpPath);
 	return 0;
 
 }
 
+s3_tree_node *searchForPathLockFree(const char *path)
+{
+	/*
+	 - searchForPath() from gS3DirectoryTree without gS3TreeLock,
+	   between epochEnter() and epochExit(), see s3_epoch.h
+	 - NULL if a name is not found; the caller takes the lock and
+	   searches again, the tree may be changing under it
+	*/
+	s3_tree_node		*tree = NULL;
+	s3_tree_node		*node = NULL;
+	char			name[S3_MAX_KEY_SIZE + 1];
+	const char		*end = NULL;
+	size_t			len = 0;
+
+	tree = NODE_LOAD(gS3DirectoryTree);
+	/* the same few paths over and over, see s3_path_cache.h */
+	node = pathCacheFindLockFree(tree, path);
+	if( node != NULL ) {
+		evictTouch(node);
+		return node;
+	}
+
+	node = tree;
+	while( node != NULL ) {
+		while( *path == '/' )
+			path++;
+		if( *path == 0 )
+			break;
+		end = strchr(path, '/');
+		len = (end != NULL) ? (size_t) (end - path) : strlen(path);
+		if( len > S3_MAX_KEY_SIZE )
+			return NULL;
+		memcpy(name, path, len);
+		name[len] = 0;
+		node = childFindLockFree(node, name);
+		path += len;
+	}
+	evictTouch(node);
+	return node;
+}
+
 int getPathFromS3(const char *path, int *pCount, s3_file_info **pS3FileInfoList,
 													int initialize)
 {
 
+	int		s3Status = 0;
+
 	log_msg("getPathFromS3\n");
 
 		if( initialize == 1 ) {
@@ -217,201 +449,1264 @@ int getPathFromS3(const char *path, int *pCount, s3_file_info **pS3FileInfoList,
 			log_msg("bucket = %s\n", bucket);
 			if( prefix != NULL)
 			log_msg("bucket = %s, prefix = %s\n", bucket, prefix);
-			list_bucket(bucket, prefix, NULL, NULL, 10000, 0, 
+			/* every key under the path, all pages */
+			s3Status = list_bucket(bucket, prefix, NULL, NULL, 0, 0, 
 										pCount, pS3FileInfoList ) ;
 			free(bucket);
 			free(prefix);
 			free(tmpPath);
+			if( s3Status != 0 ) {
+				logS3Errors(s3Status);
+				return -EIO;
+			}
 		}
 
 	return 0;
 }
 
-int insertS3NodesInTree(s3_tree_node **tree, const char *path, int count, 
-											s3_file_info *s3FileInfoList)
+/* /bucket/dir -> "bucket" and "dir/", /bucket -> "bucket" and NULL */
+static int getBucketAndPrefix(const char *path, char **pBucket, 
+							char **pPrefix)
 {
-	log_msg("insertS3NodesInTree\n");
-	/*
- 	- if Tree == NULL, insert a node with /
-	- for each s3_file_info, for each token search the tree
-	- if TREE == NULL, s3FileInfoList will be bucket list, token parsing of
-		s3_file-info not required
-	- if found, search for next token in found treeNode
-	- continue till not found, add the node  
- 
-  	*/
-
-	s3_tree_node		*child=NULL;
-	int			ret = 0 ;
-	s3_file_info 		*tmpS3FileInfo = NULL;
-	int			i = 0 ;
+	char		*tmp = NULL;
 
-	if( *tree == NULL ) {
-		ret = allocateTreeNode(tree); 		
-		if( ret != 0 ) {
-			return ret;
+	*pPrefix = NULL;
+	*pBucket = strdup(path+1);
+	if( *pBucket == NULL ) {
+		return -ENOMEM;
+	}
+	tmp = strchr(*pBucket, '/');
+	if( tmp != NULL ) {
+		*tmp = 0;
+		*pPrefix = malloc(strlen(tmp+1) + 2);
+		if( *pPrefix == NULL ) {
+			free(*pBucket);
+			*pBucket = NULL;
+			return -ENOMEM;
 		}
-		(*tree)->s3FileInfo->name= strdup("/");
-		/* After a listing all buckets, children list of / is complete */
-		(*tree)->isComplete |= NODE_COMPLETE;
-		(*tree)->isComplete |= VERSION_COMPLETE;
-		(*tree)->parent = NULL;
-
-		for(i=0; i< count; i++) {
-			ret = allocateTreeNode(&child);
-			if(ret != 0 ) {
-				return ret;
-			}
-		
-			child->parent = (*tree);
-			tmpS3FileInfo = ((s3_file_info *)&(s3FileInfoList[i]));
-			child->s3FileInfo->name = (*tmpS3FileInfo).name; 
-			child->s3FileInfo->time = (*tmpS3FileInfo).time; 
-			child->s3FileInfo->size = (*tmpS3FileInfo).size; 
+		sprintf(*pPrefix, "%s/", tmp+1);
+	}
+	return 0;
+}
 
-			child->next = (*tree)->children ;
-			(*tree)->children = child; 
-		}
+static int isMetaKey(const char *key)
+{
+	int	len = strlen(key);
+	int	metaSuffixLen = strlen("_meta.txt");
 
-	} else {
+	return (len >= metaSuffixLen)
+		&& (strcmp(key + len - metaSuffixLen, "_meta.txt") == 0);
+}
 
-		/* 
-		- s3FileInfoList->name contains full path of the object
-		- for each token nodes need to be created and added to the tree
-		- Node which matches the path needs to be marked complete
-		- since all entries begin with path, let's add path first
-		  and use the node to add rest of the tokens(children)
-		-  
+static void freeFileInfoList(int count, s3_file_info *list)
+{
+	int	i;
 
-  		*/
-		
-		s3_tree_node		*newTree = NULL;
-		char			*tmp = NULL, *tmp1 = NULL;
-		s3_tree_node		*foundNode = NULL;
-		s3_tree_node		*pathNode = NULL;
-		char			*tmpName = NULL;
-		char			*tmpPath = NULL;
-		char			*pathPrefix = NULL;
-		int			len =0;
+	for( i=0; i < count; i++ ) {
+		free(list[i].name);
+		if( list[i].eTag != NULL )
+			free(list[i].eTag);
+	}
+	free(list);
+}
 
-		/* path will never be "/", atleast there will be bucket */	
-		tmpPath = strdup(path);
-		tmp = strtok(tmpPath, "/" ) ;
-		newTree = (*tree) ;
-		while ( tmp != NULL ) {
-			ret = searchNode( newTree, tmp, 1, &foundNode) ;
-			if(ret != 0 ) {
-				return ret ;
-			}
-			/* foundNode will never be NULL, as insertFlag is 1 */
-			newTree = foundNode;
-			tmp = strtok(NULL, "/");
-		}
+static void freeDirPage(s3_dir_page *page)
+{
+	int	i;
 
-		/* last foundnode is the path prefix for which all entries are 
-  		 complete, mark it complete */
-		if(foundNode != NULL)
-			foundNode->isComplete |= NODE_COMPLETE;
-		
-		pathNode = foundNode;
-		/* 
- 		path includes bucket name, whereas S3FileInfoList starts with
-		object name
-		- remove first token from path to get pathPrefix
- 		*/
+	freeFileInfoList(page->count, page->list);
+	for( i=0; i < page->prefixCount; i++ ) {
+		free(page->prefixes[i].path);
+		freeFileInfoList(page->prefixes[i].count,
+					page->prefixes[i].list);
+	}
+	free(page->prefixes);
+	free(page->nextMarker);
+	memset(page, 0, sizeof(s3_dir_page));
+}
 
-		
-		tmp1 = strchr(path+1, '/');	
-		if( tmp1 != NULL ) {
-			*tmp1 = 0;
-			pathPrefix = tmp1+1;
-			len = strlen(pathPrefix);
-			*tmp1 = '/' ;
-		} else {
-			len = 0;
+/*
+ * Lists the page of path's children after marker, the rest of the key
+ * after the directory's prefix, and probes every common prefix of it.
+ * Doesn't touch the tree, call it without gS3TreeLock.
+ */
+static int getDirPageFromS3(const char *path, const char *marker,
+							s3_dir_page *page)
+{
+	int		ret = 0;
+	int		s3Status = 0;
+	char		*bucket = NULL;
+	char		*prefix = NULL;
+	char		*fullMarker = NULL;
+	int		prefixCount = 0;
+	char		**commonPrefixes = NULL;
+	int		probePrefixCount = 0;
+	char		**probePrefixes = NULL;
+	char		*probeMarker = NULL;
+	s3_list_prefix	*probe = NULL;
+	int		i = 0, j = 0;
+
+	memset(page, 0, sizeof(s3_dir_page));
+	ret = getBucketAndPrefix(path, &bucket, &prefix);
+	if( ret != 0 ) {
+		goto ret;
+	}
+	if( marker != NULL ) {
+		fullMarker = malloc(((prefix != NULL) ? strlen(prefix) : 0)
+						+ strlen(marker) + 1);
+		if( fullMarker == NULL ) {
+			ret = -ENOMEM;
+			goto ret;
 		}
-	
-		for(i=0; i < count ; i++ ) {
-
-			log_msg("in for\n");
-			newTree = pathNode;
-			tmpS3FileInfo = ((s3_file_info *)&(s3FileInfoList[i]));
-			log_msg("name %d : %s\n", i, tmpS3FileInfo->name);
-			tmpName = strdup((tmpS3FileInfo->name) + len); 
-			
-			log_msg("name %d : %s\n", i, tmpName);
-			tmp = strtok(tmpName, "/") ;
-			
-			while ( tmp != NULL ) {
-				log_msg("tmp = %s newTree\n", tmp, 
-						newTree->s3FileInfo->name);
-				ret = searchNode( newTree, tmp, 1, &foundNode) ;
-				if(ret != 0 ) {
-					return ret ;
-				}
-			/* foundNode will never be NULL, as insertFlag is 1 */
-				if( foundNode->s3FileInfo->time 
-						< (*tmpS3FileInfo).time)
-					foundNode->s3FileInfo->time
-						= (*tmpS3FileInfo).time;
-
-				foundNode->isComplete |= NODE_COMPLETE;
-				newTree = foundNode;
-				tmp = strtok(NULL, "/");
-			}
-		
-			/* update the time if tmp is NULL to start */
-			foundNode->s3FileInfo->time = (*tmpS3FileInfo).time;
-			/* update the size of last node, the leaf node */
-			foundNode->s3FileInfo->size = (*tmpS3FileInfo).size;
-			foundNode->isFileNode = 1;
-
-			if( isNodeMetaFile(foundNode))
-			{
-				char		*pathToMeta = NULL;
-				ret = buildPathToMeta(path,
-					tmpS3FileInfo->name,
-					&pathToMeta);
+		sprintf(fullMarker, "%s%s", (prefix != NULL) ? prefix : "",
+								marker);
+	}
 
-				
-				ret = fixEncodedFileInfo(foundNode, pathToMeta);
-				log_msg("after FixEncodedFileInfo\n");
+	log_msg("getDirPageFromS3 bucket = %s, prefix = %s, marker = %s\n",
+				bucket, (prefix != NULL) ? prefix : "",
+				(fullMarker != NULL) ? fullMarker : "");
+	s3Status = list_bucket_page(bucket, prefix, fullMarker, "/",
+				listPageKeys, &page->count, &page->list,
+				&prefixCount, &commonPrefixes, &page->nextMarker);
+	if( s3Status == S3StatusErrorNoSuchBucket ) {
+		/* nothing there, like an empty listing */
+		goto ret;
+	}
+	if( s3Status != 0 ) {
+		logS3Errors(s3Status);
+		ret = -EIO;
+		goto ret;
+	}
+	if( page->nextMarker != NULL ) {
+		/* kept as the rest after the prefix, like marker */
+		memmove(page->nextMarker, 
+			page->nextMarker + ((prefix != NULL) ? strlen(prefix) : 0),
+			strlen(page->nextMarker) + 1
+				- ((prefix != NULL) ? strlen(prefix) : 0));
+	}
 
-			}
-			free(tmpS3FileInfo->name);
+	page->prefixes = calloc(prefixCount + 1, sizeof(s3_list_prefix));
+	if( page->prefixes == NULL ) {
+		ret = -ENOMEM;
+		goto ret;
+	}
+	for( i=0; i < prefixCount; i++ ) {
+		/* chunk store objects are reached through manifests, and
+		   a prefix is never listed again after being the marker */
+		if( isChunkStoreKey(commonPrefixes[i])
+			|| ((fullMarker != NULL) 
+				&& (strcmp(commonPrefixes[i], fullMarker) == 0)) ) {
+			continue;
+		}
+		probe = &(page->prefixes[page->prefixCount++]);
+		probe->path = malloc(strlen(bucket) 
+					+ strlen(commonPrefixes[i]) + 3);
+		if( probe->path == NULL ) {
+			ret = -ENOMEM;
+			goto ret;
+		}
+		/* without the delimiter */
+		sprintf(probe->path, "/%s/%s", bucket, commonPrefixes[i]);
+		probe->path[strlen(probe->path) - 1] = 0;
+
+		s3Status = list_bucket_page(bucket, commonPrefixes[i], NULL,
+				"/", S3_LIST_PROBE_KEYS, &probe->count,
+				&probe->list, &probePrefixCount, &probePrefixes,
+				&probeMarker);
+		if( s3Status != 0 ) {
+			logS3Errors(s3Status);
+			ret = -EIO;
+			goto ret;
+		}
+		freeCommonPrefixes(probePrefixCount, probePrefixes);
+		free(probeMarker);
+		probeMarker = NULL;
+
+		for( j=0; j < probe->count; j++ ) {
+			if( probe->time < probe->list[j].time )
+				probe->time = probe->list[j].time;
+			if( isMetaKey(probe->list[j].name) )
+				break;
+		}
+		if( j == probe->count ) {
+			/* a directory, listed when it is opened */
+			freeFileInfoList(probe->count, probe->list);
+			probe->count = 0;
+			probe->list = NULL;
 		}
-	
-		log_msg ("after for\n");
 	}
 
-	log_msg("returning %d\n", ret );
+ret:
+	if( ret != 0 ) {
+		freeDirPage(page);
+	}
+	if( commonPrefixes != NULL )
+		freeCommonPrefixes(prefixCount, commonPrefixes);
+	if( fullMarker != NULL )
+		free(fullMarker);
+	if( bucket != NULL )
+		free(bucket);
+	if( prefix != NULL )
+		free(prefix);
 	return ret;
 }
 
-int isNodeMetaFile(s3_tree_node *node)
+/* insertS3NodesInTree() for a listing that may not hold all of path's
+   children: NODE_COMPLETE of path stays as it was */
+static int insertListedNodes(s3_tree_node **tree, const char *path,
+				int count, s3_file_info *list,
+				int *pMetaCount, char ***pMetaPaths)
 {
+	int			ret = 0;
+	int			complete = 0;
+	s3_tree_node		*node = NULL;
 
-	char	metaSuffix[]= "_meta.txt";
-	int	metaSuffixLen = 0 ;
-	char	*fileName = NULL;
-	int	fileNameLen = 0 ;
-	int	j = 0;
-	int	ret = 0;
-
-	metaSuffixLen = strlen("_meta.txt");
-
-	fileName = strdup(node->s3FileInfo->name);
-	fileNameLen = strlen(fileName);
-	for(j=1; j<= metaSuffixLen; j++) {
-		if(metaSuffix[metaSuffixLen -j] 
-			!= fileName[fileNameLen-j] )
-			break;
-	} 
-
-	if(j >  metaSuffixLen) { 
-		ret =  1;
-	} else {
-		ret = 0;
+	searchForPath(path, *tree, &node);
+	if( node != NULL ) {
+		complete = node->isComplete & NODE_COMPLETE;
+	}
+	ret = insertS3NodesInTree(tree, path, count, list, 
+						pMetaCount, pMetaPaths);
+	if( ret != 0 ) {
+		return ret;
+	}
+	searchForPath(path, *tree, &node);
+	if( node != NULL ) {
+		node->isComplete = (node->isComplete & ~NODE_COMPLETE) 
+								| complete;
+	}
+	return 0;
+}
+
+/*
+ * A plain object at path is only seen in a listing of its parent;
+ * look for it alone, with the one key that starts with its name first.
+ * Called with gS3TreeLock held, dropped while listing.
+ */
+static int probePlainObject(s3_tree_node **tree, const char *path)
+{
+	int			ret = 0;
+	int			s3Status = 0;
+	char			*bucket = NULL;
+	char			*key = NULL;
+	char			*parentPath = NULL;
+	int			count = 0;
+	s3_file_info		*list = NULL;
+	int			prefixCount = 0;
+	char			**commonPrefixes = NULL;
+	char			*nextMarker = NULL;
+	int			metaCount = 0;
+	char			**metaPaths = NULL;
+
+	ret = getBucketAndPrefix(path, &bucket, &key);
+	if( (ret != 0) || (key == NULL) ) {
+		goto ret;
+	}
+	/* "dir/name/" -> "dir/name" */
+	key[strlen(key) - 1] = 0;
+
+	pthread_mutex_unlock(&gS3TreeLock);
+	s3Status = list_bucket_page(bucket, key, NULL, "/", 1, &count, 
+				&list, &prefixCount, &commonPrefixes,
+				&nextMarker);
+	pthread_mutex_lock(&gS3TreeLock);
+	if( s3Status == S3StatusErrorNoSuchBucket ) {
+		goto ret;
+	}
+	if( s3Status != 0 ) {
+		logS3Errors(s3Status);
+		ret = -EIO;
+		goto ret;
+	}
+	if( (count != 1) || (strcmp(list[0].name, key) != 0) 
+					|| isChunkStoreKey(key) ) {
+		goto ret;
+	}
+
+	parentPath = strdup(path);
+	if( parentPath == NULL ) {
+		ret = -ENOMEM;
+		goto ret;
+	}
+	*strrchr(parentPath, '/') = 0;
+	ret = insertListedNodes(tree, parentPath, count, list, 
+						&metaCount, &metaPaths);
+	if( ret == 0 ) {
+		/* the tree owns the name and ETag now */
+		count = 0;
+	}
+
+ret:
+	/* a plain object is never a _meta.txt file of its own */
+	for( ; metaCount > 0; metaCount-- ) {
+		free(metaPaths[metaCount - 1]);
+	}
+	if( metaPaths != NULL )
+		free(metaPaths);
+	if( list != NULL )
+		freeFileInfoList(count, list);
+	if( commonPrefixes != NULL )
+		freeCommonPrefixes(prefixCount, commonPrefixes);
+	if( nextMarker != NULL )
+		free(nextMarker);
+	if( parentPath != NULL )
+		free(parentPath);
+	if( bucket != NULL )
+		free(bucket);
+	if( key != NULL )
+		free(key);
+	return ret;
+}
+
+/*
+ * Puts what page lists of path's children into the tree: its objects,
+ * its encoded and chunked files with their objects, its directories.
+ * The tree takes the names and ETags over; a prefix the caller took out
+ * has no path.  Called with gS3TreeLock held.
+ */
+static int insertDirPage(s3_tree_node **tree, const char *path,
+				s3_dir_page *page, int *pMetaCount,
+				char ***pMetaPaths)
+{
+	int			ret = 0;
+	s3_list_prefix		*probe = NULL;
+	s3_tree_node		*child = NULL;
+	char			*tmpPath = NULL;
+	char			*tmp = NULL;
+	int			i = 0;
+
+	if( page->count > 0 ) {
+		ret = insertListedNodes(tree, path, page->count, page->list,
+						pMetaCount, pMetaPaths);
+		if( ret != 0 ) {
+			return ret;
+		}
+		free(page->list);
+		page->list = NULL;
+		page->count = 0;
+	}
+
+	for( i=0; i < page->prefixCount; i++ ) {
+		probe = &(page->prefixes[i]);
+		if( probe->path == NULL ) {
+			continue;
+		}
+		if( probe->count > 0 ) {
+			/* an encoded or chunked file, with its objects */
+			ret = insertS3NodesInTree(tree, probe->path,
+					probe->count, probe->list,
+					pMetaCount, pMetaPaths);
+			if( ret != 0 ) {
+				return ret;
+			}
+			free(probe->list);
+			probe->list = NULL;
+			probe->count = 0;
+			continue;
+		}
+
+		tmpPath = strdup(probe->path);
+		if( tmpPath == NULL ) {
+			return -ENOMEM;
+		}
+		child = *tree;
+		for( tmp = strtok(tmpPath, "/"); tmp != NULL; 
+						tmp = strtok(NULL, "/") ) {
+			ret = searchNode(child, tmp, 1, &child);
+			if( ret != 0 ) {
+				break;
+			}
+		}
+		free(tmpPath);
+		if( ret != 0 ) {
+			return ret;
+		}
+		if( child->s3FileInfo.time < probe->time )
+			NODE_STORE(child->s3FileInfo.time, probe->time);
+		/* S3 has it now */
+		child->isComplete &= ~NODE_LOCAL;
+	}
+	return 0;
+}
+
+static int sameMarker(const char *a, const char *b)
+{
+	if( (a == NULL) || (b == NULL) ) {
+		return (a == b);
+	}
+	return (strcmp(a, b) == 0);
+}
+
+int s3ListDirPage(s3_tree_node **tree, const char *path)
+{
+	/*
+ 	- lists the next page of the directory at path into the tree,
+	  the first if it was never listed, nothing if it is complete
+	- called with gS3TreeLock held, dropped while listing; another
+	  thread may list the same page meanwhile, only the one that
+	  still finds the marker it started from moves it on
+	*/
+
+	int			ret = 0;
+	s3_tree_node		*node = NULL;
+	char			*marker = NULL;
+	s3_dir_listing		*listing = NULL;
+	s3_dir_page		page;
+	int			ours = 0;
+	int			metaCount = 0;
+	char			**metaPaths = NULL;
+	int			i = 0;
+
+	log_msg("s3ListDirPage path = %s\n", path);
+	memset(&page, 0, sizeof(page));
+	ret = searchForPath(path, *tree, &node);
+	if( ret != 0 ) {
+		goto ret;
+	}
+	if( (node != NULL) && (node->isComplete & NODE_COMPLETE) ) {
+		goto ret;
+	}
+	/* listed at the last mount, see s3_snapshot.h */
+	if( (node != NULL) && snapshotLoadDir(node, path) ) {
+		goto ret;
+	}
+	if( (node != NULL) && (node->listing != NULL)
+				&& (node->listing->marker != NULL) ) {
+		marker = strdup(node->listing->marker);
+		if( marker == NULL ) {
+			ret = -ENOMEM;
+			goto ret;
+		}
+	}
+
+	pthread_mutex_unlock(&gS3TreeLock);
+	ret = getDirPageFromS3(path, marker, &page);
+	pthread_mutex_lock(&gS3TreeLock);
+	if( ret != 0 ) {
+		goto ret;
+	}
+
+	ret = searchForPath(path, *tree, &node);
+	if( ret != 0 ) {
+		goto ret;
+	}
+	if( node == NULL ) {
+		ours = (marker == NULL);
+	} else {
+		ours = ((node->isComplete & NODE_COMPLETE) == 0)
+				&& sameMarker(marker, (node->listing != NULL)
+					? node->listing->marker : NULL);
+	}
+
+	ret = insertDirPage(tree, path, &page, &metaCount, &metaPaths);
+	if( ret != 0 ) {
+		goto ret;
+	}
+
+	searchForPath(path, *tree, &node);
+	if( (node != NULL) && ours ) {
+		if( node->listing == NULL ) {
+			listing = calloc(1, sizeof(s3_dir_listing));
+			if( listing == NULL ) {
+				ret = -ENOMEM;
+				goto ret;
+			}
+			NODE_STORE(node->listing, listing);
+			evictTouch(node);
+		}
+		if( node->listing->marker != NULL )
+			free(node->listing->marker);
+		node->listing->marker = page.nextMarker;
+		page.nextMarker = NULL;
+		if( node->listing->marker == NULL ) {
+			node->isComplete |= NODE_COMPLETE;
+			NODE_STORE(node->listing->listedTime, time(NULL));
+		}
+	}
+
+	if( metaCount > 0 ) {
+		ret = fixEncodedFileSizes(metaCount, metaPaths);
+	}
+
+ret:
+	for( i=0; i < metaCount; i++ ) {
+		free(metaPaths[i]);
+	}
+	if( metaPaths != NULL )
+		free(metaPaths);
+	if( marker != NULL )
+		free(marker);
+	freeDirPage(&page);
+	return ret;
+}
+
+/* node, or something below it, was made or uploaded here and no listing
+   has shown it yet */
+static int isLocalBelow(s3_tree_node *node)
+{
+	s3_tree_node		*child = NULL;
+
+	if( (node->isComplete & NODE_LOCAL) || node->uploaded ) {
+		return 1;
+	}
+	for( child = node->children; child != NULL; child = child->next ) {
+		if( isLocalBelow(child) ) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int nodePtrCmp(const void *a, const void *b)
+{
+	s3_tree_node	*x = *(s3_tree_node **) a;
+	s3_tree_node	*y = *(s3_tree_node **) b;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+/* the cached copies of node and of what is below it, which S3 no
+   longer has */
+static void removeCachedCopies(s3_tree_node *node, const char *path)
+{
+	s3_tree_node		*child = NULL;
+	char			*childPath = NULL;
+	char			*cachedPath = NULL;
+
+	for( child = node->children; child != NULL; child = child->next ) {
+		childPath = malloc(strlen(path) 
+					+ strlen(child->s3FileInfo.name) + 2);
+		if( childPath == NULL ) {
+			continue;
+		}
+		sprintf(childPath, "%s/%s", path, child->s3FileInfo.name);
+		removeCachedCopies(child, childPath);
+		free(childPath);
+	}
+	if( s3CacheGetCachedPath(gS3Cache, path, &cachedPath) == 0 ) {
+		if( node->isFileNode )
+			unlink(cachedPath);
+		else
+			rmdir(cachedPath);
+		free(cachedPath);
+	}
+}
+
+/* the ETag of the _meta.txt object a probe lists, and of its node */
+static int sameMetaETag(s3_tree_node *file, s3_list_prefix *probe)
+{
+	s3_tree_node		*meta = NULL;
+	char			*name = NULL;
+	int			i = 0;
+
+	for( i=0; i < probe->count; i++ ) {
+		if( isMetaKey(probe->list[i].name) )
+			break;
+	}
+	if( (i == probe->count) || (probe->list[i].eTag == NULL) ) {
+		return 0;
+	}
+	name = strrchr(probe->list[i].name, '/');
+	name = (name != NULL) ? name + 1 : probe->list[i].name;
+	meta = childFind(file, name, NULL);
+	return (meta != NULL) && (meta->s3FileInfo.eTag != NULL)
+		&& (strcmp(meta->s3FileInfo.eTag, probe->list[i].eTag) == 0);
+}
+
+/*
+ * Takes out of a page of a re-list of dir what must not go into the
+ * tree: files with writes not uploaded yet, and what did not change
+ * since the last listing.  The children the page lists are added to
+ * listed, *pAdded counts those the tree doesn't have.  Called with
+ * gS3TreeLock held.
+ */
+static int filterRelistPage(s3_tree_node *dir, const char *path,
+				int prefixLength, s3_dir_page *page,
+				s3_tree_node **listed, int *pListedCount,
+				int *pAdded)
+{
+	s3_tree_node		*child = NULL;
+	s3_list_prefix		*probe = NULL;
+	s3_file_info		*info = NULL;
+	char			*name = NULL;
+	char			*childPath = NULL;
+	int			drop = 0;
+	int			i = 0, j = 0;
+
+	childPath = malloc(strlen(path) + S3_MAX_KEY_SIZE + 2);
+	if( childPath == NULL ) {
+		return -ENOMEM;
+	}
+
+	for( i=0, j=0; i < page->count; i++ ) {
+		info = &(page->list[i]);
+		name = info->name + prefixLength;
+		child = NULL;
+		if( (*name != 0) && (strchr(name, '/') == NULL) ) {
+			child = childFind(dir, name, NULL);
+			if( child == NULL )
+				(*pAdded)++;
+		}
+		drop = 0;
+		if( child != NULL ) {
+			listed[(*pListedCount)++] = child;
+		}
+		if( (child != NULL) && child->isFileNode ) {
+			sprintf(childPath, "%s/%s", path, name);
+			drop = ((child->s3FileInfo.eTag != NULL)
+				&& (info->eTag != NULL)
+				&& (strcmp(child->s3FileInfo.eTag, info->eTag) == 0)
+				&& (child->s3FileInfo.size == info->size)
+				&& ((child->isComplete & NODE_LOCAL) == 0))
+				|| s3CacheIsDirty(gS3Cache, childPath);
+		}
+		if( drop ) {
+			free(info->name);
+			if( info->eTag != NULL )
+				free(info->eTag);
+		} else {
+			page->list[j++] = *info;
+		}
+	}
+	page->count = j;
+
+	for( i=0; i < page->prefixCount; i++ ) {
+		probe = &(page->prefixes[i]);
+		name = strrchr(probe->path, '/') + 1;
+		child = childFind(dir, name, NULL);
+		if( child == NULL ) {
+			(*pAdded)++;
+			continue;
+		}
+		listed[(*pListedCount)++] = child;
+		if( probe->count == 0 ) {
+			continue;
+		}
+		sprintf(childPath, "%s/%s", path, name);
+		if( sameMetaETag(child, probe)
+				|| s3CacheIsDirty(gS3Cache, childPath) ) {
+			free(probe->path);
+			probe->path = NULL;
+			freeFileInfoList(probe->count, probe->list);
+			probe->count = 0;
+			probe->list = NULL;
+		}
+	}
+
+	free(childPath);
+	return 0;
+}
+
+int s3RelistDir(const char *path)
+{
+	/*
+	 - lists the directory at path to the end again and merges the
+	   differences into the tree, see s3_revalidate.h
+	 - called without gS3TreeLock: it is taken once the listing is
+	   in, and dropped again while encoded file sizes are read
+	 - the listing counts as fresh afterwards, also when it failed,
+	   so that a failing directory is tried again a TTL later; one
+	   the tree changed under while it was listed is not merged and
+	   tried again at the next access
+	*/
+	int			ret = 0;
+	s3_dir_page		*pages = NULL;
+	s3_dir_page		*page = NULL;
+	int			pageCount = 0;
+	char			*marker = NULL;
+	const char		*slash = NULL;
+	int			prefixLength = 0;
+	s3_tree_node		*dir = NULL;
+	s3_tree_node		*child = NULL;
+	s3_tree_node		*next = NULL;
+	s3_tree_node		**listed = NULL;
+	int			listedCount = 0;
+	int			keyCount = 0;
+	int			added = 0;
+	int			removed = 0;
+	char			*childPath = NULL;
+	int			metaCount = 0;
+	char			**metaPaths = NULL;
+	unsigned int		changes = 0;
+	int			i = 0;
+
+	log_msg("s3RelistDir path = %s\n", path);
+	pthread_mutex_lock(&gS3TreeLock);
+	searchForPath(path, gS3DirectoryTree, &dir);
+	if( (dir != NULL) && (dir->listing != NULL) ) {
+		changes = dir->listing->changes;
+	}
+	pthread_mutex_unlock(&gS3TreeLock);
+
+	do {
+		page = realloc(pages, (pageCount + 1) * sizeof(s3_dir_page));
+		if( page == NULL ) {
+			ret = -ENOMEM;
+			break;
+		}
+		pages = page;
+		ret = getDirPageFromS3(path, marker, &pages[pageCount]);
+		if( ret != 0 ) {
+			break;
+		}
+		keyCount += pages[pageCount].count 
+				+ pages[pageCount].prefixCount;
+		marker = pages[pageCount++].nextMarker;
+	} while( marker != NULL );
+
+	/* "/bucket/dir" lists "dir/..." */
+	slash = strchr(path + 1, '/');
+	prefixLength = (slash != NULL) ? strlen(slash + 1) + 1 : 0;
+
+	pthread_mutex_lock(&gS3TreeLock);
+	searchForPath(path, gS3DirectoryTree, &dir);
+	if( (dir == NULL) || (dir->listing == NULL) ) {
+		goto unlock;
+	}
+	if( (ret != 0) || ((dir->isComplete & NODE_COMPLETE) == 0) ) {
+		/* a listing that is not complete is done in the foreground
+		   anyway */
+		goto done;
+	}
+	if( dir->listing->changes != changes ) {
+		/* what we listed may be from before the change */
+		log_msg("s3RelistDir : %s changed meanwhile\n", path);
+		dir->listing->refreshing = 0;
+		goto unlock;
+	}
+
+	listed = malloc((keyCount + 1) * sizeof(s3_tree_node *));
+	childPath = malloc(strlen(path) + S3_MAX_KEY_SIZE + 2);
+	if( (listed == NULL) || (childPath == NULL) ) {
+		ret = -ENOMEM;
+		goto done;
+	}
+	for( i=0; i < pageCount; i++ ) {
+		ret = filterRelistPage(dir, path, prefixLength, &pages[i],
+					listed, &listedCount, &added);
+		if( ret != 0 ) {
+			goto done;
+		}
+	}
+
+	/* what S3 no longer has goes first, before the new children
+	   are among the old */
+	qsort(listed, listedCount, sizeof(s3_tree_node *), nodePtrCmp);
+	for( child = dir->children; child != NULL; child = next ) {
+		next = child->next;
+		if( bsearch(&child, listed, listedCount, 
+				sizeof(s3_tree_node *), nodePtrCmp) != NULL ) {
+			continue;
+		}
+		sprintf(childPath, "%s/%s", path, child->s3FileInfo.name);
+		if( isLocalBelow(child) 
+				|| s3CacheIsDirtyBelow(gS3Cache, childPath) ) {
+			continue;
+		}
+		log_msg("s3RelistDir : %s is gone\n", childPath);
+		fillCancel(childPath);
+		removeCachedCopies(child, childPath);
+		s3Invalidate(child, S3_INVALIDATE_ENTRY);
+		deleteNode(child);
+		removed++;
+	}
+
+	for( i=0; i < pageCount; i++ ) {
+		ret = insertDirPage(&gS3DirectoryTree, path, &pages[i],
+						&metaCount, &metaPaths);
+		if( ret != 0 ) {
+			goto done;
+		}
+	}
+	log_msg("s3RelistDir : %s, %d added, %d removed\n", path, added,
+								removed);
+	if( (added > 0) || (removed > 0) ) {
+		s3Invalidate(dir, S3_INVALIDATE_DATA);
+	}
+
+done:
+	NODE_STORE(dir->listing->listedTime, time(NULL));
+	dir->listing->refreshing = 0;
+	if( metaCount > 0 ) {
+		fixEncodedFileSizes(metaCount, metaPaths);
+	}
+unlock:
+	pthread_mutex_unlock(&gS3TreeLock);
+
+	for( i=0; i < metaCount; i++ ) {
+		free(metaPaths[i]);
+	}
+	if( metaPaths != NULL )
+		free(metaPaths);
+	for( i=0; i < pageCount; i++ ) {
+		freeDirPage(&pages[i]);
+	}
+	if( pages != NULL )
+		free(pages);
+	if( listed != NULL )
+		free(listed);
+	if( childPath != NULL )
+		free(childPath);
+	return ret;
+}
+
+/* name + "/" against key, both in S3 order */
+static int listKeyCmp(const char *name, const char *key)
+{
+	while( (*name != 0) && (*name == *key) ) {
+		name++;
+		key++;
+	}
+	if( *name != 0 ) {
+		return (unsigned char) *name - (unsigned char) *key;
+	}
+	if( *key != '/' ) {
+		return '/' - (unsigned char) *key;
+	}
+	return (key[1] == 0) ? 0 : -1;
+}
+
+/* a + "/" against b + "/", names hold no "/" */
+static int listNameCmp(const char *a, const char *b)
+{
+	while( (*a != 0) && (*a == *b) ) {
+		a++;
+		b++;
+	}
+	return (unsigned char) ((*a != 0) ? *a : '/') 
+			- (unsigned char) ((*b != 0) ? *b : '/');
+}
+
+static int listChildCmp(const void *a, const void *b)
+{
+	return listNameCmp(NODE_LOAD((*(s3_tree_node **) a)->s3FileInfo.name),
+			NODE_LOAD((*(s3_tree_node **) b)->s3FileInfo.name));
+}
+
+int s3DirNextChildren(s3_tree_node *dir, char **pLast,
+			s3_tree_node ***pChildren, int *pCount)
+{
+	/*
+ 	- the children after *pLast that the pages listed so far cover,
+	  in listing order, *pLast moves to the last of them
+	- *pChildren is only valid while gS3TreeLock is held, the caller
+	  frees it
+	*/
+
+	s3_tree_node		*child = NULL;
+	s3_tree_node		**children = NULL;
+	int			count = 0;
+	int			complete = 0;
+	char			*last = NULL;
+
+	*pChildren = NULL;
+	*pCount = 0;
+	complete = (dir->isComplete & NODE_COMPLETE) 
+				|| (dir->listing == NULL)
+				|| (dir->listing->marker == NULL);
+	for( child = dir->children; child != NULL; child = child->next ) {
+		count++;
+	}
+	children = malloc((count + 1) * sizeof(s3_tree_node *));
+	if( children == NULL ) {
+		return -ENOMEM;
+	}
+
+	count = 0;
+	for( child = dir->children; child != NULL; child = child->next ) {
+		if( (*pLast != NULL)
+			&& (listNameCmp(child->s3FileInfo.name, *pLast) <= 0) ) {
+			continue;
+		}
+		if( !complete 
+			&& (listKeyCmp(child->s3FileInfo.name,
+					dir->listing->marker) > 0) ) {
+			continue;
+		}
+		children[count++] = child;
+	}
+	qsort(children, count, sizeof(s3_tree_node *), listChildCmp);
+
+	if( count > 0 ) {
+		last = strdup(children[count - 1]->s3FileInfo.name);
+		if( last == NULL ) {
+			free(children);
+			return -ENOMEM;
+		}
+		if( *pLast != NULL )
+			free(*pLast);
+		*pLast = last;
+	}
+	*pChildren = children;
+	*pCount = count;
+	return 0;
+}
+
+int s3DirNextChildrenLockFree(s3_tree_node *dir, char **pLast,
+			s3_tree_node ***pChildren, int *pCount)
+{
+	/*
+	 - s3DirNextChildren() of a directory listed to the end, without
+	   gS3TreeLock, between epochEnter() and epochExit(), see
+	   s3_epoch.h
+	 - -EAGAIN if dir was not listed to the end, or its children
+	   changed while they were taken; the caller takes the lock
+	 - *pChildren is only valid until epochExit(), the caller frees it
+	*/
+
+	s3_dir_listing		*listing = NULL;
+	s3_tree_node		*child = NULL;
+	s3_tree_node		**children = NULL;
+	s3_tree_node		**more = NULL;
+	unsigned int		changes = 0;
+	int			count = 0;
+	int			size = 0;
+	char			*last = NULL;
+
+	*pChildren = NULL;
+	*pCount = 0;
+	/* a listing the last page came in for stays complete until it
+	   goes, see s3_evict.h */
+	listing = NODE_LOAD(dir->listing);
+	if( (listing == NULL) || (NODE_LOAD(listing->listedTime) == 0) ) {
+		return -EAGAIN;
+	}
+	changes = NODE_LOAD(listing->changes);
+	if( changes & 1 ) {
+		return -EAGAIN;
+	}
+
+	for( child = NODE_LOAD(dir->children); child != NULL;
+					child = NODE_LOAD(child->next) ) {
+		if( (*pLast != NULL)
+			&& (listNameCmp(NODE_LOAD(child->s3FileInfo.name),
+							*pLast) <= 0) ) {
+			continue;
+		}
+		if( count == size ) {
+			size = (size == 0) ? 64 : size * 2;
+			more = realloc(children, size * sizeof(s3_tree_node *));
+			if( more == NULL ) {
+				free(children);
+				return -ENOMEM;
+			}
+			children = more;
+		}
+		children[count++] = child;
+	}
+	/* a writer was in the list: what we walked may be cut short */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if( __atomic_load_n(&listing->changes, __ATOMIC_RELAXED) != changes ) {
+		free(children);
+		return -EAGAIN;
+	}
+	qsort(children, count, sizeof(s3_tree_node *), listChildCmp);
+
+	if( count > 0 ) {
+		last = strdup(NODE_LOAD(children[count - 1]->s3FileInfo.name));
+		if( last == NULL ) {
+			free(children);
+			return -ENOMEM;
+		}
+		if( *pLast != NULL )
+			free(*pLast);
+		*pLast = last;
+	}
+	*pChildren = children;
+	*pCount = count;
+	return 0;
+}
+
+int getKeysFromS3(const char *path, s3_key_list *keys)
+{
+	/* every key under path, "/bucket/dir", the bucket's without dir */
+	const char	*slash = strchr(path + 1, '/');
+	char		*bucket = NULL;
+	char		*prefix = NULL;
+	int		ret = 0;
+
+	log_msg("getKeysFromS3 %s\n", path);
+	bucket = strdup(path + 1);
+	if( bucket == NULL ) {
+		return -ENOMEM;
+	}
+	if( slash != NULL ) {
+		bucket[slash - path - 1] = 0;
+		prefix = malloc(strlen(slash + 1) + 2);
+		if( prefix == NULL ) {
+			free(bucket);
+			return -ENOMEM;
+		}
+		sprintf(prefix, "%s/", slash + 1);
+	}
+
+	ret = scanKeys(bucket, prefix, keys);
+	free(bucket);
+	free(prefix);
+	if( ret != 0 ) {
+		keyListFree(keys);
+	}
+	return ret;
+}
+
+int insertS3NodesInTree(s3_tree_node **tree, const char *path, int count, 
+				s3_file_info *s3FileInfoList,
+				int *pMetaCount, char ***pMetaPaths)
+{
+	log_msg("insertS3NodesInTree\n");
+	/*
+ 	- if Tree == NULL, insert a node with /
+	- for each s3_file_info, for each token search the tree
+	- if TREE == NULL, s3FileInfoList will be bucket list, token parsing of
+		s3_file-info not required
+	- if found, search for next token in found treeNode
+	- continue till not found, add the node  
+	- keys come sorted, so a key is looked up from where the key
+	  before went, through the directories they share, and its
+	  first new name goes right next to the key before's there
+	- _meta.txt keys are returned in *pMetaPaths, the size of the 
+	  encoded file is read by the caller once the tree is unlocked
+ 
+  	*/
+
+	s3_tree_node		*child=NULL;
+	s3_tree_node		*prev=NULL;
+	char			*name=NULL;
+	int			ret = 0 ;
+	s3_file_info 		*tmpS3FileInfo = NULL;
+	s3_insert_cursor	*cursor = NULL;
+	int			i = 0 ;
+
+	if( *tree == NULL ) {
+		ret = allocateTreeNode(tree); 		
+		if( ret != 0 ) {
+			return ret;
+		}
+		(*tree)->s3FileInfo.name= nameIntern("/");
+		/* After a listing all buckets, children list of / is complete */
+		(*tree)->isComplete |= NODE_COMPLETE;
+		(*tree)->isComplete |= VERSION_COMPLETE;
+		(*tree)->parent = NULL;
+
+		for( i=0; i< count; i++ ) {
+			tmpS3FileInfo = ((s3_file_info *)&(s3FileInfoList[i]));
+			name = nameIntern((*tmpS3FileInfo).name);
+			free((*tmpS3FileInfo).name);
+			if( name == NULL ) {
+				return -ENOMEM;
+			}
+
+			ret = allocateTreeNode(&child);
+			if( ret != 0 ) {
+				nameRelease(name);
+				return ret;
+			}
+		
+			child->parent = (*tree);
+			child->s3FileInfo.name = name; 
+			child->s3FileInfo.time = (*tmpS3FileInfo).time; 
+			child->s3FileInfo.size = (*tmpS3FileInfo).size; 
+
+			childFind(*tree, child->s3FileInfo.name, &prev);
+			childLink(*tree, child, prev);
+		}
+
+	} else {
+
+		/* 
+		- s3FileInfoList->name contains full path of the object
+		- for each token nodes need to be created and added to the tree
+		- Node which matches the path needs to be marked complete
+		- since all entries begin with path, let's add path first
+		  and use the node to add rest of the tokens(children)
+		-  
+
+  		*/
+		
+		s3_tree_node		*newTree = NULL;
+		char			*tmp = NULL, *tmp1 = NULL;
+		s3_tree_node		*foundNode = NULL;
+		s3_tree_node		*pathNode = NULL;
+		char			*tmpPath = NULL;
+		char			*pathPrefix = NULL;
+		int			len =0;
+		char			**metaPaths = NULL;
+		int			next = 0;
+		int			depth = 0;
+		int			shared = 0;
+		int			d = 0;
+
+		/* path will never be "/", atleast there will be bucket */	
+		tmpPath = strdup(path);
+		tmp = strtok(tmpPath, "/" ) ;
+		newTree = (*tree) ;
+		while( tmp != NULL ) {
+			ret = searchNode( newTree, tmp, 1, &foundNode) ;
+			if( ret != 0 ) {
+				return ret ;
+			}
+			/* foundNode will never be NULL, as insertFlag is 1 */
+			newTree = foundNode;
+			tmp = strtok(NULL, "/");
+		}
+
+		/* last foundnode is the path prefix for which all entries are 
+  		 complete, mark it complete */
+		if( foundNode != NULL ) {
+			foundNode->isComplete |= NODE_COMPLETE;
+			if( count > 0 )
+				foundNode->isComplete &= ~NODE_LOCAL;
+		}
+		
+		pathNode = foundNode;
+		/* 
+ 		path includes bucket name, whereas S3FileInfoList starts with
+		object name
+		- remove first token from path to get pathPrefix
+ 		*/
+
+		
+		tmp1 = strchr(path+1, '/');	
+		if( tmp1 != NULL ) {
+			*tmp1 = 0;
+			pathPrefix = tmp1+1;
+			len = strlen(pathPrefix);
+			*tmp1 = '/' ;
+		} else {
+			len = 0;
+		}
+	
+		/* keys come sorted, the key before is where to start from */
+		cursor = malloc(sizeof(s3_insert_cursor));
+		if( cursor == NULL ) {
+			return -ENOMEM;
+		}
+		cursor->nodes[0] = pathNode;
+		cursor->depth = 0;
+		cursor->cur = 0;
+
+		for( i=0; i < count ; i++ ) {
+
+			tmpS3FileInfo = ((s3_file_info *)&(s3FileInfoList[i]));
+			log_msg("name %d : %s\n", i, tmpS3FileInfo->name);
+
+			/* chunk store objects are reached through manifests */
+			if( isChunkStoreKey(tmpS3FileInfo->name) ) {
+				free(tmpS3FileInfo->name);
+				free(tmpS3FileInfo->eTag);
+				continue;
+			}
+
+			/* S3 keys fit, and nothing is allocated per key */
+			next = 1 - cursor->cur;
+			snprintf(cursor->key[next], sizeof(cursor->key[next]),
+					"%s", (tmpS3FileInfo->name) + len);
+			depth = 0;
+			tmp = strtok(cursor->key[next], "/") ;
+			while( tmp != NULL ) {
+				cursor->names[next][depth++] = tmp;
+				tmp = strtok(NULL, "/");
+			}
+
+			/* the directories of the key before stay on the
+			   cursor, the rest is looked up from there */
+			shared = 0;
+			while( (shared < depth) && (shared < cursor->depth)
+				&& (strcmp(cursor->names[next][shared],
+				cursor->names[cursor->cur][shared]) == 0) ) {
+				shared++;
+			}
+			for( d = 0; d < depth; d++ ) {
+				if( d >= shared ) {
+					ret = appendChild(cursor->nodes[d],
+						(d < cursor->depth) ?
+						cursor->nodes[d + 1] : NULL,
+						cursor->names[next][d],
+						&cursor->nodes[d + 1]);
+					if( ret != 0 ) {
+						goto ret;
+					}
+				}
+				foundNode = cursor->nodes[d + 1];
+				if( foundNode->s3FileInfo.time 
+						< (*tmpS3FileInfo).time )
+					NODE_STORE(foundNode->s3FileInfo.time,
+						(*tmpS3FileInfo).time);
+
+				foundNode->isComplete |= NODE_COMPLETE;
+			}
+			cursor->depth = depth;
+			cursor->cur = next;
+		
+			/* update the time if tmp is NULL to start */
+			NODE_STORE(foundNode->s3FileInfo.time,
+						(*tmpS3FileInfo).time);
+			/* update the size of last node, the leaf node */
+			NODE_STORE(foundNode->s3FileInfo.size,
+						(*tmpS3FileInfo).size);
+			NODE_STORE(foundNode->isFileNode, 1);
+			foundNode->isComplete &= ~NODE_LOCAL;
+			setNodeETag(foundNode, tmpS3FileInfo->eTag);
+
+			if( isNodeMetaFile(foundNode) )
+			{
+				char		*pathToMeta = NULL;
+				ret = buildPathToMeta(path,
+					tmpS3FileInfo->name,
+					&pathToMeta);
+				if( ret != 0 ) {
+					goto ret;
+				}
+
+				/* the caller may pass the list of an
+				   earlier call in */
+				metaPaths = realloc(*pMetaPaths,
+					(*pMetaCount + 1) * sizeof(char *));
+				if( metaPaths == NULL ) {
+					free(pathToMeta);
+					ret = -ENOMEM;
+					goto ret;
+				}
+				*pMetaPaths = metaPaths;
+				(*pMetaPaths)[(*pMetaCount)++] = pathToMeta;
+
+			}
+			free(tmpS3FileInfo->name);
+		}
+	
+		log_msg ("after for\n");
+	}
+
+ret:
+	free(cursor);
+	log_msg("returning %d\n", ret );
+	return ret;
+}
+
+int isNodeMetaFile(s3_tree_node *node)
+{
+
+	char	metaSuffix[]= "_meta.txt";
+	int	metaSuffixLen = 0 ;
+	char	*fileName = NULL;
+	int	fileNameLen = 0 ;
+	int	j = 0;
+	int	ret = 0;
+
+	metaSuffixLen = strlen("_meta.txt");
+
+	fileName = strdup(node->s3FileInfo.name);
+	fileNameLen = strlen(fileName);
+	for(j=1; j<= metaSuffixLen; j++) {
+		if(metaSuffix[metaSuffixLen -j] 
+			!= fileName[fileNameLen-j] )
+			break;
+	} 
+
+	if(j >  metaSuffixLen) { 
+		ret =  1;
+	} else {
+		ret = 0;
 	}
 
 ret: 
@@ -473,62 +1768,73 @@ ret:
 
 	return ret; 
 }
+static int appendChild(s3_tree_node *dir, s3_tree_node *last, char *name,
+						s3_tree_node **pChild)
+{
+	/*
+	 - searchNode() with insertFlag, for name after last, the child of
+	   dir the key before went to: children are in descending order,
+	   so name is the child right before last or goes right there
+	 - anything else, and an empty cursor, is left to searchNode()
+	*/
+	s3_tree_node		*prev = NULL;
+	int			ret = 0;
+
+	if( (last == NULL) || (last->parent != dir)
+			|| (strcmp(name, last->s3FileInfo.name) <= 0) ) {
+		return searchNode(dir, name, 1, pChild);
+	}
+	prev = last->prev;
+	if( prev != NULL ) {
+		ret = strcmp(prev->s3FileInfo.name, name);
+		if( ret == 0 ) {
+			*pChild = prev;
+			return 0;
+		}
+		if( ret < 0 ) {
+			return searchNode(dir, name, 1, pChild);
+		}
+	}
+
+	name = nameIntern(name);
+	if( name == NULL ) {
+		return -ENOMEM;
+	}
+	ret = allocateTreeNode(pChild);
+	if( ret != 0 ) {
+		nameRelease(name);
+		return ret;
+	}
+	(*pChild)->s3FileInfo.name = name;
+	childLink(dir, *pChild, prev);
+	return 0;
+}
+
 int searchNode(s3_tree_node *tree, char *name, 
 				int insertFlag, s3_tree_node **pResultNode)
 {
-	s3_tree_node 		*child = NULL;
 	s3_tree_node 		*prev = NULL;
-	int			result=-1;
 	int			ret = 0 ;
 	
-	log_msg("searchNode\n");
 	if( tree == NULL ) {
 		*pResultNode = NULL;
 		return 0;
 
 	}	
 
-	child = tree->children;
+	*pResultNode = childFind(tree, name, &prev);
 
-	while ( child != NULL ){
-		
-		log_msg("searchNode strcmp  %s : %s\n",
-				child->s3FileInfo->name, name);
-		result = strcmp( child->s3FileInfo->name, name);
-		if(result > 0 ) {
-			prev = child;
-			child = child->next;
-		} else {
-			break;
+	if( (*pResultNode == NULL) && (insertFlag != 0) ) {
+		name = nameIntern(name);
+		if( name == NULL ) {
+			return -ENOMEM;
 		}
-	}	
-
-	if(result == 0 ) {
-		*pResultNode = child;
-	} else if (insertFlag == 0 ) {
-		*pResultNode = NULL;	
-	} else {
 		ret = allocateTreeNode(pResultNode);
 		if( *pResultNode != NULL ) {
-			(*pResultNode)->s3FileInfo->name = strdup(name);
-			
-			if(result > 0) {
-				(*pResultNode)->next = NULL;
-			} else {
-				(*pResultNode)->next = child;
-				if(child != NULL )
-					child->prev = *pResultNode;
-			}
-			(*pResultNode)->parent = tree;
-			if(prev == NULL) {
-				tree->children = *pResultNode;
-				(*pResultNode)->prev = NULL;
-			} else {
-				prev->next = *pResultNode;
-				(*pResultNode)->prev = prev;
-			}
-			
-			
+			(*pResultNode)->s3FileInfo.name = name;
+			childLink(tree, *pResultNode, prev);
+		} else {
+			nameRelease(name);
 		}
 		
 	}
@@ -540,170 +1846,284 @@ int  allocateTreeNode(s3_tree_node **pResultNode)
 {
 
 	log_msg("allocateTreeNode\n");	
-	*pResultNode = (s3_tree_node *) malloc(sizeof(s3_tree_node));
+	*pResultNode = nodeArenaAlloc();
 	if( *pResultNode == NULL ) {
 		return -ENOMEM;
 	}			
-	(*pResultNode)->s3FileInfo = (s3_file_info *) malloc(sizeof(s3_file_info)) ;
-	if( (*pResultNode)->s3FileInfo == NULL ) {
-		return -ENOMEM;
-	}			
-	(*pResultNode)->s3FileInfo->name = NULL;
-	(*pResultNode)->s3FileInfo->time = 0;
-	(*pResultNode)->s3FileInfo->size = -1;
-	(*pResultNode)->s3FileInfo->versionId = NULL;
+	(*pResultNode)->s3FileInfo.name = NULL;
+	(*pResultNode)->s3FileInfo.time = 0;
+	(*pResultNode)->s3FileInfo.size = -1;
+	(*pResultNode)->s3FileInfo.versionId = NULL;
+	(*pResultNode)->s3FileInfo.eTag = NULL;
 	(*pResultNode)->isComplete = 0;
 	(*pResultNode)->isFileNode = 0;
 	(*pResultNode)->s3Name = NULL;
 	(*pResultNode)->children = NULL;
+	(*pResultNode)->parent = NULL;
+	(*pResultNode)->prev = NULL;
+	(*pResultNode)->next = NULL;
+	(*pResultNode)->cachedETag = NULL;
+	(*pResultNode)->uploaded = 0;
+	(*pResultNode)->listing = NULL;
+	(*pResultNode)->childIndex = NULL;
+	(*pResultNode)->hashNext = NULL;
+
+	if( s3InodeAdd(*pResultNode) != 0 ) {
+		nodeArenaFree(*pResultNode);
+		*pResultNode = NULL;
+		return -ENOMEM;
+	}
+	/* over the limit the coldest subtrees go, see s3_evict.h */
+	evictCheck();
 
 	return 0;
 }
 
 
-int getPathForNode(s3_tree_node *pathNode, char **pPath)
+int pathForNode(s3_tree_node *node, char *buf, size_t size)
 {
+	/*
+	 - "/bucket/dir/name" of node into buf, "" for the root; returns
+	   its length, or -ENAMETOOLONG if it doesn't fit in size
+	 - with buf NULL only the length
+	 - the names are put in from the end, no copy of the path so far
+	*/
+	s3_tree_node	*n = NULL;
+	size_t		len = 0;
+	size_t		nameLen = 0;
+	int		pathLen = 0;
 
-	int		pathSize = 0;
-	int		bufferSize = 0;
-	s3_tree_node	*parent = NULL;
-	int		ret = 0 ;
-	char		*tmpPath = NULL;
-	char		*tmpPath1 = NULL;
-
-	parent = pathNode->parent;
+	for( n = node; n->parent != NULL; n = n->parent ) {
+		len += strlen(n->s3FileInfo.name) + 1;
+	}
+	pathLen = (int) len;
+	if( buf == NULL ) {
+		return pathLen;
+	}
+	if( len >= size ) {
+		return -ENAMETOOLONG;
+	}
 
-	bufferSize = 1024;
-	tmpPath = malloc(bufferSize);
-	if(tmpPath== NULL ) {
-		ret = -ENOMEM;
-		goto ret ;
+	buf[len] = 0;
+	for( n = node; n->parent != NULL; n = n->parent ) {
+		nameLen = strlen(n->s3FileInfo.name);
+		len -= nameLen;
+		memcpy(buf + len, n->s3FileInfo.name, nameLen);
+		buf[--len] = '/';
 	}
+	return pathLen;
+}
 
-	pathSize += strlen(pathNode->s3FileInfo->name);
-	sprintf(tmpPath, "%s", pathNode->s3FileInfo->name);
-	log_msg("path =%s\n", tmpPath);
+int getPathForNode(s3_tree_node *pathNode, char **pPath)
+{
+	int		len = 0;
+
+	len = pathForNode(pathNode, NULL, 0);
+	*pPath = malloc(len + 1);
+	if( *pPath == NULL ) {
+		return -ENOMEM;
+	}
+	pathForNode(pathNode, *pPath, len + 1);
+	log_msg("returning path =%s\n", *pPath);
+	return 0;
+}
+int fixEncodedFileInfo(s3_tree_node *node, char* path)
+{
 
-	while ( parent != NULL ) {
+/*
+ *	- node points to a _meta.txt, called with gS3TreeLock held
+ *	- get the size of the encoded file, its parent
+ *	- only the versions listing uses it, plain listings go through
+ *	  fixEncodedFileSizes() so they don't fetch with the tree locked
+ *
+ */
 
-		pathSize += strlen(parent->s3FileInfo->name);
-		if(pathSize > bufferSize) {
+	int		ret = 0;
+	char		*s3Name = NULL;
+	int64_t		fileSize = 0 ;
 
-			bufferSize += 1024;
-			tmpPath= realloc(tmpPath, bufferSize);
+	ret = getS3NameForNode(path, node, &s3Name);
+	if( ret != 0 ) {
+		goto ret;
+	}
 
-			log_msg("realloc path\n");
-			if(tmpPath == NULL ) {
-				ret = -ENOMEM;
-				goto ret ;
-			}
-		}
-		
-		log_msg("parent name %s, tmpPath = %s\n", 
-					parent->s3FileInfo->name, tmpPath);
+	ret = getEncodedFileSize(path, s3Name, node->s3FileInfo.versionId,
+								&fileSize);
+	if( ret != 0 ) {
+		log_msg("fixEncodedFileInfo : error getEncodedFileSize\n");
+		goto ret;
+	}	
 
-		tmpPath1 = strdup(tmpPath) ;
-		sprintf(tmpPath, "%s/%s", parent->s3FileInfo->name, tmpPath1);
-		free(tmpPath1);
-		log_msg("path =%s\n", tmpPath);
+	NODE_STORE(node->parent->s3FileInfo.size, fileSize);
+	NODE_STORE(node->parent->isFileNode, 1);
+ret:
+	if( s3Name != NULL )
+		free(s3Name);
+	log_msg("returning from fixEncodedFileInfo\n");
+	return ret;
+}
 
-		parent = parent->parent;
+/* a line of a meta file in buf; the rest of a longer one is skipped */
+static int readMetaLine(FILE *fp, char *buf, int size)
+{
+	int		c = 0;
 
+	if( fgets(buf, size, fp) == NULL )
+		return -EIO;
+	if( strchr(buf, '\n') == NULL ) {
+		while( ((c = getc(fp)) != EOF) && (c != '\n') )
+			;
 	}
+	return 0;
+}
 
-	// there will be an extra slash, remove it
-	
-	log_msg("path =%s\n", tmpPath+1);
-	*pPath = strdup(tmpPath + 1) ;	
-	
-	free(tmpPath);
-	log_msg("returning path =%s\n", *pPath);
-ret :
-	return ret;
+int readMetaHeader(FILE *fp, int64_t *pSize)
+{
+
+/*
+ *	- the first two lines of a _meta.txt or a chunk manifest: the file
+ *	  name, which may have spaces in it, then the size
+ *
+ */
 
+	char		line[64];
+	char		*end = NULL;
+	long long	fileSize = 0;
+
+	if( (readMetaLine(fp, line, sizeof(line)) != 0)
+			|| (readMetaLine(fp, line, sizeof(line)) != 0) )
+		return -EIO;
+	errno = 0;
+	fileSize = strtoll(line, &end, 10);
+	if( (end == line) || (errno != 0) || (fileSize < 0)
+				|| ((*end != '\n') && (*end != 0)) )
+		return -EIO;
+	*pSize = fileSize;
+	return 0;
 }
-int fixEncodedFileInfo(s3_tree_node *node, char* path)
+
+int getEncodedFileSize(char *path, char *s3Name, char *versionId, 
+							int64_t *pSize)
 {
 
 /*
- *	- node points to a _meta.txt
- *	- fetch it from S3 to cache to get parent size
- *	- unlink the file 
+ *	- path is the _meta.txt of an encoded file, s3Name its key
+ *	- if the encoded file is cached, its size is the answer
+ *	- else fetch the meta object to a temporary file, second line
+ *	  is the size
+ *	- doesn't touch the tree, call it without gS3TreeLock
  *
  */
 
 	int		ret = 0;
 	char		*cachedPath = NULL;
-	char		*parentCachedPath = NULL;
-	char		*temp = NULL;
-	int		fileSize = 0 ;
-	FILE		*fp = NULL;
-	char		*tmpPath = NULL;
+	char		*tempPath = NULL;
 	char		*tmp = NULL;
-	int		inCache = 0 ;
+	FILE		*fp = NULL;
 	struct stat 	statbuf;
 
-	tmpPath = strdup(path);
-	log_msg("tmpPath = %s\n", tmpPath );
-
-	
 	ret = s3CacheGetCachedPath(gS3Cache, path, &cachedPath); 
-	
 	if( ret != 0 ) {
-		log_msg("fixEncodedFileInfo : error s3CacheGetCachedPath\n");
+		log_msg("getEncodedFileSize : error s3CacheGetCachedPath\n");
 		goto ret;
 	}	
 
-
 	tmp = strrchr(cachedPath, '/');
 	if(tmp != NULL )
 		*tmp = 0;
-	parentCachedPath  = strdup(cachedPath) ;
-	if(tmp != NULL )
-		*tmp = '/';
-
 
-	if ( (stat(parentCachedPath, &statbuf) == 0)
+	if( (stat(cachedPath, &statbuf) == 0)
 				&& (S_ISREG(statbuf.st_mode)) ) {
 
-		node->parent->s3FileInfo->size = statbuf.st_size;
-		node->parent->isFileNode = 1;
-		free(parentCachedPath);	
+		*pSize = statbuf.st_size;
+		goto ret;
+	}
 
-	} else {
-		ret = s3CacheFetch(gS3Cache, tmpPath);
-		if( ret != 0 ) {
-			log_msg("fixEncodedFileInfo : error s3CacheFetch\n");
-			goto ret;
-		}	
+	ret = s3CacheTempPath(gS3Cache, ".meta", &tempPath);
+	if( ret != 0 ) {
+		goto ret;
+	}
 
+	ret = s3CacheFetchObject(s3Name, versionId, tempPath);
+	if( ret != 0 ) {
+		log_msg("getEncodedFileSize : error s3CacheFetchObject\n");
+		goto ret;
+	}	
 
-		fp = fopen(cachedPath, "rb");
-        	temp = (char *)malloc(sizeof(char)*(1024));
-        	fscanf(fp, "%s", temp);
+	fp = fopen(tempPath, "rb");
+	if( fp == NULL ) {
+		ret = -errno;
+		goto ret;
+	}
 
-        	if (fscanf(fp, "%d", &fileSize) != 1) {
-                	log_msg("File size is not valid\n");
-			return ret;
-        	}
+	ret = readMetaHeader(fp, pSize);
+	if( ret != 0 ) {
+		log_msg("File size is not valid\n");
+		goto ret;
+	}
 
-		free(temp);
-		temp = NULL;
-		node->parent->s3FileInfo->size = fileSize;
-		node->parent->isFileNode = 1;
+ret:
+	if( fp != NULL )
 		fclose(fp);
-		unlink(cachedPath);
-		tmp = strrchr(cachedPath, '/');
-		*tmp = 0;
-		rmdir(cachedPath); 
-		*tmp = '/';
+	if( tempPath != NULL ) {
+		unlink(tempPath);
+		free(tempPath);
 	}
-ret:
 	if(cachedPath != NULL )
 		free(cachedPath);
-	if(tmpPath != NULL )
-		free(tmpPath);	
-	log_msg("returning from fixEncodedFileInfo\n");
+	return ret;
+}
+
+int fixEncodedFileSizes(int metaCount, char **metaPaths)
+{
+
+/*
+ *	- metaPaths are _meta.txt paths just inserted by insertS3NodesInTree
+ *	- called with gS3TreeLock held, the sizes are read unlocked and
+ *	  the nodes looked up again afterwards
+ *
+ */
+
+	int		ret = 0;
+	int		i = 0;
+	int64_t		*sizes = NULL;
+	s3_tree_node	*node = NULL;
+
+	sizes = malloc(metaCount * sizeof(int64_t));
+	if( sizes == NULL ) {
+		return -ENOMEM;
+	}
+
+	pthread_mutex_unlock(&gS3TreeLock);
+	for( i=0; i < metaCount; i++ ) {
+		if( getEncodedFileSize(metaPaths[i], metaPaths[i], NULL,
+							&sizes[i]) != 0 ) {
+			log_msg("fixEncodedFileSizes : no size for %s\n",
+							metaPaths[i]);
+			sizes[i] = -1;
+		}
+	}
+	pthread_mutex_lock(&gS3TreeLock);
+
+	for( i=0; i < metaCount; i++ ) {
+		searchForPath(metaPaths[i], gS3DirectoryTree, &node);
+		if( (node == NULL) || (node->parent == NULL) ) {
+			continue;
+		}
+		/* the meta object is rewritten with every upload, its
+		   ETag stands for the whole file */
+		if( node->s3FileInfo.eTag != NULL ) {
+			setNodeETag(node->parent, 
+					strdup(node->s3FileInfo.eTag));
+		}
+		if( sizes[i] < 0 ) {
+			continue;
+		}
+		NODE_STORE(node->parent->s3FileInfo.size, sizes[i]);
+		NODE_STORE(node->parent->isFileNode, 1);
+	}
+
+	free(sizes);
 	return ret;
 }
 
@@ -722,6 +2142,7 @@ int updateDirTree(char *path, int isFileNode)
 
 
 	log_msg("updateDirTree\n");
+	negativeForget(path);
 
 	tmpPath = strdup(path);
 	tmp = strtok(tmpPath,"/");
@@ -733,7 +2154,7 @@ int updateDirTree(char *path, int isFileNode)
 		if(ret != 0 ) {
 			goto ret ;
 		}
-		log_msg("found Node : %s\n", foundNode->s3FileInfo->name);
+		log_msg("found Node : %s\n", foundNode->s3FileInfo.name);
 		newTree = foundNode;
 		tmp = strtok(NULL, "/");
 	}
@@ -746,7 +2167,8 @@ int updateDirTree(char *path, int isFileNode)
 		}
 
 		if ( stat(cachedPath, &statbuf) == 0) {
-			foundNode->s3FileInfo->size = statbuf.st_size;
+			NODE_STORE(foundNode->s3FileInfo.size,
+						(int64_t) statbuf.st_size);
 		}
 		free(cachedPath);
 		log_msg("marking not VERSION_COMPLETE\n");
@@ -757,7 +2179,9 @@ int updateDirTree(char *path, int isFileNode)
 		foundNode->isComplete |= NODE_COMPLETE;
 	}
 
-	foundNode->isFileNode = isFileNode;
+	/* until a listing shows it, a re-list of the parent keeps it */
+	foundNode->isComplete |= NODE_LOCAL;
+	NODE_STORE(foundNode->isFileNode, isFileNode);
 	
 ret: 
 	if(tmpPath != NULL)
@@ -794,9 +2218,12 @@ int	addDirectory(const char *path)
 	}
 	
 	log_msg("updating directory tree\n");
+	pthread_mutex_lock(&gS3TreeLock);
 	ret = updateDirTree(tmpPath, 0) ;
+	pthread_mutex_unlock(&gS3TreeLock);
 
 ret :
+	free(tmpPath);
 	return ret ;
 }
 
@@ -805,6 +2232,8 @@ int	deletePath( char *path)
 	int		ret = 0 ;
 
 	if(strstr(path, ".versions") == NULL ) {
+		s3CacheDiscard(gS3Cache, path);
+		fillCancel(path);
 		ret = deleteThroughS3(path);
 		if(ret != NULL) {
 
@@ -847,8 +2276,29 @@ int deleteChildren(s3_tree_node *node)
 		child = next;
 
 	}
-	node->children = NULL;
+	NODE_STORE(node->children, NULL);
+
+}
+
+/* a deleted node, once no lock-free reader can be in it */
+static void nodeRetired(void *p)
+{
+	s3_tree_node	*node = p;
+
+	if( node->listing != NULL ) {
+		if( node->listing->marker != NULL )
+			free(node->listing->marker);
+		free(node->listing);
+	}
+	if( node->s3FileInfo.name != NULL )
+		nameRelease(node->s3FileInfo.name);
+	nodeArenaFree(node);
+}
 
+/* the name a node was renamed from, once no reader can be in it */
+static void nameRetired(void *p)
+{
+	nameRelease(p);
 }
 
 int deleteNode(s3_tree_node *node)
@@ -864,30 +2314,59 @@ int deleteNode(s3_tree_node *node)
 	}
 
 
-	if( node->next != NULL)
-		node->next->prev = node->prev;
-	else
-		log_msg("%s : node->next ==  NULL\n", node->s3FileInfo->name);
-
-	if( node->prev != NULL) {
-		node->prev->next = node->next;
-	} else {
-		node->parent->children = node->next;
-		log_msg("%s : node->prev ==  NULL\n", node->s3FileInfo->name);
-	}
-
+	childUnlink(node);
+	childIndexFree(node);
 		
-	free(node->s3FileInfo->name);
-	if(node->s3FileInfo->versionId != NULL )
-		free(node->s3FileInfo->versionId);
+	s3InodeRemove(node);
+	if( node->s3FileInfo.versionId != NULL )
+		free(node->s3FileInfo.versionId);
+	if( node->s3FileInfo.eTag != NULL )
+		free(node->s3FileInfo.eTag);
+	if( node->cachedETag != NULL )
+		free(node->cachedETag);
 	if(node->s3Name != NULL)
 		free(node->s3Name);
-	free(node);
+	/* getattr may be reading it without the lock, see s3_epoch.h */
+	epochRetire(nodeRetired, node);
 	return ret;
 
 }
 
 
+int moveNode(s3_tree_node *node, s3_tree_node *newParent, const char *newName)
+{
+	/*
+	 - unlink node from its parent and insert it under newParent as
+	   newName, in the same descending order as searchNode(); the
+	   node keeps its children and its inode
+	 - a node already called newName under newParent must have been
+	   deleted by the caller
+	*/
+	s3_tree_node	*prev = NULL;
+	char		*name = NULL;
+	char		*oldName = node->s3FileInfo.name;
+
+	log_msg("moveNode %s -> %s\n", node->s3FileInfo.name, newName);
+
+	name = nameIntern(newName);
+	if( name == NULL ) {
+		return -ENOMEM;
+	}
+
+	childUnlink(node);
+	NODE_STORE(node->s3FileInfo.name, name);
+	/* a lock-free reader may be comparing it */
+	epochRetire(nameRetired, oldName);
+	if( node->listing != NULL ) {
+		/* a re-list in progress is of the old path */
+		node->listing->refreshing = 0;
+	}
+
+	childFind(newParent, name, &prev);
+	childLink(newParent, node, prev);
+	return 0;
+}
+
 int deleteThroughTree(char *path)
 {
 	int 		ret = 0 ;
@@ -895,13 +2374,20 @@ int deleteThroughTree(char *path)
 	char		*tmp = NULL;
 	char		key[4096];
 	s3_tree_node	*child = NULL;
+	char		**names = NULL;
+	char		**versionIds = NULL;
+	int		keyCount = 0 ;
+	int		i = 0 ;
 
+	/* collect the keys under the lock, delete them without it */
+	pthread_mutex_lock(&gS3TreeLock);
 	ret = searchForPath(path, gS3DirectoryTree, &foundNode);
 
 	if( ret != 0 ) {
 
 		log_msg("deleteThroughTree : searchForPath %s error\n",
 					path);
+		pthread_mutex_unlock(&gS3TreeLock);
 		goto ret;
 	}
 
@@ -911,46 +2397,36 @@ int deleteThroughTree(char *path)
 							path);
 
 		ret = -EINVAL;
+		pthread_mutex_unlock(&gS3TreeLock);
 		goto ret;
 	}
 
-	if( foundNode->children != NULL ) {
-
-		child = foundNode->children;
-		while ( child != NULL) {
-
-			if( child->s3Name != NULL ) {
-
-				tmp = strstr(path, ".versions");
-
-				if( tmp != NULL)
-					*tmp = 0;
-
-				sprintf(key, "%s%s", path+1, child->s3Name);
-
-				if(tmp != NULL )
-					*tmp = '.';
-
-			} else {
-
-				sprintf(key, "%s", path+1);
-			}
-	
-			deleteObjectFromS3(key, child->s3FileInfo->versionId);
+	child = (foundNode->children != NULL) ? foundNode->children : foundNode;
+	for( ; child != NULL; child = child->next ) {
+		keyCount++;
+		if( child == foundNode )
+			break;
+	}
 
-			child = child->next;
-		}
+	names = calloc(keyCount, sizeof(char *));
+	versionIds = calloc(keyCount, sizeof(char *));
+	if( (names == NULL) || (versionIds == NULL) ) {
+		ret = -ENOMEM;
+		pthread_mutex_unlock(&gS3TreeLock);
+		goto ret;
+	}
 
-	} else {
+	child = (foundNode->children != NULL) ? foundNode->children : foundNode;
+	for( i=0; i < keyCount; i++, child = child->next ) {
 
-		if( foundNode->s3Name != NULL ) {
+		if( child->s3Name != NULL ) {
 
 			tmp = strstr(path, ".versions");
 
 			if( tmp != NULL)
 				*tmp = 0;
 
-			sprintf(key, "%s%s", path+1, foundNode->s3Name);
+			sprintf(key, "%s%s", path+1, child->s3Name);
 
 			if(tmp != NULL )
 				*tmp = '.';
@@ -960,11 +2436,38 @@ int deleteThroughTree(char *path)
 			sprintf(key, "%s", path+1);
 		}
 	
-		deleteObjectFromS3(key, foundNode->s3FileInfo->versionId);
+		names[i] = strdup(key);
+		if( child->s3FileInfo.versionId != NULL )
+			versionIds[i] = strdup(child->s3FileInfo.versionId);
+		if( (names[i] == NULL) || ((versionIds[i] == NULL)
+				&& (child->s3FileInfo.versionId != NULL)) ) {
+			ret = -ENOMEM;
+			pthread_mutex_unlock(&gS3TreeLock);
+			goto ret;
+		}
 	}
-	deleteNode(foundNode);
-ret: 
+	pthread_mutex_unlock(&gS3TreeLock);
+
+	/* the versions of an encoded file, its fragments, in batches;
+	   a key left is logged and reported, the node goes anyway */
+	ret = deleteKeysFromS3(keyCount, names, versionIds, NULL);
 
+	pthread_mutex_lock(&gS3TreeLock);
+	searchForPath(path, gS3DirectoryTree, &foundNode);
+	if( foundNode != NULL ) {
+		s3Invalidate(foundNode, S3_INVALIDATE_ENTRY);
+		deleteNode(foundNode);
+	}
+	pthread_mutex_unlock(&gS3TreeLock);
+ret: 
+	for( i=0; (names != NULL) && (i < keyCount); i++ ) {
+		free(names[i]);
+	}
+	for( i=0; (versionIds != NULL) && (i < keyCount); i++ ) {
+		free(versionIds[i]);
+	}
+	free(names);
+	free(versionIds);
 	return ret;
 }
 
@@ -972,24 +2475,27 @@ int deleteThroughS3(char  *path)
 {
 	
 	int		ret = 0 ;
-	int		count = 0 ;
-	s3_file_info	*s3FileInfoList = NULL;
-	int		i = 0 ;
-	s3_file_info  	*tmpS3FileInfo =  NULL;
+	s3_key_list	keys;
+	s3_key_iter	iter;
+	s3_file_info  	info;
 	char		*bucket = NULL;
 	char		key[4096];
 	char		*tmp = NULL;
 	s3_tree_node	*foundNode = NULL;
 	char		*tmpPath =  NULL;
+	char		**names = NULL;
+	int		nameCount = 0;
+	int		i = 0;
 
+	keyListInit(&keys);
 	tmpPath = strdup(path);
 
-	ret = getPathFromS3(tmpPath, &count, &s3FileInfoList, 0);
+	ret = getKeysFromS3(tmpPath, &keys);
 	if( ret != 0 ) {
-		log_msg("deleteThroughS3 : getPathFromS3 error\n");
+		log_msg("deleteThroughS3 : getKeysFromS3 error\n");
 		goto ret;
 	}
-	log_msg(" count = %d\n", count);
+	log_msg(" count = %d\n", keys.count);
 	
 	tmp = strchr(tmpPath+1, '/');
 	if(tmp != NULL)
@@ -998,26 +2504,57 @@ int deleteThroughS3(char  *path)
 	if(tmp != NULL )
 		*tmp = '/';
 	
-	for(i=0; i < count; i++ ) {
+	names = malloc((keys.count + 1) * sizeof(char *));
+	if( (bucket == NULL) || (names == NULL) ) {
+		ret = -ENOMEM;
+		goto ret;
+	}
+	/* nothing under path/: a plain file, its object is the key */
+	if( (keys.count == 0) && (tmp != NULL) ) {
+		names[nameCount] = strdup(path + 1);
+		if( names[nameCount] == NULL ) {
+			ret = -ENOMEM;
+			goto ret;
+		}
+		nameCount++;
+	}
+	keyIterInit(&iter, &keys);
+	while( keyListNext(&iter, &info) ) {
 
-		tmpS3FileInfo = (s3_file_info *)&(s3FileInfoList[i]);
-		sprintf(key, "/%s/%s", bucket, tmpS3FileInfo->name);
-		deleteObjectFromS3(key+1, NULL);
+		sprintf(key, "%s/%s", bucket, info.name);
+		names[nameCount] = strdup(key);
+		if( names[nameCount] == NULL ) {
+			ret = -ENOMEM;
+			goto ret;
+		}
+		nameCount++;
 	}
 
-	if( strcmp(path+1, bucket) == 0 ) {
+	/* a directory, or the fragments of an encoded file, in batches;
+	   a key left is logged and reported, the node goes anyway */
+	ret = deleteKeysFromS3(nameCount, names, NULL, NULL);
+
+	if( (ret == 0) && (strcmp(path+1, bucket) == 0) ) {
 
 		deleteBucketFromS3(bucket);
 
 	}
 
 	
+	pthread_mutex_lock(&gS3TreeLock);
 	searchForPath(path, gS3DirectoryTree, &foundNode);
-	deleteNode(foundNode);
+	if( foundNode != NULL ) {
+		s3Invalidate(foundNode, S3_INVALIDATE_ENTRY);
+		deleteNode(foundNode);
+	}
+	pthread_mutex_unlock(&gS3TreeLock);
 
 ret: 
-	if(s3FileInfoList != NULL)
-		free(s3FileInfoList);
+	for( i=0; i < nameCount; i++ ) {
+		free(names[i]);
+	}
+	free(names);
+	keyListFree(&keys);
 	if(bucket != NULL )
 		free(bucket);
 	if(tmpPath != NULL)
@@ -1064,30 +2601,290 @@ ret:
 
 }
 
-int deleteBucketFromS3(char *bucket)
+int copyObjectInS3(char *sourceKey, char *destinationKey, char **pETag)
+{
+
+	/*
+	 - server-side copy of sourceKey to destinationKey, both
+	   "bucket/key"; no data goes through the host
+	 - *pETag, if pETag is set, is the ETag of the copy or NULL
+	*/
+	int		argc = 2;
+	char		*argv[3] = { NULL, NULL, NULL };
+	int		ret = 0 ;
+	int		s3Status = 0 ;
+
+	argv[0] = strdup(sourceKey);
+	argv[1] = strdup(destinationKey);
+	if( (argv[0] == NULL) || (argv[1] == NULL) ) {
+		ret = -ENOMEM;
+		goto ret;
+	}
+
+	log_msg("copyObjectInS3 : %s -> %s\n", argv[0], argv[1]);
+
+	s3Status = copy_object(argc, argv, 0, pETag);
+	if( s3Status != 0 ) {
+		logS3Errors(s3Status);
+		ret = (s3Status == S3StatusErrorNoSuchKey) ? -ENOENT : -EIO;
+		goto ret; 
+	}
+
+ret:
+	if( argv[0] != NULL )
+		free(argv[0]);
+	if( argv[1] != NULL )
+		free(argv[1]);
+	return ret;
+
+}
+
+int deleteBucketFromS3(char *bucket)
+{
+	int		argc = 1;
+	char		*argv[2] = {NULL, NULL};
+	int		s3Status = 0 ;
+	int		ret = 0 ;
+
+
+	argv[0] = strdup(bucket);
+	
+	s3Status = delete_bucket(argc, argv, 0 ) ;
+	if( s3Status != 0 ) {
+		logS3Errors(s3Status);
+		ret = -EINVAL;
+		goto ret; 
+	}
+
+ret :
+	if( argv[0] != NULL )
+		free(argv[0]);
+
+	return ret;
+
+}
+static void setNodeETag(s3_tree_node *node, char *eTag)
+{
+	/*
+	 - eTag was just listed for node, the node takes it over
+	 - the first listing after our own flush has the ETag of the
+	   cached copy
+	 - any other change means the object was rewritten elsewhere
+	*/
+	if( eTag == NULL ) {
+		return;
+	}
+
+	if( node->uploaded ) {
+		if( node->cachedETag != NULL )
+			free(node->cachedETag);
+		node->cachedETag = strdup(eTag);
+		node->uploaded = 0;
+	} else if( (node->s3FileInfo.eTag != NULL)
+			&& (strcmp(node->s3FileInfo.eTag, eTag) != 0) ) {
+		s3Invalidate(node, S3_INVALIDATE_DATA);
+	}
+
+	if( node->s3FileInfo.eTag != NULL )
+		free(node->s3FileInfo.eTag);
+	node->s3FileInfo.eTag = eTag;
+}
+
+static void s3Invalidate(s3_tree_node *node, int what)
+{
+	if( gS3Invalidate != NULL )
+		gS3Invalidate(node, what);
+}
+
+/***************************inode functions *****************************/
+
+/* slot ino, which is below inodeNextUnused */
+static s3_inode_slot *inodeSlot(uint64_t ino)
+{
+	return &inodeChunks[ino / S3_INODE_CHUNK_SLOTS]
+				[ino % S3_INODE_CHUNK_SLOTS];
+}
+
+/* one more chunk of slots; only the array of chunks moves */
+static int inodeGrow()
+{
+	s3_inode_slot	**chunks = NULL;
+	s3_inode_slot	**old = NULL;
+	s3_inode_slot	*chunk = NULL;
+	uint64_t	size = 0;
+
+	if( inodeChunkCount == inodeChunkSize ) {
+		size = (inodeChunkSize == 0) ? 16 : inodeChunkSize * 2;
+		chunks = calloc(size, sizeof(s3_inode_slot *));
+		if( chunks == NULL ) {
+			return -ENOMEM;
+		}
+		old = inodeChunks;
+		if( old != NULL ) {
+			memcpy(chunks, old,
+				inodeChunkCount * sizeof(s3_inode_slot *));
+		}
+		/* a lock-free reader may be in the old one */
+		NODE_STORE(inodeChunks, chunks);
+		inodeChunkSize = size;
+		if( old != NULL ) {
+			epochRetire(free, old);
+		}
+	}
+	chunk = calloc(S3_INODE_CHUNK_SLOTS, sizeof(s3_inode_slot));
+	if( chunk == NULL ) {
+		return -ENOMEM;
+	}
+	NODE_STORE(inodeChunks[inodeChunkCount], chunk);
+	inodeChunkCount++;
+	return 0;
+}
+
+int s3InodeAdd(s3_tree_node *node)
+{
+	s3_inode_slot	*slot = NULL;
+	uint64_t	ino = 0;
+
+	if( inodeFreeList != 0 ) {
+		ino = inodeFreeList;
+		inodeFreeList = inodeSlot(ino)->nextFree;
+		inodeSlot(ino)->isFree = 0;
+	} else {
+		if( (inodeNextUnused >= inodeChunkCount * S3_INODE_CHUNK_SLOTS)
+						&& (inodeGrow() != 0) ) {
+			return -ENOMEM;
+		}
+		ino = inodeNextUnused;
+	}
+
+	slot = inodeSlot(ino);
+	NODE_STORE(slot->node, node);
+	slot->generation++;
+	node->ino = ino;
+	node->generation = slot->generation;
+	if( ino == inodeNextUnused ) {
+		/* the slot is filled before a reader may look at it */
+		NODE_STORE(inodeNextUnused, ino + 1);
+	}
+	return 0;
+}
+
+/* gives slot ino back once it is deleted and forgotten */
+static void inodeFree(uint64_t ino)
+{
+	s3_inode_slot	*slot = inodeSlot(ino);
+
+	if( slot->isFree || (slot->node != NULL)
+			|| (__atomic_load_n(&slot->nlookup, __ATOMIC_SEQ_CST) != 0) )
+		return;
+	slot->isFree = 1;
+	slot->nextFree = inodeFreeList;
+	inodeFreeList = ino;
+}
+
+void s3InodeRemove(s3_tree_node *node)
+{
+	uint64_t	ino = node->ino;
+	s3_inode_slot	*slot = NULL;
+
+	if( (ino == 0) || (ino >= inodeNextUnused)
+			|| (inodeSlot(ino)->node != node) ) {
+		return;
+	}
+	slot = inodeSlot(ino);
+	/* against s3InodeRefLockFree(), which counts and then looks */
+	__atomic_store_n(&slot->node, NULL, __ATOMIC_SEQ_CST);
+	inodeFree(ino);
+	NODE_STORE(node->ino, 0);
+}
+
+void s3InodeRef(s3_tree_node *node)
+{
+	/* the kernel is handed node, gS3TreeLock held */
+	if( (node->ino != 0) && (node->ino < inodeNextUnused) )
+		__atomic_add_fetch(&inodeSlot(node->ino)->nlookup, 1,
+							__ATOMIC_SEQ_CST);
+}
+
+int s3InodeRefLockFree(s3_tree_node *node, uint64_t ino)
 {
-	int		argc = 1;
-	char		*argv[2] = {NULL, NULL};
-	int		s3Status = 0 ;
-	int		ret = 0 ;
+	/*
+	 - s3InodeRef() between epochEnter() and epochExit(), ino is what
+	   was read from node
+	 - 0 when counted; -ENOENT when nothing was counted, and -EAGAIN
+	   when the count went to a slot node has left: the caller undoes
+	   it with s3InodeForget(ino, 1) after epochExit(), then takes the
+	   lock and looks again
+	*/
+	s3_inode_slot	**chunks = NULL;
+	s3_inode_slot	*slot = NULL;
+
+	if( (ino == 0) || (ino >= NODE_LOAD(inodeNextUnused)) )
+		return -ENOENT;
+	chunks = NODE_LOAD(inodeChunks);
+	slot = &NODE_LOAD(chunks[ino / S3_INODE_CHUNK_SLOTS])
+					[ino % S3_INODE_CHUNK_SLOTS];
+	__atomic_add_fetch(&slot->nlookup, 1, __ATOMIC_SEQ_CST);
+	if( __atomic_load_n(&slot->node, __ATOMIC_SEQ_CST) != node )
+		return -EAGAIN;
+	return 0;
+}
 
+void s3InodeForget(uint64_t ino, uint64_t nlookup)
+{
+	/* the kernel forgot nlookup entries of ino, gS3TreeLock held */
+	s3_inode_slot	*slot = NULL;
+
+	if( (ino == 0) || (ino >= inodeNextUnused) )
+		return;
+	slot = inodeSlot(ino);
+	if( __atomic_sub_fetch(&slot->nlookup, nlookup, __ATOMIC_SEQ_CST) == 0 )
+		inodeFree(ino);
+}
 
-	argv[0] = strdup(bucket);
-	
-	s3Status = delete_bucket(argc, argv, 0 ) ;
-	if( s3Status != 0 ) {
-		logS3Errors(s3Status);
-		ret = -EINVAL;
-		goto ret; 
-	}
+int s3InodeHeld(s3_tree_node *node)
+{
+	/* whether the kernel holds node, gS3TreeLock held */
+	if( (node->ino == 0) || (node->ino >= inodeNextUnused) )
+		return 0;
+	return __atomic_load_n(&inodeSlot(node->ino)->nlookup,
+						__ATOMIC_RELAXED) != 0;
+}
 
-ret :
-	if(argv[0] != NULL )
-		free(argv[0]);
+int s3InodeGet(uint64_t ino, s3_tree_node **pNode)
+{
+	/* a stale inode, the node has been deleted, gives NULL */
+	*pNode = NULL;
+	if( (ino != 0) && (ino < inodeNextUnused) ) {
+		*pNode = inodeSlot(ino)->node;
+		evictTouch(*pNode);
+	}
+	return 0;
+}
 
-	return ret;
+s3_tree_node *s3InodeGetLockFree(uint64_t ino)
+{
+	/*
+	 - s3InodeGet() without gS3TreeLock, between epochEnter() and
+	   epochExit(), see s3_epoch.h
+	 - NULL for a stale inode, or one just being added; the caller
+	   takes the lock and looks again
+	*/
+	s3_inode_slot	**chunks = NULL;
+	s3_inode_slot	*chunk = NULL;
+	s3_tree_node	*node = NULL;
 
+	/* the chunk of a slot in use was stored before it was */
+	if( (ino == 0) || (ino >= NODE_LOAD(inodeNextUnused)) ) {
+		return NULL;
+	}
+	chunks = NODE_LOAD(inodeChunks);
+	chunk = NODE_LOAD(chunks[ino / S3_INODE_CHUNK_SLOTS]);
+	node = NODE_LOAD(chunk[ino % S3_INODE_CHUNK_SLOTS].node);
+	evictTouch(node);
+	return node;
 }
+
 /***************************versioning functions *****************************/
 
 int populateVersions(s3_tree_node *pathNode, const char *path)
@@ -1141,6 +2938,7 @@ int getVersioningInfo(char *bucket, char **pVersioningState)
 	int		i=0;
 	int		ret = 0 ;
 
+	pthread_mutex_lock(&versioningInfoLock);
 	if( gVersioningInfoList[0] != NULL ) {
 
 		while(gVersioningInfoList[i] != NULL ) {
@@ -1156,6 +2954,11 @@ int getVersioningInfo(char *bucket, char **pVersioningState)
 	if( gVersioningInfoList[i] == NULL ) {
 
 		// bucket info doesn't exist, populate versioning state
+		if( i >= 49 ) {
+			log_msg("getVersioningInfo : too many buckets\n");
+			ret = -ENOSPC;
+			goto ret;
+		}
 
 		ret = populateVersioningInfo(bucket, &i) ;
 		if( ret != 0 ) {
@@ -1166,6 +2969,7 @@ int getVersioningInfo(char *bucket, char **pVersioningState)
 
 	*pVersioningState = gVersioningInfoList[i]->state;
 ret:
+	pthread_mutex_unlock(&versioningInfoLock);
 	return ret;
 }
 
@@ -1252,7 +3056,7 @@ int insertVersionNodes(s3_tree_node *pathNode, const char * path )
 		}
 
 		strcat(childPath, "/");
-		strcat(childPath, child->s3FileInfo->name);			
+		strcat(childPath, child->s3FileInfo.name);			
 
 		ret = prepareForInsertingVersions(childPath, 
 						child, 
@@ -1300,7 +3104,7 @@ int insertVersionNodes(s3_tree_node *pathNode, const char * path )
 			while( childChild != NULL )  {
 
 				strcat(childPath, "/");
-				strcat(childPath, childChild->s3FileInfo->name);
+				strcat(childPath, childChild->s3FileInfo.name);
 
 				log_msg(
 					"getVersionsFromS3 : path %s\n",
@@ -1474,7 +3278,7 @@ int processVersionsList(s3_tree_node *versionNode,
 
 		}
 		memset(versionI, 0, 1024);
-		sprintf(versionI, "%d-%s", j, child->s3FileInfo->name) ;
+		sprintf(versionI, "%d-%s", j, child->s3FileInfo.name) ;
 		
 		ret = searchNode( versionNode, versionI, 1, &foundNode) ;
 
@@ -1483,17 +3287,17 @@ int processVersionsList(s3_tree_node *versionNode,
 			goto ret;
 		}
 
-		foundNode->s3Name = strdup(child->s3FileInfo->name);
-		foundNode->isFileNode = 1;
+		foundNode->s3Name = strdup(child->s3FileInfo.name);
+		NODE_STORE(foundNode->isFileNode, 1);
 
 		if( child->children == NULL ) {
-			foundNode->s3FileInfo->size =
-					tmpS3VersionsContent->size ;
+			NODE_STORE(foundNode->s3FileInfo.size,
+					tmpS3VersionsContent->size);
 		
-			foundNode->s3FileInfo->time =
-					tmpS3VersionsContent->lastModified ;
+			NODE_STORE(foundNode->s3FileInfo.time,
+					tmpS3VersionsContent->lastModified);
 
-			foundNode->s3FileInfo->versionId =
+			foundNode->s3FileInfo.versionId =
 				strdup(tmpS3VersionsContent->versionId) ;
 		} else {
 		
@@ -1506,124 +3310,693 @@ int processVersionsList(s3_tree_node *versionNode,
 			}
 
 						
-			foundNode->s3FileInfo->size =
-					tmpS3VersionsContent->size ;
+			NODE_STORE(foundNode->s3FileInfo.size,
+					tmpS3VersionsContent->size);
+		
+			NODE_STORE(foundNode->s3FileInfo.time,
+					tmpS3VersionsContent->lastModified);
+
+
+			if( foundNode->s3FileInfo.time >
+					foundNode->parent->s3FileInfo.time ) {
+					
+				NODE_STORE(foundNode->parent->s3FileInfo.time,
+					foundNode->s3FileInfo.time);
+			}
+			foundNode->s3FileInfo.versionId =
+				strdup(tmpS3VersionsContent->versionId) ;
+
+			sprintf(parentChildName, "%s/%s",
+					child->s3FileInfo.name,
+					foundNode->s3FileInfo.name);
+	
+			foundNode->s3Name = strdup(parentChildName); 
+			
+			if( isNodeMetaFile(foundNode) ) {
+			
+				char	*pathToMeta = NULL;
+				ret = getPathForNode(foundNode, &pathToMeta);
+				log_msg("before FixEncodedFileInfo\n");
+				ret = fixEncodedFileInfo(foundNode, pathToMeta);
+				log_msg("after FixEncodedFileInfo\n");
+
+			}
+		}
 		
-			foundNode->s3FileInfo->time =
-					tmpS3VersionsContent->lastModified ;
+		j++;
+
+	}
+ret:
+	return ret;
+}
+
+/**************************** Cache Functions *******************************/
+
+
+int s3CacheInit(s3_cache **pCache, char* cacheLocation)
+{
+	*pCache = (s3_cache *) malloc(sizeof(s3_cache));
+	if( *pCache == NULL ) {
+		return -ENOMEM;
+	}
+
+	(*pCache)->location = cacheLocation;
+	(*pCache)->count = 0;
+	(*pCache)->flushingCount = 0;
+	(*pCache)->dirtyBytes = 0;
+	(*pCache)->dirtyLimit = 0;
+	(*pCache)->dirtyTable = NULL;
+	(*pCache)->dirtyTableSize = 0;
+	(*pCache)->dirtyHead = NULL;
+	(*pCache)->dirtyTail = NULL;
+	pthread_mutex_init(&((*pCache)->lock), NULL);
+	pthread_cond_init(&((*pCache)->flushed), NULL);
+	gS3Cache = *pCache;
+
+	return 0;
+}
+int s3CacheGetCachedPath(s3_cache *cache, const char *path, char **pCachedPath)
+{
+
+	log_msg("s3CacheGetCachedPath\n");
+	*pCachedPath = (char * ) malloc(strlen(path) + strlen(cache->location) +1 );
+
+	if( *pCachedPath == NULL ) {
+		log_msg("out of Memory\n");
+		return -ENOMEM;
+	}
+
+	if( *path == '/' )
+		sprintf(*pCachedPath,"%s%s", cache->location, path);
+	else
+		sprintf(*pCachedPath,"%s/%s", cache->location, path);
+
+	log_msg("cachedPath = %s\n", *pCachedPath);
+	return 0;
+
+}
+int s3CacheInCache(s3_cache *cache, const char* path, int *pInCache)
+{
+	char 		*cachedPath =NULL;		
+	struct stat 	statbuf;
+	int		ret = 0 ;
+
+	log_msg("s3CacheInCache\n");
+	ret = s3CacheGetCachedPath(cache, path, &cachedPath);
+	if( ret != 0 ) {
+		return ret;
+	}
+	if( stat(cachedPath, &statbuf) == -1 ) {
+		*pInCache = 0;
+	} else {
+		*pInCache = 1;
+	}
+
+	free(cachedPath);
+	return 0;
+}
+/***************** dirty-file table, called with cache->lock held ***********/
+
+static s3_dirty_file **dirtySlot(s3_cache *cache, const char *path)
+{
+	s3_dirty_file	**slot = NULL;
+
+	slot = &(cache->dirtyTable[hash((const unsigned char *) path,
+			strlen(path)) % (uint64_t) cache->dirtyTableSize]);
+	while( (*slot != NULL) && (strcmp((*slot)->path, path) != 0) ) {
+		slot = &((*slot)->hashNext);
+	}
+	return slot;
+}
+
+/* entry of path, NULL if it is clean */
+static s3_dirty_file *findDirty(s3_cache *cache, const char *path)
+{
+	if( cache->dirtyTableSize == 0 ) {
+		return NULL;
+	}
+	return *dirtySlot(cache, path);
+}
+
+static int growDirtyTable(s3_cache *cache)
+{
+	s3_dirty_file	**table = NULL;
+	s3_dirty_file	**oldTable = cache->dirtyTable;
+	s3_dirty_file	*file = NULL;
+	int		oldSize = cache->dirtyTableSize;
+	int		size = 0;
+	int		i = 0;
+
+	size = (oldSize == 0) ? S3_CACHE_DIRTY_TABLE_INITIAL_SIZE : 2 * oldSize;
+	table = calloc(size, sizeof(s3_dirty_file *));
+	if( table == NULL ) {
+		return -ENOMEM;
+	}
+
+	cache->dirtyTable = table;
+	cache->dirtyTableSize = size;
+	for( i=0; i < oldSize; i++ ) {
+		while( (file = oldTable[i]) != NULL ) {
+			oldTable[i] = file->hashNext;
+			file->hashNext = NULL;
+			*dirtySlot(cache, file->path) = file;
+		}
+	}
+	if( oldTable != NULL )
+		free(oldTable);
+	return 0;
+}
+
+static void appendDirty(s3_cache *cache, s3_dirty_file *file)
+{
+	file->next = NULL;
+	file->prev = cache->dirtyTail;
+	if( cache->dirtyTail != NULL )
+		cache->dirtyTail->next = file;
+	else
+		cache->dirtyHead = file;
+	cache->dirtyTail = file;
+}
+
+static void unlinkDirty(s3_cache *cache, s3_dirty_file *file)
+{
+	if( file->prev != NULL )
+		file->prev->next = file->next;
+	else
+		cache->dirtyHead = file->next;
+	if( file->next != NULL )
+		file->next->prev = file->prev;
+	else
+		cache->dirtyTail = file->prev;
+}
+
+static void removeDirty(s3_cache *cache, s3_dirty_file *file)
+{
+	s3_dirty_file	**slot = NULL;
+
+	slot = dirtySlot(cache, file->path);
+	*slot = file->hashNext;
+	unlinkDirty(cache, file);
+	cache->count--;
+	cache->dirtyBytes -= file->dirtyBytes + file->flushBytes;
+
+	free(file->path);
+	if( file->ranges != NULL )
+		free(file->ranges);
+	if( file->flushRanges != NULL )
+		free(file->flushRanges);
+	free(file);
+}
+
+static int addDirtyRange(s3_cache *cache, s3_dirty_file *file, 
+						int64_t start, int64_t end)
+{
+	/*
+	 - merge [start, end) into the sorted ranges of file
+	 - ranges [first, last) overlap or touch it and are replaced by
+	   one, the bytes they had are taken off what it adds
+	*/
+	s3_dirty_range	*ranges = NULL;
+	int		first = 0 ;
+	int		last = 0 ;
+	int		i = 0 ;
+	int64_t		merged = 0 ;
+
+	if( start >= end ) {
+		return 0;
+	}
+
+	/* writes are mostly appends: look from the end */
+	first = file->rangeCount;
+	while( (first > 0) && (file->ranges[first - 1].end >= start) ) {
+		first--;
+	}
+	last = first;
+	while( (last < file->rangeCount) && (file->ranges[last].start <= end) ) {
+		last++;
+	}
+
+	if( (first == last) && (file->rangeCount == file->rangeSize) ) {
+		ranges = realloc(file->ranges, 
+			2 * (file->rangeSize + 1) * sizeof(s3_dirty_range));
+		if( ranges == NULL ) {
+			return -ENOMEM;
+		}
+		file->ranges = ranges;
+		file->rangeSize = 2 * (file->rangeSize + 1);
+	}
+
+	for( i=first; i < last; i++ ) {
+		merged += file->ranges[i].end - file->ranges[i].start;
+		if( file->ranges[i].start < start )
+			start = file->ranges[i].start;
+		if( file->ranges[i].end > end )
+			end = file->ranges[i].end;
+	}
+
+	if( first == last ) {
+		memmove(&(file->ranges[first + 1]), &(file->ranges[first]),
+			(file->rangeCount - first) * sizeof(s3_dirty_range));
+		file->rangeCount++;
+	} else {
+		memmove(&(file->ranges[first + 1]), &(file->ranges[last]),
+			(file->rangeCount - last) * sizeof(s3_dirty_range));
+		file->rangeCount -= last - first - 1;
+	}
+	file->ranges[first].start = start;
+	file->ranges[first].end = end;
+
+	file->dirtyBytes += (end - start) - merged;
+	cache->dirtyBytes += (end - start) - merged;
+	return 0;
+}
+
+/* an upload of file starts, writes from now on are a new set */
+static void takeDirty(s3_cache *cache, s3_dirty_file *file)
+{
+	file->flushing = 1;
+	file->redirtied = 0;
+	file->flushRanges = file->ranges;
+	file->flushRangeCount = file->rangeCount;
+	file->flushBytes = file->dirtyBytes;
+	file->ranges = NULL;
+	file->rangeCount = 0;
+	file->rangeSize = 0;
+	file->dirtyBytes = 0;
+	cache->flushingCount++;
+}
+
+/*************************************************************************/
+
+int s3CacheMarkForFlush(s3_cache *cache, const char* path, int64_t offset,
+							int64_t size)
+{
+	s3_dirty_file	*file = NULL;
+	int		ret = 0 ;
+	
+	log_msg("s3CacheMarkForFlush\n");
+	pthread_mutex_lock(&(cache->lock));
+
+	/* with write-back the workers bound the dirty data, wait for them */
+	while( (cache->dirtyLimit != 0) && (cache->dirtyBytes >= cache->dirtyLimit)
+				&& (cache->count > 0) ) {
+		writeBackKick();
+		pthread_cond_wait(&(cache->flushed), &(cache->lock));
+	}
+
+	file = findDirty(cache, path);
+	if( file == NULL ) {
+		if( cache->count >= cache->dirtyTableSize ) {
+			ret = growDirtyTable(cache);
+			if( ret != 0 ) {
+				goto ret;
+			}
+		}
+
+		file = calloc(1, sizeof(s3_dirty_file));
+		if( file != NULL ) {
+			file->path = strdup(path);
+		}
+		if( (file == NULL) || (file->path == NULL) ) {
+			if( file != NULL )
+				free(file);
+			ret = -ENOMEM;
+			goto ret;
+		}
+		file->dirtyTime = time(NULL);
+		*dirtySlot(cache, path) = file;
+		appendDirty(cache, file);
+		cache->count++;
+	} else if( file->flushing ) {
+		/* the upload in progress may have read the file already */
+		file->redirtied = 1;
+	}
+
+	file->lastWrite = time(NULL);
+	ret = addDirtyRange(cache, file, offset, offset + size);
+ret:
+	pthread_mutex_unlock(&(cache->lock));
+	return ret;
+}
+
+int s3CacheIsDirty(s3_cache *cache, const char *path)
+{
+	int		dirty = 0 ;
+
+	pthread_mutex_lock(&(cache->lock));
+	dirty = (findDirty(cache, path) != NULL);
+	pthread_mutex_unlock(&(cache->lock));
+	return dirty;
+}
+
+/* path, or a file under the directory path */
+static int isPathOrBelow(const char *file, const char *path, int len)
+{
+	return (strncmp(file, path, len) == 0) 
+			&& ((file[len] == 0) || (file[len] == '/'));
+}
+
+int s3CacheIsDirtyBelow(s3_cache *cache, const char *path)
+{
+	/* path, or a file under the directory path, is dirty */
+	s3_dirty_file	*file = NULL;
+	int		len = strlen(path);
+
+	pthread_mutex_lock(&(cache->lock));
+	for( file = cache->dirtyHead; file != NULL; file = file->next ) {
+		if( isPathOrBelow(file->path, path, len) )
+			break;
+	}
+	pthread_mutex_unlock(&(cache->lock));
+	return (file != NULL);
+}
+
+int s3CacheDiscard(s3_cache *cache, const char *path)
+{
+	/* path is being deleted: let uploads in progress under it finish,
+	   so they can't recreate objects afterwards, and forget the rest */
+	s3_dirty_file	*file = NULL;
+	s3_dirty_file	*next = NULL;
+	int		len = strlen(path);
+
+	pthread_mutex_lock(&(cache->lock));
+	file = cache->dirtyHead;
+	while( file != NULL ) {
+		next = file->next;
+		if( !isPathOrBelow(file->path, path, len) ) {
+			file = next;
+		} else if( file->flushing ) {
+			pthread_cond_wait(&(cache->flushed), &(cache->lock));
+			file = cache->dirtyHead;
+		} else {
+			removeDirty(cache, file);
+			file = next;
+		}
+	}
+	pthread_mutex_unlock(&(cache->lock));
+	return 0;
+}
+
+int s3CacheTakeDirty(s3_cache *cache, int delay, int64_t dirtyLimit,
+							char **pPath)
+{
+	/*
+	 - for the write-back workers: pick a file that is due and mark it
+	   flushing, *pPath is NULL when there is none
+	 - a file is due once nobody wrote it for delay seconds, or when
+	   it has been dirty four times as long even if it is still being
+	   written
+	 - above dirtyLimit bytes the oldest file is due
+	*/
+	s3_dirty_file	*file = NULL;
+	time_t		now = time(NULL);
+
+	*pPath = NULL;
+	pthread_mutex_lock(&(cache->lock));
+	for( file = cache->dirtyHead; file != NULL; file = file->next ) {
+		if( file->flushing ) {
+			continue;
+		}
+		if( (cache->dirtyBytes >= dirtyLimit)
+				|| (now - file->lastWrite >= delay)
+				|| (now - file->dirtyTime >= 4 * delay) ) {
+			break;
+		}
+	}
+
+	if( file != NULL ) {
+		*pPath = strdup(file->path);
+		if( *pPath != NULL ) {
+			takeDirty(cache, file);
+		}
+	}
+	pthread_mutex_unlock(&(cache->lock));
+	return (*pPath == NULL) ? 0 : 1;
+}
+
+static void s3CacheFlushDone(s3_cache *cache, const char *path, int ret)
+{
+	/*
+	 - the upload of path taken by s3CacheTakeDirty() or
+	   s3CacheFlushCache() finished with ret
+	 - the file stays dirty if it failed or was written meanwhile; a
+	   failed one keeps its ranges and is retried after the delay,
+	   unless its cached copy is gone
+	*/
+	s3_dirty_file	*file = NULL;
+	int		inCache = 1 ;
+	int		i = 0 ;
+
+	if( ret != 0 ) {
+		s3CacheInCache(cache, path, &inCache);
+	}
+
+	pthread_mutex_lock(&(cache->lock));
+	file = findDirty(cache, path);
+	if( (file != NULL) && file->flushing ) {
+		file->flushing = 0;
+		cache->flushingCount--;
+		cache->dirtyBytes -= file->flushBytes;
+		file->flushBytes = 0;
+
+		if( (ret != 0) && inCache ) {
+			for( i=0; i < file->flushRangeCount; i++ ) {
+				addDirtyRange(cache, file, 
+						file->flushRanges[i].start,
+						file->flushRanges[i].end);
+			}
+		}
+		free(file->flushRanges);
+		file->flushRanges = NULL;
+		file->flushRangeCount = 0;
+
+		if( ((ret == 0) || (inCache == 0)) && (file->redirtied == 0) ) {
+			removeDirty(cache, file);
+		} else {
+			/* to the end of the list, as if it was just written */
+			file->dirtyTime = time(NULL);
+			if( ret != 0 )
+				file->lastWrite = file->dirtyTime;
+			unlinkDirty(cache, file);
+			appendDirty(cache, file);
+		}
+	}
+	pthread_cond_broadcast(&(cache->flushed));
+	pthread_mutex_unlock(&(cache->lock));
+}
+
+int s3CacheWriteBack(s3_cache *cache, char *path)
+{
+	int		ret = 0 ;
+
+	ret = s3CacheFlushPath(cache, path);
+	if( ret != 0 ) {
+		log_msg("s3CacheWriteBack : %s not flushed\n", path);
+	}
+	s3CacheFlushDone(cache, path, ret);
+	return ret;
+}
+
+int s3CacheOpen(s3_cache *cache, const char *path, int flags, 
+							int *pKeepCache)
+{
+	/*
+	 - make sure the cached copy of path is there before it is opened
+	   with flags; a read-only open may get a copy still being filled,
+	   any other waits for the fill to finish
+	 - *pKeepCache is set when the copy was fetched at the ETag the
+	   last listing saw, the kernel may then keep the pages it has
+	 - a copy of an object rewritten since is fetched again, unless
+	   it has writes that are not flushed yet
+	 - without both ETags the copy is used as it is
+	*/
+	int		ret = 0 ;
+	int		inCache = 0 ;
+	int		stale = 0 ;
+	s3_tree_node	*node = NULL;
 
+	*pKeepCache = 0;
+	if( (flags & O_ACCMODE) != O_RDONLY ) {
+		ret = fillWait(path, 0, FILL_TO_END);
+		if( ret != 0 ) {
+			return ret;
+		}
+	}
 
-			if( foundNode->s3FileInfo->time >
-					foundNode->parent->s3FileInfo->time ) {
-					
-				foundNode->parent->s3FileInfo->time =
-					foundNode->s3FileInfo->time; 
-			}
-			foundNode->s3FileInfo->versionId =
-				strdup(tmpS3VersionsContent->versionId) ;
+	ret = s3CacheInCache(cache, path, &inCache);
+	if( ret != 0 ) {
+		return ret;
+	}
 
-			sprintf(parentChildName, "%s/%s",
-					child->s3FileInfo->name,
-					foundNode->s3FileInfo->name);
-	
-			foundNode->s3Name = strdup(parentChildName); 
-			
-			if( isNodeMetaFile(foundNode)) {
-			
-				char	*pathToMeta = NULL;
-				ret = getPathForNode(foundNode, &pathToMeta);
-				log_msg("before FixEncodedFileInfo\n");
-				ret = fixEncodedFileInfo(foundNode, pathToMeta);
-				log_msg("after FixEncodedFileInfo\n");
+	if( inCache ) {
+		pthread_mutex_lock(&gS3TreeLock);
+		searchForPath(path, gS3DirectoryTree, &node);
+		if( (node != NULL) && (node->cachedETag != NULL)
+				&& (node->s3FileInfo.eTag != NULL) ) {
+			if( strcmp(node->cachedETag, node->s3FileInfo.eTag) == 0 )
+				*pKeepCache = 1;
+			else
+				stale = 1;
+		}
+		pthread_mutex_unlock(&gS3TreeLock);
 
-			}
+		if( stale && !s3CacheIsDirty(cache, path) ) {
+			log_msg("s3CacheOpen : %s changed in S3\n", path);
+			/* a fill of the old version is not wanted either */
+			fillWait(path, 0, FILL_TO_END);
+			inCache = 0;
 		}
-		
-		j++;
+	}
 
+	if( !inCache ) {
+		ret = s3CacheFetch(cache, path, 
+				gFillFlag && ((flags & O_ACCMODE) == O_RDONLY));
 	}
-ret:
 	return ret;
 }
 
-/**************************** Cache Functions *******************************/
+int s3CacheTempPath(s3_cache *cache, const char *tag, char **pTempPath)
+{
+	/* <cache>/<tag>.<pid>.<n>, unique across threads; a tag starting
+	   with a dot never shadows a bucket.  Directories in tag are
+	   created. */
+	int		sequence = 0 ;
+	char		*tmp = NULL;
 
+	pthread_mutex_lock(&tempSequenceLock);
+	sequence = tempSequence++;
+	pthread_mutex_unlock(&tempSequenceLock);
 
-int s3CacheInit(s3_cache **pCache, char* cacheLocation)
-{
-	*pCache = (s3_cache *) malloc(sizeof(s3_cache));
-	if( *pCache == NULL) {
+	*pTempPath = malloc(strlen(cache->location) + strlen(tag) + 32);
+	if( *pTempPath == NULL ) {
 		return -ENOMEM;
 	}
 
-	(*pCache)->location = cacheLocation;
-	(*pCache)->count = 0;
-	gS3Cache = *pCache;
+	sprintf(*pTempPath, "%s/%s.%d.%d", cache->location, tag,
+						(int) getpid(), sequence);
 
+	tmp = strrchr(*pTempPath, '/');
+	if( tmp - *pTempPath > (int) strlen(cache->location) ) {
+		*tmp = 0;
+		mkpath(*pTempPath);
+		*tmp = '/';
+	}
 	return 0;
 }
-int s3CacheGetCachedPath(s3_cache *cache, const char *path, char **pCachedPath)
+
+static int getS3NameForNode(const char *path, s3_tree_node *node, 
+							char **pS3Name)
 {
+	char		*tmpPath = NULL;
+	char		*tmp = NULL;
 
-	log_msg("s3CacheGetCachedPath\n");
-	*pCachedPath = (char * ) malloc(strlen(path) + strlen(cache->location) +1 );
+	if( node->s3Name == NULL ) {
+		*pS3Name = strdup(path);
+		return (*pS3Name == NULL) ? -ENOMEM : 0;
+	}
 
-	if( *pCachedPath == NULL) {
-		log_msg("out of Memory\n");
+	// strip off .version-* 
+	tmpPath = strdup(path);
+	*pS3Name = malloc(strlen(path) + strlen(node->s3Name) + 1);
+	if( (tmpPath == NULL) || (*pS3Name == NULL) ) {
+		free(tmpPath);
+		free(*pS3Name);
+		*pS3Name = NULL;
 		return -ENOMEM;
 	}
 
-	if( *path == '/' )
-		sprintf(*pCachedPath,"%s%s", cache->location, path);
-	else
-		sprintf(*pCachedPath,"%s/%s", cache->location, path);
+	tmp = strstr(tmpPath, ".versions");
+	if( tmp != NULL )
+		*tmp = 0;
+	sprintf(*pS3Name, "%s%s", tmpPath, node->s3Name);		
 
-	log_msg("cachedPath = %s\n", *pCachedPath);
+	free(tmpPath);
 	return 0;
-
 }
-int s3CacheInCache(s3_cache *cache, const char* path, int *pInCache)
+
+int s3CacheFetchObject(char *s3Name, char *versionId, char *cachedPath)
 {
-	char 		*cachedPath =NULL;		
-	struct stat 	statbuf;
+	int		argc = 2;
+	char		*argv[4] = { NULL, NULL,NULL, NULL};
 	int		ret = 0 ;
+	int		s3Status = 0 ;
 
-	log_msg("s3CacheInCache\n");
-	ret = s3CacheGetCachedPath(cache, path, &cachedPath);
-	if(ret != 0 ) {
-		return ret;
+	argv[0] = strdup(s3Name+1);
+	if( argv[0] == NULL ) {
+		ret =  -ENOMEM;
+		goto ret;
 	}
-	if (stat(cachedPath, &statbuf) == -1) {
-		*pInCache = 0;
-	} else {
-		*pInCache = 1;
+		
+	log_msg("argv[0] :%s\n", argv[0]);
+
+	argv[1] = malloc(strlen(cachedPath) + strlen("filename=") +1 ) ;
+	if( argv[1] == NULL ) {
+		ret =  -ENOMEM;
+		goto ret;
 	}
+	
+	sprintf(argv[1], "filename=%s", cachedPath);
 
-	free(cachedPath);
-	return 0;
-}
-int s3CacheMarkForFlush(s3_cache *cache, const char* path)
-{
+	log_msg("argv[1] = %s\n", argv[1]);
+
+	if( versionId != NULL ) {
+
+		argc = 3;
+		argv[2] = malloc(strlen("versionId=") 
+				+ strlen(versionId) +1 ) ;
+		if( argv[2] == NULL ) {
+			ret =  -ENOMEM;
+			goto ret;
+		}
 	
-	log_msg("s3CacheMarkForFlush\n");
-	cache->flushList[(cache->count)] = strdup(path);
-	cache->count++ ;
-	return 0;
+		sprintf(argv[2], "versionId=%s", versionId);
+			
+		log_msg("argv[2] = %s\n", argv[2]);
+	}
+
+	s3Status = get_object(argc, argv, 0); 
+	if( s3Status != 0 ) { 
+		logS3Errors(s3Status);
+		ret = -EINVAL;
+		goto ret; 
+	}
+	log_msg("after getObject\n");
+
+ret:
+	if( argv[0] != NULL )
+		free(argv[0]);
+	if( argv[1] != NULL )
+		free(argv[1]);
+	if( argv[2] != NULL )
+		free(argv[2]);
+	return ret;
 }
 	
-int s3CacheFetch(s3_cache *cache, const char* path)
+int s3CacheFetch(s3_cache *cache, const char* path, int background)
 {
-	int		argc = 2;
-	char		*argv[4] = { NULL, NULL,NULL, NULL};
+	/*
+	 - bring the cached copy of path up to date with S3
+	 - with background set a plain object may be left to fillStart(),
+	   the copy is then filled while it is read
+	*/
 	char		*cachedPath = NULL;
+	char		*fetchPath = NULL;
 	int		ret = 0 ;
 	struct stat	statbuf;
 	char		*tmp = NULL;
-	char		*tmp1 = NULL;
 	char		*tmpPath = NULL;
 	s3_tree_node	*foundNode = NULL;
-	int		s3Status = 0 ;
+	s3_tree_node	*manifestNode = NULL;
+	s3_tree_node	*child = NULL;
 	char		*s3Name = NULL;
+	char		*versionId = NULL;
+	char		*eTag = NULL;
+	int		isEncoded = 0 ;
+	int		isChunked = 0 ;
+	int64_t		size = 0 ;
+	int		partCount = 0 ;
+	s3_file_info	*parts = NULL;
+	int		i = 0 ;
 	
 	
 	log_msg("s3CacheFetch\n");
@@ -1632,6 +4005,7 @@ int s3CacheFetch(s3_cache *cache, const char* path)
 
 	ret = s3CacheGetCachedPath(cache, tmpPath, &cachedPath);
 	if(ret != 0 ) {
+		free(tmpPath);
 		return ret;
 	}
 
@@ -1642,7 +4016,7 @@ int s3CacheFetch(s3_cache *cache, const char* path)
 	*tmp = 0;
 	ret = mkpath(cachedPath);
 	if((ret != 0) && (errno != EEXIST)  )
-		return ret;
+		goto ret;
 
 	*tmp = '/';
 
@@ -1650,95 +4024,141 @@ int s3CacheFetch(s3_cache *cache, const char* path)
 	log_msg("after mkpath path = %s\n", tmpPath);
 
 
-
+	/* copy what the fetch needs out of the tree, fetch without the lock */
+	pthread_mutex_lock(&gS3TreeLock);
 	ret = searchForPath(tmpPath, gS3DirectoryTree, &foundNode);
 
+	/* a file written here has not been listed, its objects tell how
+	   it is stored */
+	if( (ret == 0) && (foundNode != NULL) 
+			&& ((foundNode->isComplete & NODE_COMPLETE) == 0) ) {
+		ret = searchAndInsertPathInTree(tmpPath, &gS3DirectoryTree,
+							&foundNode, 1);
+	}
+
 	if(( ret != 0 ) || (foundNode == NULL) ) {
 
+		pthread_mutex_unlock(&gS3TreeLock);
 		goto ret;
 	} 
 
-	
-	if(foundNode->s3Name != NULL ) {
-
-		// strip off .version-* 
-		s3Name = strdup(tmpPath);	
-		tmp = strstr(tmpPath, ".versions");
-		*tmp = 0;
-
-		sprintf(s3Name, "%s%s", tmpPath, foundNode->s3Name);		
-		*tmp = '/';
-		
-	} else {
-		s3Name = strdup(tmpPath);
+	ret = getS3NameForNode(tmpPath, foundNode, &s3Name);
+	if( ret != 0 ) {
+		pthread_mutex_unlock(&gS3TreeLock);
+		goto ret;
 	}
+
 	if( (foundNode->isFileNode == 1) && (foundNode->children != NULL) ) {
 	
-		ret = getObjectAndDecode(s3Name, cachedPath, foundNode);
-		if( ret != 0 ) {
-			log_msg("Error : get_object_and_decode\n");
-			goto ret;
-		}
-		
+		searchNode(foundNode, CHUNK_MANIFEST_NAME, 0, &manifestNode);
+		if( manifestNode != NULL ) {
+			isChunked = 1;
+			if( manifestNode->s3FileInfo.versionId != NULL )
+				versionId = strdup(manifestNode->s3FileInfo.versionId);
+		} else {
+			isEncoded = 1;
+			for( child = foundNode->children; child != NULL; 
+							child = child->next )
+				partCount++;
 
-	} else { 
-		argv[0] = malloc(strlen(s3Name) +1 ) ;
-		if(argv[0] == NULL) {
-			return -ENOMEM;
+			parts = calloc(partCount, sizeof(s3_file_info));
+			if( parts == NULL ) {
+				ret = -ENOMEM;
+				pthread_mutex_unlock(&gS3TreeLock);
+				goto ret;
+			}
+			child = foundNode->children;
+			for( i=0; i < partCount; i++, child = child->next ) {
+				parts[i].name = strdup(child->s3FileInfo.name);
+				if( child->s3FileInfo.versionId != NULL )
+					parts[i].versionId = 
+					strdup(child->s3FileInfo.versionId);
+			}
 		}
-	
-	
-		strcpy( argv[0], (s3Name+1)) ;
-			
-		log_msg("argv[0] :%s\n", argv[0]);
+	} else if( foundNode->s3FileInfo.versionId != NULL ) {
+		versionId = strdup(foundNode->s3FileInfo.versionId);
+	}
+	if( foundNode->s3FileInfo.eTag != NULL )
+		eTag = strdup(foundNode->s3FileInfo.eTag);
+	size = foundNode->s3FileInfo.size;
+	pthread_mutex_unlock(&gS3TreeLock);
+
+	if( background && !isChunked && !isEncoded 
+				&& (size > fillBlockSize()) ) {
+		ret = fillStart(cache, tmpPath, cachedPath, s3Name, versionId,
+								eTag, size);
+		if( ret == 0 ) {
+			goto fetched;
+		}
+		log_msg("s3CacheFetch : fillStart %d, fetching %s now\n",
+								ret, path);
+	}
 
+	/* fetch next to the cached file and rename it into place, so a
+	   concurrent open never sees a partial file */
+	ret = s3CacheTempPath(cache, ".fetch", &fetchPath);
+	if( ret != 0 ) {
+		goto ret;
+	}
 
-		argv[1] = malloc(strlen(cachedPath) + strlen("filename=") +1 ) ;
-		if(argv[1] == NULL) {
-			ret =  -ENOMEM;
+	if( isChunked ) {
+		ret = chunkStoreGetObject(s3Name, fetchPath, versionId);
+		if( ret != 0 ) {
+			log_msg("Error : chunkStoreGetObject\n");
 			goto ret;
 		}
-	
-		sprintf(argv[1], "filename=%s", cachedPath);
-
-		log_msg("argv[1] = %s\n", argv[1]);
-
-		if(foundNode->s3FileInfo->versionId != NULL) {
-
-			argc = 3;
-			argv[2] = malloc(strlen("versionId=") 
-				+ strlen(foundNode->s3FileInfo->versionId) +1 ) ;
-			if(argv[2] == NULL) {
-				ret =  -ENOMEM;
-				goto ret;
-			}
-	
-			sprintf(argv[2], "versionId=%s", 
-					foundNode->s3FileInfo->versionId);
-			
-			log_msg("argv[2] = %s\n", argv[2]);
-
-		
+	} else if( isEncoded ) {
+		ret = getObjectAndDecode(s3Name, fetchPath, partCount, parts);
+		if( ret != 0 ) {
+			log_msg("Error : get_object_and_decode\n");
+			goto ret;
 		}
-		s3Status = get_object(argc, argv, 0); 
-		if(s3Status != 0 ) { 
-			logS3Errors(s3Status);
-			ret = -EINVAL;
-			goto ret; 
+	} else { 
+		ret = s3CacheFetchObject(s3Name, versionId, fetchPath);
+		if( ret != 0 ) {
+			goto ret;
 		}
-		log_msg("after getObject\n");
+	}
 
-		free(argv[0]);
-		free(argv[1]);
-		if(argv[2] != NULL)
-			free(argv[2]);
+	if( rename(fetchPath, cachedPath) != 0 ) {
+		ret = -errno;
+		goto ret;
 	}
 
 	if (stat(cachedPath, &statbuf) == -1) {
-		return -1;
+		ret = -1;
+		goto ret;
+	}
+
+fetched:
+	/* remember which version of the object the copy is */
+	pthread_mutex_lock(&gS3TreeLock);
+	searchForPath(tmpPath, gS3DirectoryTree, &foundNode);
+	if( foundNode != NULL ) {
+		if( foundNode->cachedETag != NULL )
+			free(foundNode->cachedETag);
+		foundNode->cachedETag = eTag;
+		foundNode->uploaded = 0;
+		eTag = NULL;
 	}
+	pthread_mutex_unlock(&gS3TreeLock);
 	
 ret :
+	if( fetchPath != NULL ) {
+		unlink(fetchPath);
+		free(fetchPath);
+	}
+	for( i=0; i < partCount; i++ ) {
+		free(parts[i].name);
+		if( parts[i].versionId != NULL )
+			free(parts[i].versionId);
+	}
+	if( parts != NULL )
+		free(parts);
+	if( versionId != NULL )
+		free(versionId);
+	if( eTag != NULL )
+		free(eTag);
 	if(s3Name != NULL)
 		free(s3Name);
 	free(tmpPath);
@@ -1750,59 +4170,147 @@ ret :
 
 int s3CacheFlushCache(s3_cache *cache, char* path)
 {
+	/*
+	 - upload path, or every dirty file when path is NULL, and return
+	   once it is in S3
+	 - an upload of path already in progress is waited for first, it
+	   may have missed the last writes; with path NULL all of them are
+	   waited for at the end
+	*/
 	int			i;
+	int			ret = 0 ;
+	char			**dirtyList = NULL;
+	int			dirtyCount = 0 ;
+	s3_dirty_file		*file = NULL;
+
+	log_msg("s3CacheFlushCache\n");
+
+	pthread_mutex_lock(&(cache->lock));
+	while( (path != NULL) && ((file = findDirty(cache, path)) != NULL) 
+						&& file->flushing ) {
+		pthread_cond_wait(&(cache->flushed), &(cache->lock));
+	}
+
+	file = (path != NULL) ? findDirty(cache, path) : cache->dirtyHead;
+	if( file != NULL ) {
+		dirtyList = malloc(cache->count * sizeof(char *));
+		if( dirtyList == NULL ) {
+			pthread_mutex_unlock(&(cache->lock));
+			return -ENOMEM;
+		}
+	}
+	for( ; file != NULL; file = (path != NULL) ? NULL : file->next ) {
+		if( file->flushing ) {
+			continue;
+		}
+		dirtyList[dirtyCount] = strdup(file->path);
+		if( dirtyList[dirtyCount] == NULL ) {
+			ret = -ENOMEM;
+			break;
+		}
+		dirtyCount++;
+		takeDirty(cache, file);
+	}
+	pthread_mutex_unlock(&(cache->lock));
+
+	for( i=0; i < dirtyCount; i++ ) {
+
+		log_msg("s3CacheFlushCache for\n");
+		if( s3CacheWriteBack(cache, dirtyList[i]) != 0 ) {
+			ret = -EIO;
+		}
+		free(dirtyList[i]);
+	}
+
+	if( path == NULL ) {
+		pthread_mutex_lock(&(cache->lock));
+		while( cache->flushingCount > 0 ) {
+			pthread_cond_wait(&(cache->flushed), &(cache->lock));
+		}
+		pthread_mutex_unlock(&(cache->lock));
+	}
+
+	if( dirtyList != NULL )
+		free(dirtyList);
+	return ret;
+}
+
+static int s3CacheFlushPath(s3_cache *cache, char *path)
+{
 	int			argc = 2;
-	char			*argv[3];
+	char			*argv[3] = { NULL, NULL, NULL };
 	char			*cachedPath = NULL;
 	int			ret = 0 ;
 	int			s3Status = 0 ;
+	s3_tree_node		*node = NULL;
 
-		log_msg("s3CacheFlushCache\n");
-	for(i=(cache->count)-1 ; i >=0; i-- ){
+	ret = s3CacheGetCachedPath(cache, path, &cachedPath);
+	if( ret != 0 ) {
+		return ret;
+	}
 
-		if( (path == NULL) || (strcmp(path,cache->flushList[i]) == 0) ) {
+	if( gChunkStoreFlag == 1 ) {
 
-		log_msg("s3CacheFlushCache for\n");
-		ret = s3CacheGetCachedPath(cache, cache->flushList[i], &cachedPath);
-		if(ret != 0 ) {
-			return ret;
-		}
+		ret = chunkStoreObjectAndPut(path, cachedPath);
+		log_msg("after chunkStoreObjectAndPut\n");
 
-		if(gEncodeFlag == 1 ) {
+	} else if( gEncodeFlag == 1 ) {
 
-			ret = encodeObjectAndPut(cache->flushList[i], cachedPath);
-			log_msg("after encodeObjectAndPut\n");
+		ret = encodeObjectAndPut(path, cachedPath);
+		log_msg("after encodeObjectAndPut\n");
 
-		} else {
-			argv[0] = strdup(cache->flushList[i]+1);
-			argv[1] = malloc(strlen(cachedPath) + strlen("filename=") +1 ) ;
-			if(argv[1] == NULL) {
-				return -ENOMEM;
-			}
+	} else {
+		argv[0] = strdup(path+1);
+		argv[1] = malloc(strlen(cachedPath) + strlen("filename=") +1 ) ;
+		if( (argv[0] == NULL) || (argv[1] == NULL) ) {
+			ret = -ENOMEM;
+			goto ret;
+		}
 	
-			sprintf(argv[1], "filename=%s", cachedPath);
-			argv[2] = 0;
+		sprintf(argv[1], "filename=%s", cachedPath);
 	
-			log_msg("argv[0] = %s argv[1] = %s\n", argv[0], argv[1]);
-			s3Status = put_object(argc, argv, 0); 
-			if(s3Status != 0 ) { 
-				logS3Errors(s3Status);
-				return -EINVAL;
-			}
-
-
-			free(argv[0]);
-			argv[0] = NULL;
-			free(argv[1]);
-			argv[1] = NULL;
-		}	
-		free(cachedPath);
-		cachedPath = NULL;
+		log_msg("argv[0] = %s argv[1] = %s\n", argv[0], argv[1]);
+		s3Status = put_object(argc, argv, 0); 
+		if( s3Status != 0 ) { 
+			logS3Errors(s3Status);
+			ret = -EINVAL;
+			goto ret;
+		}
+	}	
+	if( ret != 0 ) {
+		goto ret;
+	}
 
-		updateDirTree(cache->flushList[i], 1);
+	/* a manifest left from a chunked put would be fetched in place
+	   of what was put now */
+	if( gChunkStoreFlag != 1 ) {
+		ret = chunkStoreDropManifest(path);
+		if( ret != 0 ) {
+			goto ret;
 		}
 	}
-	return 0;
+
+	pthread_mutex_lock(&gS3TreeLock);
+	updateDirTree(path, 1);
+	/* the copy is what S3 has now, under an ETag we learn from the
+	   next listing */
+	searchForPath(path, gS3DirectoryTree, &node);
+	if( node != NULL ) {
+		if( node->cachedETag != NULL )
+			free(node->cachedETag);
+		node->cachedETag = NULL;
+		node->uploaded = 1;
+		s3Invalidate(node, S3_INVALIDATE_ATTR);
+	}
+	pthread_mutex_unlock(&gS3TreeLock);
+
+ret:
+	if( argv[0] != NULL )
+		free(argv[0]);
+	if( argv[1] != NULL )
+		free(argv[1]);
+	free(cachedPath);
+	return ret;
 }
 
 	
@@ -1854,6 +4362,25 @@ int saveExecuteDir()
 	return 0;
 }
 
+int saveListPolicy()
+{
+	char		*env = NULL;
+	char		*end = NULL;
+	long		keys = 0;
+
+	env = getenv("S3_LIST_PAGE_KEYS");
+	if( env != NULL ) {
+		keys = strtol(env, &end, 10);
+		if( (*env == 0) || (*end != 0) || (keys < 1) || (keys > 1000) ) {
+			log_msg("S3_LIST_PAGE_KEYS : %s is not valid, using %d\n",
+						env, S3_LIST_PAGE_KEYS);
+		} else {
+			listPageKeys = keys;
+		}
+	}
+	return 0;
+}
+
 
 void logS3Errors(int status)
 {
@@ -0,0 +1,1323 @@
+/*
+  Low-level FUSE frontend for s3fs.
+
+  The path frontend in s3_fuse.c is handed a full path for every
+  operation and walks the tree from the root to find it.  Here the
+  kernel talks in inode numbers instead: every tree node has a slot in
+  the inode table (see s3_fuse_bridge.h), so lookup, getattr, readdir
+  and open go from the inode straight to the node, and a path is only
+  built, with getPathForNode(), when S3 or the cache needs one.
+
+  Every entry handed to the kernel, by lookup, mkdir and create, is
+  counted in the inode table and forget takes it off again.  An inode
+  number stays with its node while it is in the tree, and after it is
+  deleted until the kernel has forgotten it; such an inode answers
+  ENOENT.
+
+  The kernel keeps attributes and names for attr_timeout and
+  entry_timeout seconds, and the pages of a file opened with
+  keep_cache.  When a node changes under it - our own flush, a delete,
+  an object rewritten in S3 - the bridge calls gS3Invalidate and a
+  worker thread tells the kernel to forget what it has.  The notify
+  calls are made outside the handlers, a handler that notifies about
+  its own inode can deadlock against the kernel.
+
+  A rename keeps the inode; the paths of the files open under the old
+  name are changed to the new one, for their flush.
+
+  usage:  s3fs --lowlevel [-o attr_timeout=T,entry_timeout=T]
+  		cacheDir mountPoint
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "log.h"
+#include "s3_fuse_bridge.h"
+#include "s3_fuse_lowlevel.h"
+#include "s3_write_back.h"
+#include "s3_cache_fill.h"
+#include "s3_rename.h"
+#include "s3_revalidate.h"
+#include "s3_child_index.h"
+#include "s3_snapshot.h"
+#include "s3_evict.h"
+#include "s3_epoch.h"
+
+#define S3_LL_DATA ((struct s3_fuse_state *) fuse_req_userdata(req))
+
+/* -o options of our own, the rest go to fuse */
+typedef struct s3_ll_config {
+	double		attrTimeout;
+	double		entryTimeout;
+} s3_ll_config;
+
+static s3_ll_config	config = { 1.0, 1.0 };
+
+static struct fuse_opt s3_ll_opts[] = {
+	{ "attr_timeout=%lf", offsetof(s3_ll_config, attrTimeout), 0 },
+	{ "entry_timeout=%lf", offsetof(s3_ll_config, entryTimeout), 0 },
+	FUSE_OPT_END
+};
+
+/* a pending kernel invalidation, see s3_ll_invalidate() */
+typedef struct s3_ll_inval {
+	fuse_ino_t		ino;
+	fuse_ino_t		parent;
+	char			*name;		/* S3_INVALIDATE_ENTRY only */
+	int			what;
+	struct s3_ll_inval	*next;
+} s3_ll_inval;
+
+static struct fuse_chan	*invalChan = NULL;
+static s3_ll_inval	*invalHead = NULL;
+static s3_ll_inval	*invalTail = NULL;
+static int		invalStop = 0;
+static pthread_mutex_t	invalLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	invalCond = PTHREAD_COND_INITIALIZER;
+
+/* an open file: its cached copy and the path flush needs */
+typedef struct s3_ll_file s3_ll_file;
+struct s3_ll_file {
+	int		fd;
+	char		*path;
+	s3_ll_file	*prev;
+	s3_ll_file	*next;
+};
+
+/* the open files, so that a rename can change their paths; the lock
+   protects the list and the path of every file on it */
+static s3_ll_file	*openFiles = NULL;
+static pthread_mutex_t	openFilesLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* an open directory: the entries read so far, a listing page at a time */
+typedef struct s3_ll_dir {
+	char		*buf;
+	size_t		size;
+	size_t		capacity;
+	char		*path;
+	char		*last;		/* for s3DirNextChildren() */
+} s3_ll_dir;
+
+/****************** helpers, called with gS3TreeLock held ******************/
+/* s3_ll_is_dir(), s3_ll_stat(), s3_ll_entry() and s3_ll_dir_add() may be
+   called in an epoch instead, see s3_epoch.h */
+
+/* inode -> node; the tree is built on first use of the root */
+static int s3_ll_node(fuse_req_t req, fuse_ino_t ino, s3_tree_node **pNode)
+{
+	int		ret = 0;
+
+	*pNode = NULL;
+	if( ino == FUSE_ROOT_ID ) {
+		if( S3_LL_DATA->dirTree == NULL ) {
+			ret = searchAndInsertPathInTree("/",
+					&(S3_LL_DATA->dirTree), pNode, 0);
+		} else {
+			*pNode = S3_LL_DATA->dirTree;
+		}
+	} else {
+		ret = s3InodeGet(ino, pNode);
+	}
+
+	if( (ret == 0) && (*pNode == NULL) ) {
+		ret = -ENOENT;
+	}
+	return ret;
+}
+
+static int s3_ll_is_dir(s3_tree_node *node)
+{
+	return (NODE_LOAD(node->isFileNode) == 0)
+			&& (NODE_LOAD(node->s3FileInfo.size) == -1);
+}
+
+/* path of node, "/" for the root */
+static int s3_ll_path(s3_tree_node *node, char **pPath)
+{
+	int		ret = 0;
+
+	if( node->parent == NULL ) {
+		*pPath = strdup("/");
+		return (*pPath == NULL) ? -ENOMEM : 0;
+	}
+	ret = getPathForNode(node, pPath);
+	return ret;
+}
+
+/* path of name in the directory node */
+static int s3_ll_child_path(s3_tree_node *node, const char *name,
+							char **pPath)
+{
+	char		*parentPath = NULL;
+	int		ret = 0;
+
+	*pPath = NULL;
+	if( node->parent != NULL ) {
+		ret = getPathForNode(node, &parentPath);
+		if( ret != 0 ) {
+			goto ret;
+		}
+	}
+
+	*pPath = malloc((parentPath ? strlen(parentPath) : 0)
+						+ strlen(name) + 2);
+	if( *pPath == NULL ) {
+		ret = -ENOMEM;
+		goto ret;
+	}
+	sprintf(*pPath, "%s/%s", parentPath ? parentPath : "", name);
+ret:
+	if( parentPath != NULL )
+		free(parentPath);
+	return ret;
+}
+
+/* same attributes as s3_fuse_getattr() reports */
+static void s3_ll_stat(fuse_ino_t ino, s3_tree_node *node,
+						struct stat *statbuf)
+{
+	time_t		time = NODE_LOAD(node->s3FileInfo.time);
+
+	memset(statbuf, 0, sizeof(struct stat));
+	statbuf->st_ino = ino;
+	statbuf->st_atime = time;
+	statbuf->st_mtime = time;
+	statbuf->st_ctime = time;
+	if( s3_ll_is_dir(node) ) {
+		statbuf->st_mode = S_IFDIR | 0755 ;
+		statbuf->st_nlink = 2;
+	} else {
+		statbuf->st_mode = S_IFREG | 0755 ;
+		statbuf->st_nlink = 1;
+		statbuf->st_size = NODE_LOAD(node->s3FileInfo.size);
+	}
+}
+
+static void s3_ll_entry(s3_tree_node *node, struct fuse_entry_param *e)
+{
+	memset(e, 0, sizeof(struct fuse_entry_param));
+	e->ino = NODE_LOAD(node->ino);
+	e->generation = node->generation;
+	e->attr_timeout = config.attrTimeout;
+	e->entry_timeout = config.entryTimeout;
+	s3_ll_stat(e->ino, node, &(e->attr));
+}
+
+/* takes back nlookup entries of ino from the inode table */
+static void s3_ll_forget_ino(fuse_ino_t ino, uint64_t nlookup)
+{
+	pthread_mutex_lock(&gS3TreeLock);
+	s3InodeForget(ino, nlookup);
+	pthread_mutex_unlock(&gS3TreeLock);
+}
+
+/* an entry counted with s3InodeRef(), which a reply that fails, the
+   request interrupted, gives back */
+static void s3_ll_reply_entry(fuse_req_t req, struct fuse_entry_param *e)
+{
+	if( fuse_reply_entry(req, e) != 0 )
+		s3_ll_forget_ino(e->ino, 1);
+}
+
+static int s3_ll_dir_add(fuse_req_t req, s3_ll_dir *dir, const char *name,
+						fuse_ino_t ino, mode_t mode)
+{
+	struct stat	statbuf;
+	size_t		entrySize = 0;
+	char		*buf = NULL;
+
+	memset(&statbuf, 0, sizeof(statbuf));
+	statbuf.st_ino = ino;
+	statbuf.st_mode = mode;
+
+	entrySize = fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+	if( dir->size + entrySize > dir->capacity ) {
+		dir->capacity = (dir->capacity == 0) ? 4096 : dir->capacity * 2;
+		while( dir->size + entrySize > dir->capacity ) {
+			dir->capacity *= 2;
+		}
+		buf = realloc(dir->buf, dir->capacity);
+		if( buf == NULL ) {
+			return -ENOMEM;
+		}
+		dir->buf = buf;
+	}
+	fuse_add_direntry(req, dir->buf + dir->size, entrySize, name,
+					&statbuf, dir->size + entrySize);
+	dir->size += entrySize;
+	return 0;
+}
+
+/************************** operations ******************************/
+
+static void s3_fuse_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	(void) conn;
+	log_msg("\ns3_fuse_ll_init()\n");
+	writeBackStart(((struct s3_fuse_state *) userdata)->cache);
+	snapshotStart(((struct s3_fuse_state *) userdata)->cache);
+	evictStart();
+	epochStart();
+}
+
+static void s3_fuse_ll_destroy(void *userdata)
+{
+	log_msg("\ns3_fuse_ll_destroy(userdata=0x%08x)\n", userdata);
+	revalidateStop();
+	evictStop();
+	epochStop();
+	fillStop();
+	writeBackStop(((struct s3_fuse_state *) userdata)->cache);
+	snapshotStop();
+}
+
+/** Look up a directory entry by name and get its attributes */
+static void s3_fuse_ll_lookup(fuse_req_t req, fuse_ino_t parent,
+							const char *name)
+{
+	struct fuse_entry_param	e;
+	s3_tree_node		*node = NULL;
+	s3_tree_node		*child = NULL;
+	char			*path = NULL;
+	int			ret = 0;
+
+	log_msg("\ns3_fuse_ll_lookup(parent=%lu, name=\"%s\")\n", parent, name);
+
+	/* a name the tree has, without gS3TreeLock, see s3_epoch.h */
+	if( epochEnter() == 0 ) {
+		node = s3InodeGetLockFree(parent);
+		if( (node != NULL) && !revalidateDue(node) ) {
+			child = childFindLockFree(node, name);
+		}
+		if( child != NULL ) {
+			s3_ll_entry(child, &e);
+			ret = s3InodeRefLockFree(child, e.ino);
+		}
+		epochExit();
+		if( (child != NULL) && (ret == 0) ) {
+			s3_ll_reply_entry(req, &e);
+			return;
+		}
+		/* the node went while it was counted */
+		if( ret == -EAGAIN )
+			s3_ll_forget_ino(e.ino, 1);
+		child = NULL;
+		ret = 0;
+	}
+
+	pthread_mutex_lock(&gS3TreeLock);
+	ret = s3_ll_node(req, parent, &node);
+	if( ret != 0 ) {
+		goto ret;
+	}
+	revalidateCheck(node);
+	ret = searchNode(node, (char *) name, 0, &child);
+	if( ret != 0 ) {
+		goto ret;
+	}
+
+	if( child == NULL ) {
+		/* not listed yet, list it from S3 like the path frontend */
+		ret = s3_ll_child_path(node, name, &path);
+		if( ret != 0 ) {
+			goto ret;
+		}
+		ret = searchAndInsertPathInTree(path, &(S3_LL_DATA->dirTree),
+								&child, 0);
+		if( ret != 0 ) {
+			goto ret;
+		}
+		if( child == NULL ) {
+			ret = -ENOENT;
+			goto ret;
+		}
+	}
+	s3_ll_entry(child, &e);
+	s3InodeRef(child);
+
+ret:
+	pthread_mutex_unlock(&gS3TreeLock);
+	if( path != NULL )
+		free(path);
+	if( ret != 0 ) {
+		fuse_reply_err(req, -ret);
+	} else {
+		s3_ll_reply_entry(req, &e);
+	}
+}
+
+/** Forget about an inode; its number is given back once the node is
+    gone too */
+static void s3_fuse_ll_forget(fuse_req_t req, fuse_ino_t ino,
+						unsigned long nlookup)
+{
+	log_msg("\ns3_fuse_ll_forget(ino=%lu, nlookup=%lu)\n", ino, nlookup);
+	s3_ll_forget_ino(ino, nlookup);
+	fuse_reply_none(req);
+}
+
+/** Forget about several inodes */
+static void s3_fuse_ll_forget_multi(fuse_req_t req, size_t count,
+					struct fuse_forget_data *forgets)
+{
+	size_t		i = 0;
+
+	log_msg("\ns3_fuse_ll_forget_multi(count=%lu)\n",
+						(unsigned long) count);
+	pthread_mutex_lock(&gS3TreeLock);
+	for( i = 0; i < count; i++ ) {
+		s3InodeForget(forgets[i].ino, forgets[i].nlookup);
+	}
+	pthread_mutex_unlock(&gS3TreeLock);
+	fuse_reply_none(req);
+}
+
+/** Get file attributes */
+static void s3_fuse_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+						struct fuse_file_info *fi)
+{
+	struct stat	statbuf;
+	s3_tree_node	*node = NULL;
+	int		ret = 0;
+
+	(void) fi;
+	log_msg("\ns3_fuse_ll_getattr(ino=%lu)\n", ino);
+
+	/* without gS3TreeLock, see s3_epoch.h */
+	if( epochEnter() == 0 ) {
+		node = s3InodeGetLockFree(ino);
+		if( node != NULL ) {
+			s3_ll_stat(ino, node, &statbuf);
+		}
+		epochExit();
+		if( node != NULL ) {
+			fuse_reply_attr(req, &statbuf, config.attrTimeout);
+			return;
+		}
+	}
+
+	pthread_mutex_lock(&gS3TreeLock);
+	ret = s3_ll_node(req, ino, &node);
+	if( ret == 0 ) {
+		s3_ll_stat(ino, node, &statbuf);
+	}
+	pthread_mutex_unlock(&gS3TreeLock);
+
+	if( ret != 0 ) {
+		fuse_reply_err(req, -ret);
+	} else {
+		fuse_reply_attr(req, &statbuf, config.attrTimeout);
+	}
+}
+
+/** Set file attributes; only the size is kept, in the cached copy */
+static void s3_fuse_ll_setattr(fuse_req_t req, fuse_ino_t ino,
+		struct stat *attr, int to_set, struct fuse_file_info *fi)
+{
+	struct stat	statbuf;
+	s3_tree_node	*node = NULL;
+	char		*path = NULL;
+	char		*cachedPath = NULL;
+	int		inCache = 0;
+	int		ret = 0;
+
+	log_msg("\ns3_fuse_ll_setattr(ino=%lu, to_set=0x%x)\n", ino, to_set);
+
+	pthread_mutex_lock(&gS3TreeLock);
+	ret = s3_ll_node(req, ino, &node);
+	if( (ret == 0) && (to_set & FUSE_SET_ATTR_SIZE) ) {
+		ret = s3_ll_is_dir(node) ? -EISDIR : s3_ll_path(node, &path);
+	}
+	pthread_mutex_unlock(&gS3TreeLock);
+	if( ret != 0 ) {
+		goto ret;
+	}
+
+	if( to_set & FUSE_SET_ATTR_SIZE ) {
+		ret = fillWait(path, 0, FILL_TO_END);
+		if( ret != 0 ) {
+			goto ret;
+		}
+		if( fi != NULL ) {
+			if( ftruncate(((s3_ll_file *) (uintptr_t) fi->fh)->fd,
+						attr->st_size) < 0 ) {
+				ret = -errno;
+				goto ret;
+			}
+		} else {
+			ret = s3CacheInCache(S3_LL_DATA->cache, path, &inCache);
+			if( (ret == 0) && (inCache == 0) ) {
+				ret = s3CacheFetch(S3_LL_DATA->cache, path, 0);
+			}
+			if( ret == 0 ) {
+				ret = s3CacheGetCachedPath(S3_LL_DATA->cache,
+							path, &cachedPath);
+			}
+			if( ret != 0 ) {
+				goto ret;
+			}
+			if( truncate(cachedPath, attr->st_size) < 0 ) {
+				ret = -errno;
+				goto ret;
+			}
+		}
+		ret = s3CacheMarkForFlush(S3_LL_DATA->cache, path,
+						attr->st_size, 0);
+		if( ret != 0 ) {
+			goto ret;
+		}
+	}
+
+	pthread_mutex_lock(&gS3TreeLock);
+	ret = s3_ll_node(req, ino, &node);
+	if( ret == 0 ) {
+		s3_ll_stat(ino, node, &statbuf);
+		if( to_set & FUSE_SET_ATTR_SIZE ) {
+			statbuf.st_size = attr->st_size;
+		}
+	}
+	pthread_mutex_unlock(&gS3TreeLock);
+
+ret:
+	if( path != NULL )
+		free(path);
+	if( cachedPath != NULL )
+		free(cachedPath);
+	if( ret != 0 ) {
+		fuse_reply_err(req, -ret);
+	} else {
+		fuse_reply_attr(req, &statbuf, config.attrTimeout);
+	}
+}
+
+/** Create a directory */
+static void s3_fuse_ll_mkdir(fuse_req_t req, fuse_ino_t parent,
+					const char *name, mode_t mode)
+{
+	struct fuse_entry_param	e;
+	s3_tree_node		*node = NULL;
+	char			*path = NULL;
+	char			*cachedPath = NULL;
+	int			ret = 0;
+
+	log_msg("\ns3_fuse_ll_mkdir(parent=%lu, name=\"%s\", mode=0%3o)\n",
+							parent, name, mode);
+
+	pthread_mutex_lock(&gS3TreeLock);
+	ret = s3_ll_node(req, parent, &node);
+	if( ret == 0 ) {
+		ret = s3_ll_child_path(node, name, &path);
+	}
+	pthread_mutex_unlock(&gS3TreeLock);
+	if( ret != 0 ) {
+		goto ret;
+	}
+
+	ret = addDirectory(path);
+	if( ret != 0 ) {
+		goto ret;
+	}
+
+	ret = s3CacheGetCachedPath(S3_LL_DATA->cache, path, &cachedPath);
+	if( ret != 0 ) {
+		goto ret;
+	}
+	mkpath(cachedPath);
+
+	pthread_mutex_lock(&gS3TreeLock);
+	ret = searchForPath(path, S3_LL_DATA->dirTree, &node);
+	if( (ret == 0) && (node == NULL) ) {
+		ret = -ENOENT;
+	}
+	if( ret == 0 ) {
+		s3_ll_entry(node, &e);
+		s3InodeRef(node);
+	}
+	pthread_mutex_unlock(&gS3TreeLock);
+
+ret:
+	if( path != NULL )
+		free(path);
+	if( cachedPath != NULL )
+		free(cachedPath);
+	if( ret != 0 ) {
+		fuse_reply_err(req, -ret);
+	} else {
+		s3_ll_reply_entry(req, &e);
+	}
+}
+
+/* unlink and rmdir */
+static void s3_ll_remove(fuse_req_t req, fuse_ino_t parent,
+					const char *name, int isDir)
+{
+	s3_tree_node	*node = NULL;
+	char		*path = NULL;
+	char		*cachedPath = NULL;
+	int		inCache = 0;
+	int		ret = 0;
+
+	pthread_mutex_lock(&gS3TreeLock);
+	ret = s3_ll_node(req, parent, &node);
+	if( ret == 0 ) {
+		ret = s3_ll_child_path(node, name, &path);
+	}
+	pthread_mutex_unlock(&gS3TreeLock);
+	if( ret != 0 ) {
+		goto ret;
+	}
+
+	ret = deletePath(path);
+	if( ret != 0 ) {
+		goto ret;
+	}
+
+	if( isDir == 0 ) {
+		ret = s3CacheInCache(S3_LL_DATA->cache, path, &inCache);
+		if( (ret == 0) && (inCache == 1) ) {
+			ret = s3CacheGetCachedPath(S3_LL_DATA->cache, path,
+								&cachedPath);
+			if( (ret == 0) && (unlink(cachedPath) < 0) ) {
+				ret = -errno;
+			}
+		}
+	}
+
+ret:
+	if( path != NULL )
+		free(path);
+	if( cachedPath != NULL )
+		free(cachedPath);
+	fuse_reply_err(req, -ret);
+}
+
+/** Remove a file */
+static void s3_fuse_ll_unlink(fuse_req_t req, fuse_ino_t parent,
+							const char *name)
+{
+	log_msg("\ns3_fuse_ll_unlink(parent=%lu, name=\"%s\")\n", parent, name);
+	s3_ll_remove(req, parent, name, 0);
+}
+
+/** Remove a directory */
+static void s3_fuse_ll_rmdir(fuse_req_t req, fuse_ino_t parent,
+							const char *name)
+{
+	log_msg("\ns3_fuse_ll_rmdir(parent=%lu, name=\"%s\")\n", parent, name);
+	s3_ll_remove(req, parent, name, 1);
+}
+
+static int s3_ll_open_file(char *path, int fd, struct fuse_file_info *fi)
+{
+	s3_ll_file	*file = NULL;
+
+	file = malloc(sizeof(s3_ll_file));
+	if( file == NULL ) {
+		close(fd);
+		free(path);
+		return -ENOMEM;
+	}
+	file->fd = fd;
+	file->path = path;
+	file->prev = NULL;
+	pthread_mutex_lock(&openFilesLock);
+	file->next = openFiles;
+	if( openFiles != NULL )
+		openFiles->prev = file;
+	openFiles = file;
+	pthread_mutex_unlock(&openFilesLock);
+	fi->fh = (uintptr_t) file;
+	return 0;
+}
+
+/* a copy of the path of an open file, it may be renamed meanwhile */
+static char *s3_ll_file_path(s3_ll_file *file)
+{
+	char		*path = NULL;
+
+	pthread_mutex_lock(&openFilesLock);
+	path = strdup(file->path);
+	pthread_mutex_unlock(&openFilesLock);
+	return path;
+}
+
+/* files open at path, or under it, are now under newPath */
+static void s3_ll_rename_files(const char *path, const char *newPath)
+{
+	s3_ll_file	*file = NULL;
+	char		*renamed = NULL;
+	int		len = strlen(path);
+
+	pthread_mutex_lock(&openFilesLock);
+	for( file = openFiles; file != NULL; file = file->next ) {
+		if( (strncmp(file->path, path, len) != 0)
+				|| ((file->path[len] != 0)
+					&& (file->path[len] != '/')) ) {
+			continue;
+		}
+		renamed = malloc(strlen(newPath) + strlen(file->path + len) + 1);
+		if( renamed == NULL ) {
+			continue;
+		}
+		sprintf(renamed, "%s%s", newPath, file->path + len);
+		free(file->path);
+		file->path = renamed;
+	}
+	pthread_mutex_unlock(&openFilesLock);
+}
+
+/** Rename: the keys are copied in S3 and the node keeps its inode,
+    see s3_rename.h */
+static void s3_fuse_ll_rename(fuse_req_t req, fuse_ino_t parent,
+		const char *name, fuse_ino_t newparent, const char *newname)
+{
+	s3_tree_node	*node = NULL;
+	char		*path = NULL;
+	char		*newPath = NULL;
+	int		ret = 0;
+
+	log_msg("\ns3_fuse_ll_rename(parent=%lu, name=\"%s\", newparent=%lu, "
+			"newname=\"%s\")\n", parent, name, newparent, newname);
+
+	pthread_mutex_lock(&gS3TreeLock);
+	ret = s3_ll_node(req, parent, &node);
+	if( ret == 0 ) {
+		ret = s3_ll_child_path(node, name, &path);
+	}
+	if( ret == 0 ) {
+		ret = s3_ll_node(req, newparent, &node);
+	}
+	if( ret == 0 ) {
+		ret = s3_ll_child_path(node, newname, &newPath);
+	}
+	pthread_mutex_unlock(&gS3TreeLock);
+	if( ret != 0 ) {
+		goto ret;
+	}
+
+	ret = renamePath(path, newPath);
+	if( ret == 0 ) {
+		s3_ll_rename_files(path, newPath);
+	}
+
+ret:
+	if( path != NULL )
+		free(path);
+	if( newPath != NULL )
+		free(newPath);
+	fuse_reply_err(req, -ret);
+}
+
+/** Open a file; fetches it into the cache first, unless the copy
+    there is current and the kernel can keep its pages */
+static void s3_fuse_ll_open(fuse_req_t req, fuse_ino_t ino,
+						struct fuse_file_info *fi)
+{
+	s3_tree_node	*node = NULL;
+	char		*path = NULL;
+	char		*cachedPath = NULL;
+	int		keepCache = 0;
+	int		fd = -1;
+	int		ret = 0;
+
+	log_msg("\ns3_fuse_ll_open(ino=%lu, flags=0x%x)\n", ino, fi->flags);
+
+	pthread_mutex_lock(&gS3TreeLock);
+	ret = s3_ll_node(req, ino, &node);
+	if( ret == 0 ) {
+		ret = s3_ll_is_dir(node) ? -EISDIR : s3_ll_path(node, &path);
+	}
+	pthread_mutex_unlock(&gS3TreeLock);
+	if( ret != 0 ) {
+		goto ret;
+	}
+
+	ret = s3CacheOpen(S3_LL_DATA->cache, path, fi->flags, &keepCache);
+	if( ret == 0 ) {
+		ret = s3CacheGetCachedPath(S3_LL_DATA->cache, path, &cachedPath);
+	}
+	if( ret != 0 ) {
+		goto ret;
+	}
+
+	fd = open(cachedPath, fi->flags);
+	if( fd < 0 ) {
+		ret = -errno;
+		goto ret;
+	}
+	ret = s3_ll_open_file(path, fd, fi);
+	path = NULL;
+	fi->keep_cache = keepCache;
+
+ret:
+	if( path != NULL )
+		free(path);
+	if( cachedPath != NULL )
+		free(cachedPath);
+	if( ret != 0 ) {
+		fuse_reply_err(req, -ret);
+	} else {
+		fuse_reply_open(req, fi);
+	}
+}
+
+/** Create and open a file */
+static void s3_fuse_ll_create(fuse_req_t req, fuse_ino_t parent,
+		const char *name, mode_t mode, struct fuse_file_info *fi)
+{
+	struct fuse_entry_param	e;
+	s3_tree_node		*node = NULL;
+	char			*path = NULL;
+	char			*cachedPath = NULL;
+	char			*tmp = NULL;
+	int			fd = -1;
+	int			counted = 0;
+	int			ret = 0;
+
+	log_msg("\ns3_fuse_ll_create(parent=%lu, name=\"%s\", mode=0%03o)\n",
+							parent, name, mode);
+
+	pthread_mutex_lock(&gS3TreeLock);
+	ret = s3_ll_node(req, parent, &node);
+	if( ret == 0 ) {
+		ret = s3_ll_child_path(node, name, &path);
+	}
+	pthread_mutex_unlock(&gS3TreeLock);
+	if( ret == 0 ) {
+		ret = s3CacheGetCachedPath(S3_LL_DATA->cache, path, &cachedPath);
+	}
+	if( ret != 0 ) {
+		goto ret;
+	}
+
+	tmp = strrchr(cachedPath, '/');
+	*tmp = 0;
+	mkpath(cachedPath);
+	*tmp = '/';
+	fd = open(cachedPath, (fi->flags & O_ACCMODE) | O_CREAT | O_TRUNC,
+									mode);
+	if( fd < 0 ) {
+		ret = -errno;
+		goto ret;
+	}
+
+	/* the new file needs a node, and so an inode, right away */
+	pthread_mutex_lock(&gS3TreeLock);
+	ret = updateDirTree(path, 1);
+	if( ret == 0 ) {
+		ret = searchForPath(path, S3_LL_DATA->dirTree, &node);
+	}
+	if( (ret == 0) && (node == NULL) ) {
+		ret = -ENOENT;
+	}
+	if( ret == 0 ) {
+		s3_ll_entry(node, &e);
+		s3InodeRef(node);
+		counted = 1;
+	}
+	pthread_mutex_unlock(&gS3TreeLock);
+	if( ret != 0 ) {
+		close(fd);
+		goto ret;
+	}
+
+	ret = s3_ll_open_file(path, fd, fi);
+	path = NULL;
+
+ret:
+	if( path != NULL )
+		free(path);
+	if( cachedPath != NULL )
+		free(cachedPath);
+	if( ret != 0 ) {
+		if( counted )
+			s3_ll_forget_ino(e.ino, 1);
+		fuse_reply_err(req, -ret);
+	} else if( fuse_reply_create(req, &e, fi) != 0 ) {
+		s3_ll_forget_ino(e.ino, 1);
+	}
+}
+
+/** Read data from an open file: the reply points libfuse at the cache
+    file, which splices the pages to /dev/fuse where it can */
+static void s3_fuse_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+				off_t offset, struct fuse_file_info *fi)
+{
+	s3_ll_file		*file = (s3_ll_file *) (uintptr_t) fi->fh;
+	struct fuse_bufvec	buf = FUSE_BUFVEC_INIT(size);
+	char			*path = NULL;
+	int			ret = 0;
+
+	log_msg("\ns3_fuse_ll_read(ino=%lu, size=%d, offset=%lld)\n",
+							ino, size, offset);
+
+	/* the copy may still be being filled */
+	path = s3_ll_file_path(file);
+	ret = (path != NULL) ? fillWait(path, offset, size) : -ENOMEM;
+	free(path);
+	if( ret != 0 ) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	buf.buf[0].fd = file->fd;
+	buf.buf[0].pos = offset;
+	fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+}
+
+/** Write data to an open file, from a buffer libfuse may have spliced
+    from /dev/fuse */
+static void s3_fuse_ll_write_buf(fuse_req_t req, fuse_ino_t ino,
+		struct fuse_bufvec *bufv, off_t offset, 
+		struct fuse_file_info *fi)
+{
+	s3_ll_file		*file = (s3_ll_file *) (uintptr_t) fi->fh;
+	struct fuse_bufvec	dst = FUSE_BUFVEC_INIT(fuse_buf_size(bufv));
+	ssize_t			count = 0;
+
+	log_msg("\ns3_fuse_ll_write_buf(ino=%lu, size=%d, offset=%lld)\n",
+					ino, fuse_buf_size(bufv), offset);
+
+	dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	dst.buf[0].fd = file->fd;
+	dst.buf[0].pos = offset;
+	count = fuse_buf_copy(&dst, bufv, FUSE_BUF_SPLICE_NONBLOCK);
+	if( count < 0 ) {
+		fuse_reply_err(req, -count);
+		return;
+	}
+	pthread_mutex_lock(&openFilesLock);
+	s3CacheMarkForFlush(S3_LL_DATA->cache, file->path, offset, count);
+	pthread_mutex_unlock(&openFilesLock);
+	fuse_reply_write(req, count);
+}
+
+/** Flush: upload the cached copy if it was written, or leave that to
+    the write-back workers */
+static void s3_fuse_ll_flush(fuse_req_t req, fuse_ino_t ino,
+						struct fuse_file_info *fi)
+{
+	s3_ll_file	*file = (s3_ll_file *) (uintptr_t) fi->fh;
+	char		*path = NULL;
+	int		ret = 0;
+
+	log_msg("\ns3_fuse_ll_flush(ino=%lu)\n", ino);
+
+	path = s3_ll_file_path(file);
+	if( path == NULL ) {
+		ret = -ENOMEM;
+	} else if( gWriteBackFlag ) {
+		ret = writeBackClose(S3_LL_DATA->cache, path);
+	} else {
+		ret = s3CacheFlushCache(S3_LL_DATA->cache, path);
+	}
+	free(path);
+	fuse_reply_err(req, -ret);
+}
+
+/** Fsync: returns once the file is in S3 */
+static void s3_fuse_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+						struct fuse_file_info *fi)
+{
+	s3_ll_file	*file = (s3_ll_file *) (uintptr_t) fi->fh;
+	char		*path = NULL;
+	int		ret = 0;
+
+	log_msg("\ns3_fuse_ll_fsync(ino=%lu, datasync=%d)\n", ino, datasync);
+
+	if( (datasync ? fdatasync(file->fd) : fsync(file->fd)) < 0 ) {
+		ret = -errno;
+	} else if( (path = s3_ll_file_path(file)) == NULL ) {
+		ret = -ENOMEM;
+	} else {
+		ret = s3CacheFlushCache(S3_LL_DATA->cache, path);
+		free(path);
+	}
+	fuse_reply_err(req, -ret);
+}
+
+/** Release an open file */
+static void s3_fuse_ll_release(fuse_req_t req, fuse_ino_t ino,
+						struct fuse_file_info *fi)
+{
+	s3_ll_file	*file = (s3_ll_file *) (uintptr_t) fi->fh;
+
+	log_msg("\ns3_fuse_ll_release(ino=%lu)\n", ino);
+
+	close(file->fd);
+	pthread_mutex_lock(&openFilesLock);
+	if( file->next != NULL )
+		file->next->prev = file->prev;
+	if( file->prev != NULL )
+		file->prev->next = file->next;
+	else
+		openFiles = file->next;
+	pthread_mutex_unlock(&openFilesLock);
+	free(file->path);
+	free(file);
+	fuse_reply_err(req, 0);
+}
+
+static void s3_ll_dir_free(s3_ll_dir *dir)
+{
+	free(dir->buf);
+	free(dir->path);
+	free(dir->last);
+	free(dir);
+}
+
+/* adds the entries after the last one, listing the next page of the
+   directory if there are none yet; stops adding at the end */
+static int s3_ll_dir_more(fuse_req_t req, s3_ll_dir *dir)
+{
+	s3_tree_node	*node = NULL;
+	s3_tree_node	**children = NULL;
+	size_t		size = dir->size;
+	int		count = 0;
+	int		ret = 0;
+	int		i = 0;
+
+	/* a directory listed to the end, without gS3TreeLock, see
+	   s3_epoch.h */
+	if( epochEnter() == 0 ) {
+		node = searchForPathLockFree(dir->path);
+		if( (node != NULL) && !revalidateDue(node)
+			&& (s3DirNextChildrenLockFree(node, &(dir->last),
+						&children, &count) == 0) ) {
+			for( i = 0; (ret == 0) && (i < count); i++ ) {
+				ret = s3_ll_dir_add(req, dir,
+					NODE_LOAD(children[i]->s3FileInfo.name),
+					NODE_LOAD(children[i]->ino),
+					s3_ll_is_dir(children[i]) ?
+						S_IFDIR : S_IFREG);
+			}
+			free(children);
+			epochExit();
+			return ret;
+		}
+		epochExit();
+	}
+
+	pthread_mutex_lock(&gS3TreeLock);
+	for( ;; ) {
+		ret = searchForPath(dir->path, S3_LL_DATA->dirTree, &node);
+		if( (ret != 0) || (node == NULL) ) {
+			break;
+		}
+		revalidateCheck(node);
+		if( ((node->isComplete & NODE_COMPLETE) == 0)
+					&& (node->listing == NULL) ) {
+			/* not listed yet */
+			ret = s3ListDirPage(&(S3_LL_DATA->dirTree), dir->path);
+			if( ret != 0 ) {
+				break;
+			}
+			continue;
+		}
+
+		ret = s3DirNextChildren(node, &(dir->last), &children, &count);
+		if( ret != 0 ) {
+			break;
+		}
+		for( i = 0; (ret == 0) && (i < count); i++ ) {
+			ret = s3_ll_dir_add(req, dir, 
+				children[i]->s3FileInfo.name, children[i]->ino,
+				s3_ll_is_dir(children[i]) ? S_IFDIR : S_IFREG);
+		}
+		free(children);
+		children = NULL;
+		if( (ret != 0) || (dir->size > size)
+				|| (node->isComplete & NODE_COMPLETE) ) {
+			break;
+		}
+
+		ret = s3ListDirPage(&(S3_LL_DATA->dirTree), dir->path);
+		if( ret != 0 ) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&gS3TreeLock);
+	return ret;
+}
+
+/** Open a directory; keeps its entries, listing the first page from S3 */
+static void s3_fuse_ll_opendir(fuse_req_t req, fuse_ino_t ino,
+						struct fuse_file_info *fi)
+{
+	s3_tree_node	*node = NULL;
+	s3_ll_dir	*dir = NULL;
+	int		ret = 0;
+
+	log_msg("\ns3_fuse_ll_opendir(ino=%lu)\n", ino);
+
+	dir = calloc(1, sizeof(s3_ll_dir));
+	if( dir == NULL ) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	pthread_mutex_lock(&gS3TreeLock);
+	ret = s3_ll_node(req, ino, &node);
+	if( ret != 0 ) {
+		goto ret;
+	}
+	if( !s3_ll_is_dir(node) ) {
+		ret = -ENOTDIR;
+		goto ret;
+	}
+	ret = s3_ll_path(node, &(dir->path));
+	if( ret != 0 ) {
+		goto ret;
+	}
+
+	ret = s3_ll_dir_add(req, dir, ".", ino, S_IFDIR);
+	if( ret == 0 ) {
+		ret = s3_ll_dir_add(req, dir, "..",
+			(node->parent != NULL) ? node->parent->ino : ino, S_IFDIR);
+	}
+
+ret:
+	pthread_mutex_unlock(&gS3TreeLock);
+	if( ret == 0 ) {
+		ret = s3_ll_dir_more(req, dir);
+	}
+	if( ret != 0 ) {
+		s3_ll_dir_free(dir);
+		fuse_reply_err(req, -ret);
+	} else {
+		fi->fh = (uintptr_t) dir;
+		fuse_reply_open(req, fi);
+	}
+}
+
+/** Read directory, from the entries kept by opendir */
+static void s3_fuse_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+				off_t offset, struct fuse_file_info *fi)
+{
+	s3_ll_dir	*dir = (s3_ll_dir *) (uintptr_t) fi->fh;
+
+	log_msg("\ns3_fuse_ll_readdir(ino=%lu, size=%d, offset=%lld)\n",
+							ino, size, offset);
+
+	if( ((size_t) offset >= dir->size) 
+			&& (s3_ll_dir_more(req, dir) != 0) ) {
+		fuse_reply_err(req, EIO);
+		return;
+	}
+	if( (size_t) offset < dir->size ) {
+		fuse_reply_buf(req, dir->buf + offset,
+			(dir->size - offset < size) ? dir->size - offset : size);
+	} else {
+		fuse_reply_buf(req, NULL, 0);
+	}
+}
+
+/** Release directory */
+static void s3_fuse_ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+						struct fuse_file_info *fi)
+{
+	s3_ll_dir	*dir = (s3_ll_dir *) (uintptr_t) fi->fh;
+
+	log_msg("\ns3_fuse_ll_releasedir(ino=%lu)\n", ino);
+
+	s3_ll_dir_free(dir);
+	fuse_reply_err(req, 0);
+}
+
+/********************** kernel cache invalidation ************************/
+
+/* gS3Invalidate, called with gS3TreeLock held: queue it for the worker */
+static void s3_ll_invalidate(s3_tree_node *node, int what)
+{
+	s3_ll_inval	*inval = NULL;
+
+	if( (what & S3_INVALIDATE_ENTRY) && (node->parent == NULL) ) {
+		return;
+	}
+
+	inval = calloc(1, sizeof(s3_ll_inval));
+	if( inval == NULL ) {
+		return;
+	}
+	inval->ino = node->ino;
+	inval->what = what;
+	if( what & S3_INVALIDATE_ENTRY ) {
+		inval->parent = node->parent->ino;
+		inval->name = strdup(node->s3FileInfo.name);
+		if( inval->name == NULL ) {
+			free(inval);
+			return;
+		}
+	}
+
+	pthread_mutex_lock(&invalLock);
+	if( invalTail != NULL ) {
+		invalTail->next = inval;
+	} else {
+		invalHead = inval;
+	}
+	invalTail = inval;
+	pthread_cond_signal(&invalCond);
+	pthread_mutex_unlock(&invalLock);
+}
+
+/*
+ * Worker thread: tell the kernel.  ENOENT only means the kernel never
+ * had, or already dropped, what we invalidate.
+ */
+static void *s3_ll_invalidate_thread(void *arg)
+{
+	s3_ll_inval	*inval = NULL;
+
+	(void) arg;
+	pthread_mutex_lock(&invalLock);
+	while( 1 ) {
+		while( (invalHead == NULL) && (invalStop == 0) ) {
+			pthread_cond_wait(&invalCond, &invalLock);
+		}
+		if( invalHead == NULL ) {
+			break;
+		}
+		inval = invalHead;
+		invalHead = inval->next;
+		if( invalHead == NULL ) {
+			invalTail = NULL;
+		}
+		pthread_mutex_unlock(&invalLock);
+
+		if( inval->what & S3_INVALIDATE_ENTRY ) {
+			fuse_lowlevel_notify_inval_entry(invalChan,
+					inval->parent, inval->name,
+					strlen(inval->name));
+		} else if( inval->what & S3_INVALIDATE_DATA ) {
+			/* attributes and every cached page */
+			fuse_lowlevel_notify_inval_inode(invalChan,
+							inval->ino, 0, 0);
+		} else {
+			/* attributes only */
+			fuse_lowlevel_notify_inval_inode(invalChan,
+							inval->ino, -1, 0);
+		}
+
+		if( inval->name != NULL )
+			free(inval->name);
+		free(inval);
+		pthread_mutex_lock(&invalLock);
+	}
+	pthread_mutex_unlock(&invalLock);
+	return NULL;
+}
+
+struct fuse_lowlevel_ops s3_fuse_ll_oper = {
+
+  .init = s3_fuse_ll_init,
+  .destroy = s3_fuse_ll_destroy,
+  .lookup = s3_fuse_ll_lookup,
+  .forget = s3_fuse_ll_forget,
+  .forget_multi = s3_fuse_ll_forget_multi,
+  .getattr = s3_fuse_ll_getattr,
+  .setattr = s3_fuse_ll_setattr,
+  .mkdir = s3_fuse_ll_mkdir,
+  .unlink = s3_fuse_ll_unlink,
+  .rmdir = s3_fuse_ll_rmdir,
+  .rename = s3_fuse_ll_rename,
+  .open = s3_fuse_ll_open,
+  .create = s3_fuse_ll_create,
+  .read = s3_fuse_ll_read,
+  .write_buf = s3_fuse_ll_write_buf,
+  .flush = s3_fuse_ll_flush,
+  .fsync = s3_fuse_ll_fsync,
+  .release = s3_fuse_ll_release,
+  .opendir = s3_fuse_ll_opendir,
+  .readdir = s3_fuse_ll_readdir,
+  .releasedir = s3_fuse_ll_releasedir
+
+};
+
+int s3_fuse_lowlevel_main(int argc, char *argv[], struct s3_fuse_state *state)
+{
+	struct fuse_args	args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_chan	*ch = NULL;
+	struct fuse_session	*se = NULL;
+	char			*mountpoint = NULL;
+	pthread_t		invalThread;
+	int			multithreaded = 0;
+	int			foreground = 0;
+	int			err = -1;
+
+	/* fuse_lowlevel_new() rejects the timeouts, take them out first;
+	   our I/O options go before the user's, who can override them */
+	if( (fuse_opt_insert_arg(&args, 1, S3_FUSE_IO_OPTIONS) == -1)
+			|| (fuse_opt_parse(&args, &config, s3_ll_opts, NULL) == -1)
+			|| (fuse_parse_cmdline(&args, &mountpoint,
+					&multithreaded, &foreground) == -1) ) {
+		goto ret;
+	}
+
+	ch = fuse_mount(mountpoint, &args);
+	if( ch == NULL ) {
+		goto ret;
+	}
+
+	se = fuse_lowlevel_new(&args, &s3_fuse_ll_oper,
+					sizeof(s3_fuse_ll_oper), state);
+	if( se != NULL ) {
+		if( fuse_set_signal_handlers(se) != -1 ) {
+			fuse_session_add_chan(se, ch);
+			fuse_daemonize(foreground);
+
+			/* after fuse_daemonize(), which forks */
+			invalChan = ch;
+			if( pthread_create(&invalThread, NULL,
+				s3_ll_invalidate_thread, NULL) == 0 ) {
+				pthread_mutex_lock(&gS3TreeLock);
+				gS3Invalidate = s3_ll_invalidate;
+				pthread_mutex_unlock(&gS3TreeLock);
+			} else {
+				invalChan = NULL;
+			}
+
+			if( multithreaded ) {
+				err = fuse_session_loop_mt(se);
+			} else {
+				err = fuse_session_loop(se);
+			}
+
+			if( invalChan != NULL ) {
+				pthread_mutex_lock(&gS3TreeLock);
+				gS3Invalidate = NULL;
+				pthread_mutex_unlock(&gS3TreeLock);
+				pthread_mutex_lock(&invalLock);
+				invalStop = 1;
+				pthread_cond_signal(&invalCond);
+				pthread_mutex_unlock(&invalLock);
+				pthread_join(invalThread, NULL);
+				invalChan = NULL;
+			}
+			fuse_remove_signal_handlers(se);
+			fuse_session_remove_chan(ch);
+		}
+		fuse_session_destroy(se);
+	}
+	fuse_unmount(mountpoint, ch);
+
+ret:
+	if( mountpoint != NULL )
+		free(mountpoint);
+	fuse_opt_free_args(&args);
+	return err ? 1 : 0;
+}
@@ -0,0 +1,159 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "s3.h"
+#include "s3_key_list.h"
+
+/*
+ * a key is
+ *	shared		varint, bytes of the key before it starts with
+ *	suffixLength	varint
+ *	suffix
+ *	size		varint
+ *	time		varint
+ *	eTagLength	varint, 0 without an ETag, else its length + 1
+ *	eTag
+ */
+
+void keyListInit(s3_key_list *list)
+{
+	list->data = NULL;
+	list->length = 0;
+	list->size = 0;
+	list->count = 0;
+	list->last[0] = 0;
+	list->lastLength = 0;
+}
+
+void keyListFree(s3_key_list *list)
+{
+	free(list->data);
+	keyListInit(list);
+}
+
+static int reserve(s3_key_list *list, size_t length)
+{
+	unsigned char	*data = NULL;
+	size_t		size = list->size;
+
+	if( list->length + length <= list->size ) {
+		return 0;
+	}
+	if( size == 0 ) {
+		size = S3_KEY_LIST_INITIAL_SIZE;
+	}
+	while( size < list->length + length ) {
+		size *= 2;
+	}
+	data = realloc(list->data, size);
+	if( data == NULL ) {
+		return -ENOMEM;
+	}
+	list->data = data;
+	list->size = size;
+	return 0;
+}
+
+static void putVarint(s3_key_list *list, uint64_t value)
+{
+	while( value >= 0x80 ) {
+		list->data[list->length++] = (unsigned char) (value | 0x80);
+		value >>= 7;
+	}
+	list->data[list->length++] = (unsigned char) value;
+}
+
+static uint64_t getVarint(const s3_key_list *list, size_t *pOffset)
+{
+	uint64_t	value = 0;
+	int		shift = 0;
+	unsigned char	byte = 0;
+
+	do {
+		byte = list->data[(*pOffset)++];
+		value |= ((uint64_t) (byte & 0x7f)) << shift;
+		shift += 7;
+	} while( byte & 0x80 );
+	return value;
+}
+
+int keyListAppend(s3_key_list *list, const char *key, time_t time,
+					int64_t size, const char *eTag)
+{
+	int		keyLength = strlen(key);
+	int		eTagLength = (eTag != NULL) ? strlen(eTag) : 0;
+	int		shared = 0;
+
+	if( keyLength > S3_MAX_KEY_SIZE ) {
+		return -ENAMETOOLONG;
+	}
+	if( eTagLength > 254 ) {
+		eTagLength = 254;
+	}
+	while( (shared < list->lastLength) && (list->last[shared] == key[shared]) ) {
+		shared++;
+	}
+
+	/* five varints of at most ten bytes */
+	if( reserve(list, 50 + keyLength - shared + eTagLength) != 0 ) {
+		return -ENOMEM;
+	}
+	putVarint(list, shared);
+	putVarint(list, keyLength - shared);
+	memcpy(list->data + list->length, key + shared, keyLength - shared);
+	list->length += keyLength - shared;
+	putVarint(list, (uint64_t) size);
+	putVarint(list, (uint64_t) time);
+	putVarint(list, (eTag != NULL) ? eTagLength + 1 : 0);
+	memcpy(list->data + list->length, eTag, eTagLength);
+	list->length += eTagLength;
+
+	memcpy(list->last + shared, key + shared, keyLength - shared + 1);
+	list->lastLength = keyLength;
+	list->count++;
+	return 0;
+}
+
+void keyIterInit(s3_key_iter *iter, const s3_key_list *list)
+{
+	iter->list = list;
+	iter->offset = 0;
+	iter->key[0] = 0;
+	iter->shared = 0;
+}
+
+int keyListNext(s3_key_iter *iter, s3_file_info *info)
+{
+	/*
+	 - the next key in *info, 0 after the last one
+	 - name and eTag are in the iterator, good until the next call
+	*/
+	const s3_key_list	*list = iter->list;
+	size_t		suffixLength = 0;
+	size_t		eTagLength = 0;
+
+	if( iter->offset >= list->length ) {
+		return 0;
+	}
+	iter->shared = (int) getVarint(list, &iter->offset);
+	suffixLength = getVarint(list, &iter->offset);
+	memcpy(iter->key + iter->shared, list->data + iter->offset,
+							suffixLength);
+	iter->key[iter->shared + suffixLength] = 0;
+	iter->offset += suffixLength;
+
+	info->name = iter->key;
+	info->size = (int64_t) getVarint(list, &iter->offset);
+	info->time = (time_t) getVarint(list, &iter->offset);
+	info->versionId = NULL;
+	info->eTag = NULL;
+	eTagLength = getVarint(list, &iter->offset);
+	if( eTagLength > 0 ) {
+		eTagLength--;
+		memcpy(iter->eTag, list->data + iter->offset, eTagLength);
+		iter->eTag[eTagLength] = 0;
+		iter->offset += eTagLength;
+		info->eTag = iter->eTag;
+	}
+	return 1;
+}
@@ -0,0 +1,190 @@
+/* strdup() */
+#define _XOPEN_SOURCE 500
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "s3_fuse_bridge.h"
+#include "s3_negative_cache.h"
+#include "log.h"
+
+/* a path S3 did not have; chained in its hash slot and, oldest first,
+   in the order it was added, which is also the order it expires in */
+typedef struct s3_negative_entry s3_negative_entry;
+struct s3_negative_entry {
+	char			*path;
+	time_t			expires;
+	s3_negative_entry	*hashNext;
+	s3_negative_entry	*prev;
+	s3_negative_entry	*next;
+};
+
+static int			negativeTTL = NEGATIVE_DEFAULT_TTL;
+static int			maxEntries = NEGATIVE_DEFAULT_ENTRIES;
+
+static s3_negative_entry	**table = NULL;
+static size_t			tableSize = 0;	/* a power of two */
+static int			count = 0;
+static s3_negative_entry	*oldest = NULL;
+static s3_negative_entry	*newest = NULL;
+
+int saveNegativePolicy()
+{
+	char		*env = NULL;
+	char		*end = NULL;
+	long		l = 0;
+
+	env = getenv("S3_NEGATIVE_TTL");
+	if( env != NULL ) {
+		l = strtol(env, &end, 10);
+		if( (*env == 0) || (*end != 0) || (l < 0) || (l > 86400) ) {
+			log_msg("S3_NEGATIVE_TTL : %s is not valid, using %d\n",
+						env, NEGATIVE_DEFAULT_TTL);
+		} else {
+			negativeTTL = (int) l;
+		}
+	}
+
+	env = getenv("S3_NEGATIVE_ENTRIES");
+	if( env != NULL ) {
+		l = strtol(env, &end, 10);
+		if( (*env == 0) || (*end != 0) || (l < 1)
+					|| (l > NEGATIVE_MAX_ENTRIES) ) {
+			log_msg("S3_NEGATIVE_ENTRIES : %s is not valid, "
+				"using %d\n", env, NEGATIVE_DEFAULT_ENTRIES);
+		} else {
+			maxEntries = (int) l;
+		}
+	}
+
+	log_msg("misses kept %d s, at most %d\n", negativeTTL, maxEntries);
+	return 0;
+}
+
+static size_t pathHash(const char *path)
+{
+	size_t		h = 2166136261u;
+
+	while( *path != 0 ) {
+		h = (h ^ (unsigned char) *path++) * 16777619u;
+	}
+	return h;
+}
+
+static s3_negative_entry **findSlot(const char *path)
+{
+	s3_negative_entry	**slot = NULL;
+
+	slot = &table[pathHash(path) & (tableSize - 1)];
+	while( (*slot != NULL) && (strcmp((*slot)->path, path) != 0) ) {
+		slot = &((*slot)->hashNext);
+	}
+	return slot;
+}
+
+static void removeEntry(s3_negative_entry **slot)
+{
+	s3_negative_entry	*entry = *slot;
+
+	*slot = entry->hashNext;
+	if( entry->prev != NULL ) {
+		entry->prev->next = entry->next;
+	} else {
+		oldest = entry->next;
+	}
+	if( entry->next != NULL ) {
+		entry->next->prev = entry->prev;
+	} else {
+		newest = entry->prev;
+	}
+	free(entry->path);
+	free(entry);
+	count--;
+}
+
+int negativeFind(const char *path)
+{
+	/* 1 if S3 did not have path a moment ago */
+	s3_negative_entry	**slot = NULL;
+
+	if( count == 0 ) {
+		return 0;
+	}
+	slot = findSlot(path);
+	if( *slot == NULL ) {
+		return 0;
+	}
+	if( (*slot)->expires <= time(NULL) ) {
+		removeEntry(slot);
+		return 0;
+	}
+	return 1;
+}
+
+void negativeAdd(const char *path)
+{
+	s3_negative_entry	*entry = NULL;
+	s3_negative_entry	**slot = NULL;
+	time_t			now = time(NULL);
+
+	if( negativeTTL == 0 ) {
+		return;
+	}
+	if( table == NULL ) {
+		/* at most half full */
+		for( tableSize = 16; tableSize < 2 * (size_t) maxEntries;
+							tableSize *= 2 )
+			;
+		table = calloc(tableSize, sizeof(s3_negative_entry *));
+		if( table == NULL ) {
+			log_msg("negativeAdd : no memory for the table\n");
+			tableSize = 0;
+			return;
+		}
+	}
+
+	slot = findSlot(path);
+	if( *slot != NULL ) {
+		removeEntry(slot);
+	}
+	while( (oldest != NULL)
+			&& ((count >= maxEntries) || (oldest->expires <= now)) ) {
+		removeEntry(findSlot(oldest->path));
+	}
+
+	entry = calloc(1, sizeof(s3_negative_entry));
+	if( entry == NULL ) {
+		return;
+	}
+	entry->path = strdup(path);
+	if( entry->path == NULL ) {
+		free(entry);
+		return;
+	}
+	entry->expires = now + negativeTTL;
+	slot = findSlot(path);
+	*slot = entry;
+	entry->prev = newest;
+	if( newest != NULL ) {
+		newest->next = entry;
+	} else {
+		oldest = entry;
+	}
+	newest = entry;
+	count++;
+}
+
+void negativeForget(const char *path)
+{
+	/* path was made here */
+	s3_negative_entry	**slot = NULL;
+
+	if( count == 0 ) {
+		return;
+	}
+	slot = findSlot(path);
+	if( *slot != NULL ) {
+		removeEntry(slot);
+	}
+}
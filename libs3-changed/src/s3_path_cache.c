@@ -0,0 +1,212 @@
+/* strdup() */
+#define _XOPEN_SOURCE 500
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "s3_fuse_bridge.h"
+#include "s3_path_cache.h"
+#include "s3_epoch.h"
+#include "log.h"
+
+/* a path searchForPath() found, and where */
+typedef struct s3_path_entry {
+	char		*path;		/* NULL: a free slot */
+	s3_tree_node	*tree;		/* the root it was found from */
+	s3_tree_node	*node;
+	unsigned long	generation;	/* of the tree, when found */
+	unsigned long	sequence;	/* odd while the entry changes */
+} s3_path_entry;
+
+static int		maxEntries = PATH_CACHE_DEFAULT_ENTRIES;
+
+static s3_path_entry	*table = NULL;
+static size_t		tableSize = 0;	/* a power of two */
+static int		used = 0;	/* slots with a path */
+static unsigned long	generation = 0;
+
+int savePathCachePolicy()
+{
+	char		*env = NULL;
+	char		*end = NULL;
+	long		l = 0;
+
+	env = getenv("S3_PATH_CACHE_ENTRIES");
+	if( env != NULL ) {
+		l = strtol(env, &end, 10);
+		if( (*env == 0) || (*end != 0) || (l < 0)
+					|| (l > PATH_CACHE_MAX_ENTRIES) ) {
+			log_msg("S3_PATH_CACHE_ENTRIES : %s is not valid, "
+				"using %d\n", env, PATH_CACHE_DEFAULT_ENTRIES);
+		} else {
+			maxEntries = (int) l;
+		}
+	}
+
+	log_msg("paths kept %d\n", maxEntries);
+	return 0;
+}
+
+static size_t pathHash(const char *path)
+{
+	size_t		h = 2166136261u;
+
+	while( *path != 0 ) {
+		h = (h ^ (unsigned char) *path++) * 16777619u;
+	}
+	return h;
+}
+
+/* "/bucket/dir/name": no empty names, no "/" at the end */
+static int isPlainPath(const char *path)
+{
+	const char	*p = NULL;
+
+	if( (path[0] != '/') || (path[1] == 0) ) {
+		return 0;
+	}
+	for( p = path; *p != 0; p++ ) {
+		if( (p[0] == '/') && ((p[1] == '/') || (p[1] == 0)) ) {
+			return 0;
+		}
+	}
+	return (p - path) < PATH_CACHE_MAX_PATH;
+}
+
+/* before and after an entry changes, see pathCacheFindLockFree() */
+static void entryBump(s3_path_entry *entry)
+{
+	NODE_STORE(entry->sequence, entry->sequence + 1);
+}
+
+/* a path that goes, once no lock-free reader can be comparing it */
+static void entryFreePath(s3_path_entry *entry)
+{
+	char		*path = entry->path;
+
+	NODE_STORE(entry->path, NULL);
+	epochRetire(free, path);
+}
+
+s3_tree_node *pathCacheFind(s3_tree_node *tree, const char *path)
+{
+	/* the node of path found from tree, or NULL */
+	s3_path_entry	*entry = NULL;
+
+	if( used == 0 ) {
+		return NULL;
+	}
+	entry = &table[pathHash(path) & (tableSize - 1)];
+	if( (entry->path == NULL) || (entry->generation != generation)
+			|| (entry->tree != tree)
+			|| (strcmp(entry->path, path) != 0) ) {
+		return NULL;
+	}
+	return entry->node;
+}
+
+void pathCacheAdd(s3_tree_node *tree, const char *path, s3_tree_node *node)
+{
+	s3_path_entry	*entry = NULL;
+	char		*copy = NULL;
+
+	if( (maxEntries == 0) || !isPlainPath(path) ) {
+		return;
+	}
+	if( table == NULL ) {
+		for( tableSize = 16; tableSize < (size_t) maxEntries;
+							tableSize *= 2 )
+			;
+		entry = calloc(tableSize, sizeof(s3_path_entry));
+		if( entry == NULL ) {
+			log_msg("pathCacheAdd : no memory for %d paths\n",
+								maxEntries);
+			maxEntries = 0;
+			return;
+		}
+		NODE_STORE(table, entry);
+	}
+
+	entry = &table[pathHash(path) & (tableSize - 1)];
+	entryBump(entry);
+	if( (entry->path == NULL) || (strcmp(entry->path, path) != 0) ) {
+		copy = strdup(path);
+		if( copy == NULL ) {
+			entryBump(entry);
+			return;
+		}
+		if( entry->path == NULL ) {
+			used++;
+		} else {
+			entryFreePath(entry);
+		}
+		NODE_STORE(entry->path, copy);
+	}
+	NODE_STORE(entry->tree, tree);
+	NODE_STORE(entry->node, node);
+	NODE_STORE(entry->generation, generation);
+	entryBump(entry);
+}
+
+void pathCacheUnlink(s3_tree_node *node)
+{
+	/*
+	 - node is about to leave its parent, deleted or moved; called
+	   while it is still linked, so its path is still the one kept
+	*/
+	char		path[PATH_CACHE_MAX_PATH];
+	s3_path_entry	*entry = NULL;
+
+	if( used == 0 ) {
+		return;
+	}
+	if( (node->children != NULL)
+		|| (pathForNode(node, path, sizeof(path)) < 0) ) {
+		NODE_STORE(generation, generation + 1);
+		return;
+	}
+	entry = &table[pathHash(path) & (tableSize - 1)];
+	if( (entry->path != NULL) && (entry->node == node)
+				&& (strcmp(entry->path, path) == 0) ) {
+		entryBump(entry);
+		entryFreePath(entry);
+		entryBump(entry);
+		used--;
+	}
+}
+
+s3_tree_node *pathCacheFindLockFree(s3_tree_node *tree, const char *path)
+{
+	/*
+	 - pathCacheFind() without gS3TreeLock, between epochEnter() and
+	   epochExit(), see s3_epoch.h
+	 - NULL if the entry is changing as well; the caller walks the tree
+	*/
+	s3_path_entry	*entries = NODE_LOAD(table);
+	s3_path_entry	*entry = NULL;
+	s3_tree_node	*node = NULL;
+	unsigned long	sequence = 0;
+	char		*entryPath = NULL;
+
+	if( entries == NULL ) {
+		return NULL;
+	}
+	entry = &entries[pathHash(path) & (tableSize - 1)];
+	sequence = NODE_LOAD(entry->sequence);
+	if( sequence & 1 ) {
+		return NULL;
+	}
+	entryPath = NODE_LOAD(entry->path);
+	if( (entryPath == NULL)
+			|| (NODE_LOAD(entry->generation) != NODE_LOAD(generation))
+			|| (NODE_LOAD(entry->tree) != tree)
+			|| (strcmp(entryPath, path) != 0) ) {
+		return NULL;
+	}
+	node = NODE_LOAD(entry->node);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if( __atomic_load_n(&entry->sequence, __ATOMIC_RELAXED) != sequence ) {
+		return NULL;
+	}
+	return node;
+}
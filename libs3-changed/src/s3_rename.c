@@ -0,0 +1,675 @@
+/* strdup() */
+#define _XOPEN_SOURCE 500
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "s3_fuse_bridge.h"
+#include "s3_chunk_store.h"
+#include "s3_cache_fill.h"
+#include "s3_rename.h"
+#include "s3_key_list.h"
+#include "s3_delete.h"
+#include "log.h"
+
+static int		renameThreads = RENAME_DEFAULT_THREADS;
+
+/* copies, shared by the workers; the deletes go to s3_delete.h */
+typedef struct s3_rename_batch {
+	int		count;
+	char		**sources;	/* "bucket/key" */
+	char		**destinations;
+	char		**eTags;	/* of the copies */
+	int		*results;
+	int		plain;		/* one object, not encoded or chunked */
+	int		next;		/* first one not taken yet */
+	pthread_mutex_t	lock;
+} s3_rename_batch;
+
+/* the keys of the target a rename replaces, sorted */
+typedef struct s3_rename_target {
+	int		count;
+	char		**keys;		/* "bucket/key" */
+	int		*overwritten;	/* by a copy of the batch */
+} s3_rename_target;
+
+int saveRenamePolicy()
+{
+	char		*env = NULL;
+	char		*end = NULL;
+	long		l = 0;
+
+	env = getenv("S3_RENAME_THREADS");
+	if( env != NULL ) {
+		l = strtol(env, &end, 10);
+		if( (*env == 0) || (*end != 0) || (l < 1)
+					|| (l > RENAME_MAX_THREADS) ) {
+			log_msg("S3_RENAME_THREADS : %s is not valid, using %d\n",
+						env, RENAME_DEFAULT_THREADS);
+		} else {
+			renameThreads = (int) l;
+		}
+	}
+
+	log_msg("rename with %d threads\n", renameThreads);
+	return 0;
+}
+
+static void *renameWorker(void *arg)
+{
+	s3_rename_batch	*batch = (s3_rename_batch *) arg;
+	int		i = 0;
+
+	for( ;; ) {
+		pthread_mutex_lock(&batch->lock);
+		i = batch->next++;
+		pthread_mutex_unlock(&batch->lock);
+		if( i >= batch->count ) {
+			break;
+		}
+		batch->results[i] = copyObjectInS3(batch->sources[i],
+				batch->destinations[i], &(batch->eTags[i]));
+	}
+	return NULL;
+}
+
+/* runs the batch on up to renameThreads threads, this one included;
+   returns the first error */
+static int runBatch(s3_rename_batch *batch)
+{
+	pthread_t	workers[RENAME_MAX_THREADS];
+	int		workerCount = 0;
+	int		i = 0;
+
+	batch->next = 0;
+	while( (workerCount < renameThreads - 1)
+				&& (workerCount < batch->count - 1) ) {
+		if( pthread_create(&workers[workerCount], NULL,
+						renameWorker, batch) != 0 ) {
+			break;
+		}
+		workerCount++;
+	}
+	renameWorker(batch);
+	for( i = 0; i < workerCount; i++ ) {
+		pthread_join(workers[i], NULL);
+	}
+
+	for( i = 0; i < batch->count; i++ ) {
+		if( batch->results[i] != 0 ) {
+			return batch->results[i];
+		}
+	}
+	return 0;
+}
+
+/*
+ * the encoder names the pieces of "stem.ext" stem_k1.ext .. stem_m1.ext
+ * and stem_meta.txt; the piece of oldName called fragment becomes the
+ * one of newName.  Anything else, a chunk manifest, keeps its name.
+ */
+static char *renamedFragment(const char *fragment, const char *oldName,
+						const char *newName)
+{
+	int		oldStemLen = strcspn(oldName, ".");
+	int		newStemLen = strcspn(newName, ".");
+	const char	*oldExt = oldName + oldStemLen;
+	const char	*newExt = newName + newStemLen;
+	const char	*tag = NULL;
+	int		tagLen = 0;
+	char		*renamed = NULL;
+
+	if( (strncmp(fragment, oldName, oldStemLen) != 0)
+					|| (fragment[oldStemLen] != '_') ) {
+		return strdup(fragment);
+	}
+	tag = fragment + oldStemLen + 1;
+	if( strcmp(tag, "meta.txt") == 0 ) {
+		newExt = ".txt";
+		tagLen = strlen("meta");
+	} else {
+		tagLen = strlen(tag) - strlen(oldExt);
+		if( (tagLen <= 0) || (strcmp(tag + tagLen, oldExt) != 0) ) {
+			return strdup(fragment);
+		}
+	}
+
+	renamed = malloc(newStemLen + tagLen + strlen(newExt) + 2);
+	if( renamed != NULL ) {
+		sprintf(renamed, "%.*s_%.*s%s", newStemLen, newName,
+						tagLen, tag, newExt);
+	}
+	return renamed;
+}
+
+/* "/bucket/some/key" -> "bucket" and "some/key", NULL for a bucket */
+static int splitPath(const char *path, char **pBucket, char **pKey)
+{
+	char		*slash = NULL;
+
+	*pKey = NULL;
+	*pBucket = strdup(path + 1);
+	if( *pBucket == NULL ) {
+		return -ENOMEM;
+	}
+	slash = strchr(*pBucket, '/');
+	if( (slash != NULL) && (slash[1] != 0) ) {
+		*slash = 0;
+		*pKey = slash + 1;
+	}
+	return 0;
+}
+
+static void freeBatch(s3_rename_batch *batch)
+{
+	int		i = 0;
+
+	for( i = 0; i < batch->count; i++ ) {
+		free(batch->sources[i]);
+		if( batch->destinations != NULL )
+			free(batch->destinations[i]);
+		if( (batch->eTags != NULL) && (batch->eTags[i] != NULL) )
+			free(batch->eTags[i]);
+	}
+	free(batch->sources);
+	free(batch->destinations);
+	free(batch->eTags);
+	free(batch->results);
+	pthread_mutex_destroy(&batch->lock);
+}
+
+/*
+ * the keys of path and what they are called under newPath: everything
+ * under "key/", or the object "key" itself for a plain file
+ */
+static int buildBatch(const char *path, const char *newPath, int isDir,
+						s3_rename_batch *batch)
+{
+	s3_key_list	keys;
+	s3_key_iter	iter;
+	s3_file_info	info;
+	int		count = 0;
+	char		*bucket = NULL;
+	char		*key = NULL;
+	char		*newBucket = NULL;
+	char		*newKey = NULL;
+	const char	*oldName = strrchr(path, '/') + 1;
+	const char	*newName = strrchr(newPath, '/') + 1;
+	const char	*rest = NULL;
+	char		*fragment = NULL;
+	int		prefixLen = 0;
+	int		chunked = 0;
+	int		i = 0;
+	int		ret = 0;
+
+	memset(batch, 0, sizeof(s3_rename_batch));
+	pthread_mutex_init(&batch->lock, NULL);
+	keyListInit(&keys);
+
+	ret = splitPath(path, &bucket, &key);
+	if( ret == 0 ) {
+		ret = splitPath(newPath, &newBucket, &newKey);
+	}
+	if( ret != 0 ) {
+		goto ret;
+	}
+
+	ret = getKeysFromS3(path, &keys);
+	if( ret != 0 ) {
+		goto ret;
+	}
+	count = keys.count;
+	prefixLen = strlen(key) + 1;
+	keyIterInit(&iter, &keys);
+	while( keyListNext(&iter, &info) ) {
+		if( strcmp(info.name + prefixLen, CHUNK_MANIFEST_NAME) == 0 ) {
+			chunked = 1;
+		}
+	}
+
+	batch->count = ((count == 0) && !isDir) ? 1 : count;
+	batch->sources = calloc(batch->count + 1, sizeof(char *));
+	batch->destinations = calloc(batch->count + 1, sizeof(char *));
+	batch->eTags = calloc(batch->count + 1, sizeof(char *));
+	batch->results = calloc(batch->count + 1, sizeof(int));
+	if( (batch->sources == NULL) || (batch->destinations == NULL)
+			|| (batch->eTags == NULL) || (batch->results == NULL) ) {
+		ret = -ENOMEM;
+		goto ret;
+	}
+
+	if( count == 0 ) {
+		if( !isDir ) {
+			batch->sources[0] = malloc(strlen(path));
+			batch->destinations[0] = malloc(strlen(newPath));
+			if( (batch->sources[0] == NULL)
+					|| (batch->destinations[0] == NULL) ) {
+				ret = -ENOMEM;
+				goto ret;
+			}
+			strcpy(batch->sources[0], path + 1);
+			strcpy(batch->destinations[0], newPath + 1);
+			batch->plain = 1;
+		}
+		goto ret;
+	}
+
+	keyIterInit(&iter, &keys);
+	for( i = 0; keyListNext(&iter, &info); i++ ) {
+		rest = info.name + prefixLen;
+		if( isDir || chunked || (strchr(rest, '/') != NULL) ) {
+			fragment = strdup(rest);
+		} else {
+			fragment = renamedFragment(rest, oldName, newName);
+		}
+		batch->sources[i] = malloc(strlen(bucket)
+						+ strlen(info.name) + 2);
+		batch->destinations[i] = malloc(strlen(newBucket)
+				+ strlen(newKey) + ((fragment != NULL)
+					? strlen(fragment) : 0) + 3);
+		if( (fragment == NULL) || (batch->sources[i] == NULL)
+				|| (batch->destinations[i] == NULL) ) {
+			free(fragment);
+			ret = -ENOMEM;
+			goto ret;
+		}
+		sprintf(batch->sources[i], "%s/%s", bucket, info.name);
+		sprintf(batch->destinations[i], "%s/%s/%s", newBucket,
+							newKey, fragment);
+		free(fragment);
+	}
+
+ret:
+	keyListFree(&keys);
+	free(bucket);
+	free(newBucket);
+	return ret;
+}
+
+static int keyCmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/*
+ * the keys of the target newPath: everything under "key/" and, for a
+ * file, the object "key" itself, which may not be there
+ */
+static int listTarget(const char *newPath, int isDir, s3_rename_target *target)
+{
+	s3_key_list	keys;
+	s3_key_iter	iter;
+	s3_file_info	info;
+	char		*bucket = NULL;
+	char		*key = NULL;
+	int		ret = 0;
+
+	memset(target, 0, sizeof(s3_rename_target));
+	keyListInit(&keys);
+	ret = splitPath(newPath, &bucket, &key);
+	if( ret == 0 ) {
+		ret = getKeysFromS3(newPath, &keys);
+	}
+	if( ret != 0 ) {
+		goto ret;
+	}
+
+	target->keys = calloc(keys.count + 1, sizeof(char *));
+	target->overwritten = calloc(keys.count + 1, sizeof(int));
+	if( (target->keys == NULL) || (target->overwritten == NULL) ) {
+		ret = -ENOMEM;
+		goto ret;
+	}
+	keyIterInit(&iter, &keys);
+	while( keyListNext(&iter, &info) ) {
+		target->keys[target->count] = malloc(strlen(bucket)
+						+ strlen(info.name) + 2);
+		if( target->keys[target->count] == NULL ) {
+			ret = -ENOMEM;
+			goto ret;
+		}
+		sprintf(target->keys[target->count++], "%s/%s", bucket,
+								info.name);
+	}
+	if( !isDir ) {
+		target->keys[target->count] = strdup(newPath + 1);
+		if( target->keys[target->count] == NULL ) {
+			ret = -ENOMEM;
+			goto ret;
+		}
+		target->count++;
+	}
+	qsort(target->keys, target->count, sizeof(char *), keyCmp);
+
+ret:
+	keyListFree(&keys);
+	free(bucket);
+	return ret;
+}
+
+static void freeTarget(s3_rename_target *target)
+{
+	int		i = 0;
+
+	for( i = 0; i < target->count; i++ ) {
+		free(target->keys[i]);
+	}
+	free(target->keys);
+	free(target->overwritten);
+	memset(target, 0, sizeof(s3_rename_target));
+}
+
+/* whether key is one of the target's, marks it overwritten if so */
+static int targetKey(s3_rename_target *target, const char *key)
+{
+	char		**found = NULL;
+
+	if( target->count == 0 ) {
+		return 0;
+	}
+	found = bsearch(&key, target->keys, target->count, sizeof(char *),
+								keyCmp);
+	if( found == NULL ) {
+		return 0;
+	}
+	target->overwritten[found - target->keys] = 1;
+	return 1;
+}
+
+/* the copies were made under new names, the versions listed are gone */
+static void forgetVersions(s3_tree_node *node)
+{
+	s3_tree_node	*child = NULL;
+
+	if( node->s3FileInfo.versionId != NULL ) {
+		free(node->s3FileInfo.versionId);
+		node->s3FileInfo.versionId = NULL;
+	}
+	for( child = node->children; child != NULL; child = child->next ) {
+		forgetVersions(child);
+	}
+}
+
+static int isDirNode(s3_tree_node *node)
+{
+	return (node->isFileNode == 0) && (node->s3FileInfo.size == -1);
+}
+
+/* gS3TreeLock held: move the node of path to newPath */
+static int moveInTree(const char *path, const char *newPath,
+							const char *eTag)
+{
+	s3_tree_node	*node = NULL;
+	s3_tree_node	*newParent = NULL;
+	s3_tree_node	*target = NULL;
+	char		*parentPath = NULL;
+	char		*newName = strrchr(newPath, '/') + 1;
+	int		ret = 0;
+
+	parentPath = strdup(newPath);
+	if( parentPath == NULL ) {
+		return -ENOMEM;
+	}
+	parentPath[newName - 1 - newPath] = 0;
+	searchForPath(path, gS3DirectoryTree, &node);
+	searchForPath(parentPath, gS3DirectoryTree, &newParent);
+	free(parentPath);
+	if( (node == NULL) || (newParent == NULL) ) {
+		/* deleted meanwhile; the next listing shows the new keys */
+		return 0;
+	}
+
+	searchNode(newParent, newName, 0, &target);
+	if( (target != NULL) && (target != node) ) {
+		if( gS3Invalidate != NULL ) {
+			gS3Invalidate(target, S3_INVALIDATE_ENTRY);
+		}
+		deleteNode(target);
+	}
+	ret = moveNode(node, newParent, newName);
+	if( ret != 0 ) {
+		return ret;
+	}
+
+	forgetVersions(node);
+	if( !isDirNode(node) ) {
+		/* the pieces of an encoded file were renamed, they are
+		   listed again when it is fetched */
+		if( node->children != NULL ) {
+			deleteChildren(node);
+			node->isComplete &= ~NODE_COMPLETE;
+		}
+		if( eTag != NULL ) {
+			if( node->s3FileInfo.eTag != NULL )
+				free(node->s3FileInfo.eTag);
+			node->s3FileInfo.eTag = strdup(eTag);
+		}
+	}
+	return 0;
+}
+
+/* the cached copy, or directory of them, goes with the node */
+static void moveCachedCopy(const char *path, const char *newPath, int isDir)
+{
+	char		*cachedPath = NULL;
+	char		*newCachedPath = NULL;
+	char		*slash = NULL;
+
+	if( (s3CacheGetCachedPath(gS3Cache, path, &cachedPath) != 0)
+			|| (s3CacheGetCachedPath(gS3Cache, newPath,
+						&newCachedPath) != 0) ) {
+		goto ret;
+	}
+
+	slash = strrchr(newCachedPath, '/');
+	*slash = 0;
+	mkpath(newCachedPath);
+	*slash = '/';
+
+	if( rename(cachedPath, newCachedPath) != 0 ) {
+		log_msg("moveCachedCopy : %s not moved, %d\n", cachedPath, errno);
+		/* whatever was cached under the new name is stale now */
+		if( isDir ) {
+			rmdir(newCachedPath);
+		} else {
+			unlink(newCachedPath);
+		}
+	}
+ret:
+	free(cachedPath);
+	free(newCachedPath);
+}
+
+int renamePath(const char *path, const char *newPath)
+{
+	s3_tree_node	*node = NULL;
+	s3_tree_node	*target = NULL;
+	s3_rename_batch	batch;
+	s3_rename_target replaced;
+	char		*bucket = NULL;
+	char		*key = NULL;
+	char		*newBucket = NULL;
+	char		*newKey = NULL;
+	char		*targetPath = NULL;
+	char		*cachedPath = NULL;
+	int		isDir = 0;
+	int		targetIsDir = 0;
+	char		*swap = NULL;
+	int		copied = 0;
+	int		left = 0;
+	int		i = 0;
+	int		ret = 0;
+
+	log_msg("renamePath %s -> %s\n", path, newPath);
+	memset(&batch, 0, sizeof(batch));
+	memset(&replaced, 0, sizeof(replaced));
+
+	if( strcmp(path, newPath) == 0 ) {
+		return 0;
+	}
+	if( (strstr(path, ".versions") != NULL)
+			|| (strstr(newPath, ".versions") != NULL) ) {
+		return -EPERM;
+	}
+	if( (strncmp(newPath, path, strlen(path)) == 0)
+				&& (newPath[strlen(path)] == '/') ) {
+		return -EINVAL;
+	}
+
+	ret = splitPath(path, &bucket, &key);
+	if( ret == 0 ) {
+		ret = splitPath(newPath, &newBucket, &newKey);
+	}
+	if( ret != 0 ) {
+		goto ret;
+	}
+	if( (key == NULL) || (newKey == NULL)
+				|| (strcmp(bucket, newBucket) != 0) ) {
+		ret = -EXDEV;
+		goto ret;
+	}
+
+	/* both ends; the target must not be listed while we decide */
+	pthread_mutex_lock(&gS3TreeLock);
+	ret = searchAndInsertPathInTree(newPath, &gS3DirectoryTree,
+								&target, 0);
+	if( ret == 0 ) {
+		ret = searchAndInsertPathInTree(path, &gS3DirectoryTree,
+								&node, 0);
+	}
+	if( (ret == 0) && (node == NULL) ) {
+		ret = -ENOENT;
+	}
+	if( ret == 0 ) {
+		isDir = isDirNode(node);
+		searchForPath(newPath, gS3DirectoryTree, &target);
+	}
+	if( (ret == 0) && (target != NULL) ) {
+		targetIsDir = isDirNode(target);
+		if( isDir != targetIsDir ) {
+			ret = isDir ? -ENOTDIR : -EISDIR;
+		} else if( targetIsDir ) {
+			ret = searchAndInsertPathInTree(newPath,
+					&gS3DirectoryTree, &target, 1);
+			if( (ret == 0) && (target != NULL)
+					&& (target->children != NULL) ) {
+				ret = -ENOTEMPTY;
+			}
+		}
+		targetPath = (target != NULL) ? strdup(newPath) : NULL;
+	}
+	pthread_mutex_unlock(&gS3TreeLock);
+	if( ret != 0 ) {
+		goto ret;
+	}
+
+	/* what is in the cache only goes up first, under the old name;
+	   the target's too, a flush after the copies would undo them */
+	if( isDir ) {
+		fillCancel(path);
+		ret = s3CacheFlushCache(gS3Cache, NULL);
+	} else {
+		fillWait(path, 0, FILL_TO_END);
+		ret = s3CacheFlushCache(gS3Cache, (char *) path);
+		if( (ret == 0) && (targetPath != NULL) ) {
+			ret = s3CacheFlushCache(gS3Cache, targetPath);
+		}
+	}
+	if( ret != 0 ) {
+		goto ret;
+	}
+
+	/* rename() replaces the target; it stays until the copies are
+	   made, over its keys of the same name */
+	if( targetPath != NULL ) {
+		ret = listTarget(targetPath, targetIsDir, &replaced);
+		if( ret != 0 ) {
+			goto ret;
+		}
+	}
+
+	ret = buildBatch(path, newPath, isDir, &batch);
+	if( ret != 0 ) {
+		goto ret;
+	}
+	log_msg("renamePath : %d keys\n", batch.count);
+
+	ret = runBatch(&batch);
+	if( ret != 0 ) {
+		/* take back the copies that were made, keep the old keys;
+		   one over a key of the target is left, it is all there is
+		   of that key now.  They are moved to the front of
+		   destinations, freeBatch() frees them all the same */
+		log_msg("renamePath : copy failed %d\n", ret);
+		for( i = 0; i < batch.count; i++ ) {
+			if( (batch.results[i] == 0)
+				&& !targetKey(&replaced, batch.destinations[i]) ) {
+				swap = batch.destinations[copied];
+				batch.destinations[copied++] = batch.destinations[i];
+				batch.destinations[i] = swap;
+			}
+		}
+		if( deleteKeysFromS3(copied, batch.destinations, NULL,
+								NULL) != 0 ) {
+			log_msg("renamePath : not every copy of %s taken back\n",
+									path);
+		}
+		goto ret;
+	}
+
+	/* what of the target the copies did not replace, extra fragments,
+	   _meta.txt, a plain object where the copies are pieces */
+	if( targetPath != NULL ) {
+		for( i = 0; i < batch.count; i++ ) {
+			targetKey(&replaced, batch.destinations[i]);
+		}
+		for( i = 0; i < replaced.count; i++ ) {
+			if( !replaced.overwritten[i] ) {
+				replaced.keys[left++] = replaced.keys[i];
+			} else {
+				free(replaced.keys[i]);
+			}
+		}
+		replaced.count = left;
+		if( deleteKeysFromS3(replaced.count, replaced.keys, NULL,
+								NULL) != 0 ) {
+			log_msg("renamePath : not every key of %s deleted\n",
+								targetPath);
+		}
+		s3CacheDiscard(gS3Cache, targetPath);
+		fillCancel(targetPath);
+		if( s3CacheGetCachedPath(gS3Cache, newPath, &cachedPath) == 0 ) {
+			if( targetIsDir ) {
+				rmdir(cachedPath);
+			} else {
+				unlink(cachedPath);
+			}
+		}
+	}
+
+	/* the old keys; a failure leaves an orphan, not a lost file */
+	if( deleteKeysFromS3(batch.count, batch.sources, NULL,
+						batch.results) != 0 ) {
+		log_msg("renamePath : not every old key of %s deleted\n", path);
+	}
+
+	pthread_mutex_lock(&gS3TreeLock);
+	ret = moveInTree(path, newPath, batch.plain ? batch.eTags[0] : NULL);
+	pthread_mutex_unlock(&gS3TreeLock);
+
+	moveCachedCopy(path, newPath, isDir);
+
+ret:
+	if( batch.sources != NULL )
+		freeBatch(&batch);
+	freeTarget(&replaced);
+	free(bucket);
+	free(newBucket);
+	free(targetPath);
+	free(cachedPath);
+	return ret;
+}
@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "s3_fuse_bridge.h"
+#include "s3_revalidate.h"
+#include "log.h"
+
+static int		listTTL = REVALIDATE_DEFAULT_TTL;
+
+/* revalidateLock guards the two below; the listings themselves are
+   guarded by gS3TreeLock */
+static int		threadCount = 0;
+static int		stopping = 0;
+static pthread_mutex_t	revalidateLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	revalidateCond = PTHREAD_COND_INITIALIZER;
+
+int saveRevalidatePolicy()
+{
+	char		*env = NULL;
+	char		*end = NULL;
+	long		l = 0;
+
+	env = getenv("S3_LIST_TTL");
+	if( env != NULL ) {
+		l = strtol(env, &end, 10);
+		if( (*env == 0) || (*end != 0) || (l < 0) || (l > 86400 * 365) ) {
+			log_msg("S3_LIST_TTL : %s is not valid, using %d\n",
+						env, REVALIDATE_DEFAULT_TTL);
+		} else {
+			listTTL = (int) l;
+		}
+	}
+
+	if( listTTL == 0 ) {
+		log_msg("listings never expire\n");
+	} else {
+		log_msg("listings expire after %d s\n", listTTL);
+	}
+	return 0;
+}
+
+static void *revalidateThread(void *arg)
+{
+	char		*path = (char *) arg;
+	int		ret = 0;
+
+	ret = s3RelistDir(path);
+	if( ret != 0 ) {
+		log_msg("revalidateThread : %s, error %d\n", path, ret);
+	}
+	free(path);
+
+	pthread_mutex_lock(&revalidateLock);
+	threadCount--;
+	pthread_cond_broadcast(&revalidateCond);
+	pthread_mutex_unlock(&revalidateLock);
+	return NULL;
+}
+
+int revalidateDue(s3_tree_node *node)
+{
+	/*
+	 - 1 if revalidateCheck(node) might start a re-list, of node or
+	   of its parent
+	 - without gS3TreeLock, between epochEnter() and epochExit()
+	*/
+	s3_tree_node	*dir = node;
+	s3_dir_listing	*listing = NULL;
+	time_t		now = 0;
+
+	if( listTTL == 0 ) {
+		return 0;
+	}
+	now = time(NULL);
+	while( dir != NULL ) {
+		listing = NODE_LOAD(dir->listing);
+		if( (listing != NULL)
+			&& (now - NODE_LOAD(listing->listedTime) >= listTTL) ) {
+			return 1;
+		}
+		dir = (dir == node) ? NODE_LOAD(node->parent) : NULL;
+	}
+	return 0;
+}
+
+void revalidateCheck(s3_tree_node *node)
+{
+	/*
+	 - node, or the directory of the file node, was just looked at:
+	   start re-listing it if its listing expired
+	 - gS3TreeLock held, never waits for the listing
+	*/
+	s3_tree_node	*dir = node;
+	char		*path = NULL;
+	pthread_t	thread;
+	pthread_attr_t	attr;
+	int		ret = 0;
+
+	if( (dir != NULL) && dir->isFileNode ) {
+		dir = dir->parent;
+	}
+	if( (listTTL == 0) || (dir == NULL) || (dir->listing == NULL)
+			|| ((dir->isComplete & NODE_COMPLETE) == 0)
+			|| dir->listing->refreshing
+			|| (time(NULL) - dir->listing->listedTime < listTTL) ) {
+		return;
+	}
+
+	pthread_mutex_lock(&revalidateLock);
+	if( stopping || (threadCount >= REVALIDATE_MAX_THREADS) ) {
+		pthread_mutex_unlock(&revalidateLock);
+		return;
+	}
+	if( getPathForNode(dir, &path) != 0 ) {
+		pthread_mutex_unlock(&revalidateLock);
+		return;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, revalidateThread, path);
+	pthread_attr_destroy(&attr);
+	if( ret != 0 ) {
+		log_msg("revalidateCheck : pthread_create %d\n", ret);
+		free(path);
+		pthread_mutex_unlock(&revalidateLock);
+		return;
+	}
+
+	log_msg("revalidateCheck : re-listing %s\n", path);
+	dir->listing->refreshing = 1;
+	threadCount++;
+	pthread_mutex_unlock(&revalidateLock);
+}
+
+void revalidateStop()
+{
+	/* at unmount: no new re-lists, the running ones are waited for */
+	pthread_mutex_lock(&revalidateLock);
+	stopping = 1;
+	while( threadCount > 0 ) {
+		pthread_cond_wait(&revalidateCond, &revalidateLock);
+	}
+	pthread_mutex_unlock(&revalidateLock);
+}
@@ -0,0 +1,450 @@
+/* strdup() */
+#define _XOPEN_SOURCE 500
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "s3.h"
+#include "s3_key_list.h"
+#include "s3_fuse_bridge.h"
+#include "s3_scan.h"
+#include "log.h"
+
+static int		scanThreads = SCAN_DEFAULT_THREADS;
+static int		scanPageKeys = SCAN_DEFAULT_PAGE_KEYS;
+
+/* the bytes a range is cut before, in key order */
+static const char	cutBytes[] = "-./0123456789"
+			"ABCDEFGHIJKLMNOPQRSTUVWXYZ_abcdefghijklmnopqrstuvwxyz";
+
+typedef struct s3_scan_range s3_scan_range;
+struct s3_scan_range {
+	char		*after;		/* its keys are after it, NULL: the first */
+	char		*upTo;		/* and up to it, NULL: the last */
+	s3_key_list	keys;
+	s3_scan_range	*nextPending;
+};
+
+typedef struct s3_scan {
+	const char	*bucket;
+	const char	*prefix;
+	int		prefixLen;
+	s3_scan_range	**ranges;	/* all of them */
+	int		rangeCount;
+	int		rangeSize;
+	s3_scan_range	*pending;	/* not taken yet */
+	int		busy;		/* threads listing a range */
+	int		ret;
+	pthread_mutex_t	lock;		/* guards everything above */
+	pthread_cond_t	changed;
+} s3_scan;
+
+int saveScanPolicy()
+{
+	char		*env = NULL;
+	char		*end = NULL;
+	long		l = 0;
+
+	env = getenv("S3_SCAN_THREADS");
+	if( env != NULL ) {
+		l = strtol(env, &end, 10);
+		if( (*env == 0) || (*end != 0) || (l < 1)
+					|| (l > SCAN_MAX_THREADS) ) {
+			log_msg("S3_SCAN_THREADS : %s is not valid, using %d\n",
+						env, SCAN_DEFAULT_THREADS);
+		} else {
+			scanThreads = (int) l;
+		}
+	}
+
+	env = getenv("S3_SCAN_PAGE_KEYS");
+	if( env != NULL ) {
+		l = strtol(env, &end, 10);
+		if( (*env == 0) || (*end != 0) || (l < 1) || (l > 1000) ) {
+			log_msg("S3_SCAN_PAGE_KEYS : %s is not valid, using %d\n",
+						env, SCAN_DEFAULT_PAGE_KEYS);
+		} else {
+			scanPageKeys = (int) l;
+		}
+	}
+
+	log_msg("key scans in %d threads, %d keys a page\n", scanThreads,
+								scanPageKeys);
+	return 0;
+}
+
+static void freePage(int count, s3_file_info *list, int prefixCount,
+					char **commonPrefixes)
+{
+	int		i;
+
+	for( i = 0; i < count; i++ ) {
+		free(list[i].name);
+		free(list[i].eTag);
+	}
+	free(list);
+	freeCommonPrefixes(prefixCount, commonPrefixes);
+}
+
+/* a range (after, upTo] to be listed; called with scan->lock held */
+static int addRange(s3_scan *scan, const char *after, const char *upTo)
+{
+	s3_scan_range	*range = NULL;
+	s3_scan_range	**ranges = NULL;
+
+	if( scan->rangeCount == scan->rangeSize ) {
+		ranges = realloc(scan->ranges, (2 * scan->rangeSize + 16)
+						* sizeof(s3_scan_range *));
+		if( ranges == NULL ) {
+			return -ENOMEM;
+		}
+		scan->ranges = ranges;
+		scan->rangeSize = 2 * scan->rangeSize + 16;
+	}
+	range = calloc(1, sizeof(s3_scan_range));
+	if( range == NULL ) {
+		return -ENOMEM;
+	}
+	keyListInit(&range->keys);
+	if( ((after != NULL) && ((range->after = strdup(after)) == NULL))
+		|| ((upTo != NULL) && ((range->upTo = strdup(upTo)) == NULL)) ) {
+		free(range->after);
+		free(range);
+		return -ENOMEM;
+	}
+	scan->ranges[scan->rangeCount++] = range;
+	range->nextPending = scan->pending;
+	scan->pending = range;
+	return 0;
+}
+
+static int cutRange(s3_scan *scan, s3_scan_range *range, const char *first,
+							const char *last)
+{
+	/*
+	 - a page of range went from first to last and there is more:
+	   while a thread has nothing to do, the rest of the range, after
+	   last, is cut in more ranges, see s3_scan.h
+	 - range is the caller's, its upTo only changes here
+	*/
+	const unsigned char	*f = (const unsigned char *) first;
+	const unsigned char	*l = (const unsigned char *) last;
+	const unsigned char	*u = (const unsigned char *) range->upTo;
+	const unsigned char	*c = NULL;
+	char			**cuts = NULL;
+	char			*upTo = NULL;
+	int			cutCount = 0;
+	int			vary = 0;
+	int			common = 0;
+	int			level = 0;
+	int			idle = 0;
+	int			k = 0;
+	int			i = 0;
+	int			ret = 0;
+
+	pthread_mutex_lock(&scan->lock);
+	idle = (scan->pending == NULL) ? scanThreads - scan->busy : 0;
+	pthread_mutex_unlock(&scan->lock);
+	if( idle <= 0 ) {
+		return 0;
+	}
+
+	while( (f[vary] != 0) && (f[vary] == l[vary]) ) {
+		vary++;
+	}
+	if( u != NULL ) {
+		while( (l[common] != 0) && (l[common] == u[common]) ) {
+			common++;
+		}
+	}
+
+	cuts = malloc(2 * sizeof(cutBytes) * sizeof(char *));
+	if( cuts == NULL ) {
+		return -ENOMEM;
+	}
+	/* deeper cuts come first in key order */
+	for( level = vary; (level >= vary - 1) && (level >= common)
+			&& (level >= scan->prefixLen); level-- ) {
+		for( c = (const unsigned char *) cutBytes; *c != 0; c++ ) {
+			if( *c <= l[level] ) {
+				continue;
+			}
+			if( (u != NULL) && (level == common) && (*c >= u[level]) ) {
+				break;
+			}
+			cuts[cutCount] = malloc(level + 2);
+			if( cuts[cutCount] == NULL ) {
+				ret = -ENOMEM;
+				goto ret;
+			}
+			memcpy(cuts[cutCount], last, level);
+			cuts[cutCount][level] = *c;
+			cuts[cutCount][level + 1] = 0;
+			cutCount++;
+		}
+	}
+	if( cutCount == 0 ) {
+		goto ret;
+	}
+
+	/* the range goes on to the first cut, the new ones after it */
+	k = (cutCount < scanThreads) ? cutCount : scanThreads;
+	upTo = range->upTo;
+	range->upTo = strdup(cuts[cutCount / (k + 1)]);
+	if( range->upTo == NULL ) {
+		range->upTo = upTo;
+		ret = -ENOMEM;
+		goto ret;
+	}
+	pthread_mutex_lock(&scan->lock);
+	for( i = 0; (ret == 0) && (i < k); i++ ) {
+		ret = addRange(scan, cuts[((i + 1) * cutCount) / (k + 1)],
+			(i + 1 < k) ? cuts[((i + 2) * cutCount) / (k + 1)]
+								: upTo);
+	}
+	pthread_cond_broadcast(&scan->changed);
+	pthread_mutex_unlock(&scan->lock);
+	free(upTo);
+
+ret:
+	for( i = 0; i < cutCount; i++ ) {
+		free(cuts[i]);
+	}
+	free(cuts);
+	return ret;
+}
+
+static int scanRange(s3_scan *scan, s3_scan_range *range)
+{
+	int		s3Status = 0;
+	int		count = 0;
+	s3_file_info	*list = NULL;
+	int		prefixCount = 0;
+	char		**commonPrefixes = NULL;
+	char		*marker = NULL;
+	char		*nextMarker = NULL;
+	int		done = 0;
+	int		ret = 0;
+	int		i = 0;
+
+	if( range->after != NULL ) {
+		marker = strdup(range->after);
+		if( marker == NULL ) {
+			return -ENOMEM;
+		}
+	}
+	do {
+		s3Status = list_bucket_page(scan->bucket, scan->prefix, marker,
+				NULL, scanPageKeys, &count, &list,
+				&prefixCount, &commonPrefixes, &nextMarker);
+		if( s3Status != 0 ) {
+			logS3Errors(s3Status);
+			ret = -EIO;
+			break;
+		}
+		for( i = 0; (ret == 0) && (i < count); i++ ) {
+			if( (range->upTo != NULL)
+				&& (strcmp(list[i].name, range->upTo) > 0) ) {
+				done = 1;
+				break;
+			}
+			ret = keyListAppend(&range->keys, list[i].name,
+					list[i].time, list[i].size,
+					list[i].eTag);
+		}
+		if( !done && (ret == 0) && (nextMarker != NULL) && (count > 0) ) {
+			ret = cutRange(scan, range, list[0].name, nextMarker);
+		}
+		freePage(count, list, prefixCount, commonPrefixes);
+
+		free(marker);
+		marker = nextMarker;
+		nextMarker = NULL;
+		if( (marker != NULL) && (range->upTo != NULL)
+				&& (strcmp(marker, range->upTo) >= 0) ) {
+			done = 1;
+		}
+	} while( !done && (ret == 0) && (marker != NULL) );
+	free(marker);
+	return ret;
+}
+
+static void *scanWorker(void *arg)
+{
+	s3_scan		*scan = (s3_scan *) arg;
+	s3_scan_range	*range = NULL;
+	int		ret = 0;
+
+	pthread_mutex_lock(&scan->lock);
+	for( ;; ) {
+		while( (scan->pending == NULL) && (scan->busy > 0)
+						&& (scan->ret == 0) ) {
+			pthread_cond_wait(&scan->changed, &scan->lock);
+		}
+		/* nothing left, and nobody to cut more */
+		if( (scan->pending == NULL) || (scan->ret != 0) ) {
+			break;
+		}
+		range = scan->pending;
+		scan->pending = range->nextPending;
+		scan->busy++;
+		pthread_mutex_unlock(&scan->lock);
+
+		ret = scanRange(scan, range);
+
+		pthread_mutex_lock(&scan->lock);
+		scan->busy--;
+		if( (ret != 0) && (scan->ret == 0) ) {
+			scan->ret = ret;
+		}
+		pthread_cond_broadcast(&scan->changed);
+	}
+	pthread_cond_broadcast(&scan->changed);
+	pthread_mutex_unlock(&scan->lock);
+	return NULL;
+}
+
+static int scanSeed(s3_scan *scan, s3_key_list *keys)
+{
+	/*
+	 - one page of the prefix with delimiter "/": 1 if it was all the
+	   keys, they are in keys, else 0 with the first ranges pending
+	 - a common prefix "a/" is cut after, its keys are after it
+	*/
+	int		s3Status = 0;
+	int		count = 0;
+	s3_file_info	*list = NULL;
+	int		prefixCount = 0;
+	char		**commonPrefixes = NULL;
+	char		*nextMarker = NULL;
+	const char	*after = NULL;
+	int		k = 0;
+	int		i = 0;
+	int		ret = 0;
+
+	s3Status = list_bucket_page(scan->bucket, scan->prefix, NULL, "/",
+			scanPageKeys, &count, &list, &prefixCount,
+			&commonPrefixes, &nextMarker);
+	if( s3Status != 0 ) {
+		logS3Errors(s3Status);
+		return -EIO;
+	}
+
+	if( (nextMarker == NULL) && (prefixCount == 0) ) {
+		for( i = 0; (ret == 0) && (i < count); i++ ) {
+			ret = keyListAppend(keys, list[i].name, list[i].time,
+					list[i].size, list[i].eTag);
+		}
+		ret = (ret == 0) ? 1 : ret;
+	} else {
+		k = (prefixCount < 4 * scanThreads) ? prefixCount
+							: 4 * scanThreads;
+		for( i = 0; (ret == 0) && (i < k); i++ ) {
+			ret = addRange(scan, after,
+				commonPrefixes[((i + 1) * prefixCount) / (k + 1)]);
+			after = commonPrefixes[((i + 1) * prefixCount) / (k + 1)];
+		}
+		if( ret == 0 ) {
+			ret = addRange(scan, after, NULL);
+		}
+	}
+
+	freePage(count, list, prefixCount, commonPrefixes);
+	free(nextMarker);
+	return ret;
+}
+
+static int rangeCmp(const void *a, const void *b)
+{
+	const s3_scan_range	*ra = *(s3_scan_range * const *) a;
+	const s3_scan_range	*rb = *(s3_scan_range * const *) b;
+
+	if( ra->after == NULL ) {
+		return (rb->after == NULL) ? 0 : -1;
+	}
+	if( rb->after == NULL ) {
+		return 1;
+	}
+	return strcmp(ra->after, rb->after);
+}
+
+int scanKeys(const char *bucket, const char *prefix, s3_key_list *keys)
+{
+	/*
+	 - every key under prefix into keys, in key order, see s3_scan.h
+	 - doesn't touch the tree, call it without gS3TreeLock
+	*/
+	s3_scan		scan;
+	pthread_t	threads[SCAN_MAX_THREADS];
+	int		threadCount = 0;
+	s3_key_iter	iter;
+	s3_file_info	info;
+	int		s3Status = 0;
+	int		ret = 0;
+	int		i = 0;
+
+	if( scanThreads == 1 ) {
+		s3Status = list_bucket_keys(bucket, prefix, keys);
+		if( s3Status != 0 ) {
+			logS3Errors(s3Status);
+			return -EIO;
+		}
+		return 0;
+	}
+
+	memset(&scan, 0, sizeof(scan));
+	scan.bucket = bucket;
+	scan.prefix = prefix;
+	scan.prefixLen = (prefix != NULL) ? strlen(prefix) : 0;
+	pthread_mutex_init(&scan.lock, NULL);
+	pthread_cond_init(&scan.changed, NULL);
+
+	ret = scanSeed(&scan, keys);
+	if( ret != 0 ) {
+		goto ret;
+	}
+
+	/* this thread is one of them */
+	for( threadCount = 0; threadCount < scanThreads - 1; threadCount++ ) {
+		if( pthread_create(&threads[threadCount], NULL, scanWorker,
+							&scan) != 0 ) {
+			log_msg("scanKeys : pthread_create, %d threads\n",
+							threadCount + 1);
+			break;
+		}
+	}
+	scanWorker(&scan);
+	for( i = 0; i < threadCount; i++ ) {
+		pthread_join(threads[i], NULL);
+	}
+	ret = scan.ret;
+	if( ret != 0 ) {
+		goto ret;
+	}
+
+	qsort(scan.ranges, scan.rangeCount, sizeof(s3_scan_range *), rangeCmp);
+	for( i = 0; (ret == 0) && (i < scan.rangeCount); i++ ) {
+		keyIterInit(&iter, &scan.ranges[i]->keys);
+		while( (ret == 0) && keyListNext(&iter, &info) ) {
+			ret = keyListAppend(keys, info.name, info.time,
+						info.size, info.eTag);
+		}
+	}
+	log_msg("scanKeys : %s/%s, %d keys in %d ranges\n", bucket,
+			(prefix != NULL) ? prefix : "", keys->count,
+			scan.rangeCount);
+
+ret:
+	for( i = 0; i < scan.rangeCount; i++ ) {
+		keyListFree(&scan.ranges[i]->keys);
+		free(scan.ranges[i]->after);
+		free(scan.ranges[i]->upTo);
+		free(scan.ranges[i]);
+	}
+	free(scan.ranges);
+	pthread_mutex_destroy(&scan.lock);
+	pthread_cond_destroy(&scan.changed);
+	return (ret < 0) ? ret : 0;
+}
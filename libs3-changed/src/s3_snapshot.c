@@ -0,0 +1,830 @@
+/* strdup() */
+#define _XOPEN_SOURCE 500
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "s3_fuse_bridge.h"
+#include "s3_child_index.h"
+#include "s3_snapshot.h"
+#include "s3_evict.h"
+#include "log.h"
+
+static char		*snapshotFile = NULL;
+static int		snapshotOff = 0;
+static int		snapshotInterval = SNAPSHOT_DEFAULT_INTERVAL;
+
+/* the snapshot of the last mount, mapped read only; used marks the
+   directories loaded from it.  Guarded by gS3TreeLock */
+static char			*mapBase = NULL;
+static size_t			mapSize = 0;
+static s3_snapshot_header	*mapHeader = NULL;
+static s3_snapshot_node		*mapNodes = NULL;
+static char			*mapStrings = NULL;
+static char			*used = NULL;
+
+/* saveLock makes saves one at a time; saverLock guards the two below */
+static char		*savePath = NULL;
+static pthread_t	saver;
+static int		saverRunning = 0;
+static int		stopping = 0;
+static pthread_mutex_t	saveLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t	saverLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	saverWakeup = PTHREAD_COND_INITIALIZER;
+
+/* a snapshot being saved: the nodes, breadth first, each from the tree
+   or, not loaded yet, from the old snapshot */
+typedef struct snapshot_item {
+	s3_tree_node	*node;		/* NULL: only in the old snapshot */
+	int64_t		old;		/* its node there, -1 none */
+} snapshot_item;
+
+typedef struct snapshot_buf {
+	snapshot_item		*items;
+	s3_snapshot_node	*nodes;
+	uint64_t		count;
+	uint64_t		size;
+	char			*strings;
+	uint64_t		stringsSize;
+	uint64_t		stringsCap;
+} snapshot_buf;
+
+int saveSnapshotPolicy()
+{
+	char		*env = NULL;
+	char		*end = NULL;
+	long		l = 0;
+
+	env = getenv("S3_SNAPSHOT");
+	if( env != NULL ) {
+		if( strcmp(env, "off") == 0 ) {
+			snapshotOff = 1;
+		} else if( *env != 0 ) {
+			snapshotFile = env;
+		}
+	}
+
+	env = getenv("S3_SNAPSHOT_INTERVAL");
+	if( env != NULL ) {
+		l = strtol(env, &end, 10);
+		if( (*env == 0) || (*end != 0) || (l < 0) || (l > 86400 * 365) ) {
+			log_msg("S3_SNAPSHOT_INTERVAL : %s is not valid, using %d\n",
+						env, SNAPSHOT_DEFAULT_INTERVAL);
+		} else {
+			snapshotInterval = (int) l;
+		}
+	}
+
+	if( snapshotOff ) {
+		log_msg("tree snapshot off\n");
+	} else {
+		log_msg("tree snapshot %s, saved every %d s\n",
+				(snapshotFile != NULL) ? snapshotFile : "in the cache",
+				snapshotInterval);
+	}
+	return 0;
+}
+
+/******************** the old snapshot ****************************/
+
+static const char *mapString(uint32_t offset)
+{
+	if( (offset == SNAPSHOT_NONE) || (offset >= mapHeader->stringsSize) ) {
+		return NULL;
+	}
+	return mapStrings + offset;
+}
+
+static int mapChildren(uint32_t node, uint32_t *pFirst, uint32_t *pCount)
+{
+	/* children come after their parent, so a bad file can't loop */
+	s3_snapshot_node	*rec = &mapNodes[node];
+
+	*pFirst = rec->firstChild;
+	*pCount = rec->childCount;
+	if( (rec->childCount != 0) && ((rec->firstChild <= node)
+			|| ((uint64_t) rec->firstChild + rec->childCount
+					> mapHeader->nodeCount)) ) {
+		return -EIO;
+	}
+	return 0;
+}
+
+/* the child of node called name, -1 if none */
+static int64_t mapChild(uint32_t node, const char *name)
+{
+	uint32_t	lo = 0;
+	uint32_t	hi = 0;
+	uint32_t	mid = 0;
+	const char	*midName = NULL;
+	int		cmp = 0;
+
+	if( mapChildren(node, &lo, &hi) != 0 ) {
+		return -1;
+	}
+	hi += lo;
+	while( lo < hi ) {
+		mid = lo + (hi - lo) / 2;
+		midName = mapString(mapNodes[mid].name);
+		if( midName == NULL ) {
+			return -1;
+		}
+		cmp = strcmp(name, midName);
+		if( cmp == 0 ) {
+			return mid;
+		}
+		if( cmp < 0 ) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+	return -1;
+}
+
+static int64_t mapFind(const char *path)
+{
+	char		*tmpPath = NULL;
+	char		*name = NULL;
+	char		*slash = NULL;
+	int64_t		node = 0;
+
+	tmpPath = strdup(path);
+	if( tmpPath == NULL ) {
+		return -1;
+	}
+	for( name = tmpPath; (node >= 0) && (name != NULL); name = slash ) {
+		slash = strchr(name, '/');
+		if( slash != NULL ) {
+			*slash++ = 0;
+		}
+		if( *name != 0 ) {
+			node = mapChild((uint32_t) node, name);
+		}
+	}
+	free(tmpPath);
+	return node;
+}
+
+static int mapStrdup(uint32_t offset, char **pCopy)
+{
+	const char	*s = mapString(offset);
+
+	*pCopy = NULL;
+	if( s == NULL ) {
+		return 0;
+	}
+	*pCopy = strdup(s);
+	return (*pCopy == NULL) ? -ENOMEM : 0;
+}
+
+static void snapshotOpen(const char *path)
+{
+	int			fd = -1;
+	struct stat		statbuf;
+	char			*base = MAP_FAILED;
+	s3_snapshot_header	*header = NULL;
+	uint64_t		nodesSize = 0;
+
+	fd = open(path, O_RDONLY);
+	if( fd < 0 ) {
+		log_msg("snapshotOpen : no snapshot %s, errno %d\n", path, errno);
+		return;
+	}
+	if( (fstat(fd, &statbuf) != 0)
+			|| (statbuf.st_size < (off_t) sizeof(s3_snapshot_header)) ) {
+		goto bad;
+	}
+	base = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if( base == MAP_FAILED ) {
+		goto bad;
+	}
+
+	header = (s3_snapshot_header *) base;
+	nodesSize = (uint64_t) header->nodeCount * sizeof(s3_snapshot_node);
+	if( (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0)
+			|| (header->version != SNAPSHOT_VERSION)
+			|| (header->nodeCount == 0)
+			|| (header->stringsSize == 0)
+			|| (header->stringsSize > SNAPSHOT_NONE)
+			|| (sizeof(s3_snapshot_header) + nodesSize
+				+ header->stringsSize
+					!= (uint64_t) statbuf.st_size)
+			|| (base[statbuf.st_size - 1] != 0) ) {
+		goto bad;
+	}
+
+	pthread_mutex_lock(&gS3TreeLock);
+	used = calloc(header->nodeCount, 1);
+	if( used != NULL ) {
+		mapBase = base;
+		mapSize = statbuf.st_size;
+		mapHeader = header;
+		mapNodes = (s3_snapshot_node *) (base + sizeof(s3_snapshot_header));
+		mapStrings = base + sizeof(s3_snapshot_header) + nodesSize;
+	}
+	pthread_mutex_unlock(&gS3TreeLock);
+	close(fd);
+	if( used == NULL ) {
+		munmap(base, statbuf.st_size);
+		return;
+	}
+	log_msg("snapshotOpen : %s, %u nodes, saved %lld s ago\n", path,
+			header->nodeCount,
+			(long long) (time(NULL) - header->savedTime));
+	return;
+
+bad:
+	log_msg("snapshotOpen : %s is not a snapshot, not used\n", path);
+	if( base != MAP_FAILED )
+		munmap(base, statbuf.st_size);
+	close(fd);
+}
+
+/*
+ * Puts the children of node idx under dir, and below file nodes all of
+ * their subtree; a child the tree has already is newer and stays.
+ */
+static int restoreChildren(s3_tree_node *dir, uint32_t idx, int inFile)
+{
+	s3_snapshot_node	*rec = NULL;
+	s3_tree_node		*child = NULL;
+	const char		*name = NULL;
+	uint32_t		first = 0;
+	uint32_t		count = 0;
+	uint32_t		i = 0;
+	int			ret = 0;
+
+	ret = mapChildren(idx, &first, &count);
+	if( ret != 0 ) {
+		return ret;
+	}
+	for( i = first; i < first + count; i++ ) {
+		rec = &mapNodes[i];
+		name = mapString(rec->name);
+		if( name == NULL ) {
+			return -EIO;
+		}
+		if( childFind(dir, name, NULL) != NULL ) {
+			continue;
+		}
+		ret = searchNode(dir, (char *) name, 1, &child);
+		if( ret != 0 ) {
+			return ret;
+		}
+		NODE_STORE(child->s3FileInfo.time, (time_t) rec->time);
+		NODE_STORE(child->s3FileInfo.size, (int64_t) rec->size);
+		NODE_STORE(child->isFileNode, (char) rec->isFileNode);
+		/* a directory is loaded or listed when it is opened, what a
+		   listing shows is not made here any more */
+		child->isComplete = rec->isComplete & ~NODE_LOCAL;
+		if( !inFile && !rec->isFileNode ) {
+			child->isComplete &= ~NODE_COMPLETE;
+		}
+		if( ((ret = mapStrdup(rec->versionId,
+				&child->s3FileInfo.versionId)) != 0)
+			|| ((ret = mapStrdup(rec->eTag,
+				&child->s3FileInfo.eTag)) != 0)
+			|| ((ret = mapStrdup(rec->cachedETag,
+				&child->cachedETag)) != 0)
+			|| ((ret = mapStrdup(rec->s3Name,
+				&child->s3Name)) != 0) ) {
+			return ret;
+		}
+		if( rec->isFileNode || inFile ) {
+			ret = restoreChildren(child, i, 1);
+			if( ret != 0 ) {
+				return ret;
+			}
+		}
+	}
+	return 0;
+}
+
+static int loadDir(s3_tree_node *dir, int64_t idx)
+{
+	s3_dir_listing		*listing = NULL;
+	int			ret = 0;
+
+	/* the root's children are the buckets, from list_service() */
+	if( (mapNodes == NULL) || (idx <= 0) || !mapNodes[idx].listed
+			|| used[idx] || dir->isFileNode
+			|| (dir->listing != NULL)
+			|| (dir->isComplete & (NODE_COMPLETE | NODE_LOCAL)) ) {
+		return 0;
+	}
+	used[idx] = 1;
+
+	listing = calloc(1, sizeof(s3_dir_listing));
+	if( listing == NULL ) {
+		return 0;
+	}
+	ret = restoreChildren(dir, (uint32_t) idx, 0);
+	if( ret != 0 ) {
+		/* what came in stays, a listing from S3 completes it */
+		log_msg("loadDir : %s, error %d\n", dir->s3FileInfo.name, ret);
+		free(listing);
+		return 0;
+	}
+	listing->listedTime = (time_t) mapNodes[idx].listedTime;
+	NODE_STORE(dir->listing, listing);
+	evictTouch(dir);
+	dir->isComplete |= NODE_COMPLETE;
+	log_msg("loadDir : %s, %u children from the snapshot\n",
+			dir->s3FileInfo.name, mapNodes[idx].childCount);
+	return 1;
+}
+
+int snapshotLoadDir(s3_tree_node *dir, const char *path)
+{
+	/*
+	 - dir at path is about to be listed from S3: 1 if its children
+	   came from the snapshot instead, with the listing they had
+	 - called with gS3TreeLock held
+	*/
+	if( (mapNodes == NULL) || (dir->listing != NULL) ) {
+		return 0;
+	}
+	return loadDir(dir, mapFind(path));
+}
+
+int snapshotLoadPath(s3_tree_node *tree, const char *path)
+{
+	/*
+	 - path is not in the tree: loads the directories on the way to
+	   it that the snapshot has, 1 if any was
+	 - called with gS3TreeLock held
+	*/
+	s3_tree_node		*dir = tree;
+	s3_tree_node		*child = NULL;
+	char			*tmpPath = NULL;
+	char			*name = NULL;
+	char			*slash = NULL;
+	int64_t			idx = 0;
+	int			loaded = 0;
+
+	if( (mapNodes == NULL) || (tree == NULL) ) {
+		return 0;
+	}
+	tmpPath = strdup(path);
+	if( tmpPath == NULL ) {
+		return 0;
+	}
+	for( name = tmpPath; name != NULL; name = slash ) {
+		slash = strchr(name, '/');
+		if( slash != NULL ) {
+			*slash++ = 0;
+		}
+		if( *name == 0 ) {
+			continue;
+		}
+		searchNode(dir, name, 0, &child);
+		if( (child == NULL) && loadDir(dir, idx) ) {
+			loaded = 1;
+			searchNode(dir, name, 0, &child);
+		}
+		if( child == NULL ) {
+			break;
+		}
+		idx = (idx >= 0) ? mapChild((uint32_t) idx, name) : -1;
+		dir = child;
+	}
+	free(tmpPath);
+	return loaded;
+}
+
+/******************** saving ****************************/
+
+static int addString(snapshot_buf *buf, const char *s, uint32_t *pOffset)
+{
+	size_t		len = 0;
+	uint64_t	cap = 0;
+	char		*strings = NULL;
+
+	*pOffset = SNAPSHOT_NONE;
+	if( s == NULL ) {
+		return 0;
+	}
+	len = strlen(s) + 1;
+	if( buf->stringsSize + len >= SNAPSHOT_NONE ) {
+		return -EFBIG;
+	}
+	if( buf->stringsSize + len > buf->stringsCap ) {
+		cap = (buf->stringsCap == 0) ? 64 * 1024 : 2 * buf->stringsCap;
+		while( cap < buf->stringsSize + len ) {
+			cap *= 2;
+		}
+		strings = realloc(buf->strings, cap);
+		if( strings == NULL ) {
+			return -ENOMEM;
+		}
+		buf->strings = strings;
+		buf->stringsCap = cap;
+	}
+	memcpy(buf->strings + buf->stringsSize, s, len);
+	*pOffset = (uint32_t) buf->stringsSize;
+	buf->stringsSize += len;
+	return 0;
+}
+
+static int addItem(snapshot_buf *buf, s3_tree_node *node, int64_t old)
+{
+	uint64_t		size = 0;
+	snapshot_item		*items = NULL;
+	s3_snapshot_node	*nodes = NULL;
+
+	if( buf->count == buf->size ) {
+		if( buf->count >= SNAPSHOT_NONE ) {
+			return -EFBIG;
+		}
+		size = (buf->size == 0) ? 1024 : 2 * buf->size;
+		items = realloc(buf->items, size * sizeof(snapshot_item));
+		if( items == NULL ) {
+			return -ENOMEM;
+		}
+		buf->items = items;
+		nodes = realloc(buf->nodes, size * sizeof(s3_snapshot_node));
+		if( nodes == NULL ) {
+			return -ENOMEM;
+		}
+		buf->nodes = nodes;
+		buf->size = size;
+	}
+	buf->items[buf->count].node = node;
+	buf->items[buf->count].old = old;
+	memset(&buf->nodes[buf->count], 0, sizeof(s3_snapshot_node));
+	buf->count++;
+	return 0;
+}
+
+static int nodeNameCmp(const void *a, const void *b)
+{
+	return strcmp((*(s3_tree_node **) a)->s3FileInfo.name,
+			(*(s3_tree_node **) b)->s3FileInfo.name);
+}
+
+/* the children of a directory not loaded from the old snapshot yet, or
+   of a node only in it, as they were */
+static int saveOldChildren(snapshot_buf *buf, int64_t old)
+{
+	uint32_t	first = 0;
+	uint32_t	count = 0;
+	uint32_t	i = 0;
+	int		ret = 0;
+
+	if( mapChildren((uint32_t) old, &first, &count) != 0 ) {
+		return 0;
+	}
+	for( i = first; (ret == 0) && (i < first + count); i++ ) {
+		ret = addItem(buf, NULL, i);
+	}
+	return ret;
+}
+
+static int saveTreeNode(snapshot_buf *buf, uint64_t i)
+{
+	s3_tree_node		*node = buf->items[i].node;
+	int64_t			old = buf->items[i].old;
+	s3_tree_node		**children = NULL;
+	s3_tree_node		*child = NULL;
+	uint64_t		first = buf->count;
+	uint32_t		oldFirst = 0;
+	uint32_t		oldCount = 0;
+	uint32_t		k = 0;
+	int			count = 0;
+	int			local = 0;
+	int			carry = 0;
+	int			cmp = 0;
+	int			ret = 0;
+	int			j = 0;
+
+	/* the children of every node are saved, the lookups of the next
+	   mount go through them; only a complete listing is loaded */
+	for( child = node->children; child != NULL; child = child->next ) {
+		count++;
+	}
+	children = malloc((count + 1) * sizeof(s3_tree_node *));
+	if( children == NULL ) {
+		return -ENOMEM;
+	}
+	count = 0;
+	for( child = node->children; child != NULL; child = child->next ) {
+		children[count++] = child;
+		/* the next mount has to see what S3 says of it */
+		if( (child->isComplete & NODE_LOCAL) || child->uploaded ) {
+			local = 1;
+		}
+	}
+	qsort(children, count, sizeof(s3_tree_node *), nodeNameCmp);
+
+	/* a directory not loaded from the old snapshot yet keeps what it
+	   had there */
+	carry = !node->isFileNode && (node->listing == NULL)
+			&& ((node->isComplete & NODE_LOCAL) == 0)
+			&& (old > 0) && mapNodes[old].listed && !used[old]
+			&& (mapChildren((uint32_t) old, &oldFirst, &oldCount) == 0);
+	if( !carry ) {
+		oldCount = 0;
+	}
+	k = oldFirst;
+	j = 0;
+	while( (ret == 0) && ((j < count) || (k < oldFirst + oldCount)) ) {
+		if( j == count ) {
+			cmp = 1;
+		} else if( k == oldFirst + oldCount ) {
+			cmp = -1;
+		} else if( mapString(mapNodes[k].name) == NULL ) {
+			k++;
+			continue;
+		} else {
+			cmp = strcmp(children[j]->s3FileInfo.name,
+					mapString(mapNodes[k].name));
+		}
+		if( cmp > 0 ) {
+			ret = addItem(buf, NULL, k++);
+		} else if( cmp == 0 ) {
+			ret = addItem(buf, children[j++], k++);
+		} else {
+			ret = addItem(buf, children[j], ((old >= 0) && !carry)
+				? mapChild((uint32_t) old,
+					children[j]->s3FileInfo.name) : -1);
+			j++;
+		}
+	}
+	free(children);
+	if( ret != 0 ) {
+		return ret;
+	}
+
+	if( carry ) {
+		buf->nodes[i].listed = 1;
+		buf->nodes[i].listedTime = mapNodes[old].listedTime;
+	} else if( (node->listing != NULL)
+			&& (node->isComplete & NODE_COMPLETE) ) {
+		buf->nodes[i].listed = 1;
+		buf->nodes[i].listedTime = local ? 0
+					: node->listing->listedTime;
+	}
+	buf->nodes[i].firstChild = (uint32_t) first;
+	buf->nodes[i].childCount = (uint32_t) (buf->count - first);
+	buf->nodes[i].isFileNode = node->isFileNode;
+	buf->nodes[i].isComplete = node->isComplete;
+	buf->nodes[i].time = node->s3FileInfo.time;
+	buf->nodes[i].size = node->s3FileInfo.size;
+	if( ((ret = addString(buf, node->s3FileInfo.name,
+				&buf->nodes[i].name)) != 0)
+		|| ((ret = addString(buf, node->s3Name,
+				&buf->nodes[i].s3Name)) != 0)
+		|| ((ret = addString(buf, node->s3FileInfo.versionId,
+				&buf->nodes[i].versionId)) != 0)
+		|| ((ret = addString(buf, node->s3FileInfo.eTag,
+				&buf->nodes[i].eTag)) != 0)
+		|| ((ret = addString(buf, node->cachedETag,
+				&buf->nodes[i].cachedETag)) != 0) ) {
+		return ret;
+	}
+	return 0;
+}
+
+static int saveOldNode(snapshot_buf *buf, uint64_t i)
+{
+	s3_snapshot_node	*rec = &mapNodes[buf->items[i].old];
+	uint64_t		first = buf->count;
+	int			ret = 0;
+
+	ret = saveOldChildren(buf, buf->items[i].old);
+	if( ret != 0 ) {
+		return ret;
+	}
+	buf->nodes[i] = *rec;
+	buf->nodes[i].firstChild = (uint32_t) first;
+	buf->nodes[i].childCount = (uint32_t) (buf->count - first);
+	if( ((ret = addString(buf, mapString(rec->name),
+				&buf->nodes[i].name)) != 0)
+		|| ((ret = addString(buf, mapString(rec->s3Name),
+				&buf->nodes[i].s3Name)) != 0)
+		|| ((ret = addString(buf, mapString(rec->versionId),
+				&buf->nodes[i].versionId)) != 0)
+		|| ((ret = addString(buf, mapString(rec->eTag),
+				&buf->nodes[i].eTag)) != 0)
+		|| ((ret = addString(buf, mapString(rec->cachedETag),
+				&buf->nodes[i].cachedETag)) != 0) ) {
+		return ret;
+	}
+	return 0;
+}
+
+static int writeAll(int fd, const void *data, size_t size)
+{
+	const char	*p = data;
+	ssize_t		n = 0;
+
+	while( size > 0 ) {
+		n = write(fd, p, size);
+		if( n < 0 ) {
+			if( errno == EINTR )
+				continue;
+			return -errno;
+		}
+		p += n;
+		size -= n;
+	}
+	return 0;
+}
+
+static int writeSnapshot(snapshot_buf *buf, const char *path)
+{
+	s3_snapshot_header	header;
+	char			*tempPath = NULL;
+	int			fd = -1;
+	int			ret = 0;
+
+	tempPath = malloc(strlen(path) + 5);
+	if( tempPath == NULL ) {
+		return -ENOMEM;
+	}
+	sprintf(tempPath, "%s.new", path);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = SNAPSHOT_VERSION;
+	header.nodeCount = (uint32_t) buf->count;
+	header.stringsSize = buf->stringsSize;
+	header.savedTime = time(NULL);
+
+	fd = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if( fd < 0 ) {
+		ret = -errno;
+		goto ret;
+	}
+	if( ((ret = writeAll(fd, &header, sizeof(header))) != 0)
+		|| ((ret = writeAll(fd, buf->nodes,
+			buf->count * sizeof(s3_snapshot_node))) != 0)
+		|| ((ret = writeAll(fd, buf->strings, buf->stringsSize)) != 0) ) {
+		goto ret;
+	}
+	if( fsync(fd) != 0 ) {
+		ret = -errno;
+		goto ret;
+	}
+	close(fd);
+	fd = -1;
+	/* the old one may still be mapped, it goes when it is unmapped */
+	if( rename(tempPath, path) != 0 ) {
+		ret = -errno;
+	}
+
+ret:
+	if( fd >= 0 )
+		close(fd);
+	if( ret != 0 )
+		unlink(tempPath);
+	free(tempPath);
+	return ret;
+}
+
+int snapshotSave()
+{
+	/* writes the tree, with the old snapshot's directories that were
+	   not loaded yet; the tree is only locked while it is copied */
+	snapshot_buf		buf;
+	uint64_t		i = 0;
+	int			ret = 0;
+
+	memset(&buf, 0, sizeof(buf));
+	pthread_mutex_lock(&saveLock);
+	if( savePath == NULL ) {
+		goto ret;
+	}
+
+	pthread_mutex_lock(&gS3TreeLock);
+	if( gS3DirectoryTree == NULL ) {
+		/* nothing was looked at, the old one is as good */
+		pthread_mutex_unlock(&gS3TreeLock);
+		goto ret;
+	}
+	ret = addItem(&buf, gS3DirectoryTree, (mapNodes != NULL) ? 0 : -1);
+	for( i = 0; (ret == 0) && (i < buf.count); i++ ) {
+		if( buf.items[i].node != NULL ) {
+			ret = saveTreeNode(&buf, i);
+		} else {
+			ret = saveOldNode(&buf, i);
+		}
+	}
+	pthread_mutex_unlock(&gS3TreeLock);
+
+	if( ret == 0 ) {
+		ret = writeSnapshot(&buf, savePath);
+	}
+	if( ret != 0 ) {
+		log_msg("snapshotSave : %s, error %d\n", savePath, ret);
+	} else {
+		log_msg("snapshotSave : %s, %llu nodes\n", savePath,
+					(unsigned long long) buf.count);
+	}
+
+ret:
+	pthread_mutex_unlock(&saveLock);
+	free(buf.items);
+	free(buf.nodes);
+	free(buf.strings);
+	return ret;
+}
+
+/******************** start and stop ****************************/
+
+static void *snapshotSaver(void *arg)
+{
+	struct timespec	until;
+
+	(void) arg;
+	pthread_mutex_lock(&saverLock);
+	while( !stopping ) {
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += snapshotInterval;
+		while( !stopping && (pthread_cond_timedwait(&saverWakeup,
+				&saverLock, &until) != ETIMEDOUT) )
+			;
+		if( stopping ) {
+			break;
+		}
+		pthread_mutex_unlock(&saverLock);
+		snapshotSave();
+		pthread_mutex_lock(&saverLock);
+	}
+	pthread_mutex_unlock(&saverLock);
+	return NULL;
+}
+
+int snapshotStart(s3_cache *cache)
+{
+	/* at mount, before the first lookup */
+	int		ret = 0;
+
+	if( snapshotOff ) {
+		return 0;
+	}
+	if( snapshotFile != NULL ) {
+		savePath = strdup(snapshotFile);
+	} else {
+		savePath = malloc(strlen(cache->location)
+					+ strlen(SNAPSHOT_DEFAULT_NAME) + 2);
+		if( savePath != NULL ) {
+			sprintf(savePath, "%s/%s", cache->location,
+						SNAPSHOT_DEFAULT_NAME);
+		}
+	}
+	if( savePath == NULL ) {
+		return -ENOMEM;
+	}
+	snapshotOpen(savePath);
+
+	if( snapshotInterval == 0 ) {
+		return 0;
+	}
+	pthread_mutex_lock(&saverLock);
+	stopping = 0;
+	ret = pthread_create(&saver, NULL, snapshotSaver, NULL);
+	if( ret != 0 ) {
+		log_msg("snapshotStart : pthread_create %d\n", ret);
+	} else {
+		saverRunning = 1;
+	}
+	pthread_mutex_unlock(&saverLock);
+	return -ret;
+}
+
+void snapshotStop()
+{
+	/* at unmount, after the uploads: the last save */
+	pthread_mutex_lock(&saverLock);
+	stopping = 1;
+	pthread_cond_broadcast(&saverWakeup);
+	pthread_mutex_unlock(&saverLock);
+	if( saverRunning ) {
+		pthread_join(saver, NULL);
+		saverRunning = 0;
+	}
+
+	snapshotSave();
+
+	pthread_mutex_lock(&gS3TreeLock);
+	if( mapBase != NULL ) {
+		munmap(mapBase, mapSize);
+		free(used);
+	}
+	mapBase = NULL;
+	mapSize = 0;
+	mapHeader = NULL;
+	mapNodes = NULL;
+	mapStrings = NULL;
+	used = NULL;
+	pthread_mutex_unlock(&gS3TreeLock);
+}
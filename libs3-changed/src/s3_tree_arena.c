@@ -0,0 +1,250 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "s3_fuse_bridge.h"
+#include "s3_tree_arena.h"
+#include "log.h"
+
+#define CACHE_LINE	64
+
+/* the node slabs */
+static s3_tree_node	*freeNodes = NULL;
+static s3_tree_node	*slabNext = NULL;	/* unused part of the last slab */
+static int		slabLeft = 0;
+static size_t		slabBytes = 0;
+static size_t		liveNodes = 0;	/* allocated and not freed */
+
+/*
+ * A name is a reference count and the string, in NAME_ALIGN bytes
+ * from a NAME_ALIGN boundary, in a block or, if it is long, on its
+ * own.  A name whose last reference goes is chained, through its
+ * first bytes, unaligned, on the free list of its size; a name takes
+ * at least the 8 bytes of the link.
+ */
+#define NAME_ALIGN		4
+#define NAME_SIZE(len)		((sizeof(uint32_t) + (len) + NAME_ALIGN - 1) \
+					& ~((size_t) NAME_ALIGN - 1))
+#define NAME_LONG		(NAME_ARENA_BLOCK / 4)
+#define NAME_REFS(name)		(((uint32_t *) (name)) - 1)
+
+/* the string arena and its table */
+static char		*nameBlock = NULL;	/* unused part of the last block */
+static size_t		nameBlockLeft = 0;
+static size_t		nameBytes = 0;
+static void		*nameFree[NAME_SIZE(NAME_LONG) / NAME_ALIGN + 1];
+static char		**nameTable = NULL;	/* open addressing */
+static size_t		nameTableSize = 0;	/* a power of two */
+static size_t		nameCount = 0;
+
+s3_tree_node *nodeArenaAlloc()
+{
+	s3_tree_node	*node = NULL;
+	void		*slab = NULL;
+
+	if( freeNodes != NULL ) {
+		node = freeNodes;
+		freeNodes = node->next;
+		liveNodes++;
+		return node;
+	}
+	if( slabLeft == 0 ) {
+		if( posix_memalign(&slab, CACHE_LINE,
+				NODE_SLAB_NODES * sizeof(s3_tree_node)) != 0 ) {
+			log_msg("nodeArenaAlloc : no memory for a slab\n");
+			return NULL;
+		}
+		slabNext = (s3_tree_node *) slab;
+		slabLeft = NODE_SLAB_NODES;
+		slabBytes += NODE_SLAB_NODES * sizeof(s3_tree_node);
+	}
+	slabLeft--;
+	liveNodes++;
+	return slabNext++;
+}
+
+void nodeArenaFree(s3_tree_node *node)
+{
+	node->next = freeNodes;
+	freeNodes = node;
+	liveNodes--;
+}
+
+static size_t nameHash(const char *name)
+{
+	size_t		h = 2166136261u;
+
+	while( *name != 0 ) {
+		h = (h ^ (unsigned char) *name++) * 16777619u;
+	}
+	return h;
+}
+
+static int nameTableResize(size_t size)
+{
+	char		**old = nameTable;
+	size_t		oldSize = nameTableSize;
+	size_t		h = 0;
+	size_t		i = 0;
+
+	nameTable = calloc(size, sizeof(char *));
+	if( nameTable == NULL ) {
+		nameTable = old;
+		return -1;
+	}
+	nameTableSize = size;
+	for( i = 0; i < oldSize; i++ ) {
+		if( old[i] == NULL ) {
+			continue;
+		}
+		h = nameHash(old[i]) & (size - 1);
+		while( nameTable[h] != NULL ) {
+			h = (h + 1) & (size - 1);
+		}
+		nameTable[h] = old[i];
+	}
+	free(old);
+	return 0;
+}
+
+/* takes name out of the table, moving back what probed past it */
+static void nameTableRemove(const char *name)
+{
+	size_t		mask = nameTableSize - 1;
+	size_t		i = nameHash(name) & mask;
+	size_t		j = 0;
+	size_t		h = 0;
+
+	while( nameTable[i] != name ) {
+		i = (i + 1) & mask;
+	}
+	for( j = (i + 1) & mask; nameTable[j] != NULL; j = (j + 1) & mask ) {
+		/* the name at j stays unless its hash is outside (i, j] */
+		h = nameHash(nameTable[j]) & mask;
+		if( (j > i) ? ((h <= i) || (h > j)) : ((h <= i) && (h > j)) ) {
+			nameTable[i] = nameTable[j];
+			i = j;
+		}
+	}
+	nameTable[i] = NULL;
+}
+
+/* copies name to the arena, with one reference */
+static char *nameCopy(const char *name)
+{
+	size_t		len = strlen(name) + 1;
+	size_t		size = NAME_SIZE(len);
+	char		*copy = NULL;
+
+	if( size < sizeof(void *) ) {
+		size = sizeof(void *);
+	}
+	if( len > NAME_LONG ) {
+		/* would waste most of a block, gets its own */
+		copy = malloc(size);
+		if( copy == NULL ) {
+			return NULL;
+		}
+		nameBytes += size;
+	} else if( nameFree[size / NAME_ALIGN] != NULL ) {
+		/* one of the same size that was released */
+		copy = nameFree[size / NAME_ALIGN];
+		memcpy(&nameFree[size / NAME_ALIGN], copy, sizeof(void *));
+	} else {
+		if( size > nameBlockLeft ) {
+			nameBlock = malloc(NAME_ARENA_BLOCK);
+			if( nameBlock == NULL ) {
+				nameBlockLeft = 0;
+				return NULL;
+			}
+			nameBlockLeft = NAME_ARENA_BLOCK;
+			nameBytes += NAME_ARENA_BLOCK;
+		}
+		copy = nameBlock;
+		nameBlock += size;
+		nameBlockLeft -= size;
+	}
+	copy += sizeof(uint32_t);
+	*NAME_REFS(copy) = 1;
+	memcpy(copy, name, len);
+	return copy;
+}
+
+char *nameIntern(const char *name)
+{
+	size_t		h = 0;
+	char		*copy = NULL;
+
+	/* at most half full */
+	if( (2 * (nameCount + 1) > nameTableSize)
+			&& (nameTableResize((nameTableSize == 0)
+				? NAME_TABLE_INITIAL_SIZE : nameTableSize * 2) != 0) ) {
+		log_msg("nameIntern : no memory for the table\n");
+		return NULL;
+	}
+	h = nameHash(name) & (nameTableSize - 1);
+	while( nameTable[h] != NULL ) {
+		if( strcmp(nameTable[h], name) == 0 ) {
+			(*NAME_REFS(nameTable[h]))++;
+			return nameTable[h];
+		}
+		h = (h + 1) & (nameTableSize - 1);
+	}
+
+	copy = nameCopy(name);
+	if( copy == NULL ) {
+		log_msg("nameIntern : no memory for %s\n", name);
+		return NULL;
+	}
+	nameTable[h] = copy;
+	nameCount++;
+	return copy;
+}
+
+void nameRelease(char *name)
+{
+	/*
+	 - drops a reference nameIntern() gave; with the last one the
+	   name leaves the table and its bytes go to the next name of
+	   the same size
+	 - no lock-free reader may still be looking at name, so it is
+	   called once the node, or its old name, is retired (s3_epoch.h)
+	*/
+	size_t		len = 0;
+	size_t		size = 0;
+	char		*slot = NULL;
+
+	if( --(*NAME_REFS(name)) > 0 ) {
+		return;
+	}
+	nameTableRemove(name);
+	nameCount--;
+	len = strlen(name) + 1;
+	size = NAME_SIZE(len);
+	if( size < sizeof(void *) ) {
+		size = sizeof(void *);
+	}
+	slot = (char *) NAME_REFS(name);
+	if( len > NAME_LONG ) {
+		nameBytes -= size;
+		free(slot);
+	} else {
+		memcpy(slot, &nameFree[size / NAME_ALIGN], sizeof(void *));
+		nameFree[size / NAME_ALIGN] = slot;
+	}
+	/* at least an eighth full; failing to shrink it is harmless */
+	if( (nameTableSize > NAME_TABLE_INITIAL_SIZE)
+			&& (8 * nameCount < nameTableSize) ) {
+		nameTableResize(nameTableSize / 2);
+	}
+}
+
+void treeArenaUsage(size_t *pNodeBytes, size_t *pNameBytes)
+{
+	*pNodeBytes = slabBytes;
+	*pNameBytes = nameBytes + nameTableSize * sizeof(char *);
+}
+
+size_t treeArenaNodes()
+{
+	return liveNodes;
+}
@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include "s3_fuse_bridge.h"
+#include "s3_write_back.h"
+#include "log.h"
+
+int			gWriteBackFlag = 0;
+
+static int		writeBackDelay = WRITE_BACK_DEFAULT_DELAY;
+static int64_t		writeBackDirtyLimit = 
+			(int64_t) WRITE_BACK_DEFAULT_DIRTY_MB * 1024 * 1024;
+static int		writeBackThreads = WRITE_BACK_DEFAULT_THREADS;
+
+/* the worker pool; wakeup is signalled by writeBackKick() and stop */
+static pthread_t	workers[WRITE_BACK_MAX_THREADS];
+static int		workerCount = 0;
+static int		stopping = 0;
+static int		kicked = 0;
+static pthread_mutex_t	workersLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	wakeup = PTHREAD_COND_INITIALIZER;
+
+static int policyInt(const char *name, int value, int min, int max)
+{
+	char		*env = NULL;
+	char		*end = NULL;
+	long		l = 0;
+
+	env = getenv(name);
+	if( env == NULL ) {
+		return value;
+	}
+	l = strtol(env, &end, 10);
+	if( (*env == 0) || (*end != 0) || (l < min) || (l > max) ) {
+		log_msg("%s : %s is not valid, using %d\n", name, env, value);
+		return value;
+	}
+	return (int) l;
+}
+
+int saveWriteBackPolicy()
+{
+	char		*mode = NULL;
+
+	mode = getenv("S3_WRITE_BACK");
+	if( (mode != NULL) && ((strcmp(mode, "1") == 0)
+				|| (strcasecmp(mode, "on") == 0)
+				|| (strcasecmp(mode, "yes") == 0)) ) {
+		gWriteBackFlag = 1;
+	}
+
+	writeBackDelay = policyInt("S3_WRITE_BACK_DELAY", writeBackDelay,
+								0, 86400);
+	writeBackDirtyLimit = (int64_t) policyInt("S3_WRITE_BACK_DIRTY_MB",
+			WRITE_BACK_DEFAULT_DIRTY_MB, 0, 1024 * 1024) * 1024 * 1024;
+	writeBackThreads = policyInt("S3_WRITE_BACK_THREADS", writeBackThreads,
+						1, WRITE_BACK_MAX_THREADS);
+
+	log_msg("write-back %s, delay %d s, dirty limit %lld bytes, %d threads\n",
+			gWriteBackFlag ? "enabled" : "disabled", writeBackDelay,
+			(long long) writeBackDirtyLimit, writeBackThreads);
+	return 0;
+}
+
+static void *writeBackWorker(void *arg)
+{
+	s3_cache	*cache = (s3_cache *) arg;
+	char		*path = NULL;
+	struct timespec	until;
+
+	pthread_mutex_lock(&workersLock);
+	while( !stopping ) {
+		pthread_mutex_unlock(&workersLock);
+
+		s3CacheTakeDirty(cache, writeBackDelay, writeBackDirtyLimit,
+								&path);
+		if( path != NULL ) {
+			s3CacheWriteBack(cache, path);
+			free(path);
+			path = NULL;
+			pthread_mutex_lock(&workersLock);
+			continue;
+		}
+
+		/* nothing due: look again in a second, or when kicked */
+		pthread_mutex_lock(&workersLock);
+		if( !stopping && !kicked ) {
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_sec += 1;
+			pthread_cond_timedwait(&wakeup, &workersLock, &until);
+		}
+		kicked = 0;
+	}
+	pthread_mutex_unlock(&workersLock);
+	return NULL;
+}
+
+int writeBackStart(s3_cache *cache)
+{
+	int		ret = 0;
+
+	if( !gWriteBackFlag ) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&workersLock);
+	stopping = 0;
+	while( workerCount < writeBackThreads ) {
+		ret = pthread_create(&workers[workerCount], NULL,
+						writeBackWorker, cache);
+		if( ret != 0 ) {
+			log_msg("writeBackStart : pthread_create %d\n", ret);
+			ret = -ret;
+			break;
+		}
+		workerCount++;
+	}
+	pthread_mutex_unlock(&workersLock);
+
+	/* without any worker nothing would ever be uploaded */
+	if( workerCount == 0 ) {
+		gWriteBackFlag = 0;
+		return ret;
+	}
+
+	/* writers get ahead of the workers by twice the limit at most */
+	pthread_mutex_lock(&(cache->lock));
+	cache->dirtyLimit = 2 * writeBackDirtyLimit;
+	pthread_mutex_unlock(&(cache->lock));
+	return ret;
+}
+
+void writeBackStop(s3_cache *cache)
+{
+	int		i;
+
+	pthread_mutex_lock(&(cache->lock));
+	cache->dirtyLimit = 0;
+	pthread_cond_broadcast(&(cache->flushed));
+	pthread_mutex_unlock(&(cache->lock));
+
+	pthread_mutex_lock(&workersLock);
+	stopping = 1;
+	pthread_cond_broadcast(&wakeup);
+	pthread_mutex_unlock(&workersLock);
+
+	for( i = 0; i < workerCount; i++ ) {
+		pthread_join(workers[i], NULL);
+	}
+	workerCount = 0;
+
+	/* whatever is still dirty goes up before unmount returns */
+	gWriteBackFlag = 0;
+	s3CacheFlushCache(cache, NULL);
+}
+
+int writeBackClose(s3_cache *cache, const char *path)
+{
+	/* in place of the upload on close: the tree shows the new size
+	   right away, the workers upload later */
+	int		ret = 0;
+
+	if( !s3CacheIsDirty(cache, path) ) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&gS3TreeLock);
+	ret = updateDirTree((char *) path, 1);
+	pthread_mutex_unlock(&gS3TreeLock);
+
+	writeBackKick();
+	return ret;
+}
+
+void writeBackKick()
+{
+	pthread_mutex_lock(&workersLock);
+	kicked = 1;
+	pthread_cond_broadcast(&wakeup);
+	pthread_mutex_unlock(&workersLock);
+}
@@ -205,3 +205,17 @@ S3Status simplexml_add(SimpleXml *simpleXml, const char *data, int dataLen)
 
     return simpleXml->status;
 }
+
+
+S3Status simplexml_finish(SimpleXml *simpleXml)
+{
+    if (!simpleXml->xmlParser) {
+        return simpleXml->status;
+    }
+
+    if (xmlParseChunk((xmlParserCtxtPtr) simpleXml->xmlParser, 0, 0, 1)) {
+        return S3StatusXmlParseFailure;
+    }
+
+    return simpleXml->status;
+}
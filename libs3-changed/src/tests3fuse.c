@@ -0,0 +1,1376 @@
+/*
+  Multi-threaded stress test for the s3fs handlers.
+
+  libfuse's multi-threaded loop calls the handlers in s3_fuse_oper from
+  several threads at once; this does the same, without a kernel mount,
+  against a local S3 stand-in (test/s3_standin.py, see test/stress.sh).
+
+  - seed: create NFILES files under /<bucket>/stress through create,
+    write, flush and release; getattr must not find them before, twice,
+    and find them after
+  - mixed: every thread runs getattr/readdir/open+read/open+write+flush
+    on random files; every read must see well formed records of the
+    right file, getattr the right size, readdir every file, in two halves
+  - refetch: fsync every file, remember what the cache holds, remove the
+    cached copies and read every file back from every thread at once,
+    which fetches and decodes the same objects concurrently
+  - stream: put the same contents as plain objects behind s3fs' back
+    and read random ranges of them from every thread, while they are
+    filled in the background
+  - rename: every thread renames its encoded and plain files, reads
+    them back from S3 under the new name and renames them back; then
+    the plain directory is renamed and read back whole; a plain
+    object renamed over an encoded file must leave none of its keys
+  - chunked: a file with spaces in its name, stored in chunks, has a
+    few bytes rewritten; only the chunks that changed are put again,
+    and it reads back from its manifest; rewritten once more in the
+    mode of the mount, it reads back without the manifest
+  - unlink: one thread unlinks every other file of two directories,
+    one too small for a child index, while the others look the rest
+    up without the lock, getattr and readdir them; none of those may
+    be missed, and what was unlinked must stay gone
+  - scan: every key of the bucket, listed in ranges at once, must be
+    what one listing has, in the same order
+  - evict: a directory put behind s3fs' back and listed, then not used
+    for two seconds, loses its children to an eviction pass, but not
+    while one of their inodes is held; readdir must list them again
+    and they must read back
+  - revalidate, with S3_LIST_TTL set: put an object into the renamed
+    directory and delete another behind s3fs' back; once the listing
+    expired readdir must show both changes, after a background re-list
+
+  With S3_WRITE_BACK=1 the writes are uploaded by the write-back workers
+  while the threads run.
+
+  With -w it mounts again over the cache dir and bucket of an earlier
+  run, with S3_LIST_TTL=0: readdir of the bucket and then of renamed,
+  as ls -R would, must serve renamed from the tree snapshot the earlier
+  run saved, without an object put behind s3fs' back, and its files
+  must read back.
+
+  usage: tests3fuse [-w] <cache dir> <bucket> [threads [iterations]]
+  S3_HOSTNAME, S3_PROTOCOL, S3_ACCESS_KEY_ID and S3_SECRET_ACCESS_KEY
+  point it at the stand-in; erasure_policy is read from the current
+  directory as by s3fs.
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "s3.h"
+#include "s3_key_list.h"
+#include "s3_fuse_bridge.h"
+#include "s3_erasure_code.h"
+#include "s3_chunk_store.h"
+#include "s3_write_back.h"
+#include "s3_cache_fill.h"
+#include "s3_rename.h"
+#include "s3_delete.h"
+#include "s3_revalidate.h"
+#include "s3_negative_cache.h"
+#include "s3_snapshot.h"
+#include "s3_scan.h"
+#include "s3_path_cache.h"
+#include "s3_evict.h"
+#include "s3_epoch.h"
+#include "s3_child_index.h"
+
+#define NFILES		8
+#define RECORD_SIZE	32
+#define NRECORDS	2048
+#define FILE_SIZE	(RECORD_SIZE * NRECORDS)
+
+extern struct fuse_operations	s3_fuse_oper;
+
+static struct fuse_context	context;
+static char			*bucket;
+static char			*cacheLocation;
+static int			threads = 8;
+static int			iterations = 200;
+static int			failures = 0;
+static pthread_mutex_t		failuresLock = PTHREAD_MUTEX_INITIALIZER;
+static char			*expected[NFILES];
+
+/* the handlers find their state through fuse_get_context(), this one
+   takes the place of libfuse's; the fuse_buf functions come from it */
+struct fuse_context *fuse_get_context(void)
+{
+	return &context;
+}
+
+static void fail(const char *format, const char *path, long value)
+{
+	pthread_mutex_lock(&failuresLock);
+	failures++;
+	fprintf(stderr, "FAIL: ");
+	fprintf(stderr, format, path, value);
+	fprintf(stderr, "\n");
+	pthread_mutex_unlock(&failuresLock);
+}
+
+static void filePath(int file, char *path)
+{
+	/* the encoder wants an extension */
+	sprintf(path, "/%s/stress/f%02d.bin", bucket, file);
+}
+
+/* NRECORDS records of "f<file> g<generation>", padded to RECORD_SIZE */
+static void fillFile(char *buf, int file, int generation)
+{
+	int		i;
+
+	for( i = 0; i < NRECORDS; i++ ) {
+		snprintf(buf + i * RECORD_SIZE, RECORD_SIZE, "f%02d g%08d",
+							file, generation);
+		memset(buf + i * RECORD_SIZE + 13, '.', RECORD_SIZE - 14);
+		buf[(i + 1) * RECORD_SIZE - 1] = '\n';
+	}
+}
+
+static void checkFile(const char *path, char *buf, int len, int file)
+{
+	char		prefix[8];
+	int		i;
+
+	if( len != FILE_SIZE ) {
+		fail("%s: read %ld bytes", path, len);
+		return;
+	}
+	sprintf(prefix, "f%02d g", file);
+	for( i = 0; i < NRECORDS; i++ ) {
+		if( memcmp(buf + i * RECORD_SIZE, prefix, 5) != 0
+				|| buf[(i + 1) * RECORD_SIZE - 1] != '\n' ) {
+			fail("%s: bad record %ld", path, i);
+			return;
+		}
+	}
+}
+
+/* size bytes of buf at offset of path, through write_buf or write;
+   flushed and released */
+static int writePath(const char *path, const char *buf, int size,
+					off_t offset, int create, int useBuf)
+{
+	struct fuse_file_info	fi;
+	int			ret;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_WRONLY;
+	if( create ) {
+		ret = s3_fuse_oper.create(path, 0644, &fi);
+	} else {
+		ret = s3_fuse_oper.open(path, &fi);
+	}
+	if( ret != 0 ) {
+		fail("%s: open %ld", path, ret);
+		return ret;
+	}
+
+	if( useBuf ) {
+		struct fuse_bufvec	src = FUSE_BUFVEC_INIT(size);
+
+		src.buf[0].mem = (char *) buf;
+		ret = s3_fuse_oper.write_buf(path, &src, offset, &fi);
+	} else {
+		ret = s3_fuse_oper.write(path, buf, size, offset, &fi);
+	}
+	if( ret != size ) {
+		fail("%s: write %ld", path, ret);
+	}
+	s3_fuse_oper.flush(path, &fi);
+	s3_fuse_oper.release(path, &fi);
+	return 0;
+}
+
+static int writeFile(int file, int generation, int create)
+{
+	char			path[1024];
+	char			*buf;
+	int			ret;
+
+	filePath(file, path);
+	buf = malloc(FILE_SIZE);
+	fillFile(buf, file, generation);
+
+	/* libfuse calls write_buf when there is one, half the writes
+	   check that plain write still works */
+	ret = writePath(path, buf, FILE_SIZE, 0, create, generation % 2);
+	free(buf);
+	return ret;
+}
+
+static int readPath(const char *path, int file, char *buf)
+{
+	struct fuse_file_info	fi;
+	struct stat		statbuf;
+	int			ret;
+
+	/* the kernel looks a file up before opening it */
+	ret = s3_fuse_oper.getattr(path, &statbuf);
+	if( ret != 0 ) {
+		fail("%s: getattr %ld", path, ret);
+		return -1;
+	}
+
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_RDONLY;
+	ret = s3_fuse_oper.open(path, &fi);
+	if( ret != 0 ) {
+		fail("%s: open %ld", path, ret);
+		return -1;
+	}
+	/* read_buf hands back the cache file, copy from it as libfuse
+	   would into /dev/fuse */
+	if( file % 2 ) {
+		struct fuse_bufvec	dst = FUSE_BUFVEC_INIT(FILE_SIZE + 1);
+		struct fuse_bufvec	*src = NULL;
+
+		dst.buf[0].mem = buf;
+		ret = s3_fuse_oper.read_buf(path, &src, FILE_SIZE + 1, 0, &fi);
+		if( ret == 0 ) {
+			ret = fuse_buf_copy(&dst, src, 0);
+			free(src);
+		}
+	} else {
+		ret = s3_fuse_oper.read(path, buf, FILE_SIZE + 1, 0, &fi);
+	}
+	s3_fuse_oper.release(path, &fi);
+	return ret;
+}
+
+static int readFile(int file, char *buf)
+{
+	char		path[1024];
+
+	filePath(file, path);
+	return readPath(path, file, buf);
+}
+
+static void syncFile(int file)
+{
+	struct fuse_file_info	fi;
+	char			path[1024];
+	int			ret;
+
+	filePath(file, path);
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_RDONLY;
+	ret = s3_fuse_oper.open(path, &fi);
+	if( ret == 0 ) {
+		ret = s3_fuse_oper.fsync(path, 0, &fi);
+		s3_fuse_oper.release(path, &fi);
+	}
+	if( ret != 0 ) {
+		fail("%s: fsync %ld", path, ret);
+	}
+}
+
+// readdir filler: counts the regular files of FILE_SIZE, and stops
+// after "stop" of them so that the caller resumes at the last offset
+typedef struct dir_count {
+	long	count;
+	long	stop;
+	off_t	off;
+} dir_count;
+
+static int countEntry(void *buf, const char *name, const struct stat *stbuf,
+								off_t off)
+{
+	dir_count	*dc = (dir_count *) buf;
+
+	(void) name;
+	if( dc->stop != 0 && dc->count == dc->stop ) {
+		return 1;
+	}
+	if( stbuf != NULL && S_ISREG(stbuf->st_mode) &&
+					stbuf->st_size == FILE_SIZE ) {
+		dc->count++;
+	}
+	dc->off = off;
+	return 0;
+}
+
+static void *mixedThread(void *arg)
+{
+	unsigned int	seed = (unsigned int) (long) arg;
+	char		path[1024];
+	char		*buf;
+	struct stat	statbuf;
+	struct fuse_file_info	fi;
+	dir_count	dc;
+	int		i, file, ret;
+
+	buf = malloc(FILE_SIZE + 1);
+	for( i = 0; i < iterations; i++ ) {
+		file = rand_r(&seed) % NFILES;
+		filePath(file, path);
+
+		switch( rand_r(&seed) % 4 ) {
+		case 0:
+			ret = s3_fuse_oper.getattr(path, &statbuf);
+			if( ret != 0 || statbuf.st_size != FILE_SIZE ) {
+				fail("%s: getattr size %ld", path,
+					(ret != 0) ? ret : (long) statbuf.st_size);
+			}
+			break;
+		case 1:
+			sprintf(path, "/%s/stress", bucket);
+			memset(&dc, 0, sizeof(dc));
+			memset(&fi, 0, sizeof(fi));
+			ret = s3_fuse_oper.opendir(path, &fi);
+			if( ret != 0 ) {
+				fail("%s: opendir %ld", path, (long) ret);
+				break;
+			}
+			dc.stop = NFILES / 2;
+			ret = s3_fuse_oper.readdir(path, &dc, countEntry,
+								0, &fi);
+			dc.stop = 0;
+			if( ret == 0 ) {
+				ret = s3_fuse_oper.readdir(path, &dc,
+						countEntry, dc.off, &fi);
+			}
+			s3_fuse_oper.releasedir(path, &fi);
+			if( ret != 0 || dc.count != NFILES ) {
+				fail("%s: readdir found %ld", path, dc.count);
+			}
+			break;
+		case 2:
+			ret = readFile(file, buf);
+			if( ret >= 0 ) {
+				checkFile(path, buf, ret, file);
+			}
+			break;
+		case 3:
+			writeFile(file, (int) (long) arg * iterations + i, 0);
+			break;
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+static void *refetchThread(void *arg)
+{
+	char		path[1024];
+	char		*buf;
+	int		i, file, ret;
+
+	buf = malloc(FILE_SIZE + 1);
+	for( i = 0; i < NFILES; i++ ) {
+		file = (i + (int) (long) arg) % NFILES;
+		ret = readFile(file, buf);
+		filePath(file, path);
+		if( ret != FILE_SIZE || memcmp(buf, expected[file], FILE_SIZE) ) {
+			fail("%s: refetched copy differs, %ld bytes", path, ret);
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+static void plainPath(int file, char *path)
+{
+	sprintf(path, "/%s/plain/p%02d.bin", bucket, file);
+}
+
+/* put expected[file] at path as an object of its own, not encoded */
+static int putObject(const char *path, int file)
+{
+	char		key[1024];
+	char		src[1024];
+	char		filename[1100];
+	char		*argv[2] = { key, filename };
+	FILE		*fp;
+
+	strcpy(key, path + 1);
+	sprintf(src, "plain%02d.src", file);
+	sprintf(filename, "filename=%s", src);
+	fp = fopen(src, "wb");
+	if( fp == NULL || fwrite(expected[file], 1, FILE_SIZE, fp) != FILE_SIZE ) {
+		fail("%s: cannot write source %ld", src, 0);
+		if( fp != NULL )
+			fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+	return put_object(2, argv, 0);
+}
+
+static int putPlain(int file)
+{
+	char		path[1024];
+
+	plainPath(file, path);
+	return putObject(path, file);
+}
+
+static void *streamThread(void *arg)
+{
+	unsigned int	seed = (unsigned int) (long) arg;
+	struct fuse_file_info	fi;
+	char		path[1024];
+	char		buf[8 * RECORD_SIZE];
+	int		i, file, ret, offset, size;
+
+	for( i = 0; i < iterations; i++ ) {
+		file = rand_r(&seed) % NFILES;
+		plainPath(file, path);
+		offset = (rand_r(&seed) % NRECORDS) * RECORD_SIZE;
+		size = (1 + rand_r(&seed) % 8) * RECORD_SIZE;
+		if( offset + size > FILE_SIZE )
+			size = FILE_SIZE - offset;
+
+		memset(&fi, 0, sizeof(fi));
+		fi.flags = O_RDONLY;
+		ret = s3_fuse_oper.open(path, &fi);
+		if( ret != 0 ) {
+			fail("%s: open %ld", path, ret);
+			continue;
+		}
+		ret = s3_fuse_oper.read(path, buf, size, offset, &fi);
+		s3_fuse_oper.release(path, &fi);
+		if( ret != size || memcmp(buf, expected[file] + offset, size) ) {
+			fail("%s: stream read differs at %ld", path, offset);
+		}
+	}
+	return NULL;
+}
+
+static void movedPath(int file, char *path)
+{
+	/* another extension, the fragments are renamed after it */
+	sprintf(path, "/%s/moved/m%02d.dat", bucket, file);
+}
+
+/* rename, read back from S3 and rename back; the copies of the
+   encoded file are of its fragments, of the plain object of itself */
+static void renameOne(const char *path, const char *newPath, int file,
+								char *buf)
+{
+	char		cachedPath[4096];
+	struct stat	statbuf;
+	int		ret;
+
+	ret = s3_fuse_oper.rename(path, newPath);
+	if( ret != 0 ) {
+		fail("%s: rename %ld", path, ret);
+		return;
+	}
+	if( s3_fuse_oper.getattr(path, &statbuf) != -ENOENT ) {
+		fail("%s: still there after rename %ld", path, 0);
+	}
+	sprintf(cachedPath, "%s%s", cacheLocation, newPath);
+	unlink(cachedPath);
+	ret = readPath(newPath, file, buf);
+	if( ret != FILE_SIZE || memcmp(buf, expected[file], FILE_SIZE) ) {
+		fail("%s: renamed copy differs, %ld bytes", newPath, ret);
+	}
+	ret = s3_fuse_oper.rename(newPath, path);
+	if( ret != 0 ) {
+		fail("%s: rename back %ld", newPath, ret);
+	}
+}
+
+static void *renameThread(void *arg)
+{
+	char		path[1024];
+	char		newPath[1024];
+	char		*buf;
+	int		file;
+
+	buf = malloc(FILE_SIZE + 1);
+	for( file = (int) (long) arg - 1; file < NFILES; file += threads ) {
+		filePath(file, path);
+		movedPath(file, newPath);
+		renameOne(path, newPath, file, buf);
+
+		plainPath(file, path);
+		sprintf(newPath, "/%s/plain/q%02d.bin", bucket, file);
+		renameOne(path, newPath, file, buf);
+	}
+	free(buf);
+	return NULL;
+}
+
+/* a plain object renamed over an encoded file takes its place, and
+   no fragment of the file is left; returns the keys it had */
+static int replaceEncoded()
+{
+	s3_key_list	keys;
+	char		path[1024];
+	char		newPath[1024];
+	char		*buf;
+	int		count = 0;
+	int		ret;
+
+	sprintf(newPath, "/%s/replace", bucket);
+	if( s3_fuse_oper.mkdir(newPath, 0755) != 0 ) {
+		fail("%s: mkdir %ld", newPath, 0);
+		return 0;
+	}
+	sprintf(newPath, "/%s/replace/target.bin", bucket);
+	if( writePath(newPath, expected[1], FILE_SIZE, 0, 1, 0) != 0 ) {
+		return 0;
+	}
+	keyListInit(&keys);
+	if( getKeysFromS3(newPath, &keys) == 0 ) {
+		count = keys.count;
+	}
+	keyListFree(&keys);
+
+	sprintf(path, "/%s/replace/source.bin", bucket);
+	if( putObject(path, 0) != 0 ) {
+		fail("%s: put %ld", path, -1);
+		return count;
+	}
+	ret = s3_fuse_oper.rename(path, newPath);
+	if( ret != 0 ) {
+		fail("%s: rename over an encoded file %ld", path, ret);
+		return count;
+	}
+
+	keyListInit(&keys);
+	if( getKeysFromS3(newPath, &keys) != 0 ) {
+		fail("%s: cannot list %ld", newPath, 0);
+	} else if( keys.count != 0 ) {
+		fail("%s: %ld keys of the old file left", newPath,
+							(long) keys.count);
+	}
+	keyListFree(&keys);
+	sprintf(path, "%s%s", cacheLocation, newPath);
+	unlink(path);
+	buf = malloc(FILE_SIZE + 1);
+	ret = readPath(newPath, 0, buf);
+	if( ret != FILE_SIZE || memcmp(buf, expected[0], FILE_SIZE) ) {
+		fail("%s: replaced copy differs, %ld bytes", newPath, ret);
+	}
+	free(buf);
+	return count;
+}
+
+#define CHUNKED_SIZE	(1024 * 1024)
+
+/* syncs path and reads it back from S3 into readBuf, which must
+   match buf */
+static void syncChunked(const char *path, char *buf, char *readBuf)
+{
+	struct fuse_file_info	fi;
+	struct stat		statbuf;
+	char			cachedPath[2048];
+	int			ret;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_RDONLY;
+	if( (s3_fuse_oper.open(path, &fi) != 0)
+			|| (s3_fuse_oper.fsync(path, 0, &fi) != 0) ) {
+		fail("%s: fsync %ld", path, 0);
+	}
+	s3_fuse_oper.release(path, &fi);
+	if( readBuf == NULL ) {
+		return;
+	}
+
+	sprintf(cachedPath, "%s%s", cacheLocation, path);
+	unlink(cachedPath);
+	if( (s3_fuse_oper.getattr(path, &statbuf) != 0)
+			|| (statbuf.st_size != CHUNKED_SIZE) ) {
+		fail("%s: size after rewrite %ld", path,
+						(long) statbuf.st_size);
+	}
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_RDONLY;
+	ret = s3_fuse_oper.open(path, &fi);
+	if( ret != 0 ) {
+		fail("%s: open %ld", path, ret);
+		return;
+	}
+	ret = s3_fuse_oper.read(path, readBuf, CHUNKED_SIZE + 1, 0, &fi);
+	s3_fuse_oper.release(path, &fi);
+	if( (ret != CHUNKED_SIZE) || memcmp(readBuf, buf, CHUNKED_SIZE) ) {
+		fail("%s: read back differs, %ld bytes", path, ret);
+	}
+}
+
+/* the chunk keys of the bucket, with when they were put */
+static int listChunks(s3_key_list *keys)
+{
+	char		path[1024];
+
+	keyListInit(keys);
+	sprintf(path, "/%s/%s", bucket, CHUNK_STORE_PREFIX);
+	if( getKeysFromS3(path, keys) != 0 ) {
+		fail("%s: cannot list %ld", path, 0);
+		return -1;
+	}
+	return 0;
+}
+
+/* a chunked file with spaces in its name, rewritten in the middle,
+   puts only its changed chunks again; returns the chunks kept */
+static int chunkedRoundTrip()
+{
+	s3_key_list		before;
+	s3_key_list		after;
+	s3_key_iter		beforeIter;
+	s3_key_iter		afterIter;
+	s3_file_info		beforeInfo;
+	s3_file_info		afterInfo;
+	char			path[1024];
+	char			*buf;
+	char			*readBuf;
+	uint64_t		x = 88172645463325252ULL;
+	int			more;
+	int			kept = 0;
+	int			added = 0;
+	int			flag = gChunkStoreFlag;
+	int			i;
+
+	sprintf(path, "/%s/chunked", bucket);
+	if( s3_fuse_oper.mkdir(path, 0755) != 0 ) {
+		fail("%s: mkdir %ld", path, 0);
+		return 0;
+	}
+	/* content defined chunks want content that is not periodic */
+	buf = malloc(CHUNKED_SIZE);
+	readBuf = malloc(CHUNKED_SIZE + 1);
+	for( i = 0; i < CHUNKED_SIZE; i++ ) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		buf[i] = (char) x;
+	}
+
+	gChunkStoreFlag = 1;
+	sprintf(path, "/%s/chunked/a chunked file.bin", bucket);
+	if( writePath(path, buf, CHUNKED_SIZE, 0, 1, 0) != 0 ) {
+		goto ret;
+	}
+	syncChunked(path, buf, NULL);
+	if( listChunks(&before) != 0 ) {
+		goto ret;
+	}
+
+	/* a chunk put again would have a later time */
+	sleep(1);
+	memset(buf + CHUNKED_SIZE / 2, 'x', 100);
+	writePath(path, buf + CHUNKED_SIZE / 2, 100, CHUNKED_SIZE / 2, 0, 1);
+	syncChunked(path, buf, NULL);
+	if( listChunks(&after) != 0 ) {
+		keyListFree(&before);
+		goto ret;
+	}
+
+	keyIterInit(&beforeIter, &before);
+	keyIterInit(&afterIter, &after);
+	more = keyListNext(&beforeIter, &beforeInfo);
+	while( keyListNext(&afterIter, &afterInfo) ) {
+		while( more && (strcmp(beforeInfo.name, afterInfo.name) < 0) ) {
+			more = keyListNext(&beforeIter, &beforeInfo);
+		}
+		if( !more || strcmp(beforeInfo.name, afterInfo.name) ) {
+			added++;
+		} else if( beforeInfo.time != afterInfo.time ) {
+			fail("%s: unchanged chunk put again, %ld s later",
+					afterInfo.name,
+					(long) (afterInfo.time - beforeInfo.time));
+		} else {
+			kept++;
+		}
+	}
+	keyListFree(&before);
+	keyListFree(&after);
+	if( (added == 0) || (kept == 0) ) {
+		fail("%s: rewrite put %ld new chunks", path, added);
+	}
+
+	/* read back from the manifest, the name has spaces in it */
+	syncChunked(path, buf, readBuf);
+
+	/* put in the mode of the mount, the manifest must not be what
+	   is fetched */
+	gChunkStoreFlag = flag;
+	memset(buf + CHUNKED_SIZE / 4, 'y', 100);
+	writePath(path, buf + CHUNKED_SIZE / 4, 100, CHUNKED_SIZE / 4, 0, 0);
+	syncChunked(path, buf, readBuf);
+
+ret:
+	gChunkStoreFlag = flag;
+	free(readBuf);
+	free(buf);
+	return kept;
+}
+
+// readdir filler: notes whether the two names are there
+typedef struct dir_names {
+	const char	*names[2];
+	int		found[2];
+} dir_names;
+
+static int findNames(void *buf, const char *name, const struct stat *stbuf,
+								off_t off)
+{
+	dir_names	*dn = (dir_names *) buf;
+	int		i;
+
+	(void) stbuf;
+	(void) off;
+	for( i = 0; i < 2; i++ ) {
+		if( strcmp(name, dn->names[i]) == 0 ) {
+			dn->found[i] = 1;
+		}
+	}
+	return 0;
+}
+
+/* readdir of dirPath, which of dn's names it has */
+static int readNames(const char *dirPath, dir_names *dn)
+{
+	struct fuse_file_info	fi;
+	int			ret;
+
+	dn->found[0] = dn->found[1] = 0;
+	memset(&fi, 0, sizeof(fi));
+	ret = s3_fuse_oper.opendir(dirPath, &fi);
+	if( ret == 0 ) {
+		ret = s3_fuse_oper.readdir(dirPath, dn, findNames, 0, &fi);
+		s3_fuse_oper.releasedir(dirPath, &fi);
+	}
+	if( ret != 0 ) {
+		fail("%s: readdir %ld", dirPath, (long) ret);
+	}
+	return ret;
+}
+
+/* an object put and one deleted behind s3fs' back show up in the
+   directory a while after its listing expired, readdir never waits */
+static void revalidateDir(int ttl)
+{
+	struct stat	statbuf;
+	dir_names	dn;
+	char		dirPath[1024];
+	char		path[1100];
+	int		i, ret;
+
+	sprintf(dirPath, "/%s/renamed", bucket);
+	sprintf(path, "%s/n00.bin", dirPath);
+	if( putObject(path, 0) != 0 ) {
+		fail("%s: put %ld", path, -1);
+		return;
+	}
+	sprintf(path, "%s/renamed/p00.bin", bucket);
+	if( deleteObjectFromS3(path, NULL) != 0 ) {
+		fail("%s: delete %ld", path, -1);
+		return;
+	}
+	sleep(ttl + 1);
+
+	dn.names[0] = "n00.bin";
+	dn.names[1] = "p00.bin";
+	for( i = 0; i < 100; i++ ) {
+		if( readNames(dirPath, &dn) != 0 ) {
+			return;
+		}
+		if( dn.found[0] && !dn.found[1] ) {
+			break;
+		}
+		usleep(100000);
+	}
+	if( !dn.found[0] || dn.found[1] ) {
+		fail("%s: not revalidated after %ld ms", dirPath, i * 100L);
+		return;
+	}
+
+	sprintf(path, "%s/n00.bin", dirPath);
+	ret = s3_fuse_oper.getattr(path, &statbuf);
+	if( ret != 0 || statbuf.st_size != FILE_SIZE ) {
+		fail("%s: getattr size %ld", path,
+				(ret != 0) ? ret : (long) statbuf.st_size);
+	}
+	sprintf(path, "%s/p00.bin", dirPath);
+	if( s3_fuse_oper.getattr(path, &statbuf) != -ENOENT ) {
+		fail("%s: still there after its delete %ld", path, 0);
+	}
+}
+
+/* a mount over what an earlier run left, see -w above */
+static void warmMount()
+{
+	dir_names	dn;
+	char		dirPath[1024];
+	char		path[1100];
+	char		*buf;
+	int		ret;
+
+	expected[0] = malloc(FILE_SIZE);
+	fillFile(expected[0], 0, 0);
+	sprintf(dirPath, "/%s/renamed", bucket);
+	sprintf(path, "%s/q00.bin", dirPath);
+	if( putObject(path, 0) != 0 ) {
+		fail("%s: put %ld", path, -1);
+		return;
+	}
+
+	sprintf(path, "/%s", bucket);
+	dn.names[0] = "renamed";
+	dn.names[1] = "renamed";
+	if( readNames(path, &dn) != 0 ) {
+		return;
+	}
+	if( !dn.found[0] ) {
+		fail("%s: renamed not found %ld", path, 0);
+		return;
+	}
+
+	dn.names[0] = "p01.bin";
+	dn.names[1] = "q00.bin";
+	if( readNames(dirPath, &dn) != 0 ) {
+		return;
+	}
+	if( !dn.found[0] || dn.found[1] ) {
+		fail("%s: not from the snapshot %ld", dirPath, 0);
+	}
+
+	sprintf(path, "%s/p01.bin", dirPath);
+	buf = malloc(FILE_SIZE + 1);
+	ret = readPath(path, 1, buf);
+	if( ret != FILE_SIZE ) {
+		fail("%s: read %ld bytes", path, ret);
+	} else {
+		checkFile(path, buf, ret, 1);
+	}
+	free(buf);
+}
+
+/* the keys of the bucket from ranges listed at once, as one listing has
+   them; returns how many */
+static int scanBucket()
+{
+	s3_key_list	scanned;
+	s3_key_list	listed;
+	s3_key_iter	scanIter;
+	s3_key_iter	listIter;
+	s3_file_info	scanInfo;
+	s3_file_info	listInfo;
+	char		path[1024];
+	int		count = 0;
+
+	keyListInit(&scanned);
+	keyListInit(&listed);
+	sprintf(path, "/%s", bucket);
+	if( getKeysFromS3(path, &scanned) != 0 ) {
+		fail("%s: scan %ld", path, -1);
+		return 0;
+	}
+	if( list_bucket_keys(bucket, NULL, &listed) != 0 ) {
+		fail("%s: list %ld", path, -1);
+		keyListFree(&scanned);
+		return 0;
+	}
+	if( scanned.count != listed.count ) {
+		fail("%s: scan has %ld keys", path, scanned.count - listed.count);
+	}
+	keyIterInit(&scanIter, &scanned);
+	keyIterInit(&listIter, &listed);
+	while( keyListNext(&listIter, &listInfo) ) {
+		if( !keyListNext(&scanIter, &scanInfo)
+				|| strcmp(scanInfo.name, listInfo.name)
+				|| (scanInfo.size != listInfo.size) ) {
+			fail("%s: scanned out of order, key %ld",
+							listInfo.name, count);
+			break;
+		}
+		count++;
+	}
+	keyListFree(&scanned);
+	keyListFree(&listed);
+	return count;
+}
+
+/* a cold directory is evicted and listed again when it is read;
+   returns the nodes the pass dropped, the eviction thread may have
+   been first */
+static size_t evictCold()
+{
+	s3_tree_node	*node;
+	s3_tree_node	*held;
+	dir_names	dn;
+	char		dirPath[1024];
+	char		path[1100];
+	char		*buf;
+	size_t		dropped;
+	uint64_t	ino;
+	int		i, ret;
+
+	sprintf(dirPath, "/%s/cold", bucket);
+	for( i = 0; i < 2; i++ ) {
+		sprintf(path, "%s/c%02d.bin", dirPath, i);
+		if( putObject(path, i) != 0 ) {
+			fail("%s: put %ld", path, -1);
+			return 0;
+		}
+	}
+	dn.names[0] = "c00.bin";
+	dn.names[1] = "c01.bin";
+	if( readNames(dirPath, &dn) != 0 ) {
+		return 0;
+	}
+	if( !dn.found[0] || !dn.found[1] ) {
+		fail("%s: not listed %ld", dirPath, 0);
+		return 0;
+	}
+
+	/* what the kernel holds stays, as the kernel had looked it up */
+	pthread_mutex_lock(&gS3TreeLock);
+	sprintf(path, "%s/c00.bin", dirPath);
+	searchForPath(path, gS3DirectoryTree, &held);
+	ino = 0;
+	if( held != NULL ) {
+		s3InodeRef(held);
+		ino = held->ino;
+	}
+	pthread_mutex_unlock(&gS3TreeLock);
+
+	/* and what was used this second */
+	sleep(2);
+	pthread_mutex_lock(&gS3TreeLock);
+	if( ino != 0 ) {
+		/* held->parent, a lookup would count as a use */
+		evictRun(0);
+		if( held->parent->children == NULL ) {
+			fail("%s: evicted while held, inode %ld", dirPath,
+								(long) ino);
+		}
+		s3InodeForget(ino, 1);
+	}
+	dropped = evictRun(0);
+	searchForPath(dirPath, gS3DirectoryTree, &node);
+	if( (node == NULL) || (node->children != NULL)
+			|| (node->isComplete & NODE_COMPLETE) ) {
+		fail("%s: not evicted, %ld nodes dropped", dirPath,
+							(long) dropped);
+	}
+	pthread_mutex_unlock(&gS3TreeLock);
+
+	if( readNames(dirPath, &dn) != 0 ) {
+		return dropped;
+	}
+	if( !dn.found[0] || !dn.found[1] ) {
+		fail("%s: not listed again %ld", dirPath, 0);
+	}
+	sprintf(path, "%s/c01.bin", dirPath);
+	buf = malloc(FILE_SIZE + 1);
+	ret = readPath(path, 1, buf);
+	if( ret != FILE_SIZE ) {
+		fail("%s: read %ld bytes after eviction", path, ret);
+	} else {
+		checkFile(path, buf, ret, 1);
+	}
+	free(buf);
+	return dropped;
+}
+
+/* a directory goes in multi-object deletes, names XML has to escape
+   included; returns how many keys were deleted */
+static int deleteMany()
+{
+	s3_key_list	left;
+	char		dirPath[1024];
+	char		path[1100];
+	int		count = 0;
+	int		i;
+
+	sprintf(dirPath, "/%s/gone", bucket);
+	for( i = 0; i < 24; i++ ) {
+		sprintf(path, "%s/%s%02d.bin", dirPath,
+					(i % 4 == 0) ? "a&b<c>'\"" : "g", i);
+		if( putObject(path, i % NFILES) != 0 ) {
+			fail("%s: put %ld", path, -1);
+			return 0;
+		}
+		count++;
+	}
+	if( deletePath(dirPath) != 0 ) {
+		fail("%s: delete %ld", dirPath, -1);
+	}
+
+	keyListInit(&left);
+	if( list_bucket_keys(bucket, "gone/", &left) != 0 ) {
+		fail("%s: list %ld", dirPath, -1);
+	} else if( left.count != 0 ) {
+		fail("%s: %ld keys left", dirPath, left.count);
+	}
+	keyListFree(&left);
+	return count;
+}
+
+static int runThreads(int threads, void *(*fn)(void *))
+{
+	pthread_t	*tids;
+	long		i;
+
+	tids = malloc(threads * sizeof(pthread_t));
+	for( i = 0; i < threads; i++ ) {
+		pthread_create(&tids[i], NULL, fn, (void *) (i + 1));
+	}
+	for( i = 0; i < threads; i++ ) {
+		pthread_join(tids[i], NULL);
+	}
+	free(tids);
+	return 0;
+}
+
+/* a directory walked as a list, and one with a child index */
+static const int	unlinkFiles[2] = { CHILD_INDEX_MIN - 2, 64 };
+static int		unlinkDone = 0;
+
+static void unlinkPath(int dir, int file, char *path)
+{
+	/* kept and unlinked files one after the other in the list */
+	sprintf(path, "/%s/unlink/d%d/u%02d.bin", bucket, dir, file);
+}
+
+static void *unlinkThread(void *arg)
+{
+	s3_tree_node	*node;
+	struct stat	statbuf;
+	struct fuse_file_info	fi;
+	dir_count	dc;
+	char		path[1024];
+	char		name[16];
+	int		dir, i, n, ret;
+
+	if( (long) arg == 1 ) {
+		for( i = 1; i < unlinkFiles[1]; i += 2 ) {
+			for( dir = 0; dir < 2; dir++ ) {
+				if( i >= unlinkFiles[dir] ) {
+					continue;
+				}
+				unlinkPath(dir, i, path);
+				ret = s3_fuse_oper.unlink(path);
+				if( ret != 0 ) {
+					fail("%s: unlink %ld", path, ret);
+				}
+			}
+		}
+		__atomic_store_n(&unlinkDone, 1, __ATOMIC_RELEASE);
+		return NULL;
+	}
+
+	while( !__atomic_load_n(&unlinkDone, __ATOMIC_ACQUIRE) ) {
+		/* in the directory itself, the path cache would have the
+		   file; the list is in descending order, u00 is found past
+		   every unlinked name, the index has them in chains */
+		for( n = 0; n < 20000; n++ ) {
+			dir = n % 2;
+			sprintf(path, "/%s/unlink/d%d", bucket, dir);
+			sprintf(name, "u%02d.bin", dir * (2 * n % unlinkFiles[dir]));
+			if( epochEnter() != 0 ) {
+				break;
+			}
+			node = searchForPathLockFree(path);
+			if( node != NULL ) {
+				node = childFindLockFree(node, name);
+			}
+			epochExit();
+			if( node == NULL ) {
+				fail("%s: missed without the lock %ld", name, dir);
+			}
+		}
+
+		for( dir = 0; dir < 2; dir++ ) {
+			for( i = 0; i < unlinkFiles[dir]; i += 2 ) {
+				unlinkPath(dir, i, path);
+				ret = s3_fuse_oper.getattr(path, &statbuf);
+				if( ret != 0 ) {
+					fail("%s: getattr while unlinking %ld",
+								path, ret);
+				}
+			}
+
+			sprintf(path, "/%s/unlink/d%d", bucket, dir);
+			memset(&dc, 0, sizeof(dc));
+			memset(&fi, 0, sizeof(fi));
+			ret = s3_fuse_oper.opendir(path, &fi);
+			if( ret != 0 ) {
+				fail("%s: opendir %ld", path, (long) ret);
+				continue;
+			}
+			ret = s3_fuse_oper.readdir(path, &dc, countEntry, 0, &fi);
+			s3_fuse_oper.releasedir(path, &fi);
+			if( (ret != 0) || (dc.count < unlinkFiles[dir] / 2) ) {
+				fail("%s: readdir while unlinking found %ld",
+							path, dc.count);
+			}
+		}
+	}
+	return NULL;
+}
+
+/* files unlinked under lock-free readers; returns how many */
+static int unlinkWhileRead()
+{
+	s3_tree_node	*held;
+	struct stat	statbuf;
+	struct fuse_file_info	fi;
+	dir_count	dc;
+	char		path[1024];
+	uint64_t	ino[2] = { 0, 0 };
+	int		count = 0;
+	int		dir, i;
+
+	for( dir = 0; dir < 2; dir++ ) {
+		for( i = 0; i < unlinkFiles[dir]; i++ ) {
+			unlinkPath(dir, i, path);
+			if( putObject(path, i % NFILES) != 0 ) {
+				fail("%s: put %ld", path, -1);
+				return 0;
+			}
+		}
+
+		/* listed to the end, what it has is found without the lock */
+		sprintf(path, "/%s/unlink/d%d", bucket, dir);
+		memset(&dc, 0, sizeof(dc));
+		memset(&fi, 0, sizeof(fi));
+		if( (s3_fuse_oper.getattr(path, &statbuf) != 0)
+				|| (s3_fuse_oper.opendir(path, &fi) != 0) ) {
+			fail("%s: not found", path, 0);
+			goto ret;
+		}
+		s3_fuse_oper.readdir(path, &dc, countEntry, 0, &fi);
+		s3_fuse_oper.releasedir(path, &fi);
+		if( dc.count != unlinkFiles[dir] ) {
+			fail("%s: readdir found %ld", path, dc.count);
+			goto ret;
+		}
+
+		/* as the kernel would, so that no eviction drops it */
+		pthread_mutex_lock(&gS3TreeLock);
+		unlinkPath(dir, 0, path);
+		searchForPath(path, gS3DirectoryTree, &held);
+		if( held != NULL ) {
+			s3InodeRef(held);
+			ino[dir] = held->ino;
+		}
+		pthread_mutex_unlock(&gS3TreeLock);
+		if( ino[dir] == 0 ) {
+			fail("%s: not listed %ld", path, 0);
+			goto ret;
+		}
+	}
+
+	runThreads(threads, unlinkThread);
+
+	for( dir = 0; dir < 2; dir++ ) {
+		for( i = 1; i < unlinkFiles[dir]; i += 2 ) {
+			unlinkPath(dir, i, path);
+			if( s3_fuse_oper.getattr(path, &statbuf) != -ENOENT ) {
+				fail("%s: there after unlink %ld", path, 0);
+			}
+			count++;
+		}
+	}
+
+ret:
+	pthread_mutex_lock(&gS3TreeLock);
+	for( dir = 0; dir < 2; dir++ ) {
+		if( ino[dir] != 0 ) {
+			s3InodeForget(ino[dir], 1);
+		}
+	}
+	pthread_mutex_unlock(&gS3TreeLock);
+	return count;
+}
+
+int main(int argc, char **argv)
+{
+	struct s3_fuse_state	*state;
+	struct stat		statbuf;
+	char			path[2048];
+	char			cachedPath[4096];
+	FILE			*fp;
+	char			*buf;
+	int			i, ret;
+	int			warm = 0;
+
+	if( (argc > 1) && (strcmp(argv[1], "-w") == 0) ) {
+		warm = 1;
+		argc--;
+		argv++;
+	}
+	if( argc < 3 ) {
+		fprintf(stderr, "usage: tests3fuse [-w] <cache dir> <bucket> "
+					"[threads [iterations]]\n");
+		return 1;
+	}
+	if( argc > 3 ) {
+		threads = atoi(argv[3]);
+	}
+	if( argc > 4 ) {
+		iterations = atoi(argv[4]);
+	}
+	bucket = argv[2];
+
+	state = calloc(sizeof(struct s3_fuse_state), 1);
+	context.private_data = state;
+	state->logfile = log_open();
+
+	mkdir(argv[1], S_IRWXU);
+	cacheLocation = realpath(argv[1], NULL);
+	if( (cacheLocation == NULL)
+			|| (s3CacheInit(&(state->cache), cacheLocation) != 0)
+			|| (saveSecurityCredentials() != 0)
+			|| (saveExecuteDir() != 0)
+			|| (saveErasurePolicy() != 0)
+			|| (saveChunkStorePolicy() != 0)
+			|| (saveWriteBackPolicy() != 0)
+			|| (saveListPolicy() != 0)
+			|| (saveFillPolicy() != 0)
+			|| (saveRenamePolicy() != 0)
+			|| (saveRevalidatePolicy() != 0)
+			|| (saveNegativePolicy() != 0)
+			|| (saveSnapshotPolicy() != 0)
+			|| (saveScanPolicy() != 0)
+			|| (savePathCachePolicy() != 0)
+			|| (saveEvictPolicy() != 0)
+			|| (saveDeletePolicy() != 0) ) {
+		fprintf(stderr, "tests3fuse: setup failed\n");
+		return 1;
+	}
+
+	if( warm ) {
+		s3_fuse_oper.init(NULL);
+		s3_fuse_oper.getattr("/", &statbuf);
+		warmMount();
+		printf("warm: renamed from the snapshot\n");
+		s3_fuse_oper.destroy(state);
+		goto ret;
+	}
+
+	/* seed */
+	s3_fuse_oper.init(NULL);
+	s3_fuse_oper.getattr("/", &statbuf);
+	sprintf(path, "/%s", bucket);
+	if( s3_fuse_oper.mkdir(path, 0755) != 0 ) {
+		fprintf(stderr, "tests3fuse: cannot create bucket %s\n", bucket);
+		return 1;
+	}
+	for( i = 0; i < NFILES; i++ ) {
+		/* the second miss is answered without S3, create must
+		   forget it */
+		filePath(i, path);
+		if( (s3_fuse_oper.getattr(path, &statbuf) != -ENOENT)
+				|| (s3_fuse_oper.getattr(path, &statbuf) != -ENOENT) ) {
+			fail("%s: there before create %ld", path, 0);
+		}
+		writeFile(i, 0, 1);
+		ret = s3_fuse_oper.getattr(path, &statbuf);
+		if( ret != 0 ) {
+			fail("%s: getattr after create %ld", path, ret);
+		}
+	}
+	printf("seeded %d files\n", NFILES);
+
+	runThreads(threads, mixedThread);
+	printf("mixed: %d threads x %d operations\n", threads, iterations);
+
+	for( i = 0; i < NFILES; i++ ) {
+		syncFile(i);
+		filePath(i, path);
+		sprintf(cachedPath, "%s%s", cacheLocation, path);
+		expected[i] = malloc(FILE_SIZE);
+		fp = fopen(cachedPath, "rb");
+		if( fp == NULL || fread(expected[i], 1, FILE_SIZE, fp) != FILE_SIZE ) {
+			fail("%s: cached copy missing, %ld", path, 0);
+		}
+		if( fp != NULL ) {
+			fclose(fp);
+		}
+		unlink(cachedPath);
+	}
+
+	runThreads(threads, refetchThread);
+	printf("refetch: %d threads x %d files\n", threads, NFILES);
+
+	/* objects put behind s3fs' back are plain, and read while the
+	   background fill is still bringing them in */
+	for( i = 0; i < NFILES; i++ ) {
+		plainPath(i, path);
+		if( putPlain(i) != 0 ) {
+			fail("%s: put %ld", path, -1);
+		}
+	}
+	sprintf(path, "/%s/plain", bucket);
+	if( s3_fuse_oper.getattr(path, &statbuf) != 0 ) {
+		fail("%s: not found", path, 0);
+	}
+	runThreads(threads, streamThread);
+	printf("stream: %d threads x %d reads\n", threads, iterations);
+
+	sprintf(path, "/%s/moved", bucket);
+	if( s3_fuse_oper.mkdir(path, 0755) != 0 ) {
+		fail("%s: mkdir %ld", path, 0);
+	}
+	runThreads(threads, renameThread);
+
+	/* a directory, and what is in it, goes along */
+	sprintf(path, "/%s/plain", bucket);
+	sprintf(cachedPath, "/%s/renamed", bucket);
+	if( s3_fuse_oper.rename(path, cachedPath) != 0 ) {
+		fail("%s: rename %ld", path, 0);
+	}
+	buf = malloc(FILE_SIZE + 1);
+	for( i = 0; i < NFILES; i++ ) {
+		sprintf(path, "/%s/renamed/p%02d.bin", bucket, i);
+		ret = readPath(path, i, buf);
+		if( ret != FILE_SIZE || memcmp(buf, expected[i], FILE_SIZE) ) {
+			fail("%s: renamed with its directory, %ld bytes",
+								path, ret);
+		}
+	}
+	free(buf);
+	printf("rename: %d threads x %d files, and a directory\n", threads,
+								NFILES);
+	ret = replaceEncoded();
+	printf("rename: over an encoded file of %d keys\n", ret);
+	ret = chunkedRoundTrip();
+	printf("chunked: %d chunks kept over a rewrite\n", ret);
+
+	ret = scanBucket();
+	printf("scan: %d keys in ranges at once\n", ret);
+
+	printf("evict: %lu nodes of cold directories dropped\n",
+					(unsigned long) evictCold());
+
+	ret = deleteMany();
+	printf("delete: %d keys of a directory in batches\n", ret);
+
+	ret = unlinkWhileRead();
+	printf("unlink: %d files under %d lock-free readers\n", ret,
+								threads - 1);
+
+	if( getenv("S3_LIST_TTL") != NULL && atoi(getenv("S3_LIST_TTL")) > 0 ) {
+		revalidateDir(atoi(getenv("S3_LIST_TTL")));
+		printf("revalidate: a put and a delete behind our back\n");
+	}
+
+	s3_fuse_oper.destroy(state);
+
+ret:
+	if( failures != 0 ) {
+		printf("FAILED: %d failures\n", failures);
+		return 1;
+	}
+	printf("PASSED\n");
+	return 0;
+}
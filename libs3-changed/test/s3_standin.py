@@ -0,0 +1,243 @@
+#!/usr/bin/env python3
+#
+# Minimal local S3 stand-in for tests: path-style buckets and objects kept
+# in memory, enough of the API for s3fs (list service, list bucket with
+# prefix/marker/delimiter/max-keys, create/delete bucket, get/head/put/
+# delete object with Range and If-Match, copy object, get versioning,
+# multi-object delete).  Requests are served by one thread each and
+# signatures are not checked.
+#
+# usage: s3_standin.py [port]     port 0 (the default) picks a free one;
+#                                 the port is printed on the first line
+
+import sys
+import threading
+import time
+from base64 import b64encode
+from hashlib import md5
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import urlsplit, parse_qs, unquote_plus
+from xml.etree import ElementTree
+from xml.sax.saxutils import escape
+
+buckets = {}            # name -> { key -> (data, mtime) }
+lock = threading.Lock()
+
+
+def iso(t):
+    return time.strftime("%Y-%m-%dT%H:%M:%S.000Z", time.gmtime(t))
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, fmt, *args):
+        pass
+
+    def split(self):
+        url = urlsplit(self.path)
+        parts = url.path.lstrip("/").split("/", 1)
+        # libs3 sends a space in a key as '+', which S3 takes as a space
+        bucket = unquote_plus(parts[0])
+        key = unquote_plus(parts[1]) if len(parts) > 1 else ""
+        return bucket, key, parse_qs(url.query, keep_blank_values=True)
+
+    def reply(self, status, body=b"", headers=None):
+        self.send_response(status)
+        for name, value in (headers or {}).items():
+            self.send_header(name, value)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        if self.command != "HEAD":
+            self.wfile.write(body)
+
+    def error(self, status, code):
+        body = ("<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+                "<Error><Code>%s</Code><Message>%s</Message></Error>"
+                % (code, code)).encode()
+        self.reply(status, body, {"Content-Type": "application/xml"})
+
+    def body(self):
+        length = int(self.headers.get("Content-Length", 0))
+        return self.rfile.read(length) if length else b""
+
+    def list_service(self):
+        with lock:
+            names = sorted(buckets)
+        xml = ["<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+               "<ListAllMyBucketsResult><Owner><ID>standin</ID>"
+               "<DisplayName>standin</DisplayName></Owner><Buckets>"]
+        for name in names:
+            xml.append("<Bucket><Name>%s</Name><CreationDate>%s"
+                       "</CreationDate></Bucket>" % (escape(name), iso(0)))
+        xml.append("</Buckets></ListAllMyBucketsResult>")
+        self.reply(200, "".join(xml).encode())
+
+    def list_bucket(self, bucket, query):
+        prefix = query.get("prefix", [""])[0]
+        marker = query.get("marker", [""])[0]
+        delimiter = query.get("delimiter", [""])[0]
+        maxkeys = int(query.get("max-keys", ["1000"])[0] or 1000)
+        with lock:
+            objects = sorted(buckets[bucket].items())
+        contents, prefixes, truncated, last = [], [], False, None
+        for key, (data, mtime) in objects:
+            if not key.startswith(prefix) or key <= marker:
+                continue
+            rest = key[len(prefix):]
+            common = None
+            if delimiter and delimiter in rest:
+                common = prefix + rest.split(delimiter, 1)[0] + delimiter
+                # a prefix is returned once, and not again after it
+                # has been the marker
+                if common <= marker or common in prefixes:
+                    continue
+            if len(contents) + len(prefixes) == maxkeys:
+                truncated = True
+                break
+            if common is not None:
+                prefixes.append(common)
+                last = common
+                continue
+            contents.append((key, data, mtime))
+            last = key
+        xml = ["<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+               "<ListBucketResult><Name>%s</Name><Prefix>%s</Prefix>"
+               "<Marker>%s</Marker><MaxKeys>%d</MaxKeys>"
+               "<IsTruncated>%s</IsTruncated>"
+               % (escape(bucket), escape(prefix), escape(marker), maxkeys,
+                  "true" if truncated else "false")]
+        if truncated and last is not None:
+            xml.append("<NextMarker>%s</NextMarker>" % escape(last))
+        for key, data, mtime in contents:
+            xml.append("<Contents><Key>%s</Key><LastModified>%s"
+                       "</LastModified><ETag>\"%s\"</ETag><Size>%d</Size>"
+                       "<Owner><ID>standin</ID><DisplayName>standin"
+                       "</DisplayName></Owner><StorageClass>STANDARD"
+                       "</StorageClass></Contents>"
+                       % (escape(key), iso(mtime), md5(data).hexdigest(),
+                          len(data)))
+        for common in prefixes:
+            xml.append("<CommonPrefixes><Prefix>%s</Prefix></CommonPrefixes>"
+                       % escape(common))
+        xml.append("</ListBucketResult>")
+        self.reply(200, "".join(xml).encode())
+
+    def do_GET(self):
+        bucket, key, query = self.split()
+        if not bucket:
+            return self.list_service()
+        with lock:
+            objects = buckets.get(bucket)
+            found = objects.get(key) if objects is not None and key else None
+        if objects is None:
+            return self.error(404, "NoSuchBucket")
+        if not key:
+            if "versioning" in query:
+                return self.reply(200, b"<?xml version=\"1.0\" encoding="
+                                  b"\"UTF-8\"?><VersioningConfiguration/>")
+            return self.list_bucket(bucket, query)
+        if found is None:
+            return self.error(404, "NoSuchKey")
+        data, mtime = found
+        etag = "\"%s\"" % md5(data).hexdigest()
+        match = self.headers.get("If-Match")
+        if match is not None and match != etag:
+            return self.error(412, "PreconditionFailed")
+        status = 200
+        ranges = self.headers.get("Range")
+        if ranges is not None and ranges.startswith("bytes="):
+            first, last = ranges[len("bytes="):].split("-")
+            last = int(last) if last else len(data) - 1
+            data = data[int(first):last + 1]
+            status = 206
+        self.reply(status, data, {
+            "ETag": etag,
+            "Last-Modified": time.strftime("%a, %d %b %Y %H:%M:%S GMT",
+                                           time.gmtime(mtime)),
+            "Content-Type": "application/octet-stream"})
+
+    do_HEAD = do_GET
+
+    def do_PUT(self):
+        bucket, key, query = self.split()
+        data = self.body()
+        with lock:
+            if not key:
+                buckets.setdefault(bucket, {})
+                return self.reply(200)
+            if bucket not in buckets:
+                return self.error(404, "NoSuchBucket")
+            source = self.headers.get("x-amz-copy-source")
+            if source is not None:
+                return self.copy(bucket, key, unquote_plus(source))
+            buckets[bucket][key] = (data, time.time())
+        self.reply(200, b"", {"ETag": "\"%s\"" % md5(data).hexdigest()})
+
+    # called with lock held
+    def copy(self, bucket, key, source):
+        source_bucket, _, source_key = source.lstrip("/").partition("/")
+        found = buckets.get(source_bucket, {}).get(source_key)
+        if found is None:
+            return self.error(404, "NoSuchKey")
+        data, mtime = found[0], time.time()
+        buckets[bucket][key] = (data, mtime)
+        self.reply(200, ("<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+                         "<CopyObjectResult><LastModified>%s</LastModified>"
+                         "<ETag>\"%s\"</ETag></CopyObjectResult>"
+                         % (iso(mtime), md5(data).hexdigest())).encode())
+
+    def do_DELETE(self):
+        bucket, key, query = self.split()
+        with lock:
+            if bucket not in buckets:
+                return self.error(404, "NoSuchBucket")
+            if not key:
+                if buckets[bucket]:
+                    return self.error(409, "BucketNotEmpty")
+                del buckets[bucket]
+            else:
+                buckets[bucket].pop(key, None)
+        self.reply(204)
+
+    def do_POST(self):
+        bucket, key, query = self.split()
+        data = self.body()
+        if key or "delete" not in query:
+            return self.error(405, "MethodNotAllowed")
+        if self.headers.get("Content-MD5") != b64encode(md5(data).digest()
+                                                        ).decode():
+            return self.error(400, "InvalidDigest")
+        try:
+            request = ElementTree.fromstring(data)
+        except ElementTree.ParseError:
+            return self.error(400, "MalformedXML")
+        objects = request.findall("Object")
+        if not objects or len(objects) > 1000:
+            return self.error(400, "MalformedXML")
+        quiet = request.findtext("Quiet") == "true"
+        xml = ["<?xml version=\"1.0\" encoding=\"UTF-8\"?><DeleteResult>"]
+        with lock:
+            if bucket not in buckets:
+                return self.error(404, "NoSuchBucket")
+            for item in objects:
+                name = item.findtext("Key")
+                buckets[bucket].pop(name, None)
+                if not quiet:
+                    xml.append("<Deleted><Key>%s</Key></Deleted>"
+                               % escape(name))
+        xml.append("</DeleteResult>")
+        self.reply(200, "".join(xml).encode(),
+                   {"Content-Type": "application/xml"})
+
+
+def main():
+    port = int(sys.argv[1]) if len(sys.argv) > 1 else 0
+    server = ThreadingHTTPServer(("127.0.0.1", port), Handler)
+    server.daemon_threads = True
+    print(server.server_address[1], flush=True)
+    server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,73 @@
+#!/bin/sh
+
+# Multi-threaded stress test of the s3fs handlers against a local S3
+# stand-in; build it first with "make stress".
+#
+# Environment:
+# TESTS3FUSE - may be set to the tests3fuse binary to use; defaults to
+#              build/bin/tests3fuse
+# THREADS - number of threads, defaults to 8
+# ITERATIONS - operations per thread in the mixed phase, defaults to 200
+#
+# Runs once uploading on close, mounts that bucket again from the tree
+# snapshot, and runs once with write-back.
+
+TEST_DIR=$(cd "$(dirname "$0")" && pwd)
+
+if [ -z "$TESTS3FUSE" ]; then
+    TESTS3FUSE=$TEST_DIR/../build/bin/tests3fuse
+fi
+TESTS3FUSE=$(cd "$(dirname "$TESTS3FUSE")" && pwd)/$(basename "$TESTS3FUSE")
+
+WORK_DIR=$(mktemp -d /tmp/s3stressXXXXXX)
+trap 'kill $STANDIN_PID 2>/dev/null; rm -rf $WORK_DIR' EXIT
+
+# Start the stand-in and wait for its port
+python3 $TEST_DIR/s3_standin.py > $WORK_DIR/port &
+STANDIN_PID=$!
+while [ ! -s $WORK_DIR/port ]; do
+    sleep 0.1
+done
+
+export S3_HOSTNAME=127.0.0.1:$(cat $WORK_DIR/port)
+export S3_PROTOCOL=http
+export S3_ACCESS_KEY_ID=standin
+export S3_SECRET_ACCESS_KEY=standin
+
+# 4k blocks, so the 64k plain objects of the stream phase are filled in
+# several pieces while they are read
+export S3_FILL_BLOCK_KB=4
+
+# 3 keys a page, so every directory is listed in several pages while
+# it is read
+export S3_LIST_PAGE_KEYS=3
+
+# Key scans of 2 keys a page, so a directory rename or delete is
+# listed in many ranges at once
+export S3_SCAN_PAGE_KEYS=2
+
+# 16 paths kept, so the path cache replaces its entries all the time
+export S3_PATH_CACHE_ENTRIES=16
+
+# A tree of 64 nodes, so cold directories are evicted while they are
+# used around them
+export S3_TREE_MEMORY_KB=16
+
+# Listings expire after a second, so directories are re-listed in the
+# background while they are written
+export S3_LIST_TTL=1
+
+# A small 4+2 stripe, so every file spans several
+cd $WORK_DIR
+printf "4\n2\nreed_sol_van\n8\n16\n4096\nnone\n" > erasure_policy
+
+echo "$TESTS3FUSE cache stressbucket ${THREADS:-8} ${ITERATIONS:-200}"
+$TESTS3FUSE cache stressbucket ${THREADS:-8} ${ITERATIONS:-200} || exit 1
+
+# A second mount over the first one's cache, from its tree snapshot
+echo "S3_LIST_TTL=0 $TESTS3FUSE -w cache stressbucket"
+S3_LIST_TTL=0 $TESTS3FUSE -w cache stressbucket || exit 1
+
+echo "S3_WRITE_BACK=1 $TESTS3FUSE wbcache wbbucket ${THREADS:-8} ${ITERATIONS:-200}"
+S3_WRITE_BACK=1 S3_WRITE_BACK_DELAY=1 \
+    $TESTS3FUSE wbcache wbbucket ${THREADS:-8} ${ITERATIONS:-200}
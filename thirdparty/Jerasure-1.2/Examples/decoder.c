@@ -50,6 +50,7 @@ same arguments, and encoder.c does error check.
 #include "galois.h"
 #include "cauchy.h"
 #include "liberation.h"
+#include "stripe_pool.h"
 
 #define N 10
 
@@ -57,14 +58,23 @@ enum Coding_Technique {Reed_Sol_Van, Reed_Sol_R6_Op, Cauchy_Orig, Cauchy_Good, L
 
 //char *Methods[N] = {"reed_sol_van", "reed_sol_r6_op", "cauchy_orig", "cauchy_good", "liberation", "blaum_roth", "liber8tion", "rdp", "evenodd", "no_coding"};
 
-/* Global variables for signal handler */
-enum Coding_Technique method;
-int readins, n;
+/* Global variables for signal handler, defined in encoder.c */
+extern __thread enum Coding_Technique method;
+extern __thread int readins, n;
 
 /* Function prototype */
 void ctrl_bs_handler(int dummy);
+int decode_in_dir(const char *workdir, int argc, char **argv);
 
+/* decode() works in the current directory, decode_in_dir() under workdir */
 int decode (int argc, char **argv) {
+	char curdir[1000];
+
+	getcwd(curdir, 1000);
+	return decode_in_dir(curdir, argc, argv);
+}
+
+int decode_in_dir (const char *workdir, int argc, char **argv) {
 	FILE *fp;				// File pointer
 
 	/* Jerasure arguments */
@@ -74,6 +84,7 @@ int decode (int argc, char **argv) {
 	int *erased;
 	int *matrix;
 	int *bitmatrix;
+	stripe_buf *stripe;
 	
 	/* Parameters */
 	int k, m, w, packetsize, buffersize;
@@ -115,11 +126,11 @@ int decode (int argc, char **argv) {
 		fprintf(stderr, "usage: inputfile\n");
 		exit(0);
 	}
-	curdir = (char *)malloc(sizeof(char)*1000);
-	getcwd(curdir, 1000);
+	curdir = (char *)malloc(sizeof(char)*(strlen(workdir)+1));
+	strcpy(curdir, workdir);
 	fprintf(stderr, "curdir : %s\n", curdir);	
 	/* Begin recreation of file names */
-	cs1 = (char*)malloc(sizeof(char)*strlen(argv[1]));
+	cs1 = (char*)malloc(sizeof(char)*(strlen(argv[1])+1));
 	cs2 = strrchr(argv[1], '/');
 	if (cs2 != NULL) {
 		fprintf(stderr, "slash in argv\n");	
@@ -134,10 +145,10 @@ int decode (int argc, char **argv) {
 	if (cs2 != NULL) {
 		*cs2 = '\0';
 	}	
-	cs2 = (char*)malloc(sizeof(char)*strlen(argv[1]));
+	cs2 = (char*)malloc(sizeof(char)*(strlen(argv[1])+1));
 	fname = strchr(argv[1], '.');
 	strcpy(cs2, fname);
-	fname = (char *)malloc(sizeof(char*)*(1000+strlen(argv[1])+10));
+	fname = (char *)malloc(sizeof(char*)*(strlen(curdir)+strlen(argv[1])+10));
 
 	/* Read in parameters from metadata file */
 	sprintf(fname, "%s/Coding/%s_meta.txt", curdir, cs1);
@@ -145,7 +156,9 @@ int decode (int argc, char **argv) {
 	fprintf(stderr, "fname =%s\n", fname); 
 	fp = fopen(fname, "rb");
 	temp = (char *)malloc(sizeof(char)*(strlen(argv[1])+1000));
-	fscanf(fp, "%s", temp);	
+	/* the first line is the file name, which may have spaces in it */
+	while (((i = getc(fp)) != EOF) && (i != '\n'))
+		;
 	
 	if (fscanf(fp, "%d", &origsize) != 1) {
 		fprintf(stderr, "Original size is not valid\n");
@@ -170,14 +183,20 @@ int decode (int argc, char **argv) {
 
 	data = (char **)malloc(sizeof(char *)*k);
 	coding = (char **)malloc(sizeof(char *)*m);
+	stripe = NULL;
 	if (buffersize != origsize) {
+		blocksize = buffersize/k;
+		stripe = stripe_pool_get(k, m, blocksize);
+		if (stripe == NULL) {
+			fprintf(stderr, "Unable to allocate stripe buffers.\n");
+			exit(0);
+		}
 		for (i = 0; i < k; i++) {
-			data[i] = (char *)malloc(sizeof(char)*(buffersize/k));
+			data[i] = stripe->data[i];
 		}
 		for (i = 0; i < m; i++) {
-			coding[i] = (char *)malloc(sizeof(char)*(buffersize/k));
+			coding[i] = stripe->coding[i];
 		}
-		blocksize = buffersize/k;
 	}
 
 	sprintf(temp, "%d", k);
@@ -242,7 +261,14 @@ int decode (int argc, char **argv) {
 				if (buffersize == origsize) {
 					stat(fname, &status);
 					blocksize = status.st_size;
-					data[i-1] = (char *)malloc(sizeof(char)*blocksize);
+					if (stripe == NULL) {
+						stripe = stripe_pool_get(k, m, blocksize);
+						if (stripe == NULL) {
+							fprintf(stderr, "Unable to allocate stripe buffers.\n");
+							exit(0);
+						}
+					}
+					data[i-1] = stripe->data[i-1];
 					fread(data[i-1], sizeof(char), blocksize, fp);
 				}
 				else {
@@ -265,7 +291,14 @@ int decode (int argc, char **argv) {
 				if (buffersize == origsize) {
 					stat(fname, &status);
 					blocksize = status.st_size;
-					coding[i-1] = (char *)malloc(sizeof(char)*blocksize);
+					if (stripe == NULL) {
+						stripe = stripe_pool_get(k, m, blocksize);
+						if (stripe == NULL) {
+							fprintf(stderr, "Unable to allocate stripe buffers.\n");
+							exit(0);
+						}
+					}
+					coding[i-1] = stripe->coding[i-1];
 					fread(coding[i-1], sizeof(char), blocksize, fp);
 				}
 				else {
@@ -279,10 +312,10 @@ int decode (int argc, char **argv) {
 		if (n == 1) {
 			for (i = 0; i < numerased; i++) {
 				if (erasures[i] < k) {
-					data[erasures[i]] = (char *)malloc(sizeof(char)*blocksize);
+					data[erasures[i]] = stripe->data[erasures[i]];
 				}
 				else {
-					coding[erasures[i]-k] = (char *)malloc(sizeof(char)*blocksize);
+					coding[erasures[i]-k] = stripe->coding[erasures[i]-k];
 				}
 			}
 		}
@@ -354,6 +387,7 @@ int decode (int argc, char **argv) {
 	free(fname);
 	free(data);
 	free(coding);
+	stripe_pool_put(stripe);
 	free(erasures);
 	free(erased);
 	
@@ -367,6 +401,7 @@ int decode (int argc, char **argv) {
 	tsec -= t1.tv_sec;
 	printf("Decoding (MB/sec): %0.10f\n", (origsize/1024/1024)/totalsec);
 	printf("De_Total (MB/sec): %0.10f\n\n", (origsize/1024/1024)/tsec);
+	return 0;
 }	
 
 /*
@@ -0,0 +1,102 @@
+/* Examples/ec_bench.c
+
+Encode throughput of the generic jerasure_matrix_encode() path against
+the generated rs_kernels for every geometry rs_kernel_lookup() knows
+about.  The coding blocks of both paths are compared before timing.
+
+usage: ec_bench [blocksize [iterations]]
+*/
+
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jerasure.h"
+#include "reed_sol.h"
+#include "rs_kernels.h"
+#include "stripe_pool.h"
+
+#define talloc(type, num) (type *) malloc(sizeof(type)*(num))
+
+static int geometries[][2] = { { 4, 2 }, { 6, 3 }, { 10, 4 }, { 20, 4 } };
+
+static double now()
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+int main(int argc, char **argv)
+{
+	int blocksize = 65536;
+	int iterations = 200;
+	int g, i, j, k, m, w = 8;
+	int *matrix;
+	char **check;
+	stripe_buf *stripe;
+	rs_encode_kernel kernel;
+	double t0, generic, special, mb;
+
+	if (argc > 1 && (sscanf(argv[1], "%d", &blocksize) != 1 || blocksize <= 0
+				|| blocksize % sizeof(long) != 0)) {
+		fprintf(stderr, "usage: ec_bench [blocksize [iterations]] - blocksize must be a multiple of %d\n",
+			(int) sizeof(long));
+		exit(1);
+	}
+	if (argc > 2 && (sscanf(argv[2], "%d", &iterations) != 1 || iterations <= 0)) {
+		fprintf(stderr, "usage: ec_bench [blocksize [iterations]]\n");
+		exit(1);
+	}
+
+	srand48(1);
+	printf("%-8s %12s %12s %8s\n", "k+m", "generic MB/s", "kernel MB/s", "speedup");
+	for (g = 0; g < (int) (sizeof(geometries) / sizeof(geometries[0])); g++) {
+		k = geometries[g][0];
+		m = geometries[g][1];
+
+		matrix = reed_sol_vandermonde_coding_matrix(k, m, w);
+		kernel = rs_kernel_lookup(k, m, w, matrix);
+		if (kernel == NULL) {
+			fprintf(stderr, "no kernel for k=%d m=%d w=%d\n", k, m, w);
+			exit(1);
+		}
+
+		stripe = stripe_pool_get(k, m, blocksize);
+		check = talloc(char *, m);
+		for (i = 0; i < k*blocksize; i++) stripe->block[i] = (char) lrand48();
+		for (j = 0; j < m; j++) check[j] = talloc(char, blocksize);
+
+		jerasure_matrix_encode(k, m, w, matrix, stripe->data, check, blocksize);
+		kernel(stripe->data, stripe->coding, blocksize);
+		for (j = 0; j < m; j++) {
+			if (memcmp(check[j], stripe->coding[j], blocksize) != 0) {
+				fprintf(stderr, "k=%d m=%d: kernel disagrees with jerasure_matrix_encode on coding block %d\n",
+					k, m, j);
+				exit(1);
+			}
+		}
+
+		t0 = now();
+		for (i = 0; i < iterations; i++) {
+			jerasure_matrix_encode(k, m, w, matrix, stripe->data, stripe->coding, blocksize);
+		}
+		generic = now() - t0;
+
+		t0 = now();
+		for (i = 0; i < iterations; i++) {
+			kernel(stripe->data, stripe->coding, blocksize);
+		}
+		special = now() - t0;
+
+		mb = (double) k * blocksize * iterations / (1024.0 * 1024.0);
+		printf("%2d+%-5d %12.1f %12.1f %7.2fx\n", k, m, mb / generic, mb / special, generic / special);
+
+		for (j = 0; j < m; j++) free(check[j]);
+		free(check);
+		free(matrix);
+		stripe_pool_put(stripe);
+	}
+	return 0;
+}
@@ -53,6 +53,8 @@ is the file name with "_k#" or "_m#" and then the extension.
 #include "galois.h"
 #include "cauchy.h"
 #include "liberation.h"
+#include "stripe_pool.h"
+#include "rs_kernels.h"
 
 #define N 10
 
@@ -60,13 +62,15 @@ enum Coding_Technique {Reed_Sol_Van, Reed_Sol_R6_Op, Cauchy_Orig, Cauchy_Good, L
 
 char *Methods[N] = {"reed_sol_van", "reed_sol_r6_op", "cauchy_orig", "cauchy_good", "liberation", "blaum_roth", "liber8tion", "no_coding"};
 
-/* Global variables for signal handler */
-int readins, n;
-enum Coding_Technique method;
+/* Global variables for signal handler, per thread so that several
+   encodes can run at once */
+__thread int readins, n;
+__thread enum Coding_Technique method;
 
 /* Function prototypes */
 int is_prime(int w);
 void ctrl_bs_handler(int dummy);
+int encode_in_dir(const char *workdir, int argc, char **argv);
 
 int jfread(void *ptr, int size, int nmembers, FILE *stream)
 {
@@ -81,7 +85,16 @@ int jfread(void *ptr, int size, int nmembers, FILE *stream)
 }
 
 
+/* encode() works in the current directory; encode_in_dir() writes the
+   Coding directory under workdir instead, so callers do not need chdir() */
 int encode (int argc, char **argv) {
+	char curdir[1000];
+
+	getcwd(curdir, 1000);
+	return encode_in_dir(curdir, argc, argv);
+}
+
+int encode_in_dir (const char *workdir, int argc, char **argv) {
 	FILE *fp, *fp2;				// file pointers
 	char *memblock;				// reading in file
 	char *block;				// padding file
@@ -100,6 +113,8 @@ int encode (int argc, char **argv) {
 	/* Jerasure Arguments */
 	char **data;				
 	char **coding;
+	stripe_buf *stripe;
+	rs_encode_kernel rsKernel;		/* specialized Reed_Sol_Van encoder, if any */
 	int *matrix;
 	int *bitmatrix;
 	int **schedule;
@@ -131,6 +146,7 @@ int encode (int argc, char **argv) {
 	totalsec = 0.0;
 	matrix = NULL;
 	bitmatrix = NULL;
+	rsKernel = NULL;
 	schedule = NULL;
 	
 	/* Error check Arguments*/
@@ -310,9 +326,9 @@ int encode (int argc, char **argv) {
 	/* Set global variable method for signal handler */
 	method = tech;
 
-	/* Get current working directory for construction of file names */
-	curdir = (char*)malloc(sizeof(char)*1000);	
-	getcwd(curdir, 1000);
+	/* Working directory for construction of file names */
+	curdir = (char*)malloc(sizeof(char)*(strlen(workdir)+1));
+	strcpy(curdir, workdir);
 
         if (argv[1][0] != '-') {
 
@@ -324,7 +340,10 @@ int encode (int argc, char **argv) {
 		}
 	
 		/* Create Coding directory */
-		i = mkdir("Coding", S_IRWXU);
+		fname = (char*)malloc(sizeof(char)*(strlen(curdir)+10));
+		sprintf(fname, "%s/Coding", curdir);
+		i = mkdir(fname, S_IRWXU);
+		free(fname);
 		if (i == -1 && errno != EEXIST) {
 			fprintf(stderr, "Unable to create Coding directory.\n");
 			exit(0);
@@ -375,13 +394,11 @@ int encode (int argc, char **argv) {
 		else {
 			readins = newsize/buffersize;
 		}
-		block = (char *)malloc(sizeof(char)*buffersize);
 		blocksize = buffersize/k;
 	}
 	else {
 		readins = 1;
 		buffersize = size;
-		block = (char *)malloc(sizeof(char)*newsize);
 	}
 	
 	/* Break inputfile name into the filename and extension */	
@@ -404,17 +421,21 @@ int encode (int argc, char **argv) {
 		strcpy(s2, fname);
 	}
 	
-	/* Allocate for full file name */
-	fname = (char*)malloc(sizeof(char)*(strlen(argv[1])+strlen(curdir)+10));
 	sprintf(temp, "%d", k);
 	md = strlen(temp);
+
+	/* Allocate for full file name */
+	fname = (char*)malloc(sizeof(char)*(strlen(argv[1])+strlen(curdir)+strlen("/Coding/_meta.txt")+md+10));
 	
-	/* Allocate data and coding */
-	data = (char **)malloc(sizeof(char*)*k);
-	coding = (char **)malloc(sizeof(char*)*m);
-	for (i = 0; i < m; i++) {
-		coding[i] = (char *)malloc(sizeof(char)*blocksize);
+	/* Check data and coding out of the stripe pool */
+	stripe = stripe_pool_get(k, m, blocksize);
+	if (stripe == NULL) {
+		fprintf(stderr, "Unable to allocate stripe buffers.\n");
+		exit(0);
 	}
+	block = stripe->block;
+	data = stripe->data;
+	coding = stripe->coding;
 
 	
 	/* Create coding matrix or bitmatrix and schedule */
@@ -424,6 +445,7 @@ int encode (int argc, char **argv) {
 			break;
 		case Reed_Sol_Van:
 			matrix = reed_sol_vandermonde_coding_matrix(k, m, w);
+			rsKernel = rs_kernel_lookup(k, m, w, matrix);
 			break;
 		case Cauchy_Orig:
 			matrix = cauchy_original_coding_matrix(k, m, w);
@@ -481,18 +503,18 @@ int encode (int argc, char **argv) {
 		}
 	
 			
-		/* Set pointers to point to file data */
-		for (i = 0; i < k; i++) {
-			data[i] = block+(i*blocksize);
-		}
-
 	gettimeofday(&t3, &tz);
 		/* Encode according to coding method */
 		switch(tech) {	
 			case No_Coding:
 				break;
 			case Reed_Sol_Van:
-				jerasure_matrix_encode(k, m, w, matrix, data, coding, blocksize);
+				if (rsKernel != NULL) {
+					rsKernel(data, coding, blocksize);
+				}
+				else {
+					jerasure_matrix_encode(k, m, w, matrix, data, coding, blocksize);
+				}
 				break;
 			case Reed_Sol_R6_Op:
 				reed_sol_r6_encode(k, w, data, coding, blocksize);
@@ -581,7 +603,7 @@ int encode (int argc, char **argv) {
 	free(s2);
 	free(s1);
 	free(fname);
-	free(block);
+	stripe_pool_put(stripe);
 	free(curdir);
 	
 	/* Calculate rate in MB/sec and print */
@@ -594,6 +616,7 @@ int encode (int argc, char **argv) {
 	tsec -= t1.tv_sec;
 	printf("Encoding (MB/sec): %0.10f\n", (size/1024/1024)/totalsec);
 	printf("En_Total (MB/sec): %0.10f\n", (size/1024/1024)/tsec);
+	return 0;
 }
 
 /* is_prime returns 1 if number if prime, 0 if not prime */
@@ -1,4 +1,6 @@
 
 extern int encode (int argc, char **argv) ;
 extern int decode (int argc, char **argv) ;
+extern int encode_in_dir (const char *workdir, int argc, char **argv) ;
+extern int decode_in_dir (const char *workdir, int argc, char **argv) ;
 
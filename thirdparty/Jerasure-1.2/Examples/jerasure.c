@@ -39,9 +39,10 @@ plank@cs.utk.edu
 
 #define talloc(type, num) (type *) malloc(sizeof(type)*(num))
 
-static double jerasure_total_xor_bytes = 0;
-static double jerasure_total_gf_bytes = 0;
-static double jerasure_total_memcpy_bytes = 0;
+/* per thread: jerasure_get_stats() reports the calling thread's work */
+static __thread double jerasure_total_xor_bytes = 0;
+static __thread double jerasure_total_gf_bytes = 0;
+static __thread double jerasure_total_memcpy_bytes = 0;
 
 void jerasure_print_matrix(int *m, int rows, int cols, int w)
 {
@@ -0,0 +1,24 @@
+/* Examples/rs_kernels.h
+
+Specialized Reed-Solomon Vandermonde encode kernels.
+
+rs_kernels.c is generated by rs_kernels_gen for the geometries listed
+in rs_kernels_gen.c (w = 8 only).  Each kernel has k, m and the coding
+matrix baked in, so the per-row 0/1 checks, the w switch and the loop
+bounds of jerasure_matrix_dotprod() all disappear.
+
+rs_kernel_lookup() is called once, when the coding matrix is created.
+It returns NULL unless (k, m, w) is a generated geometry and the matrix
+is exactly the one the kernel was generated from; callers then fall
+back to jerasure_matrix_encode().
+*/
+
+#ifndef _RS_KERNELS_H
+#define _RS_KERNELS_H
+
+/* size must be a multiple of sizeof(long), as for jerasure_matrix_encode() */
+typedef void (*rs_encode_kernel)(char **data_ptrs, char **coding_ptrs, int size);
+
+extern rs_encode_kernel rs_kernel_lookup(int k, int m, int w, int *matrix);
+
+#endif
@@ -0,0 +1,190 @@
+/* Examples/rs_kernels_gen.c
+
+Generates rs_kernels.c: fully unrolled Reed-Solomon Vandermonde encode
+kernels for the (k, m) geometries we deploy, at w = 8.
+
+For each geometry the generator builds the coding matrix with
+reed_sol_vandermonde_coding_matrix() and emits:
+
+  - a copy of the matrix, so rs_kernel_lookup() can check that the
+    caller's matrix is the one the kernel was generated from,
+  - one word-wide XOR loop for every row whose coefficients are all 1
+    (the first row of a Vandermonde coding matrix),
+  - one byte loop computing every other row in a single pass over the
+    data, with each coefficient turned into a lookup in a static
+    256-entry multiplication table; coefficients of 1 become a plain
+    XOR and coefficients of 0 are dropped.
+
+Usage: rs_kernels_gen > rs_kernels.c
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jerasure.h"
+#include "reed_sol.h"
+#include "galois.h"
+
+#define W 8
+
+static struct {
+	int k;
+	int m;
+} geometries[] = {
+	{ 4, 2 },
+	{ 6, 3 },
+	{ 10, 4 },
+	{ 20, 4 },
+};
+
+#define NGEOMETRIES ((int) (sizeof(geometries) / sizeof(geometries[0])))
+
+static int *matrices[NGEOMETRIES];
+static int used[256];
+
+static int row_all_ones(int *row, int k)
+{
+	int i;
+
+	for (i = 0; i < k; i++) {
+		if (row[i] != 1) return 0;
+	}
+	return 1;
+}
+
+static void emit_tables()
+{
+	int c, x;
+
+	for (c = 2; c < 256; c++) {
+		if (!used[c]) continue;
+		printf("static const unsigned char gf08_mul_%d[256] = {", c);
+		for (x = 0; x < 256; x++) {
+			if (x % 16 == 0) printf("\n\t");
+			printf("%d%s", galois_single_multiply(c, x, W), (x == 255) ? "" : ", ");
+		}
+		printf("\n};\n\n");
+	}
+}
+
+static void emit_kernel(int k, int m, int *matrix)
+{
+	int i, j, first, ones, others;
+	int *row;
+
+	printf("static int rs_matrix_w08_k%d_m%d[%d] = {", k, m, k*m);
+	for (i = 0; i < k*m; i++) {
+		if (i % k == 0) printf("\n\t");
+		printf("%d%s", matrix[i], (i == k*m-1) ? "" : ", ");
+	}
+	printf("\n};\n\n");
+
+	printf("static void rs_encode_w08_k%d_m%d(char **data_ptrs, char **coding_ptrs, int size)\n{\n", k, m);
+	for (i = 0; i < k; i++) {
+		printf("\tconst unsigned char *d%d = (const unsigned char *) data_ptrs[%d];\n", i, i);
+	}
+	for (j = 0; j < m; j++) {
+		printf("\tunsigned char *c%d = (unsigned char *) coding_ptrs[%d];\n", j, j);
+	}
+	printf("\tint i;\n");
+
+	ones = 0;
+	others = 0;
+	for (j = 0; j < m; j++) {
+		if (row_all_ones(matrix + j*k, k)) ones++;
+		else others++;
+	}
+
+	/* rows of all ones: plain parity, a long at a time */
+	if (ones > 0) {
+		for (i = 0; i < k; i++) {
+			printf("\tconst unsigned long *ld%d = (const unsigned long *) d%d;\n", i, i);
+		}
+		printf("\n\tfor (i = 0; i < size / (int) sizeof(long); i++) {\n");
+		printf("\t\tunsigned long p = ld0[i]");
+		for (i = 1; i < k; i++) printf(" ^ ld%d[i]", i);
+		printf(";\n");
+		for (j = 0; j < m; j++) {
+			if (row_all_ones(matrix + j*k, k)) {
+				printf("\t\t((unsigned long *) c%d)[i] = p;\n", j);
+			}
+		}
+		printf("\t}\n");
+	}
+
+	/* everything else: one pass over the data */
+	if (others > 0) {
+		printf("\n\tfor (i = 0; i < size; i++) {\n");
+		for (i = 0; i < k; i++) {
+			printf("\t\tunsigned char x%d = d%d[i];\n", i, i);
+		}
+		for (j = 0; j < m; j++) {
+			row = matrix + j*k;
+			if (row_all_ones(row, k)) continue;
+			printf("\t\tc%d[i] = ", j);
+			first = 1;
+			for (i = 0; i < k; i++) {
+				if (row[i] == 0) continue;
+				if (!first) printf(" ^ ");
+				if (row[i] == 1) printf("x%d", i);
+				else printf("gf08_mul_%d[x%d]", row[i], i);
+				first = 0;
+			}
+			if (first) printf("0");
+			printf(";\n");
+		}
+		printf("\t}\n");
+	}
+	printf("}\n\n");
+}
+
+int main(int argc, char **argv)
+{
+	int g, i;
+
+	memset(used, 0, sizeof(used));
+	for (g = 0; g < NGEOMETRIES; g++) {
+		matrices[g] = reed_sol_vandermonde_coding_matrix(geometries[g].k, geometries[g].m, W);
+		if (matrices[g] == NULL) {
+			fprintf(stderr, "rs_kernels_gen: no matrix for k=%d m=%d w=%d\n",
+				geometries[g].k, geometries[g].m, W);
+			exit(1);
+		}
+		for (i = 0; i < geometries[g].k * geometries[g].m; i++) {
+			used[matrices[g][i]] = 1;
+		}
+	}
+
+	printf("/* Examples/rs_kernels.c\n\n");
+	printf("Generated by rs_kernels_gen.  Do not edit.\n*/\n\n");
+	printf("#include <string.h>\n");
+	printf("#include \"rs_kernels.h\"\n\n");
+
+	emit_tables();
+	for (g = 0; g < NGEOMETRIES; g++) {
+		emit_kernel(geometries[g].k, geometries[g].m, matrices[g]);
+	}
+
+	printf("static struct {\n\tint k;\n\tint m;\n\tint *matrix;\n\trs_encode_kernel kernel;\n} rs_kernels[] = {\n");
+	for (g = 0; g < NGEOMETRIES; g++) {
+		printf("\t{ %d, %d, rs_matrix_w08_k%d_m%d, rs_encode_w08_k%d_m%d },\n",
+			geometries[g].k, geometries[g].m,
+			geometries[g].k, geometries[g].m,
+			geometries[g].k, geometries[g].m);
+	}
+	printf("};\n\n");
+
+	printf("rs_encode_kernel rs_kernel_lookup(int k, int m, int w, int *matrix)\n{\n");
+	printf("\tint i;\n\n");
+	printf("\tif (w != %d || matrix == NULL) return NULL;\n", W);
+	printf("\tfor (i = 0; i < %d; i++) {\n", NGEOMETRIES);
+	printf("\t\tif (rs_kernels[i].k == k && rs_kernels[i].m == m\n");
+	printf("\t\t\t\t&& memcmp(rs_kernels[i].matrix, matrix, sizeof(int)*k*m) == 0) {\n");
+	printf("\t\t\treturn rs_kernels[i].kernel;\n");
+	printf("\t\t}\n");
+	printf("\t}\n");
+	printf("\treturn NULL;\n");
+	printf("}\n");
+
+	return 0;
+}
@@ -0,0 +1,240 @@
+/* Examples/stripe_pool.c
+
+Process-wide pool of 64-byte aligned stripe buffers.  encoder.c and
+decoder.c used to malloc the block, data[] and coding[] buffers on every
+call; they now check a stripe out of this pool and hand it back when
+done, so the hot path sees no allocator churn and the GF kernels always
+run on aligned buffers.
+
+The pool geometry (k, m, blocksize) comes from the erasure policy.
+Requests for the pool geometry are served from the free list; anything
+else (a different k/m, or a file that needs a larger block) gets a
+transient stripe that is released on put.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "stripe_pool.h"
+
+#define HUGE_PAGE_SIZE	(2 * 1024 * 1024)
+
+#define align_up(x, a)	((((x) + (a) - 1) / (a)) * (a))
+
+static pthread_mutex_t	poolLock = PTHREAD_MUTEX_INITIALIZER;
+static stripe_buf	*freeList = NULL;
+static int		freeCount = 0;
+static int		poolMaxFree = 0;
+static int		poolK = 0;
+static int		poolM = 0;
+static size_t		poolBlocksize = 0;
+static int		poolFlags = 0;
+
+static size_t stripe_region_size(int k, int m, size_t blocksize)
+{
+	return align_up(k * blocksize, STRIPE_POOL_ALIGN)
+		+ m * align_up(blocksize, STRIPE_POOL_ALIGN);
+}
+
+static char *stripe_region_alloc(size_t size, int flags, size_t *mapSize, int *mapped)
+{
+	void	*region = MAP_FAILED;
+	size_t	len;
+
+	*mapped = 0;
+	*mapSize = size;
+
+#ifdef MAP_HUGETLB
+	if (flags & STRIPE_POOL_HUGETLB) {
+		len = align_up(size, HUGE_PAGE_SIZE);
+		region = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (region != MAP_FAILED) {
+			*mapSize = len;
+			*mapped = 1;
+			return (char *) region;
+		}
+		/* no reserved huge pages, fall back to THP */
+		flags |= STRIPE_POOL_THP;
+	}
+#endif
+
+	if (flags & STRIPE_POOL_THP) {
+		len = align_up(size, HUGE_PAGE_SIZE);
+		region = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (region != MAP_FAILED) {
+#ifdef MADV_HUGEPAGE
+			madvise(region, len, MADV_HUGEPAGE);
+#endif
+			*mapSize = len;
+			*mapped = 1;
+			return (char *) region;
+		}
+	}
+
+	if (posix_memalign(&region, STRIPE_POOL_ALIGN, size) != 0) {
+		return NULL;
+	}
+	return (char *) region;
+}
+
+static stripe_buf *stripe_alloc(int k, int m, size_t blocksize, int flags)
+{
+	stripe_buf	*sb;
+
+	sb = (stripe_buf *) malloc(sizeof(stripe_buf));
+	if (sb == NULL) {
+		return NULL;
+	}
+	memset(sb, 0, sizeof(stripe_buf));
+
+	sb->data = (char **) malloc(sizeof(char *) * k);
+	sb->coding = (char **) malloc(sizeof(char *) * (m > 0 ? m : 1));
+	sb->block = stripe_region_alloc(stripe_region_size(k, m, blocksize),
+			flags, &(sb->mapSize), &(sb->mapped));
+	if (sb->data == NULL || sb->coding == NULL || sb->block == NULL) {
+		free(sb->data);
+		free(sb->coding);
+		free(sb);
+		return NULL;
+	}
+
+	sb->k = k;
+	sb->m = m;
+	sb->capacity = blocksize;
+	return sb;
+}
+
+static void stripe_free(stripe_buf *sb)
+{
+	if (sb->mapped) {
+		munmap(sb->block, sb->mapSize);
+	} else {
+		free(sb->block);
+	}
+	free(sb->data);
+	free(sb->coding);
+	free(sb);
+}
+
+/* Lay data[] out back to back in the block (encoder.c reads the input
+   straight into it) and the coding buffers after it. */
+static void stripe_layout(stripe_buf *sb, size_t blocksize)
+{
+	char	*p;
+	int	i;
+
+	sb->blocksize = blocksize;
+	for (i = 0; i < sb->k; i++) {
+		sb->data[i] = sb->block + i * blocksize;
+	}
+	p = sb->block + align_up(sb->k * sb->capacity, STRIPE_POOL_ALIGN);
+	for (i = 0; i < sb->m; i++) {
+		sb->coding[i] = p + i * align_up(sb->capacity, STRIPE_POOL_ALIGN);
+	}
+}
+
+int stripe_pool_init(int k, int m, size_t blocksize, int maxFree, int flags)
+{
+	stripe_buf	*sb;
+
+	if (k <= 0 || m < 0 || blocksize == 0) {
+		return -1;
+	}
+	blocksize = align_up(blocksize, STRIPE_POOL_ALIGN);
+
+	stripe_pool_destroy();
+
+	pthread_mutex_lock(&poolLock);
+	poolK = k;
+	poolM = m;
+	poolBlocksize = blocksize;
+	poolMaxFree = (maxFree > 0) ? maxFree : 1;
+	poolFlags = flags;
+
+	/* prime the pool so the first encode does not pay for the mapping */
+	sb = stripe_alloc(k, m, blocksize, flags);
+	if (sb != NULL) {
+		sb->pooled = 1;
+		sb->next = freeList;
+		freeList = sb;
+		freeCount++;
+	}
+	pthread_mutex_unlock(&poolLock);
+
+	return (sb == NULL) ? -1 : 0;
+}
+
+stripe_buf *stripe_pool_get(int k, int m, size_t blocksize)
+{
+	stripe_buf	*sb = NULL;
+	int		pooled;
+	size_t		capacity;
+	int		flags;
+
+	pthread_mutex_lock(&poolLock);
+	pooled = (k == poolK && m == poolM && blocksize <= poolBlocksize);
+	if (pooled && freeList != NULL) {
+		sb = freeList;
+		freeList = sb->next;
+		freeCount--;
+	}
+	capacity = pooled ? poolBlocksize : align_up(blocksize, STRIPE_POOL_ALIGN);
+	flags = pooled ? poolFlags : (poolFlags & ~STRIPE_POOL_HUGETLB);
+	pthread_mutex_unlock(&poolLock);
+
+	if (sb == NULL) {
+		sb = stripe_alloc(k, m, capacity, flags);
+		if (sb == NULL) {
+			return NULL;
+		}
+		sb->pooled = pooled;
+	}
+
+	sb->next = NULL;
+	stripe_layout(sb, blocksize);
+	return sb;
+}
+
+void stripe_pool_put(stripe_buf *sb)
+{
+	if (sb == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&poolLock);
+	if (sb->pooled && sb->k == poolK && sb->m == poolM
+			&& sb->capacity == poolBlocksize
+			&& freeCount < poolMaxFree) {
+		sb->next = freeList;
+		freeList = sb;
+		freeCount++;
+		sb = NULL;
+	}
+	pthread_mutex_unlock(&poolLock);
+
+	if (sb != NULL) {
+		stripe_free(sb);
+	}
+}
+
+void stripe_pool_destroy()
+{
+	stripe_buf	*sb;
+	stripe_buf	*next;
+
+	pthread_mutex_lock(&poolLock);
+	sb = freeList;
+	freeList = NULL;
+	freeCount = 0;
+	pthread_mutex_unlock(&poolLock);
+
+	while (sb != NULL) {
+		next = sb->next;
+		stripe_free(sb);
+		sb = next;
+	}
+}
@@ -0,0 +1,42 @@
+/* Examples/stripe_pool.h
+
+Process-wide pool of stripe buffers for encoder.c and decoder.c.
+
+A stripe is one contiguous data block of k*blocksize bytes (data[i]
+points at block+i*blocksize) followed by m coding buffers of blocksize
+bytes.  The block and every coding buffer start on a STRIPE_POOL_ALIGN
+boundary, and so does each data[i] whenever blocksize is a multiple of
+STRIPE_POOL_ALIGN, so the region multiply kernels can rely on it.
+*/
+
+#ifndef _STRIPE_POOL_H
+#define _STRIPE_POOL_H
+
+#include <stddef.h>
+
+#define STRIPE_POOL_ALIGN	64
+
+/* flags for stripe_pool_init() */
+#define STRIPE_POOL_HUGETLB	1	/* mmap with MAP_HUGETLB */
+#define STRIPE_POOL_THP		2	/* madvise(MADV_HUGEPAGE) */
+
+typedef struct stripe_buf {
+	char			*block;		/* k*blocksize data bytes */
+	char			**data;		/* k pointers into block */
+	char			**coding;	/* m coding buffers */
+	int			k;
+	int			m;
+	size_t			blocksize;	/* blocksize of the current checkout */
+	size_t			capacity;	/* largest blocksize this stripe holds */
+	size_t			mapSize;
+	int			mapped;		/* region came from mmap() */
+	int			pooled;		/* return to the free list on put */
+	struct stripe_buf	*next;
+} stripe_buf;
+
+extern int stripe_pool_init(int k, int m, size_t blocksize, int maxFree, int flags);
+extern stripe_buf *stripe_pool_get(int k, int m, size_t blocksize);
+extern void stripe_pool_put(stripe_buf *sb);
+extern void stripe_pool_destroy();
+
+#endif